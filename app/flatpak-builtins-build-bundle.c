@@ -50,6 +50,9 @@ static char **opt_gpg_file;
 static gboolean opt_oci = FALSE;
 static char **opt_gpg_key_ids;
 static char *opt_gpg_homedir;
+static char *opt_from_commit;
+static int opt_compression_level = -1;
+static gboolean opt_split_layers = FALSE;
 
 static GOptionEntry options[] = {
   { "runtime", 0, 0, G_OPTION_ARG_NONE, &opt_runtime, N_("Export runtime instead of app"), NULL },
@@ -60,6 +63,9 @@ static GOptionEntry options[] = {
   { "oci", 0, 0, G_OPTION_ARG_NONE, &opt_oci, N_("Export oci image instead of flatpak bundle"), NULL },
   { "gpg-sign", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_gpg_key_ids, N_("GPG Key ID to sign the OCI image with"), N_("KEY-ID") },
   { "gpg-homedir", 0, 0, G_OPTION_ARG_STRING, &opt_gpg_homedir, N_("GPG Homedir to use when looking for keyrings"), N_("HOMEDIR") },
+  { "from", 0, 0, G_OPTION_ARG_STRING, &opt_from_commit, N_("Only include the changes since COMMIT"), N_("COMMIT") },
+  { "split-layers", 0, 0, G_OPTION_ARG_NONE, &opt_split_layers, N_("Split the OCI image into one layer per top-level directory"), NULL },
+  { "compression-level", 0, 0, G_OPTION_ARG_INT, &opt_compression_level, N_("Compression level, 0 for none"), N_("LEVEL") },
 
   { NULL }
 };
@@ -123,6 +129,7 @@ build_bundle (OstreeRepo *repo, GFile *file,
   g_autoptr(GInputStream) xml_in = NULL;
   g_autoptr(GFile) root = NULL;
   g_autofree char *commit_checksum = NULL;
+  g_autofree char *from_checksum = NULL;
   g_autoptr(GBytes) gpg_data = NULL;
   g_autoptr(GVariant) params = NULL;
   g_autoptr(GVariant) metadata = NULL;
@@ -134,6 +141,15 @@ build_bundle (OstreeRepo *repo, GFile *file,
   if (!ostree_repo_read_commit (repo, commit_checksum, &root, NULL, NULL, error))
     return FALSE;
 
+  if (opt_from_commit)
+    {
+      if (!ostree_repo_resolve_rev (repo, opt_from_commit, FALSE, &from_checksum, error))
+        return FALSE;
+
+      if (strcmp (from_checksum, commit_checksum) == 0)
+        return flatpak_fail (error, _("The --from commit is the same as the bundled commit"));
+    }
+
   g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE ("a{sv}"));
 
   /* We add this first in the metadata, so this will become the file
@@ -258,7 +274,7 @@ build_bundle (OstreeRepo *repo, GFile *file,
 
   g_variant_builder_init (&param_builder, G_VARIANT_TYPE ("a{sv}"));
   g_variant_builder_add (&param_builder, "{sv}", "min-fallback-size", g_variant_new_uint32 (0));
-  g_variant_builder_add (&param_builder, "{sv}", "compression", g_variant_new_byte ('x'));
+  g_variant_builder_add (&param_builder, "{sv}", "compression", g_variant_new_byte (opt_compression_level == 0 ? '0' : 'x'));
   g_variant_builder_add (&param_builder, "{sv}", "bsdiff-enabled", g_variant_new_boolean (FALSE));
   g_variant_builder_add (&param_builder, "{sv}", "inline-parts", g_variant_new_boolean (TRUE));
   g_variant_builder_add (&param_builder, "{sv}", "include-detached", g_variant_new_boolean (TRUE));
@@ -269,7 +285,7 @@ build_bundle (OstreeRepo *repo, GFile *file,
 
   if (!ostree_repo_static_delta_generate (repo,
                                           OSTREE_STATIC_DELTA_GENERATE_OPT_LOWLATENCY,
-                                          /* from */ NULL,
+                                          from_checksum,
                                           commit_checksum,
                                           metadata,
                                           params,
@@ -309,6 +325,262 @@ export_commit_to_archive (OstreeRepo *repo,
   return TRUE;
 }
 
+#define LAYER_TREE_ATTRIBUTES "standard::name,standard::type,standard::size,standard::symlink-target,unix::mode,unix::uid,unix::gid"
+
+static gboolean
+write_entry_to_archive (GFile          *file,
+                        GFileInfo      *info,
+                        const char     *path,
+                        guint64         timestamp,
+                        struct archive *a,
+                        GCancellable   *cancellable,
+                        GError        **error)
+{
+  g_autoptr(GInputStream) in = NULL;
+  struct archive_entry *entry;
+  GFileType type = g_file_info_get_file_type (info);
+  gboolean res = FALSE;
+
+  entry = archive_entry_new2 (a);
+  archive_entry_set_pathname (entry, *path ? path : ".");
+  archive_entry_set_mode (entry, g_file_info_get_attribute_uint32 (info, "unix::mode"));
+  archive_entry_set_uid (entry, g_file_info_get_attribute_uint32 (info, "unix::uid"));
+  archive_entry_set_gid (entry, g_file_info_get_attribute_uint32 (info, "unix::gid"));
+  archive_entry_set_mtime (entry, timestamp, 0);
+
+  if (type == G_FILE_TYPE_SYMBOLIC_LINK)
+    archive_entry_set_symlink (entry, g_file_info_get_symlink_target (info));
+  else if (type == G_FILE_TYPE_REGULAR)
+    {
+      archive_entry_set_size (entry, g_file_info_get_size (info));
+
+      in = (GInputStream *) g_file_read (file, cancellable, error);
+      if (in == NULL)
+        goto out;
+    }
+
+  if (archive_write_header (a, entry) != ARCHIVE_OK)
+    {
+      flatpak_fail (error, "%s", archive_error_string (a));
+      goto out;
+    }
+
+  if (in != NULL)
+    {
+      char buffer[64 * 1024];
+      gssize n_read;
+
+      while ((n_read = g_input_stream_read (in, buffer, sizeof (buffer), cancellable, error)) > 0)
+        {
+          if (archive_write_data (a, buffer, n_read) != n_read)
+            {
+              flatpak_fail (error, "%s", archive_error_string (a));
+              goto out;
+            }
+        }
+
+      if (n_read < 0)
+        goto out;
+    }
+
+  res = TRUE;
+
+out:
+  archive_entry_free (entry);
+  return res;
+}
+
+/* Like ostree_repo_export_tree_to_archive(), but keeps the paths relative
+ * to the commit root, and leaves out the subdirectories in @skip. */
+static gboolean
+write_tree_to_archive (GFile          *dir,
+                       const char     *path,
+                       guint64         timestamp,
+                       GHashTable     *skip,
+                       struct archive *a,
+                       GCancellable   *cancellable,
+                       GError        **error)
+{
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  GFileInfo *child_info;
+  GFile *child;
+
+  dir_enum = g_file_enumerate_children (dir, LAYER_TREE_ATTRIBUTES,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  while (TRUE)
+    {
+      g_autofree char *child_path = NULL;
+
+      if (!g_file_enumerator_iterate (dir_enum, &child_info, &child, cancellable, error))
+        return FALSE;
+      if (child_info == NULL)
+        break;
+
+      if (*path)
+        child_path = g_build_filename (path, g_file_info_get_name (child_info), NULL);
+      else
+        child_path = g_strdup (g_file_info_get_name (child_info));
+
+      if (skip != NULL && g_hash_table_contains (skip, child_path))
+        continue;
+
+      if (!write_entry_to_archive (child, child_info, child_path, timestamp, a,
+                                   cancellable, error))
+        return FALSE;
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY &&
+          !write_tree_to_archive (child, child_path, timestamp, skip, a,
+                                  cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Writes the directory @subdir of the commit as a layer, including
+ * entries for its parent directories. If @subdir is NULL the whole
+ * commit is written, except for the directories in @skip. */
+static gboolean
+write_layer (FlatpakOciRegistry *registry,
+             OstreeRepo         *repo,
+             GFile              *root,
+             const char         *subdir,
+             GHashTable         *skip,
+             guint64             timestamp,
+             GPtrArray          *layer_descs,
+             GPtrArray          *diff_ids,
+             GCancellable       *cancellable,
+             GError            **error)
+{
+  g_autoptr(FlatpakOciLayerWriter) layer_writer = NULL;
+  g_autoptr(FlatpakOciDescriptor) layer_desc = NULL;
+  g_autofree char *uncompressed_digest = NULL;
+  struct archive *archive;
+
+  layer_writer = flatpak_oci_registry_write_layer (registry, cancellable, error);
+  if (layer_writer == NULL)
+    return FALSE;
+
+  flatpak_oci_layer_writer_set_compression_level (layer_writer, opt_compression_level);
+
+  archive = flatpak_oci_layer_writer_get_archive (layer_writer);
+
+  if (subdir == NULL && skip == NULL)
+    {
+      if (!export_commit_to_archive (repo, root, timestamp,
+                                     archive, cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      g_auto(GStrv) elements = g_strsplit (subdir ? subdir : "", "/", -1);
+      g_autoptr(GFile) dir = g_object_ref (root);
+      g_autoptr(GString) path = g_string_new ("");
+      GFile *child;
+      int i;
+
+      /* Parent directories first, so their metadata is always right */
+      for (i = 0; TRUE; i++)
+        {
+          g_autoptr(GFileInfo) info = NULL;
+
+          info = g_file_query_info (dir, LAYER_TREE_ATTRIBUTES,
+                                    G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                    cancellable, error);
+          if (info == NULL)
+            return FALSE;
+
+          if (!write_entry_to_archive (dir, info, path->str, timestamp, archive,
+                                       cancellable, error))
+            return FALSE;
+
+          if (elements[i] == NULL || *elements[i] == 0)
+            break;
+
+          if (path->len > 0)
+            g_string_append_c (path, '/');
+          g_string_append (path, elements[i]);
+
+          child = g_file_get_child (dir, elements[i]);
+          g_object_unref (dir);
+          dir = child;
+        }
+
+      if (!write_tree_to_archive (dir, path->str, timestamp, skip, archive,
+                                  cancellable, error))
+        return FALSE;
+    }
+
+  if (!flatpak_oci_layer_writer_close (layer_writer,
+                                       &uncompressed_digest,
+                                       &layer_desc,
+                                       cancellable,
+                                       error))
+    return FALSE;
+
+  g_ptr_array_add (layer_descs, g_steal_pointer (&layer_desc));
+  g_ptr_array_add (diff_ids, g_steal_pointer (&uncompressed_digest));
+
+  return TRUE;
+}
+
+/* The layers are the top-level directories of files/, plus one for
+ * everything else. A change to one of them then leaves the blobs of
+ * the others unchanged, so they can be reused by registries and clients.
+ * For that the entries can't carry the commit timestamp, so they get
+ * the same fixed mtime as ostree checkouts. */
+static gboolean
+write_split_layers (FlatpakOciRegistry *registry,
+                    OstreeRepo         *repo,
+                    GFile              *root,
+                    GPtrArray          *layer_descs,
+                    GPtrArray          *diff_ids,
+                    GCancellable       *cancellable,
+                    GError            **error)
+{
+  g_autoptr(GFile) files = g_file_get_child (root, "files");
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GHashTable) subdirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GPtrArray) subdir_list = g_ptr_array_new ();
+  GFileInfo *child_info;
+  int i;
+
+  dir_enum = g_file_enumerate_children (files, LAYER_TREE_ATTRIBUTES,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, NULL);
+  while (dir_enum != NULL)
+    {
+      if (!g_file_enumerator_iterate (dir_enum, &child_info, NULL, cancellable, error))
+        return FALSE;
+      if (child_info == NULL)
+        break;
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          char *subdir = g_build_filename ("files", g_file_info_get_name (child_info), NULL);
+          g_hash_table_add (subdirs, subdir);
+          g_ptr_array_add (subdir_list, subdir);
+        }
+    }
+
+  if (!write_layer (registry, repo, root, NULL, subdirs, OSTREE_TIMESTAMP,
+                    layer_descs, diff_ids, cancellable, error))
+    return FALSE;
+
+  for (i = 0; i < subdir_list->len; i++)
+    {
+      if (!write_layer (registry, repo, root, g_ptr_array_index (subdir_list, i), NULL, OSTREE_TIMESTAMP,
+                        layer_descs, diff_ids, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 build_oci (OstreeRepo *repo, GFile *dir,
            const char *name, const char *ref,
@@ -320,22 +592,22 @@ build_oci (OstreeRepo *repo, GFile *dir,
   g_autofree char *commit_checksum = NULL;
   g_autofree char *dir_uri = NULL;
   g_autoptr(FlatpakOciRegistry) registry = NULL;
-  g_autoptr(FlatpakOciLayerWriter) layer_writer = NULL;
-  struct archive *archive;
-  g_autofree char *uncompressed_digest = NULL;
+  g_autoptr(GPtrArray) layer_descs = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_oci_descriptor_free);
+  g_autoptr(GPtrArray) diff_ids = g_ptr_array_new_with_free_func (g_free);
   g_autofree char *timestamp = NULL;
   g_autoptr(FlatpakOciImage) image = NULL;
-  g_autoptr(FlatpakOciDescriptor) layer_desc = NULL;
   g_autoptr(FlatpakOciDescriptor) image_desc = NULL;
   g_autoptr(FlatpakOciDescriptor) manifest_desc = NULL;
   g_autoptr(FlatpakOciManifest) manifest = NULL;
   g_autoptr(FlatpakOciIndex) index = NULL;
   g_autoptr(GFile) metadata_file = NULL;
   guint64 installed_size = 0;
+  guint64 download_size = 0;
   GHashTable *annotations;
   gsize metadata_size;
   g_autofree char *metadata_contents = NULL;
   g_auto(GStrv) ref_parts = NULL;
+  int i;
 
   if (!ostree_repo_resolve_rev (repo, ref, FALSE, &commit_checksum, error))
     return FALSE;
@@ -358,26 +630,27 @@ build_oci (OstreeRepo *repo, GFile *dir,
   if (registry == NULL)
     return FALSE;
 
-  layer_writer = flatpak_oci_registry_write_layer (registry, cancellable, error);
-  if (layer_writer == NULL)
-    return FALSE;
-
-  archive = flatpak_oci_layer_writer_get_archive (layer_writer);
-
-  if (!export_commit_to_archive (repo, root, ostree_commit_get_timestamp (commit_data),
-                                 archive, cancellable, error))
-    return FALSE;
+  if (opt_split_layers)
+    {
+      if (!write_split_layers (registry, repo, root,
+                               layer_descs, diff_ids, cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      if (!write_layer (registry, repo, root, NULL, NULL, ostree_commit_get_timestamp (commit_data),
+                        layer_descs, diff_ids, cancellable, error))
+        return FALSE;
+    }
 
-  if (!flatpak_oci_layer_writer_close (layer_writer,
-                                       &uncompressed_digest,
-                                       &layer_desc,
-                                       cancellable,
-                                       error))
-    return FALSE;
+  for (i = 0; i < layer_descs->len; i++)
+    download_size += ((FlatpakOciDescriptor *) g_ptr_array_index (layer_descs, i))->size;
 
+  g_ptr_array_add (layer_descs, NULL);
+  g_ptr_array_add (diff_ids, NULL);
 
   image = flatpak_oci_image_new ();
-  flatpak_oci_image_set_layer (image, uncompressed_digest);
+  flatpak_oci_image_set_layers (image, (const char **) diff_ids->pdata);
   flatpak_oci_image_set_architecture (image, flatpak_arch_to_oci_arch (ref_parts[2]));
 
   timestamp = timestamp_to_iso8601 (ostree_commit_get_timestamp (commit_data));
@@ -389,7 +662,7 @@ build_oci (OstreeRepo *repo, GFile *dir,
 
   manifest = flatpak_oci_manifest_new ();
   flatpak_oci_manifest_set_config (manifest, image_desc);
-  flatpak_oci_manifest_set_layer (manifest, layer_desc);
+  flatpak_oci_manifest_set_layers (manifest, (FlatpakOciDescriptor **) layer_descs->pdata);
 
   annotations = flatpak_oci_manifest_get_annotations (manifest);
   flatpak_oci_add_annotations_for_commit (annotations, ref, commit_checksum, commit_data);
@@ -412,7 +685,7 @@ build_oci (OstreeRepo *repo, GFile *dir,
 
   g_hash_table_replace (annotations,
                         g_strdup ("org.flatpak.download-size"),
-                        g_strdup_printf ("%" G_GUINT64_FORMAT, layer_desc->size));
+                        g_strdup_printf ("%" G_GUINT64_FORMAT, download_size));
 
   manifest_desc = flatpak_oci_registry_store_json (registry, FLATPAK_JSON (manifest), cancellable, error);
   if (manifest_desc == NULL)
@@ -478,6 +751,12 @@ flatpak_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
   if (argc > 5)
     return usage_error (context, _("Too many arguments"), error);
 
+  if (opt_compression_level < -1 || opt_compression_level > 9)
+    return usage_error (context, _("--compression-level must be between 0 and 9"), error);
+
+  if (opt_oci && opt_from_commit)
+    return usage_error (context, _("Can't use --from with --oci"), error);
+
   location = argv[1];
   filename = argv[2];
   name = argv[3];
@@ -45,6 +45,7 @@ static char *opt_gpg_homedir;
 static char *opt_files;
 static char *opt_metadata;
 static char *opt_timestamp = NULL;
+static int opt_jobs = 0;
 #ifdef FLATPAK_ENABLE_P2P
 static char *opt_collection_id = NULL;
 #endif  /* FLATPAK_ENABLE_P2P */
@@ -63,6 +64,7 @@ static GOptionEntry options[] = {
   { "include", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_include, N_("Excluded files to include"), N_("PATTERN") },
   { "gpg-homedir", 0, 0, G_OPTION_ARG_STRING, &opt_gpg_homedir, N_("GPG Homedir to use when looking for keyrings"), N_("HOMEDIR") },
   { "timestamp", 0, 0, G_OPTION_ARG_STRING, &opt_timestamp, N_("Override the timestamp of the commit"), N_("ISO-8601-TIMESTAMP") },
+  { "jobs", 0, 0, G_OPTION_ARG_INT, &opt_jobs, N_("Number of files to write in parallel (default: number of CPUs)"), N_("JOBS") },
 #ifdef FLATPAK_ENABLE_P2P
   { "collection-id", 0, 0, G_OPTION_ARG_STRING, &opt_collection_id, N_("Collection ID"), "COLLECTION-ID" },
 #endif  /* FLATPAK_ENABLE_P2P */
@@ -205,6 +207,391 @@ commit_filter (OstreeRepo *repo,
   return OSTREE_REPO_COMMIT_FILTER_ALLOW;
 }
 
+/* This is what ostree_repo_write_directory_to_mtree() does with our
+ * commit_filter, except that content objects are checksummed and
+ * written by a pool of threads while the tree is being walked. Files
+ * are only added to the mtrees once all are written, and the tree
+ * serialization is sorted by name, so the commit is the same as with a
+ * serial export. */
+
+#define EXPORT_QUERYINFO_ATTRIBUTES "standard::name,standard::type,standard::size,standard::is-symlink,standard::symlink-target,unix::device,unix::inode,unix::mode,unix::uid,unix::gid,unix::rdev,time::modified,time::modified-usec,time::changed,time::changed-usec"
+
+/* Like the ostree devino cache, but persistent: the build directory
+ * remembers the checksum of each exported file by device and inode,
+ * along with the mtime, ctime, size and mode it had. The ctime catches
+ * content changes that keep the size and mtime, like cp -p or touch -r.
+ * Re-exports then only need to read the files that changed. It is
+ * sorted by key. */
+#define EXPORT_CACHE_FILENAME ".flatpak-export-cache"
+#define EXPORT_CACHE_GVARIANT_FORMAT G_VARIANT_TYPE ("a{s(tttsu)}")
+
+typedef struct
+{
+  GFile             *file;
+  GFileInfo         *file_info;
+  OstreeMutableTree *mtree;
+  char              *checksum;
+  char              *cache_key;
+  guint64            mtime;
+  guint64            ctime;
+} ExportFile;
+
+typedef struct
+{
+  OstreeRepo   *repo;
+  CommitData   *commit_data;
+  GThreadPool  *pool;
+  GPtrArray    *files; /* ExportFile, in the order they were found */
+  GVariant     *cache;
+  guint         n_cached;
+  GCancellable *cancellable;
+  GMutex        lock;
+  GError       *error;
+} ParallelExport;
+
+static void
+export_file_free (ExportFile *export_file)
+{
+  g_object_unref (export_file->file);
+  g_object_unref (export_file->file_info);
+  g_object_unref (export_file->mtree);
+  g_free (export_file->checksum);
+  g_free (export_file->cache_key);
+  g_free (export_file);
+}
+
+static void
+parallel_export_load_cache (ParallelExport *export,
+                            GFile          *cache_file)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  char *contents;
+  gsize len;
+
+  if (!g_file_load_contents (cache_file, export->cancellable, &contents, &len, NULL, NULL))
+    return;
+
+  bytes = g_bytes_new_take (contents, len);
+  export->cache = g_variant_ref_sink (g_variant_new_from_bytes (EXPORT_CACHE_GVARIANT_FORMAT, bytes, FALSE));
+}
+
+/* Returns the checksum of the file if it is unchanged since it was
+ * last exported, and the object is still in the repo */
+static char *
+parallel_export_lookup_cache (ParallelExport *export,
+                              ExportFile     *export_file)
+{
+  g_autoptr(GVariant) entry = NULL;
+  guint64 mtime, ctime, size;
+  guint32 mode;
+  const char *checksum;
+  gboolean has_object;
+  int pos;
+
+  if (export->cache == NULL ||
+      !flatpak_variant_bsearch_str (export->cache, export_file->cache_key, &pos))
+    return NULL;
+
+  entry = g_variant_get_child_value (export->cache, pos);
+  g_variant_get (entry, "{&s(ttt&su)}", NULL, &mtime, &ctime, &size, &checksum, &mode);
+
+  if (mtime != export_file->mtime ||
+      ctime != export_file->ctime ||
+      size != g_file_info_get_size (export_file->file_info) ||
+      mode != g_file_info_get_attribute_uint32 (export_file->file_info, "unix::mode"))
+    return NULL;
+
+  if (!ostree_repo_has_object (export->repo, OSTREE_OBJECT_TYPE_FILE, checksum,
+                               &has_object, export->cancellable, NULL) ||
+      !has_object)
+    return NULL;
+
+  return g_strdup (checksum);
+}
+
+static int
+compare_export_file_cache_key (gconstpointer a,
+                               gconstpointer b)
+{
+  const ExportFile *export_file_a = *(const ExportFile **) a;
+  const ExportFile *export_file_b = *(const ExportFile **) b;
+
+  return strcmp (export_file_a->cache_key, export_file_b->cache_key);
+}
+
+static void
+parallel_export_save_cache (ParallelExport *export,
+                            GFile          *cache_file)
+{
+  g_autoptr(GPtrArray) cacheable = g_ptr_array_new ();
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GError) local_error = NULL;
+  int i;
+
+  for (i = 0; i < export->files->len; i++)
+    {
+      ExportFile *export_file = g_ptr_array_index (export->files, i);
+
+      if (export_file->cache_key != NULL && export_file->checksum != NULL)
+        g_ptr_array_add (cacheable, export_file);
+    }
+
+  g_ptr_array_sort (cacheable, compare_export_file_cache_key);
+
+  g_variant_builder_init (&builder, EXPORT_CACHE_GVARIANT_FORMAT);
+  for (i = 0; i < cacheable->len; i++)
+    {
+      ExportFile *export_file = g_ptr_array_index (cacheable, i);
+
+      /* Hardlinks share the key */
+      if (i > 0 && strcmp (export_file->cache_key,
+                           ((ExportFile *) g_ptr_array_index (cacheable, i - 1))->cache_key) == 0)
+        continue;
+
+      g_variant_builder_add (&builder, "{s(tttsu)}", export_file->cache_key,
+                             export_file->mtime,
+                             export_file->ctime,
+                             (guint64) g_file_info_get_size (export_file->file_info),
+                             export_file->checksum,
+                             g_file_info_get_attribute_uint32 (export_file->file_info, "unix::mode"));
+    }
+
+  cache = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!g_file_replace_contents (cache_file,
+                                g_variant_get_data (cache), g_variant_get_size (cache),
+                                NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                export->cancellable, &local_error))
+    g_debug ("Failed to write export cache: %s", local_error->message);
+}
+
+/* Runs in the thread pool */
+static void
+export_file_write (gpointer data,
+                   gpointer user_data)
+{
+  ExportFile *export_file = data;
+  ParallelExport *export = user_data;
+  g_autoptr(GInputStream) raw_input = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  g_autofree guchar *child_file_csum = NULL;
+  g_autoptr(GError) local_error = NULL;
+  guint64 length;
+  gboolean failed;
+
+  g_mutex_lock (&export->lock);
+  failed = export->error != NULL;
+  g_mutex_unlock (&export->lock);
+  if (failed)
+    return;
+
+  if (g_file_info_get_file_type (export_file->file_info) == G_FILE_TYPE_REGULAR)
+    {
+      raw_input = (GInputStream *) g_file_read (export_file->file, export->cancellable, &local_error);
+      if (raw_input == NULL)
+        goto out;
+    }
+
+  if (!ostree_raw_file_to_content_stream (raw_input,
+                                          export_file->file_info, NULL,
+                                          &input, &length,
+                                          export->cancellable, &local_error))
+    goto out;
+
+  if (!ostree_repo_write_content (export->repo, NULL, input, length,
+                                  &child_file_csum, export->cancellable, &local_error))
+    goto out;
+
+  export_file->checksum = ostree_checksum_from_bytes (child_file_csum);
+
+out:
+  if (local_error)
+    {
+      g_mutex_lock (&export->lock);
+      if (export->error == NULL)
+        export->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&export->lock);
+    }
+}
+
+static void
+parallel_export_init (ParallelExport *export,
+                      OstreeRepo     *repo,
+                      CommitData     *commit_data,
+                      int             n_jobs,
+                      GCancellable   *cancellable)
+{
+  export->repo = repo;
+  export->commit_data = commit_data;
+  export->files = g_ptr_array_new_with_free_func ((GDestroyNotify) export_file_free);
+  export->cache = NULL;
+  export->n_cached = 0;
+  export->cancellable = cancellable;
+  g_mutex_init (&export->lock);
+  export->error = NULL;
+  export->pool = g_thread_pool_new (export_file_write, export,
+                                    n_jobs > 0 ? n_jobs : (int) g_get_num_processors (),
+                                    FALSE, NULL);
+}
+
+static void
+parallel_export_clear (ParallelExport *export)
+{
+  if (export->pool)
+    g_thread_pool_free (export->pool, TRUE, TRUE);
+  export->pool = NULL;
+  g_clear_pointer (&export->files, g_ptr_array_unref);
+  g_clear_pointer (&export->cache, g_variant_unref);
+  g_clear_error (&export->error);
+  g_mutex_clear (&export->lock);
+}
+
+static gboolean
+parallel_export_directory (ParallelExport    *export,
+                           GFile             *dir,
+                           GFileInfo         *dir_info,
+                           const char        *path,
+                           OstreeMutableTree *mtree,
+                           GError           **error)
+{
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autofree guchar *dirmeta_csum = NULL;
+  g_autofree char *dirmeta_checksum = NULL;
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  GFileInfo *child_info;
+  GFile *child;
+
+  dirmeta = g_variant_ref_sink (ostree_create_directory_metadata (dir_info, NULL));
+  if (!ostree_repo_write_metadata (export->repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                   dirmeta, &dirmeta_csum, export->cancellable, error))
+    return FALSE;
+
+  dirmeta_checksum = ostree_checksum_from_bytes (dirmeta_csum);
+  ostree_mutable_tree_set_metadata_checksum (mtree, dirmeta_checksum);
+
+  dir_enum = g_file_enumerate_children (dir, EXPORT_QUERYINFO_ATTRIBUTES,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        export->cancellable, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  while (TRUE)
+    {
+      g_autoptr(GFileInfo) modified_info = NULL;
+      g_autofree char *child_path = NULL;
+      const char *name;
+      GFileType type;
+
+      if (!g_file_enumerator_iterate (dir_enum, &child_info, &child, export->cancellable, error))
+        return FALSE;
+      if (child_info == NULL)
+        break;
+
+      name = g_file_info_get_name (child_info);
+      child_path = g_build_filename (path, name, NULL);
+
+      modified_info = g_file_info_dup (child_info);
+      if (commit_filter (export->repo, child_path, modified_info,
+                         export->commit_data) == OSTREE_REPO_COMMIT_FILTER_SKIP)
+        continue;
+
+      type = g_file_info_get_file_type (modified_info);
+      if (type == G_FILE_TYPE_DIRECTORY)
+        {
+          g_autoptr(OstreeMutableTree) child_mtree = NULL;
+
+          if (!ostree_mutable_tree_ensure_dir (mtree, name, &child_mtree, error))
+            return FALSE;
+
+          if (!parallel_export_directory (export, child, modified_info, child_path,
+                                          child_mtree, error))
+            return FALSE;
+        }
+      else if (type == G_FILE_TYPE_REGULAR || type == G_FILE_TYPE_SYMBOLIC_LINK)
+        {
+          ExportFile *export_file = g_new0 (ExportFile, 1);
+
+          export_file->file = g_object_ref (child);
+          export_file->file_info = g_steal_pointer (&modified_info);
+          export_file->mtree = g_object_ref (mtree);
+          g_ptr_array_add (export->files, export_file);
+
+          if (type == G_FILE_TYPE_REGULAR)
+            {
+              export_file->cache_key =
+                g_strdup_printf ("%" G_GUINT32_FORMAT ":%" G_GUINT64_FORMAT,
+                                 g_file_info_get_attribute_uint32 (child_info, "unix::device"),
+                                 g_file_info_get_attribute_uint64 (child_info, "unix::inode"));
+              export_file->mtime =
+                g_file_info_get_attribute_uint64 (child_info, "time::modified") * G_USEC_PER_SEC +
+                g_file_info_get_attribute_uint32 (child_info, "time::modified-usec");
+              export_file->ctime =
+                g_file_info_get_attribute_uint64 (child_info, "time::changed") * G_USEC_PER_SEC +
+                g_file_info_get_attribute_uint32 (child_info, "time::changed-usec");
+              export_file->checksum = parallel_export_lookup_cache (export, export_file);
+            }
+
+          if (export_file->checksum != NULL)
+            export->n_cached++;
+          else
+            g_thread_pool_push (export->pool, export_file, NULL);
+        }
+      else
+        return flatpak_fail (error, _("Unsupported file type for %s"), flatpak_file_get_path_cached (child));
+    }
+
+  return TRUE;
+}
+
+static gboolean
+parallel_export_add_tree (ParallelExport    *export,
+                          GFile             *dir,
+                          OstreeMutableTree *mtree,
+                          GError           **error)
+{
+  g_autoptr(GFileInfo) dir_info = NULL;
+
+  dir_info = g_file_query_info (dir, EXPORT_QUERYINFO_ATTRIBUTES,
+                                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                export->cancellable, error);
+  if (dir_info == NULL)
+    return FALSE;
+
+  commit_filter (export->repo, "/", dir_info, export->commit_data);
+
+  return parallel_export_directory (export, dir, dir_info, "/", mtree, error);
+}
+
+/* Waits for all files to be written, and adds them to their mtrees */
+static gboolean
+parallel_export_finish (ParallelExport *export,
+                        GError        **error)
+{
+  int i;
+
+  g_thread_pool_free (export->pool, FALSE, TRUE);
+  export->pool = NULL;
+
+  if (export->error)
+    {
+      g_propagate_error (error, g_steal_pointer (&export->error));
+      return FALSE;
+    }
+
+  for (i = 0; i < export->files->len; i++)
+    {
+      ExportFile *export_file = g_ptr_array_index (export->files, i);
+
+      if (!ostree_mutable_tree_replace_file (export_file->mtree,
+                                             g_file_info_get_name (export_file->file_info),
+                                             export_file->checksum, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 add_file_to_mtree (GFile             *file,
                    const char        *name,
@@ -629,6 +1016,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   g_autoptr(GFile) export = NULL;
   g_autoptr(GFile) repofile = NULL;
   g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) export_cache_file = NULL;
   g_autoptr(OstreeRepo) repo = NULL;
   const char *location;
   const char *directory;
@@ -649,8 +1037,8 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   g_autofree char *subject = NULL;
   g_autofree char *body = NULL;
   OstreeRepoTransactionStats stats;
-  g_autoptr(OstreeRepoCommitModifier) modifier = NULL;
   CommitData commit_data = {0};
+  ParallelExport export_data = {0};
   g_auto(GVariantDict) metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
   g_autoptr(GVariant) metadata_dict_v = NULL;
   gboolean is_runtime = FALSE;
@@ -830,14 +1218,16 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   if (!ostree_mutable_tree_ensure_dir (mtree, "files", &files_mtree, error))
     goto out;
 
-  modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
-                                              (OstreeRepoCommitFilter) commit_filter, &commit_data, NULL);
+  parallel_export_init (&export_data, repo, &commit_data, opt_jobs, cancellable);
+
+  export_cache_file = g_file_get_child (base, EXPORT_CACHE_FILENAME);
+  parallel_export_load_cache (&export_data, export_cache_file);
 
   if (is_extension)
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, files, files_mtree, modifier, cancellable, error))
+      if (!parallel_export_add_tree (&export_data, files, files_mtree, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -846,7 +1236,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, usr, files_mtree, modifier, cancellable, error))
+      if (!parallel_export_add_tree (&export_data, usr, files_mtree, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -855,7 +1245,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, files, files_mtree, modifier, cancellable, error))
+      if (!parallel_export_add_tree (&export_data, files, files_mtree, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -863,10 +1253,16 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
       if (!ostree_mutable_tree_ensure_dir (mtree, "export", &export_mtree, error))
         goto out;
 
-      if (!ostree_repo_write_directory_to_mtree (repo, export, export_mtree, modifier, cancellable, error))
+      if (!parallel_export_add_tree (&export_data, export, export_mtree, error))
         goto out;
     }
 
+  if (!parallel_export_finish (&export_data, error))
+    goto out;
+
+  g_debug ("Reused %u unchanged files from the export cache", export_data.n_cached);
+  parallel_export_save_cache (&export_data, export_cache_file);
+
   if (!add_file_to_mtree (metadata, "metadata", repo, mtree, cancellable, error))
     goto out;
 
@@ -977,6 +1373,9 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   ret = TRUE;
 
 out:
+  if (export_data.files != NULL)
+    parallel_export_clear (&export_data);
+
   if (repo)
     ostree_repo_abort_transaction (repo, cancellable, NULL);
 
@@ -136,7 +136,7 @@ import_bundle (OstreeRepo *repo, GFile *file,
 
   /* Don’t need to check the collection ID of the bundle here;
    * flatpak_pull_from_bundle() does that. */
-  metadata = flatpak_bundle_load (file, &to_checksum,
+  metadata = flatpak_bundle_load (file, &to_checksum, NULL,
                                   &bundle_ref,
                                   NULL, NULL, NULL,
                                   NULL, NULL, NULL, error);
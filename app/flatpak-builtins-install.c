@@ -231,7 +231,7 @@ handle_runtime_repo_deps_from_bundle (FlatpakDir *dir, GFile *file, GError **err
   if (opt_no_deps)
     return TRUE;
 
-  metadata = flatpak_bundle_load (file, NULL,
+  metadata = flatpak_bundle_load (file, NULL, NULL,
                                   NULL,
                                   NULL,
                                   &dep_url,
@@ -468,12 +468,23 @@ complete (int    argc,
   return 0;
 }
 
+static void
+removed_cleanup_progress (guint    left,
+                          guint64  reclaimed,
+                          gpointer user_data)
+{
+  g_autofree char *formatted = g_format_size (reclaimed);
+
+  g_print (_("Removing old deployments, %u left (%s reclaimed so far)\n"), left, formatted);
+}
+
 int
 main (int    argc,
       char **argv)
 {
   GError *error = NULL;
   g_autofree const char *old_env = NULL;
+  guint64 reclaimed;
   int ret;
 
   setlocale (LC_ALL, "");
@@ -500,6 +511,15 @@ main (int    argc,
   flatpak_migrate_from_xdg_app ();
 
   ret = flatpak_run (argc, argv, &error);
+
+  /* Old deployments are removed in the background while we run */
+  reclaimed = flatpak_dir_wait_for_removed_cleanup (removed_cleanup_progress, NULL);
+  if (reclaimed > 0)
+    {
+      g_autofree char *formatted = g_format_size (reclaimed);
+      g_print (_("Reclaimed %s from old deployments\n"), formatted);
+    }
+
   if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
     flatpak_usage (commands, TRUE);
 
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <sys/file.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
 #include <utime.h>
 #include <glnx-console.h>
 
@@ -37,6 +38,7 @@
 
 #include <gio/gio.h>
 #include <gio/gunixsocketaddress.h>
+#include <gio/gunixinputstream.h>
 #include "libglnx/libglnx.h"
 #include "lib/flatpak-error.h"
 #include <ostree.h>
@@ -127,6 +129,12 @@ struct FlatpakDir
   GHashTable          *summary_cache;
 
   SoupSession         *soup_session;
+
+  char               **default_locale_languages;
+  GDBusConnection     *accounts_bus;
+  guint                accounts_changed_id;
+
+  GHashTable          *deploy_file_cache;
 };
 
 typedef struct
@@ -259,22 +267,21 @@ flatpak_deploy_get_dir (FlatpakDeploy *deploy)
   return g_object_ref (deploy->dir);
 }
 
-GVariant *
-flatpak_load_deploy_data (GFile *deploy_dir,
-                          GCancellable *cancellable,
-                          GError      **error)
+/* @data is the contents of the deploy file of @deploy_dir, or %NULL if
+ * loading it failed with @load_error. Deployments from before the deploy
+ * file existed get their deploy data from the old origin files. */
+static GVariant *
+deploy_data_from_bytes (GFile        *deploy_dir,
+                        GBytes       *data,
+                        GError       *load_error,
+                        GCancellable *cancellable,
+                        GError      **error)
 {
-  g_autoptr(GFile) data_file = NULL;
-  g_autoptr(GError) my_error = NULL;
-  char *data = NULL;
-  gsize data_size;
-
-  data_file = g_file_get_child (deploy_dir, "deploy");
-  if (!g_file_load_contents (data_file, cancellable, &data, &data_size, NULL, &my_error))
+  if (data == NULL)
     {
-      if (!g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+      if (!g_error_matches (load_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
         {
-          g_propagate_error (error, g_steal_pointer (&my_error));
+          g_propagate_error (error, g_error_copy (load_error));
           return NULL;
         }
 
@@ -282,9 +289,26 @@ flatpak_load_deploy_data (GFile *deploy_dir,
                                                   cancellable, error);
     }
 
-  return g_variant_ref_sink (g_variant_new_from_data (FLATPAK_DEPLOY_DATA_GVARIANT_FORMAT,
-                                                      data, data_size,
-                                                      FALSE, g_free, data));
+  return g_variant_ref_sink (g_variant_new_from_bytes (FLATPAK_DEPLOY_DATA_GVARIANT_FORMAT,
+                                                       data, FALSE));
+}
+
+GVariant *
+flatpak_load_deploy_data (GFile *deploy_dir,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  g_autoptr(GFile) data_file = NULL;
+  g_autoptr(GBytes) data = NULL;
+  g_autoptr(GError) my_error = NULL;
+  char *contents = NULL;
+  gsize len;
+
+  data_file = g_file_get_child (deploy_dir, "deploy");
+  if (g_file_load_contents (data_file, cancellable, &contents, &len, NULL, &my_error))
+    data = g_bytes_new_take (contents, len);
+
+  return deploy_data_from_bytes (deploy_dir, data, my_error, cancellable, error);
 }
 
 
@@ -742,6 +766,44 @@ flatpak_ensure_oci_summary_cache_dir_location (GError **error)
   return g_steal_pointer (&dir);
 }
 
+/* Layers are often shared between refs, remotes and installations, so
+ * all OCI pulls by a user go through a common cache of verified blobs.
+ * System installations are downloaded by the calling user into a child
+ * registry before the system helper imports them, so they use the
+ * cache of that user. The cache is per user, not per machine: a shared
+ * one would have to be writable by everyone. */
+#define OCI_BLOB_CACHE_DEFAULT_MAX_SIZE (2 * (guint64) 1024 * 1024 * 1024)
+
+static void
+flatpak_dir_setup_oci_blob_cache (FlatpakOciRegistry *registry)
+{
+  g_autoptr(GFile) cache_dir = flatpak_get_user_cache_dir_location ();
+  g_autoptr(GFile) dir = g_file_get_child (cache_dir, "oci-blobs");
+  g_autoptr(GError) local_error = NULL;
+  const char *max_size_env = g_getenv ("FLATPAK_OCI_BLOB_CACHE_SIZE");
+  guint64 max_size = OCI_BLOB_CACHE_DEFAULT_MAX_SIZE;
+
+  if (max_size_env != NULL && *max_size_env != 0)
+    {
+      char *end = NULL;
+      guint64 parsed;
+
+      errno = 0;
+      parsed = g_ascii_strtoull (max_size_env, &end, 10);
+      if (errno != 0 || end == max_size_env || *end != 0)
+        g_warning ("Invalid FLATPAK_OCI_BLOB_CACHE_SIZE '%s', using the default", max_size_env);
+      else
+        max_size = parsed;
+    }
+
+  if (max_size == 0)
+    return;
+
+  if (!flatpak_oci_registry_set_blob_cache (registry, flatpak_file_get_path_cached (dir),
+                                            max_size, &local_error))
+    g_debug ("Not using OCI blob cache: %s", local_error->message);
+}
+
 static FlatpakSystemHelper *
 flatpak_dir_get_system_helper (FlatpakDir *self)
 {
@@ -832,6 +894,12 @@ flatpak_dir_finalize (GObject *object)
   g_clear_object (&self->soup_session);
   g_clear_pointer (&self->summary_cache, g_hash_table_unref);
 
+  if (self->accounts_changed_id != 0)
+    g_dbus_connection_signal_unsubscribe (self->accounts_bus, self->accounts_changed_id);
+  g_clear_object (&self->accounts_bus);
+  g_clear_pointer (&self->default_locale_languages, g_strfreev);
+  g_clear_pointer (&self->deploy_file_cache, g_hash_table_unref);
+
   G_OBJECT_CLASS (flatpak_dir_parent_class)->finalize (object);
 }
 
@@ -1100,6 +1168,97 @@ flatpak_save_override_keyfile (GKeyFile   *metakey,
   return g_key_file_save_to_file (metakey, filename, error);
 }
 
+/* The deploy data and metadata of deployments are read over and over
+ * during a transaction, and by long-running library users, so keep
+ * their contents around. The deploy dir is named after the checksum,
+ * so the path identifies the deployment. An entry is only used if the
+ * file still has the same inode, size and mtime, and all of them are
+ * dropped when the installation is marked as changed. */
+typedef struct
+{
+  dev_t   dev;
+  ino_t   ino;
+  off_t   size;
+  guint64 mtime_nsec;
+  GBytes *contents;
+} CachedDeployFile;
+
+static void
+cached_deploy_file_free (CachedDeployFile *cached)
+{
+  g_bytes_unref (cached->contents);
+  g_free (cached);
+}
+
+G_LOCK_DEFINE_STATIC (deploy_file_cache);
+
+static GBytes *
+flatpak_dir_load_deploy_file (FlatpakDir   *self,
+                              GFile        *file,
+                              GCancellable *cancellable,
+                              GError      **error)
+{
+  const char *path = flatpak_file_get_path_cached (file);
+  CachedDeployFile *cached;
+  struct stat stbuf;
+  guint64 mtime_nsec = 0;
+  gboolean have_stat;
+  char *contents;
+  gsize len;
+
+  have_stat = stat (path, &stbuf) == 0;
+  if (have_stat)
+    {
+      mtime_nsec = (guint64) stbuf.st_mtim.tv_sec * 1000000000 + stbuf.st_mtim.tv_nsec;
+
+      G_LOCK (deploy_file_cache);
+      cached = self->deploy_file_cache ? g_hash_table_lookup (self->deploy_file_cache, path) : NULL;
+      if (cached != NULL &&
+          cached->dev == stbuf.st_dev &&
+          cached->ino == stbuf.st_ino &&
+          cached->size == stbuf.st_size &&
+          cached->mtime_nsec == mtime_nsec)
+        {
+          GBytes *res = g_bytes_ref (cached->contents);
+          G_UNLOCK (deploy_file_cache);
+          return res;
+        }
+      G_UNLOCK (deploy_file_cache);
+    }
+
+  if (!g_file_load_contents (file, cancellable, &contents, &len, NULL, error))
+    return NULL;
+
+  if (!have_stat)
+    return g_bytes_new_take (contents, len);
+
+  cached = g_new0 (CachedDeployFile, 1);
+  cached->contents = g_bytes_new_take (contents, len);
+
+  /* If it changed while we read it, we just don't use this next time */
+  cached->dev = stbuf.st_dev;
+  cached->ino = stbuf.st_ino;
+  cached->size = stbuf.st_size;
+  cached->mtime_nsec = mtime_nsec;
+
+  G_LOCK (deploy_file_cache);
+  if (self->deploy_file_cache == NULL)
+    self->deploy_file_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                     (GDestroyNotify) cached_deploy_file_free);
+  g_hash_table_replace (self->deploy_file_cache, g_strdup (path), cached);
+  G_UNLOCK (deploy_file_cache);
+
+  return g_bytes_ref (cached->contents);
+}
+
+static void
+flatpak_dir_clear_deploy_file_cache (FlatpakDir *self)
+{
+  G_LOCK (deploy_file_cache);
+  g_clear_pointer (&self->deploy_file_cache, g_hash_table_unref);
+  G_UNLOCK (deploy_file_cache);
+}
+
 /* Note: passing a checksum only works here for non-sub-set deploys, not
    e.g. a partial locale install, because it will not find the real
    deploy directory. This is ok for now, because checksum is only
@@ -1114,11 +1273,11 @@ flatpak_dir_load_deployed (FlatpakDir   *self,
 {
   g_autoptr(GFile) deploy_dir = NULL;
   g_autoptr(GKeyFile) metakey = NULL;
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("load-deployed", ref);
   g_autoptr(GFile) metadata = NULL;
   g_auto(GStrv) ref_parts = NULL;
-  g_autofree char *metadata_contents = NULL;
+  g_autoptr(GBytes) metadata_contents = NULL;
   FlatpakDeploy *deploy;
-  gsize metadata_size;
 
   deploy_dir = flatpak_dir_get_if_deployed (self, ref, checksum, cancellable);
   if (deploy_dir == NULL)
@@ -1129,11 +1288,15 @@ flatpak_dir_load_deployed (FlatpakDir   *self,
     }
 
   metadata = g_file_get_child (deploy_dir, "metadata");
-  if (!g_file_load_contents (metadata, cancellable, &metadata_contents, &metadata_size, NULL, error))
+  metadata_contents = flatpak_dir_load_deploy_file (self, metadata, cancellable, error);
+  if (metadata_contents == NULL)
     return NULL;
 
   metakey = g_key_file_new ();
-  if (!g_key_file_load_from_data (metakey, metadata_contents, metadata_size, 0, error))
+  if (!g_key_file_load_from_data (metakey,
+                                  g_bytes_get_data (metadata_contents, NULL),
+                                  g_bytes_get_size (metadata_contents),
+                                  0, error))
     return NULL;
 
   deploy = flatpak_deploy_new (deploy_dir, metakey);
@@ -1425,6 +1588,9 @@ flatpak_dir_get_deploy_data (FlatpakDir   *self,
                              GError      **error)
 {
   g_autoptr(GFile) deploy_dir = NULL;
+  g_autoptr(GFile) data_file = NULL;
+  g_autoptr(GBytes) data = NULL;
+  g_autoptr(GError) my_error = NULL;
 
   deploy_dir = flatpak_dir_get_if_deployed (self, ref, NULL, cancellable);
   if (deploy_dir == NULL)
@@ -1434,9 +1600,10 @@ flatpak_dir_get_deploy_data (FlatpakDir   *self,
       return NULL;
     }
 
-  return flatpak_load_deploy_data (deploy_dir,
-                                   cancellable,
-                                   error);
+  data_file = g_file_get_child (deploy_dir, "deploy");
+  data = flatpak_dir_load_deploy_file (self, data_file, cancellable, &my_error);
+
+  return deploy_data_from_bytes (deploy_dir, data, my_error, cancellable, error);
 }
 
 
@@ -1670,6 +1837,8 @@ flatpak_dir_mark_changed (FlatpakDir *self,
 {
   g_autoptr(GFile) changed_file = NULL;
 
+  flatpak_dir_clear_deploy_file_cache (self);
+
   changed_file = flatpak_dir_get_changed_path (self);
   if (!g_file_replace_contents (changed_file, "", 0, NULL, FALSE,
                                 G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, error))
@@ -1678,6 +1847,179 @@ flatpak_dir_mark_changed (FlatpakDir *self,
   return TRUE;
 }
 
+/* The change log is a small a(tssss) variant of (generation, op, ref,
+ * old-commit, new-commit) entries, oldest first. It is rewritten
+ * atomically under the dir lock by the deploy and uninstall paths, so
+ * readers never need to take the lock. */
+#define CHANGELOG_FILENAME ".changelog"
+#define CHANGELOG_MAX_ENTRIES 256
+#define CHANGELOG_ENTRY_FORMAT "(tssss)"
+
+static GVariant *
+flatpak_dir_load_changelog (FlatpakDir   *self,
+                            GCancellable *cancellable,
+                            GError      **error)
+{
+  g_autoptr(GFile) changelog_file = g_file_get_child (self->basedir, CHANGELOG_FILENAME);
+  g_autoptr(GError) local_error = NULL;
+  char *contents;
+  gsize len;
+
+  if (!g_file_load_contents (changelog_file, cancellable, &contents, &len, NULL, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE (CHANGELOG_ENTRY_FORMAT), NULL, 0));
+
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+
+  return g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE ("a" CHANGELOG_ENTRY_FORMAT),
+                                                      contents, len, FALSE, g_free, contents));
+}
+
+static guint64
+changelog_get_generation (GVariant *changelog)
+{
+  gsize n = g_variant_n_children (changelog);
+  guint64 generation = 0;
+
+  if (n > 0)
+    g_variant_get_child (changelog, n - 1, CHANGELOG_ENTRY_FORMAT, &generation, NULL, NULL, NULL, NULL);
+
+  return generation;
+}
+
+/* Must be called with the dir lock held */
+static gboolean
+flatpak_dir_record_change (FlatpakDir   *self,
+                           const char   *op,
+                           const char   *ref,
+                           const char   *old_commit,
+                           const char   *new_commit,
+                           GCancellable *cancellable,
+                           GError      **error)
+{
+  g_autoptr(GFile) changelog_file = g_file_get_child (self->basedir, CHANGELOG_FILENAME);
+  g_autoptr(GVariant) changelog = NULL;
+  g_autoptr(GVariant) new_changelog = NULL;
+  GVariantBuilder builder;
+  gsize n, i;
+
+  changelog = flatpak_dir_load_changelog (self, cancellable, error);
+  if (changelog == NULL)
+    return FALSE;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a" CHANGELOG_ENTRY_FORMAT));
+
+  n = g_variant_n_children (changelog);
+  for (i = n >= CHANGELOG_MAX_ENTRIES ? n - CHANGELOG_MAX_ENTRIES + 1 : 0; i < n; i++)
+    {
+      g_autoptr(GVariant) entry = g_variant_get_child_value (changelog, i);
+      g_variant_builder_add_value (&builder, entry);
+    }
+
+  g_variant_builder_add (&builder, CHANGELOG_ENTRY_FORMAT,
+                         changelog_get_generation (changelog) + 1,
+                         op, ref,
+                         old_commit ? old_commit : "",
+                         new_commit ? new_commit : "");
+  new_changelog = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!g_file_replace_contents (changelog_file,
+                                g_variant_get_data (new_changelog), g_variant_get_size (new_changelog),
+                                NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+static void
+flatpak_dir_record_change_or_warn (FlatpakDir   *self,
+                                   const char   *op,
+                                   const char   *ref,
+                                   const char   *old_commit,
+                                   const char   *new_commit,
+                                   GCancellable *cancellable)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  /* The deployment itself already succeeded, so a failure here only
+   * means change log readers fall back to a full reload */
+  if (!flatpak_dir_record_change (self, op, ref, old_commit, new_commit,
+                                  cancellable, &local_error))
+    g_warning ("Failed to record change of %s: %s", ref, local_error->message);
+}
+
+/* Returns the generation of the latest recorded change, or 0 if no
+ * change has been recorded yet. */
+guint64
+flatpak_dir_get_generation (FlatpakDir   *self,
+                            GCancellable *cancellable,
+                            GError      **error)
+{
+  g_autoptr(GVariant) changelog = NULL;
+
+  changelog = flatpak_dir_load_changelog (self, cancellable, error);
+  if (changelog == NULL)
+    return 0;
+
+  return changelog_get_generation (changelog);
+}
+
+/* Returns the a(tssss) entries newer than @generation. Fails with
+ * FLATPAK_ERROR_CHANGES_EXPIRED if some of those changes have already
+ * been dropped from the log, in which case the caller has to reload
+ * everything. */
+GVariant *
+flatpak_dir_list_changes_since (FlatpakDir   *self,
+                                guint64       generation,
+                                guint64      *out_generation,
+                                GCancellable *cancellable,
+                                GError      **error)
+{
+  g_autoptr(GVariant) changelog = NULL;
+  GVariantBuilder builder;
+  guint64 latest, oldest = 0;
+  gsize n, i;
+
+  changelog = flatpak_dir_load_changelog (self, cancellable, error);
+  if (changelog == NULL)
+    return NULL;
+
+  n = g_variant_n_children (changelog);
+  latest = changelog_get_generation (changelog);
+  if (n > 0)
+    g_variant_get_child (changelog, 0, CHANGELOG_ENTRY_FORMAT, &oldest, NULL, NULL, NULL, NULL);
+
+  /* A generation newer than the log means the log was reset, e.g. by
+   * removing and recreating the installation */
+  if (generation > latest || (n > 0 && oldest > generation + 1))
+    {
+      g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_CHANGES_EXPIRED,
+                   _("Changes since generation %" G_GUINT64_FORMAT " are no longer available"),
+                   generation);
+      return NULL;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a" CHANGELOG_ENTRY_FORMAT));
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) entry = g_variant_get_child_value (changelog, i);
+      guint64 entry_generation;
+
+      g_variant_get_child (entry, 0, "t", &entry_generation);
+      if (entry_generation > generation)
+        g_variant_builder_add_value (&builder, entry);
+    }
+
+  if (out_generation)
+    *out_generation = latest;
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
 gboolean
 flatpak_dir_remove_appstream (FlatpakDir   *self,
                               const char   *remote,
@@ -1700,6 +2042,23 @@ flatpak_dir_remove_appstream (FlatpakDir   *self,
   return TRUE;
 }
 
+/* The index is an optimization only, so failing to build it is not fatal */
+static void
+ensure_appstream_index (const char   *checkout_path,
+                        GCancellable *cancellable)
+{
+  g_autofree char *appstream_path = g_build_filename (checkout_path, "appstream.xml.gz", NULL);
+  g_autofree char *index_path = g_build_filename (checkout_path, "appstream.gvdb", NULL);
+  g_autoptr(GError) local_error = NULL;
+
+  if (g_file_test (index_path, G_FILE_TEST_EXISTS) ||
+      !g_file_test (appstream_path, G_FILE_TEST_EXISTS))
+    return;
+
+  if (!flatpak_appstream_index_write (appstream_path, index_path, cancellable, &local_error))
+    g_warning ("Unable to build appstream index: %s", local_error->message);
+}
+
 gboolean
 flatpak_dir_deploy_appstream (FlatpakDir          *self,
                               const char          *remote,
@@ -1776,6 +2135,12 @@ flatpak_dir_deploy_appstream (FlatpakDir          *self,
                                     G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, error))
         return FALSE;
 
+      /* Checkouts from older versions have no index yet */
+      {
+        g_autofree char *real_checkout_path = g_file_get_path (real_checkout_dir);
+        ensure_appstream_index (real_checkout_path, cancellable);
+      }
+
       if (out_changed)
         *out_changed = FALSE;
 
@@ -1805,6 +2170,8 @@ flatpak_dir_deploy_appstream (FlatpakDir          *self,
                                 cancellable, error))
     return FALSE;
 
+  ensure_appstream_index (checkout_dir_path, cancellable);
+
   glnx_gen_temp_name (tmpname);
   active_tmp_link = g_file_get_child (arch_dir, tmpname);
 
@@ -2797,6 +3164,8 @@ flatpak_dir_mirror_oci (FlatpakDir          *self,
   if (registry == NULL)
     return FALSE;
 
+  flatpak_dir_setup_oci_blob_cache (registry);
+
   if (progress == NULL)
     {
       glnx_console_lock (&console);
@@ -2878,6 +3247,8 @@ flatpak_dir_pull_oci (FlatpakDir          *self,
   if (registry == NULL)
     return FALSE;
 
+  flatpak_dir_setup_oci_blob_cache (registry);
+
   versioned = flatpak_oci_registry_load_versioned (registry, oci_digest, NULL,
                                                    cancellable, error);
   if (versioned == NULL)
@@ -2952,6 +3323,8 @@ flatpak_dir_pull (FlatpakDir          *self,
   /* If @opt_results is set, @opt_rev must be. */
   g_return_val_if_fail (opt_results == NULL || opt_rev != NULL, FALSE);
 
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("pull", ref);
+
   if (!flatpak_dir_ensure_repo (self, cancellable, error))
     return FALSE;
 
@@ -3214,6 +3587,140 @@ repo_pull_one_local_untrusted (FlatpakDir          *self,
   return res;
 }
 
+/* Copies a single regular file content object from the (user owned)
+ * src_repo into the bare-user-only repo of self. The data is cloned
+ * into a new, root owned file, so with reflink support this shares the
+ * extents rather than writing them again. The checksum is verified on
+ * the clone, so later modifications of the source can't affect us.
+ * Returns TRUE without importing if the object needs the generic path.
+ *
+ * The object is linked directly into objects/ rather than staged in the
+ * transaction, so it is synced first to never leave a truncated object
+ * behind. If the pull fails afterwards it stays around as a complete,
+ * unreferenced object until the next prune.
+ */
+static gboolean
+import_content_object_by_clone (FlatpakDir   *self,
+                                OstreeRepo   *src_repo,
+                                const char   *checksum,
+                                GCancellable *cancellable,
+                                GError      **error)
+{
+  g_autofree char *relpath = ostree_get_relative_object_path (checksum, OSTREE_OBJECT_TYPE_FILE, FALSE);
+  g_autofree char *objdir = g_path_get_dirname (relpath);
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autofree char *actual_checksum = NULL;
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  glnx_autofd int src_fd = -1;
+  int repo_dfd = ostree_repo_get_dfd (self->repo);
+  guint32 mode;
+  const struct timespec times[2] = { { 0, UTIME_OMIT }, { OSTREE_TIMESTAMP, } };
+
+  src_fd = openat (ostree_repo_get_dfd (src_repo), relpath, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (src_fd == -1)
+    return TRUE; /* Probably in the parent repo */
+
+  if (!ostree_repo_load_file (src_repo, checksum, NULL, &file_info, &xattrs,
+                              cancellable, error))
+    return FALSE;
+
+  /* Symlinks are small, and modes with bits outside of 0775 must be
+     rejected by the pull (OSTREE_REPO_PULL_FLAGS_BAREUSERONLY_FILES),
+     so leave those to it */
+  mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
+  if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_REGULAR ||
+      (mode & ~S_IFMT & ~0775) != 0)
+    return TRUE;
+
+  if (!glnx_open_tmpfile_linkable_at (repo_dfd, "tmp",
+                                      O_RDWR | O_CLOEXEC | O_NOCTTY,
+                                      &tmpf, error))
+    return FALSE;
+
+  if (glnx_regfile_copy_bytes (src_fd, tmpf.fd, (off_t)-1) < 0)
+    return glnx_throw_errno_prefix (error, "copyfile");
+
+  if (lseek (tmpf.fd, 0, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+
+  in = g_unix_input_stream_new (tmpf.fd, FALSE);
+  if (!ostree_checksum_file_from_input (file_info, xattrs, in, OSTREE_OBJECT_TYPE_FILE,
+                                        &csum, cancellable, error))
+    return FALSE;
+
+  actual_checksum = ostree_checksum_from_bytes (csum);
+  if (strcmp (actual_checksum, checksum) != 0)
+    return flatpak_fail (error, "Corrupted file object; checksum expected='%s' actual='%s'",
+                         checksum, actual_checksum);
+
+  /* This is how ostree stores content objects in bare-user-only repos */
+  if (fchmod (tmpf.fd, (mode & 0775) | S_IRUSR) != 0 ||
+      futimens (tmpf.fd, times) != 0)
+    return glnx_throw_errno (error);
+
+  if (!ostree_repo_get_disable_fsync (self->repo) && fsync (tmpf.fd) != 0)
+    return glnx_throw_errno_prefix (error, "fsync");
+
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, objdir, 0755, cancellable, error))
+    return FALSE;
+
+  if (!glnx_link_tmpfile_at (&tmpf,
+                             GLNX_LINK_TMPFILE_NOREPLACE_IGNORE_EXIST,
+                             repo_dfd, relpath,
+                             error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* The untrusted pull re-reads, re-checksums and re-writes every object
+ * from the child repo. Pre-import the content objects by cloning them
+ * instead, so the pull only has to handle the metadata objects. */
+static gboolean
+import_content_objects_by_clone (FlatpakDir   *self,
+                                 OstreeRepo   *src_repo,
+                                 const char   *commit,
+                                 GCancellable *cancellable,
+                                 GError      **error)
+{
+  g_autoptr(GHashTable) reachable = NULL;
+  GHashTableIter iter;
+  gpointer key;
+
+  if (ostree_repo_get_mode (self->repo) != OSTREE_REPO_MODE_BARE_USER_ONLY)
+    return TRUE;
+
+  if (!ostree_repo_traverse_commit (src_repo, commit, 0, &reachable, cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, reachable);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      gboolean has_object;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+      if (objtype != OSTREE_OBJECT_TYPE_FILE)
+        continue;
+
+      if (!ostree_repo_has_object (self->repo, objtype, checksum, &has_object,
+                                   cancellable, error))
+        return FALSE;
+
+      if (has_object)
+        continue;
+
+      if (!import_content_object_by_clone (self, src_repo, checksum, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 gboolean
 flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
                                   const char          *src_path,
@@ -3425,6 +3932,14 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
 
   /* Past this we must use goto out, so we abort the transaction on error */
 
+  /* Subpath pulls only want some of the objects, leave those to ostree */
+  if (subdirs_arg == NULL &&
+      !import_content_objects_by_clone (self, src_repo, checksum, cancellable, error))
+    {
+      g_prefix_error (error, _("While pulling %s from remote %s: "), ref, remote_name);
+      goto out;
+    }
+
   if (!repo_pull_one_local_untrusted (self, self->repo, remote_name, url,
                                       subdirs_arg ? (const char **)subdirs_arg->pdata : NULL,
                                       ref, checksum, progress,
@@ -3879,6 +4394,7 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
   g_autoptr(GFileEnumerator) dir_enum = NULL;
   g_autoptr(GFileInfo) child_info = NULL;
   g_autoptr(GFile) triggersdir = NULL;
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("triggers", NULL);
   GError *temp_error = NULL;
   const char *triggerspath;
 
@@ -5068,6 +5584,8 @@ flatpak_dir_deploy (FlatpakDir          *self,
   g_autoptr(GVariant) commit_metadata = NULL;
   GVariantBuilder metadata_builder;
   g_auto(GLnxLockFile) lock = { 0, };
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("deploy", ref);
+  g_autoptr(FlatpakTraceSpan) checkout_span = NULL;
 
   if (!flatpak_dir_ensure_repo (self, cancellable, error))
     return FALSE;
@@ -5149,6 +5667,8 @@ flatpak_dir_deploy (FlatpakDir          *self,
   options.bareuseronly_dirs = TRUE; /* https://github.com/ostreedev/ostree/pull/927 */
   checkoutdirpath = g_file_get_path (checkoutdir);
 
+  checkout_span = flatpak_trace_begin ("checkout", checksum);
+
   if (subpaths == NULL || *subpaths == NULL)
     {
       if (!ostree_repo_checkout_at (self->repo, &options,
@@ -5218,6 +5738,8 @@ flatpak_dir_deploy (FlatpakDir          *self,
         }
     }
 
+  flatpak_trace_end (g_steal_pointer (&checkout_span));
+
   /* Extract any extra data */
   extradir = g_file_resolve_relative_path (checkoutdir, "files/extra");
   if (!flatpak_rm_rf (extradir, cancellable, error))
@@ -5442,6 +5964,7 @@ flatpak_dir_deploy_install (FlatpakDir   *self,
   g_auto(GLnxLockFile) lock = { 0, };
   g_autoptr(GFile) deploy_base = NULL;
   g_autoptr(GFile) old_deploy_dir = NULL;
+  g_autofree char *new_active = NULL;
   gboolean created_deploy_base = FALSE;
   gboolean ret = FALSE;
   g_autoptr(GError) local_error = NULL;
@@ -5485,6 +6008,9 @@ flatpak_dir_deploy_install (FlatpakDir   *self,
         goto out;
     }
 
+  new_active = flatpak_dir_read_active (self, ref, cancellable);
+  flatpak_dir_record_change_or_warn (self, "install", ref, NULL, new_active, cancellable);
+
   /* Release lock before doing possibly slow prune */
   glnx_release_lock_file (&lock);
 
@@ -5515,6 +6041,7 @@ flatpak_dir_deploy_update (FlatpakDir   *self,
   g_auto(GLnxLockFile) lock = { 0, };
   g_autofree const char **old_subpaths = NULL;
   g_autofree char *old_active = NULL;
+  g_autofree char *new_active = NULL;
   const char *old_origin;
 
   if (!flatpak_dir_lock (self, &lock,
@@ -5553,6 +6080,9 @@ flatpak_dir_deploy_update (FlatpakDir   *self,
         return FALSE;
     }
 
+  new_active = flatpak_dir_read_active (self, ref, cancellable);
+  flatpak_dir_record_change_or_warn (self, "update", ref, old_active, new_active, cancellable);
+
   /* Release lock before doing possibly slow prune */
   glnx_release_lock_file (&lock);
 
@@ -5738,6 +6268,7 @@ flatpak_dir_install (FlatpakDir          *self,
                      GCancellable        *cancellable,
                      GError             **error)
 {
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("install", ref);
   FlatpakPullFlags flatpak_flags;
 
   flatpak_flags = FLATPAK_PULL_FLAGS_DOWNLOAD_EXTRA_DATA;
@@ -5759,6 +6290,7 @@ flatpak_dir_install (FlatpakDir          *self,
       gboolean gpg_verify;
       g_autofree char *collection_id = NULL;
       gboolean is_oci;
+      g_autoptr(FlatpakTraceSpan) helper_span = NULL;
 
       system_helper = flatpak_dir_get_system_helper (self);
       g_assert (system_helper != NULL);
@@ -5893,6 +6425,8 @@ flatpak_dir_install (FlatpakDir          *self,
       if (no_deploy)
         helper_flags |= FLATPAK_HELPER_DEPLOY_FLAGS_NO_DEPLOY;
 
+      helper_span = flatpak_trace_begin ("system-helper-deploy", ref);
+
       g_debug ("Calling system helper: Deploy");
       if (!flatpak_system_helper_call_deploy_sync (system_helper,
                                                    child_repo_path ? child_repo_path : "",
@@ -5903,6 +6437,8 @@ flatpak_dir_install (FlatpakDir          *self,
                                                    error))
         return FALSE;
 
+      flatpak_trace_end (g_steal_pointer (&helper_span));
+
       if (child_repo_path)
         (void) glnx_shutil_rm_rf_at (AT_FDCWD, child_repo_path, NULL, NULL);
 
@@ -5956,7 +6492,7 @@ flatpak_dir_ensure_bundle_remote (FlatpakDir          *self,
   if (!flatpak_dir_ensure_repo (self, cancellable, error))
     return NULL;
 
-  metadata = flatpak_bundle_load (file, &to_checksum,
+  metadata = flatpak_bundle_load (file, &to_checksum, NULL,
                                   &ref,
                                   &origin,
                                   NULL, &fp_metadata, NULL,
@@ -6065,7 +6601,7 @@ flatpak_dir_install_bundle (FlatpakDir          *self,
   if (!flatpak_dir_ensure_repo (self, cancellable, error))
     return FALSE;
 
-  metadata = flatpak_bundle_load (file, &to_checksum,
+  metadata = flatpak_bundle_load (file, &to_checksum, NULL,
                                   &ref,
                                   &origin,
                                   NULL, NULL,
@@ -6331,6 +6867,7 @@ flatpak_dir_update (FlatpakDir          *self,
                     GCancellable        *cancellable,
                     GError             **error)
 {
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("update", ref);
   g_autoptr(GVariant) deploy_data = NULL;
   const char **subpaths = NULL;
   g_autofree char *url = NULL;
@@ -6374,6 +6911,7 @@ flatpak_dir_update (FlatpakDir          *self,
       gboolean gpg_verify_summary;
       gboolean gpg_verify;
       g_autofree char *collection_id = NULL;
+      g_autoptr(FlatpakTraceSpan) helper_span = NULL;
 
       system_helper = flatpak_dir_get_system_helper (self);
       g_assert (system_helper != NULL);
@@ -6496,6 +7034,8 @@ flatpak_dir_update (FlatpakDir          *self,
       if (no_deploy)
         helper_flags |= FLATPAK_HELPER_DEPLOY_FLAGS_NO_DEPLOY;
 
+      helper_span = flatpak_trace_begin ("system-helper-deploy", ref);
+
       g_debug ("Calling system helper: Deploy");
       if (!flatpak_system_helper_call_deploy_sync (system_helper,
                                                    child_repo_path ? child_repo_path : "",
@@ -6506,6 +7046,8 @@ flatpak_dir_update (FlatpakDir          *self,
                                                    error))
         return FALSE;
 
+      flatpak_trace_end (g_steal_pointer (&helper_span));
+
       if (child_repo_path)
         (void) glnx_shutil_rm_rf_at (AT_FDCWD, child_repo_path, NULL, NULL);
 
@@ -6543,6 +7085,7 @@ flatpak_dir_uninstall (FlatpakDir          *self,
 {
   const char *repository;
   g_autofree char *current_ref = NULL;
+  g_autofree char *old_active = NULL;
   gboolean was_deployed;
   gboolean is_app;
   const char *name;
@@ -6551,6 +7094,7 @@ flatpak_dir_uninstall (FlatpakDir          *self,
   g_autoptr(GVariant) deploy_data = NULL;
   gboolean keep_ref = flags & FLATPAK_HELPER_UNINSTALL_FLAGS_KEEP_REF;
   gboolean force_remove = flags & FLATPAK_HELPER_UNINSTALL_FLAGS_FORCE_REMOVE;
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("uninstall", ref);
 
   parts = flatpak_decompose_ref (ref, error);
   if (parts == NULL)
@@ -6588,6 +7132,8 @@ flatpak_dir_uninstall (FlatpakDir          *self,
   if (repository == NULL)
     return FALSE;
 
+  old_active = flatpak_dir_read_active (self, ref, cancellable);
+
   g_debug ("dropping active ref");
   if (!flatpak_dir_set_active (self, ref, NULL, cancellable, error))
     return FALSE;
@@ -6615,6 +7161,9 @@ flatpak_dir_uninstall (FlatpakDir          *self,
       !flatpak_dir_update_exports (self, name, cancellable, error))
     return FALSE;
 
+  if (was_deployed)
+    flatpak_dir_record_change_or_warn (self, "uninstall", ref, old_active, NULL, cancellable);
+
   glnx_release_lock_file (&lock);
 
   if (repository != NULL &&
@@ -6849,18 +7398,373 @@ dir_is_locked (GFile *dir)
   return FALSE;
 }
 
-gboolean
-flatpak_dir_undeploy (FlatpakDir   *self,
-                      const char   *ref,
-                      const char   *active_id,
-                      gboolean      is_update,
-                      gboolean      force_remove,
-                      GCancellable *cancellable,
-                      GError      **error)
-{
-  gboolean ret = FALSE;
+/* Removed deployments can be large, so they are deleted on a worker
+ * thread at a low I/O priority (see FLATPAK_CLEANUP_IO_PRIORITY),
+ * rather than making uninstalls and updates wait for it. The top
+ * directories of each one are deleted in parallel. Anything that is
+ * interrupted stays in .removed and is picked up again the next time
+ * flatpak_dir_cleanup_removed() runs. */
+#define REMOVED_CLEANUP_MAX_THREADS 4
+#define REMOVED_CLEANUP_PARALLEL_DEPTH 2
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+/* The pools are exclusive, as the I/O priority set on their threads
+ * must not leak into other work that GLib would otherwise run on them */
+static struct {
+  GMutex       lock;
+  GCond        cond;
+  GThreadPool *worker;      /* One removed deployment at a time */
+  GThreadPool *removers;    /* The subdirectories of the current one */
+  GHashTable  *queued;      /* Paths queued or being removed */
+  guint64      reclaimed;
+} removed_cleanup;
 
-  g_autoptr(GFile) deploy_base = NULL;
+typedef struct {
+  GMutex  lock;
+  GCond   cond;
+  guint   pending;
+  guint64 reclaimed;
+} RemoveSubdirs;
+
+typedef struct {
+  RemoveSubdirs *subdirs;
+  char          *path;
+} RemoveSubdir;
+
+static void
+set_cleanup_io_priority (void)
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+  const char *prio_env = g_getenv ("FLATPAK_CLEANUP_IO_PRIORITY");
+  int ioprio;
+
+  if (prio_env == NULL || *prio_env == 0 || strcmp (prio_env, "idle") == 0)
+    ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+  else if (strcmp (prio_env, "low") == 0)
+    ioprio = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7;
+  else
+    ioprio = IOPRIO_CLASS_NONE << IOPRIO_CLASS_SHIFT; /* Derived from the nice value */
+
+  /* This only affects the calling thread */
+  if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) != 0)
+    g_debug ("Failed to set I/O priority: %s", g_strerror (errno));
+#endif
+}
+
+/* Like glnx_shutil_rm_rf_at(), but it counts the space freed, and
+   things that are already gone are not an error so that we can pick
+   up where an interrupted removal left off. */
+static gboolean
+remove_tree_at (int           dfd,
+                const char   *name,
+                guint64      *reclaimed,
+                GError      **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  g_autoptr(GError) local_error = NULL;
+  struct dirent *dent;
+  struct stat stbuf;
+
+  if (fstatat (dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      if (errno == ENOENT)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "fstatat(%s)", name);
+    }
+
+  if (!S_ISDIR (stbuf.st_mode))
+    {
+      if (unlinkat (dfd, name, 0) != 0 && errno != ENOENT)
+        return glnx_throw_errno_prefix (error, "unlinkat(%s)", name);
+
+      /* Files hardlinked from the repo don't free anything */
+      if (stbuf.st_nlink == 1)
+        *reclaimed += stbuf.st_blocks * 512;
+
+      return TRUE;
+    }
+
+  if (!glnx_dirfd_iterator_init_at (dfd, name, FALSE, &iter, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return TRUE;
+
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  while (TRUE)
+    {
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (!remove_tree_at (iter.fd, dent->d_name, reclaimed, error))
+        return FALSE;
+    }
+
+  if (unlinkat (dfd, name, AT_REMOVEDIR) != 0 && errno != ENOENT)
+    return glnx_throw_errno_prefix (error, "rmdir(%s)", name);
+
+  return TRUE;
+}
+
+static void
+remove_subdir_thread (gpointer data,
+                      gpointer user_data)
+{
+  RemoveSubdir *subdir = data;
+  RemoveSubdirs *subdirs = subdir->subdirs;
+  g_autoptr(GError) local_error = NULL;
+  guint64 reclaimed = 0;
+
+  set_cleanup_io_priority ();
+
+  if (!remove_tree_at (AT_FDCWD, subdir->path, &reclaimed, &local_error))
+    g_warning ("Unable to remove old checkout: %s", local_error->message);
+
+  g_mutex_lock (&subdirs->lock);
+  subdirs->reclaimed += reclaimed;
+  subdirs->pending--;
+  g_cond_signal (&subdirs->cond);
+  g_mutex_unlock (&subdirs->lock);
+
+  g_free (subdir->path);
+  g_free (subdir);
+}
+
+static void
+queue_subdirs (RemoveSubdirs *subdirs,
+               const char    *path,
+               int            depth)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, path, FALSE, &iter, NULL))
+    return;
+
+  while (glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, NULL, NULL) && dent != NULL)
+    {
+      g_autofree char *child_path = NULL;
+      RemoveSubdir *subdir;
+
+      if (dent->d_type != DT_DIR)
+        continue;
+
+      child_path = g_build_filename (path, dent->d_name, NULL);
+      if (depth + 1 < REMOVED_CLEANUP_PARALLEL_DEPTH)
+        {
+          queue_subdirs (subdirs, child_path, depth + 1);
+          continue;
+        }
+
+      subdir = g_new0 (RemoveSubdir, 1);
+      subdir->subdirs = subdirs;
+      subdir->path = g_steal_pointer (&child_path);
+
+      g_mutex_lock (&subdirs->lock);
+      subdirs->pending++;
+      g_mutex_unlock (&subdirs->lock);
+
+      g_thread_pool_push (removed_cleanup.removers, subdir, NULL);
+    }
+}
+
+static void
+removed_cleanup_thread (gpointer data,
+                        gpointer user_data)
+{
+  g_autofree char *path = g_strdup (data);
+  RemoveSubdirs subdirs = { { 0 } };
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *formatted_size = NULL;
+  g_autofree char *formatted_total = NULL;
+  guint64 reclaimed = 0;
+  guint left;
+
+  set_cleanup_io_priority ();
+
+  g_mutex_init (&subdirs.lock);
+  g_cond_init (&subdirs.cond);
+
+  queue_subdirs (&subdirs, path, 0);
+
+  g_mutex_lock (&subdirs.lock);
+  while (subdirs.pending > 0)
+    g_cond_wait (&subdirs.cond, &subdirs.lock);
+  g_mutex_unlock (&subdirs.lock);
+
+  reclaimed = subdirs.reclaimed;
+  if (!remove_tree_at (AT_FDCWD, path, &reclaimed, &local_error))
+    g_warning ("Unable to remove old checkout: %s", local_error->message);
+
+  g_mutex_clear (&subdirs.lock);
+  g_cond_clear (&subdirs.cond);
+
+  g_mutex_lock (&removed_cleanup.lock);
+  removed_cleanup.reclaimed += reclaimed;
+  g_hash_table_remove (removed_cleanup.queued, path);
+  left = g_hash_table_size (removed_cleanup.queued);
+  formatted_size = g_format_size (reclaimed);
+  formatted_total = g_format_size (removed_cleanup.reclaimed);
+  g_cond_broadcast (&removed_cleanup.cond);
+  g_mutex_unlock (&removed_cleanup.lock);
+
+  g_debug ("Removed %s, reclaimed %s (%s in total, %u left)",
+           path, formatted_size, formatted_total, left);
+}
+
+static void
+queue_removed_cleanup (GFile *dir)
+{
+  const char *path = flatpak_file_get_path_cached (dir);
+
+  g_mutex_lock (&removed_cleanup.lock);
+
+  if (removed_cleanup.worker == NULL)
+    {
+      removed_cleanup.queued = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      removed_cleanup.worker = g_thread_pool_new (removed_cleanup_thread, NULL, 1, TRUE, NULL);
+      removed_cleanup.removers = g_thread_pool_new (remove_subdir_thread, NULL,
+                                                    MIN (g_get_num_processors (), REMOVED_CLEANUP_MAX_THREADS),
+                                                    TRUE, NULL);
+    }
+
+  if (!g_hash_table_contains (removed_cleanup.queued, path))
+    {
+      char *queued_path = g_strdup (path);
+
+      g_hash_table_add (removed_cleanup.queued, queued_path);
+      g_thread_pool_push (removed_cleanup.worker, queued_path, NULL);
+    }
+
+  g_mutex_unlock (&removed_cleanup.lock);
+}
+
+/* Pruning normally only looks at the objects of the commits that were
+ * undeployed since the last prune, which are listed in this file.
+ * A full prune of the repo is still done once in a while, to catch
+ * objects that became unreferenced in some other way. */
+#define PRUNE_PENDING_FILENAME ".prune-pending"
+#define FULL_PRUNE_STAMP_FILENAME ".prune-full"
+#define FULL_PRUNE_INTERVAL_SECS (7 * 24 * 60 * 60)
+
+/* The prune rewrites the pending file in place, so both that and the
+ * appends in flatpak_dir_add_prune_pending() hold a lock on the file. */
+static int
+open_prune_pending_locked (FlatpakDir *self,
+                           int         flags,
+                           GError    **error)
+{
+  g_autoptr(GFile) pending_file = g_file_get_child (self->basedir, PRUNE_PENDING_FILENAME);
+  glnx_autofd int fd = -1;
+
+  fd = open (flatpak_file_get_path_cached (pending_file), flags | O_CLOEXEC, 0644);
+  if (fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return -1;
+    }
+
+  if (flock (fd, LOCK_EX) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return -1;
+    }
+
+  return glnx_steal_fd (&fd);
+}
+
+static void
+flatpak_dir_add_prune_pending (FlatpakDir *self,
+                               const char *commit)
+{
+  g_autofree char *line = g_strconcat (commit, "\n", NULL);
+  g_autoptr(GError) local_error = NULL;
+  glnx_autofd int fd = -1;
+
+  fd = open_prune_pending_locked (self, O_WRONLY | O_APPEND | O_CREAT, &local_error);
+  if (fd == -1)
+    g_debug ("Failed to queue %s for pruning: %s", commit, local_error->message);
+  else if (glnx_loop_write (fd, line, strlen (line)) < 0)
+    g_debug ("Failed to queue %s for pruning: %s", commit, g_strerror (errno));
+}
+
+/* Returns the queued commits, or an empty string if there are none */
+static char *
+flatpak_dir_read_prune_pending (FlatpakDir   *self,
+                                GCancellable *cancellable,
+                                GError      **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  glnx_autofd int fd = -1;
+
+  fd = open_prune_pending_locked (self, O_RDONLY, &local_error);
+  if (fd == -1)
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return g_strdup ("");
+
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+
+  return glnx_fd_readall_utf8 (fd, NULL, cancellable, error);
+}
+
+/* Replaces the pending commits that were read as @handled with @keep,
+ * preserving any that were queued since. */
+static gboolean
+flatpak_dir_rewrite_prune_pending (FlatpakDir *self,
+                                   const char *handled,
+                                   const char *keep,
+                                   GError    **error)
+{
+  g_autoptr(GString) remaining = g_string_new (keep);
+  g_autofree char *current_contents = NULL;
+  glnx_autofd int fd = -1;
+
+  fd = open_prune_pending_locked (self, O_RDWR | O_APPEND | O_CREAT, error);
+  if (fd == -1)
+    return FALSE;
+
+  current_contents = glnx_fd_readall_utf8 (fd, NULL, NULL, NULL);
+  if (current_contents != NULL)
+    {
+      if (g_str_has_prefix (current_contents, handled))
+        g_string_append (remaining, current_contents + strlen (handled));
+      else
+        g_string_append (remaining, current_contents);
+    }
+
+  /* O_APPEND, so this writes from the start again */
+  if (ftruncate (fd, 0) != 0 ||
+      glnx_loop_write (fd, remaining->str, remaining->len) < 0)
+    return glnx_throw_errno_prefix (error, "Writing %s", PRUNE_PENDING_FILENAME);
+
+  return TRUE;
+}
+
+gboolean
+flatpak_dir_undeploy (FlatpakDir   *self,
+                      const char   *ref,
+                      const char   *active_id,
+                      gboolean      is_update,
+                      gboolean      force_remove,
+                      GCancellable *cancellable,
+                      GError      **error)
+{
+  gboolean ret = FALSE;
+
+  g_autoptr(GFile) deploy_base = NULL;
   g_autoptr(GFile) checkoutdir = NULL;
   g_autoptr(GFile) removed_subdir = NULL;
   g_autoptr(GFile) removed_dir = NULL;
@@ -6933,15 +7837,9 @@ flatpak_dir_undeploy (FlatpakDir   *self,
                            G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, NULL);
 
   if (force_remove || !dir_is_locked (removed_subdir))
-    {
-      GError *tmp_error = NULL;
+    queue_removed_cleanup (removed_subdir);
 
-      if (!flatpak_rm_rf (removed_subdir, cancellable, &tmp_error))
-        {
-          g_warning ("Unable to remove old checkout: %s", tmp_error->message);
-          g_error_free (tmp_error);
-        }
-    }
+  flatpak_dir_add_prune_pending (self, active_id);
 
   ret = TRUE;
 out:
@@ -7100,14 +7998,7 @@ flatpak_dir_cleanup_removed (FlatpakDir   *self,
 
       if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY &&
           !dir_is_locked (child))
-        {
-          GError *tmp_error = NULL;
-          if (!flatpak_rm_rf (child, cancellable, &tmp_error))
-            {
-              g_warning ("Unable to remove old checkout: %s", tmp_error->message);
-              g_error_free (tmp_error);
-            }
-        }
+        queue_removed_cleanup (child);
 
       g_clear_object (&child_info);
     }
@@ -7123,18 +8014,358 @@ out:
   return ret;
 }
 
+/**
+ * flatpak_dir_wait_for_removed_cleanup:
+ * @progress: (nullable): called while waiting, each time the number of
+ *   deployments left to remove changes
+ * @progress_data: user data for @progress
+ *
+ * Waits for the removal of old deployments queued by
+ * flatpak_dir_undeploy() and flatpak_dir_cleanup_removed() to finish.
+ * Processes that are about to exit should call this, otherwise the
+ * rest is only removed the next time.
+ *
+ * Returns: the number of bytes reclaimed by all removals in this process
+ */
+guint64
+flatpak_dir_wait_for_removed_cleanup (FlatpakDirCleanupProgress progress,
+                                      gpointer                  progress_data)
+{
+  guint last_left = 0;
+  guint64 reclaimed;
+
+  g_mutex_lock (&removed_cleanup.lock);
+  while (removed_cleanup.queued != NULL &&
+         g_hash_table_size (removed_cleanup.queued) > 0)
+    {
+      guint left = g_hash_table_size (removed_cleanup.queued);
+
+      if (progress != NULL && left != last_left)
+        {
+          reclaimed = removed_cleanup.reclaimed;
+          last_left = left;
+
+          g_mutex_unlock (&removed_cleanup.lock);
+          progress (left, reclaimed, progress_data);
+          g_mutex_lock (&removed_cleanup.lock);
+          continue;
+        }
+
+      g_cond_wait (&removed_cleanup.cond, &removed_cleanup.lock);
+    }
+  reclaimed = removed_cleanup.reclaimed;
+  g_mutex_unlock (&removed_cleanup.lock);
+
+  return reclaimed;
+}
+
+static GHashTable *
+reachable_objects_new (void)
+{
+  return g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
+                                NULL, (GDestroyNotify) g_variant_unref);
+}
+
+static gboolean
+prune_budget_exceeded (gint64 deadline)
+{
+  return deadline != 0 && g_get_monotonic_time () > deadline;
+}
+
+static gboolean
+remove_reachable_candidate (gpointer key,
+                            gpointer value,
+                            gpointer user_data)
+{
+  GHashTable *reachable = user_data;
+
+  return g_hash_table_contains (reachable, key);
+}
+
+/* Marks everything reachable from the refs in the repo. If @candidates
+ * is given, the objects found are removed from it as we go, and we stop
+ * early once it is empty. Sets @out_timed_out if the budget ran out. */
+static gboolean
+flatpak_dir_mark_reachable_from_refs (FlatpakDir   *self,
+                                      GHashTable   *reachable,
+                                      GHashTable   *candidates,
+                                      gint64        deadline,
+                                      gboolean     *out_timed_out,
+                                      GCancellable *cancellable,
+                                      GError      **error)
+{
+  g_autoptr(GHashTable) refs = NULL;
+  g_autoptr(GHashTable) commits = g_hash_table_new (g_str_hash, g_str_equal);
+#ifdef FLATPAK_ENABLE_P2P
+  g_autoptr(GHashTable) collection_refs = NULL;
+#endif
+  GHashTableIter iter;
+  gpointer value;
+
+  *out_timed_out = FALSE;
+
+  if (!ostree_repo_list_refs (self->repo, NULL, &refs, cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, refs);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_hash_table_add (commits, value);
+
+#ifdef FLATPAK_ENABLE_P2P
+  if (!ostree_repo_list_collection_refs (self->repo, NULL, &collection_refs,
+                                         OSTREE_REPO_LIST_REFS_EXT_NONE,
+                                         cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, collection_refs);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_hash_table_add (commits, value);
+#endif  /* FLATPAK_ENABLE_P2P */
+
+  g_hash_table_iter_init (&iter, commits);
+  while (g_hash_table_iter_next (&iter, &value, NULL))
+    {
+      const char *commit = value;
+
+      if (candidates != NULL && g_hash_table_size (candidates) == 0)
+        break;
+
+      if (prune_budget_exceeded (deadline))
+        {
+          *out_timed_out = TRUE;
+          return TRUE;
+        }
+
+      if (!ostree_repo_traverse_commit_union (self->repo, commit, 0, reachable,
+                                              cancellable, error))
+        return FALSE;
+
+      if (candidates != NULL)
+        g_hash_table_foreach_remove (candidates, remove_reachable_candidate, reachable);
+    }
+
+  return TRUE;
+}
+
+static gint
+compare_prune_order (gconstpointer a,
+                     gconstpointer b)
+{
+  OstreeObjectType objtype_a, objtype_b;
+  const char *checksum;
+
+  ostree_object_name_deserialize (*(GVariant **) a, &checksum, &objtype_a);
+  ostree_object_name_deserialize (*(GVariant **) b, &checksum, &objtype_b);
+
+  /* Content first, so the commit can be traversed again if we stop half-way */
+  return (int) objtype_a - (int) objtype_b;
+}
+
+static gboolean
+flatpak_dir_prune_full (FlatpakDir   *self,
+                        gint64        deadline,
+                        GCancellable *cancellable,
+                        GError      **error)
+{
+  g_autoptr(GHashTable) reachable = reachable_objects_new ();
+  g_autoptr(GFile) stamp_file = g_file_get_child (self->basedir, FULL_PRUNE_STAMP_FILENAME);
+  g_autofree char *pending_contents = NULL;
+  OstreeRepoPruneOptions opts = { OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY, NULL };
+  gint objects_total, objects_pruned;
+  guint64 pruned_object_size_total;
+  g_autofree char *formatted_freed_size = NULL;
+  gboolean timed_out;
+
+  g_debug ("Pruning repo");
+
+  pending_contents = flatpak_dir_read_prune_pending (self, cancellable, error);
+  if (pending_contents == NULL)
+    return FALSE;
+
+  if (!flatpak_dir_mark_reachable_from_refs (self, reachable, NULL, deadline, &timed_out,
+                                             cancellable, error))
+    return FALSE;
+
+  if (timed_out)
+    {
+      g_debug ("Prune budget exceeded, postponing full prune");
+      return TRUE;
+    }
+
+  opts.reachable = reachable;
+  if (!ostree_repo_prune_from_reachable (self->repo, &opts,
+                                         &objects_total,
+                                         &objects_pruned,
+                                         &pruned_object_size_total,
+                                         cancellable, error))
+    return FALSE;
+
+  formatted_freed_size = g_format_size_full (pruned_object_size_total, 0);
+  g_debug ("Pruned %d/%d objects, size %s", objects_total, objects_pruned, formatted_freed_size);
+
+  /* Everything pending was handled too */
+  if (!flatpak_dir_rewrite_prune_pending (self, pending_contents, "", error))
+    return FALSE;
+
+  if (!g_file_replace_contents (stamp_file, "", 0, NULL, FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+flatpak_dir_full_prune_due (FlatpakDir *self)
+{
+  g_autoptr(GFile) stamp_file = g_file_get_child (self->basedir, FULL_PRUNE_STAMP_FILENAME);
+  g_autoptr(GFileInfo) info = NULL;
+  guint64 last_prune;
+
+  info = g_file_query_info (stamp_file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                            G_FILE_QUERY_INFO_NONE, NULL, NULL);
+  if (info == NULL)
+    return TRUE;
+
+  last_prune = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+
+  return g_get_real_time () / G_USEC_PER_SEC > last_prune + FULL_PRUNE_INTERVAL_SECS;
+}
+
+/* Prunes only the objects reachable from the commits that were queued
+ * by flatpak_dir_undeploy(), and not from any ref. Sets @out_need_full
+ * if that can't be worked out, e.g. because a previous prune removed
+ * some objects of a commit but not the commit itself. */
+static gboolean
+flatpak_dir_prune_incremental (FlatpakDir   *self,
+                               gint64        deadline,
+                               gboolean     *out_need_full,
+                               GCancellable *cancellable,
+                               GError      **error)
+{
+  g_autofree char *pending_contents = NULL;
+  g_auto(GStrv) pending = NULL;
+  g_autoptr(GHashTable) candidates = reachable_objects_new ();
+  g_autoptr(GHashTable) reachable = reachable_objects_new ();
+  g_autoptr(GPtrArray) to_delete = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *formatted_freed_size = NULL;
+  guint64 pruned_object_size_total = 0;
+  gboolean timed_out = FALSE;
+  GHashTableIter iter;
+  gpointer key;
+  guint i;
+
+  *out_need_full = FALSE;
+
+  pending_contents = flatpak_dir_read_prune_pending (self, cancellable, error);
+  if (pending_contents == NULL)
+    return FALSE;
+
+  if (*pending_contents == 0)
+    return TRUE;
+
+  pending = g_strsplit (pending_contents, "\n", -1);
+  for (i = 0; pending[i] != NULL; i++)
+    {
+      const char *commit = pending[i];
+      gboolean has_commit;
+
+      if (!ostree_validate_checksum_string (commit, NULL))
+        continue;
+
+      if (!ostree_repo_has_object (self->repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
+                                   &has_commit, cancellable, error))
+        return FALSE;
+
+      /* Already gone */
+      if (!has_commit)
+        continue;
+
+      if (!ostree_repo_traverse_commit_union (self->repo, commit, 0, candidates,
+                                              cancellable, &local_error))
+        {
+          if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            {
+              g_debug ("Can't prune %s incrementally: %s", commit, local_error->message);
+              *out_need_full = TRUE;
+              return TRUE;
+            }
+
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+    }
+
+  g_debug ("Pruning repo incrementally, %u candidate objects", g_hash_table_size (candidates));
+
+  if (!flatpak_dir_mark_reachable_from_refs (self, reachable, candidates, deadline, &timed_out,
+                                             cancellable, error))
+    return FALSE;
+
+  if (timed_out)
+    {
+      g_debug ("Prune budget exceeded, postponing prune");
+      return TRUE;
+    }
+
+  to_delete = g_ptr_array_sized_new (g_hash_table_size (candidates));
+  g_hash_table_iter_init (&iter, candidates);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_ptr_array_add (to_delete, key);
+  g_ptr_array_sort (to_delete, compare_prune_order);
+
+  for (i = 0; i < to_delete->len; i++)
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      guint64 storage_size = 0;
+
+      if (prune_budget_exceeded (deadline))
+        {
+          timed_out = TRUE;
+          break;
+        }
+
+      ostree_object_name_deserialize (g_ptr_array_index (to_delete, i), &checksum, &objtype);
+
+      if (!ostree_repo_query_object_storage_size (self->repo, objtype, checksum,
+                                                  &storage_size, cancellable, NULL))
+        continue; /* Already removed */
+
+      if (!ostree_repo_delete_object (self->repo, objtype, checksum, cancellable, error))
+        return FALSE;
+
+      pruned_object_size_total += storage_size;
+    }
+
+  formatted_freed_size = g_format_size_full (pruned_object_size_total, 0);
+  g_debug ("Pruned %u objects, size %s%s", i, formatted_freed_size,
+           timed_out ? " (budget exceeded)" : "");
+
+  /* Keep the commits for next time if we didn't get to all of them, and
+     anything that was queued while we were pruning */
+  if (!flatpak_dir_rewrite_prune_pending (self, pending_contents,
+                                          timed_out ? pending_contents : "",
+                                          error))
+    return FALSE;
+
+  return TRUE;
+}
+
 gboolean
 flatpak_dir_prune (FlatpakDir   *self,
                    GCancellable *cancellable,
                    GError      **error)
 {
   gboolean ret = FALSE;
-  gint objects_total, objects_pruned;
-  guint64 pruned_object_size_total;
-  g_autofree char *formatted_freed_size = NULL;
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GError) lock_error = NULL;
   g_auto(GLnxLockFile) lock = { 0, };
+  const char *budget_env = g_getenv ("FLATPAK_PRUNE_BUDGET");
+  gint64 deadline = 0;
+  gboolean need_full;
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("prune", NULL);
 
   if (error == NULL)
     error = &local_error;
@@ -7176,18 +8407,19 @@ flatpak_dir_prune (FlatpakDir   *self,
       return FALSE;
     }
 
-  g_debug ("Pruning repo");
-  if (!ostree_repo_prune (self->repo,
-                          OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY,
-                          0,
-                          &objects_total,
-                          &objects_pruned,
-                          &pruned_object_size_total,
-                          cancellable, error))
+  /* The budget is in seconds, a prune that runs out of it leaves
+     the rest of the work for the next one */
+  if (budget_env != NULL && g_ascii_strtod (budget_env, NULL) > 0)
+    deadline = g_get_monotonic_time () + g_ascii_strtod (budget_env, NULL) * G_USEC_PER_SEC;
+
+  if (flatpak_dir_full_prune_due (self))
+    need_full = TRUE;
+  else if (!flatpak_dir_prune_incremental (self, deadline, &need_full, cancellable, error))
     goto out;
 
-  formatted_freed_size = g_format_size_full (pruned_object_size_total, 0);
-  g_debug ("Pruned %d/%d objects, size %s", objects_total, objects_pruned, formatted_freed_size);
+  if (need_full &&
+      !flatpak_dir_prune_full (self, deadline, cancellable, error))
+    goto out;
 
   ret = TRUE;
 
@@ -7364,15 +8596,261 @@ flatpak_dir_cache_summary (FlatpakDir  *self,
 }
 
 
-static int
-compare_mdp (const void *a, const void *b)
-{
-  FlatpakOciManifestDescriptor *aa = *(FlatpakOciManifestDescriptor **)a;
-  FlatpakOciManifestDescriptor *bb = *(FlatpakOciManifestDescriptor **)b;
-  const char *ref_a = flatpak_oci_manifest_descriptor_get_ref (aa);
-  const char *ref_b = flatpak_oci_manifest_descriptor_get_ref (bb);
+static int
+compare_mdp (const void *a, const void *b)
+{
+  FlatpakOciManifestDescriptor *aa = *(FlatpakOciManifestDescriptor **)a;
+  FlatpakOciManifestDescriptor *bb = *(FlatpakOciManifestDescriptor **)b;
+  const char *ref_a = flatpak_oci_manifest_descriptor_get_ref (aa);
+  const char *ref_b = flatpak_oci_manifest_descriptor_get_ref (bb);
+
+  return g_strcmp0 (ref_a, ref_b);
+}
+
+/* Returns the flatpak annotations of the images in a previously
+ * synthesized summary, keyed by manifest digest */
+static GHashTable *
+load_cached_oci_annotations (GVariant *cached_summary)
+{
+  GHashTable *annotations_by_digest = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                             (GDestroyNotify) g_hash_table_unref);
+  g_autoptr(GVariant) refs = g_variant_get_child_value (cached_summary, 0);
+  g_autoptr(GVariant) extensions = g_variant_get_child_value (cached_summary, 1);
+  g_autoptr(GVariant) cache_v = g_variant_lookup_value (extensions, "xa.cache", NULL);
+  g_autoptr(GVariant) cache = cache_v ? g_variant_get_child_value (cache_v, 0) : NULL;
+  g_autofree const char **skipped = NULL;
+  gsize i, n;
+
+  n = g_variant_n_children (refs);
+  for (i = 0; i < n; i++)
+    {
+      const char *ref;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autoptr(GVariant) ref_metadata = NULL;
+      g_autofree char *digest = NULL;
+      const char *signature_digest;
+      guint64 installed_size, download_size;
+      const char *metadata;
+      GHashTable *annotations;
+
+      g_variant_get_child (refs, i, "(&s(t@ay@a{sv}))", &ref, NULL, &csum_v, &ref_metadata);
+      if (g_variant_n_children (csum_v) != OSTREE_SHA256_DIGEST_LEN)
+        continue;
+      digest = ostree_checksum_from_bytes_v (csum_v);
+
+      annotations = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      g_hash_table_insert (annotations, g_strdup ("org.opencontainers.image.ref.name"), g_strdup (ref));
+
+      if (g_variant_lookup (ref_metadata, "xa.oci-signature", "&s", &signature_digest))
+        g_hash_table_insert (annotations, g_strdup ("org.flatpak.signature-digest"),
+                             g_strdup (signature_digest));
+
+      if (cache != NULL &&
+          g_variant_lookup (cache, ref, "(tt&s)", &installed_size, &download_size, &metadata))
+        {
+          g_hash_table_insert (annotations, g_strdup ("org.flatpak.installed-size"),
+                               g_strdup_printf ("%" G_GUINT64_FORMAT, GUINT64_FROM_BE (installed_size)));
+          g_hash_table_insert (annotations, g_strdup ("org.flatpak.download-size"),
+                               g_strdup_printf ("%" G_GUINT64_FORMAT, GUINT64_FROM_BE (download_size)));
+          if (*metadata != 0)
+            g_hash_table_insert (annotations, g_strdup ("org.flatpak.metadata"), g_strdup (metadata));
+        }
+
+      g_hash_table_replace (annotations_by_digest, g_strconcat ("sha256:", digest, NULL), annotations);
+    }
+
+  /* Images we know are not flatpaks get no annotations */
+  if (g_variant_lookup (extensions, "xa.oci-skipped", "^a&s", &skipped))
+    {
+      for (i = 0; skipped[i] != NULL; i++)
+        g_hash_table_replace (annotations_by_digest, g_strdup (skipped[i]),
+                              g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free));
+    }
+
+  return annotations_by_digest;
+}
+
+typedef struct
+{
+  const char   *oci_uri;
+  GPtrArray    *descriptors;
+  gboolean     *loaded;
+  gint          next;
+  GCancellable *cancellable;
+  GMutex        lock;
+  GError       *error;
+} OciManifestFetch;
+
+static void
+oci_manifest_fetch_set_error (OciManifestFetch *fetch,
+                              GError           *error)
+{
+  g_mutex_lock (&fetch->lock);
+  if (fetch->error == NULL)
+    fetch->error = error;
+  else
+    g_error_free (error);
+  g_mutex_unlock (&fetch->lock);
+}
+
+static gboolean
+oci_manifest_fetch_failed (OciManifestFetch *fetch)
+{
+  gboolean failed;
+
+  g_mutex_lock (&fetch->lock);
+  failed = fetch->error != NULL;
+  g_mutex_unlock (&fetch->lock);
+
+  return failed;
+}
+
+static gpointer
+oci_manifest_fetch_thread (gpointer user_data)
+{
+  OciManifestFetch *fetch = user_data;
+  g_autoptr(FlatpakOciRegistry) registry = NULL;
+  GError *local_error = NULL;
+  guint i;
+
+  /* Soup sessions are not thread-safe, so each thread has its own */
+  registry = flatpak_oci_registry_new (fetch->oci_uri, FALSE, -1, fetch->cancellable, &local_error);
+  if (registry == NULL)
+    {
+      oci_manifest_fetch_set_error (fetch, local_error);
+      return NULL;
+    }
+
+  while (!oci_manifest_fetch_failed (fetch) &&
+         (i = g_atomic_int_add (&fetch->next, 1)) < fetch->descriptors->len)
+    {
+      FlatpakOciDescriptor *d = g_ptr_array_index (fetch->descriptors, i);
+      g_autoptr(FlatpakOciVersioned) versioned = NULL;
+
+      versioned = flatpak_oci_registry_load_versioned (registry, d->digest, NULL,
+                                                       fetch->cancellable, &local_error);
+      if (versioned == NULL)
+        {
+          g_prefix_error (&local_error, "Can't load OCI manifest %s: ", d->digest);
+          oci_manifest_fetch_set_error (fetch, local_error);
+          return NULL;
+        }
+
+      /* The index entry lacked the annotations, but the manifest has them */
+      if (FLATPAK_IS_OCI_MANIFEST (versioned) &&
+          FLATPAK_OCI_MANIFEST (versioned)->annotations != NULL)
+        flatpak_oci_export_annotations (FLATPAK_OCI_MANIFEST (versioned)->annotations,
+                                        d->annotations);
+
+      fetch->loaded[i] = TRUE;
+    }
+
+  return NULL;
+}
+
+/* Makes sure all index entries have the flatpak annotations, which are
+ * only copied into the index by flatpak itself. They are taken from the
+ * previous summary when the manifest digest is unchanged, and otherwise
+ * from the manifests, which are then loaded in parallel. Only images
+ * whose manifest was actually seen to not be a flatpak are added to
+ * @skipped, so a failure to load one is an error rather than cached. */
+static gboolean
+complete_oci_index_annotations (FlatpakOciIndex *index,
+                                const char      *oci_uri,
+                                GHashTable      *cached_annotations,
+                                GPtrArray       *skipped,
+                                GCancellable    *cancellable,
+                                GError         **error)
+{
+  g_autoptr(GPtrArray) to_fetch = g_ptr_array_new ();
+  g_autoptr(GHashTable) resolved = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_autofree gboolean *loaded = NULL;
+  OciManifestFetch fetch = { oci_uri, to_fetch, NULL, 0, cancellable, };
+  g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+  guint n_threads;
+  int i;
+
+  for (i = 0; index->manifests != NULL && index->manifests[i] != NULL; i++)
+    {
+      FlatpakOciDescriptor *d = (FlatpakOciDescriptor *) index->manifests[i];
+      const char *ref = flatpak_oci_manifest_descriptor_get_ref (index->manifests[i]);
+      GHashTable *cached;
+
+      if (d->mediatype == NULL || strcmp (d->mediatype, FLATPAK_OCI_MEDIA_TYPE_IMAGE_MANIFEST) != 0)
+        continue;
+
+      if (d->annotations == NULL)
+        d->annotations = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+      if (ref != NULL &&
+          (g_hash_table_contains (d->annotations, "org.flatpak.metadata") ||
+           g_str_has_prefix (ref, "appstream/")))
+        continue;
+
+      cached = cached_annotations ? g_hash_table_lookup (cached_annotations, d->digest) : NULL;
+      if (cached != NULL)
+        {
+          GHashTableIter iter;
+          gpointer key, value;
+
+          g_hash_table_iter_init (&iter, cached);
+          while (g_hash_table_iter_next (&iter, &key, &value))
+            if (!g_hash_table_contains (d->annotations, key))
+              g_hash_table_insert (d->annotations, g_strdup (key), g_strdup (value));
+
+          g_hash_table_add (resolved, d);
+        }
+      else
+        g_ptr_array_add (to_fetch, d);
+    }
+
+  if (to_fetch->len > 0)
+    {
+      loaded = g_new0 (gboolean, to_fetch->len);
+      fetch.loaded = loaded;
+      g_mutex_init (&fetch.lock);
+
+      n_threads = MIN (to_fetch->len, 8);
+      g_debug ("Loading %u OCI manifests using %u threads", to_fetch->len, n_threads);
+
+      for (i = 0; i < n_threads; i++)
+        g_ptr_array_add (threads, g_thread_new ("oci-manifest-fetch", oci_manifest_fetch_thread, &fetch));
+
+      for (i = 0; i < threads->len; i++)
+        g_thread_join (g_ptr_array_index (threads, i));
+
+      g_mutex_clear (&fetch.lock);
+
+      if (fetch.error != NULL)
+        {
+          g_propagate_error (error, fetch.error);
+          return FALSE;
+        }
+
+      for (i = 0; i < to_fetch->len; i++)
+        if (loaded[i])
+          g_hash_table_add (resolved, g_ptr_array_index (to_fetch, i));
+    }
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  /* Remember what turned out not to be a flatpak, so we don't load it again */
+  for (i = 0; index->manifests != NULL && index->manifests[i] != NULL; i++)
+    {
+      FlatpakOciDescriptor *d = (FlatpakOciDescriptor *) index->manifests[i];
+      const char *ref = flatpak_oci_manifest_descriptor_get_ref (index->manifests[i]);
+
+      if (!g_hash_table_contains (resolved, d))
+        continue;
+
+      if (ref == NULL ||
+          (!g_hash_table_contains (d->annotations, "org.flatpak.metadata") &&
+           !g_str_has_prefix (ref, "appstream/")))
+        g_ptr_array_add (skipped, d->digest);
+    }
 
-  return g_strcmp0 (ref_a, ref_b);
+  return TRUE;
 }
 
 static gboolean
@@ -7400,6 +8878,9 @@ flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GMappedFile) mfile = NULL;
   g_autoptr(GBytes) cache_bytes = NULL;
+  g_autoptr(GVariant) cached_summary = NULL;
+  g_autoptr(GHashTable) cached_annotations = NULL;
+  g_autoptr(GPtrArray) skipped = g_ptr_array_new ();
 
   if (!ostree_repo_remote_get_url (self->repo,
                                    remote,
@@ -7420,7 +8901,7 @@ flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
   if (mfile)
     {
       cache_bytes = g_mapped_file_get_bytes (mfile);
-      g_autoptr(GVariant) cached_summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT, cache_bytes, TRUE));
+      cached_summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT, cache_bytes, TRUE));
       g_autoptr(GVariant) extensions = g_variant_get_child_value (cached_summary, 1);
       g_variant_lookup (extensions, "xa.oci-etag", "s", &cache_etag);
     }
@@ -7447,6 +8928,13 @@ flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
   ref_data_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{s(tts)}"));
   additional_metadata_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
 
+  if (cached_summary != NULL)
+    cached_annotations = load_cached_oci_annotations (cached_summary);
+
+  if (!complete_oci_index_annotations (index, oci_uri, cached_annotations, skipped,
+                                       cancellable, error))
+    return FALSE;
+
   /* The summary has to be sorted by ref, so pre-sort the manifests */
   if (index->manifests != NULL)
     qsort (index->manifests, flatpak_oci_index_get_n_manifests (index), sizeof (FlatpakOciManifestDescriptor *), compare_mdp);
@@ -7514,6 +9002,9 @@ flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
   if (new_etag)
     g_variant_builder_add (additional_metadata_builder, "{sv}", "xa.oci-etag",
                            g_variant_new_string (new_etag));
+  if (skipped->len > 0)
+    g_variant_builder_add (additional_metadata_builder, "{sv}", "xa.oci-skipped",
+                           g_variant_new_strv ((const char * const *) skipped->pdata, skipped->len));
 
   summary_builder = g_variant_builder_new (OSTREE_SUMMARY_GVARIANT_FORMAT);
 
@@ -7533,6 +9024,91 @@ flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
   return TRUE;
 }
 
+/* Command line completion must never block on the network, so it
+ * only looks at an index of the refs of each remote, as of the last
+ * time we fetched its summary, and of the installed refs. It lives
+ * in the user cache, as system installations are not writable. */
+#define REF_INDEX_INSTALLED ".installed"
+
+static GFile *
+flatpak_dir_get_ref_index_dir (FlatpakDir *self)
+{
+  g_autoptr(GFile) cache_dir = flatpak_get_user_cache_dir_location ();
+  g_autoptr(GFile) index_dir = g_file_get_child (cache_dir, "ref-index");
+  g_autofree char *dir_key = g_compute_checksum_for_string (G_CHECKSUM_SHA256,
+                                                            flatpak_file_get_path_cached (self->basedir), -1);
+
+  return g_file_get_child (index_dir, dir_key);
+}
+
+static void
+flatpak_dir_save_ref_index (FlatpakDir *self,
+                            const char *name,
+                            GPtrArray  *refs)
+{
+  g_autoptr(GFile) index_dir = flatpak_dir_get_ref_index_dir (self);
+  g_autoptr(GFile) index_file = g_file_get_child (index_dir, name);
+  g_autoptr(GVariant) index = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  g_ptr_array_sort (refs, flatpak_strcmp0_ptr);
+  index = g_variant_ref_sink (g_variant_new_strv ((const char * const *) refs->pdata, refs->len));
+
+  if (g_mkdir_with_parents (flatpak_file_get_path_cached (index_dir), 0755) != 0)
+    {
+      g_debug ("Failed to create ref index: %s", g_strerror (errno));
+      return;
+    }
+
+  if (!g_file_replace_contents (index_file,
+                                g_variant_get_data (index), g_variant_get_size (index),
+                                NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                NULL, &local_error))
+    g_debug ("Failed to write ref index: %s", local_error->message);
+}
+
+/* Completion would otherwise keep offering refs of a remote that was
+ * removed, or that now points somewhere else */
+static void
+flatpak_dir_remove_ref_index (FlatpakDir *self,
+                              const char *name)
+{
+  g_autoptr(GFile) index_dir = flatpak_dir_get_ref_index_dir (self);
+  g_autoptr(GFile) index_file = g_file_get_child (index_dir, name);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!g_file_delete (index_file, NULL, &local_error) &&
+      !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    g_debug ("Failed to remove ref index: %s", local_error->message);
+}
+
+static void
+flatpak_dir_update_remote_ref_index (FlatpakDir *self,
+                                     const char *remote,
+                                     GBytes     *summary_bytes)
+{
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GVariant) summary_refs = NULL;
+  g_autoptr(GPtrArray) refs = g_ptr_array_new ();
+  gsize i, n;
+
+  summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                                          summary_bytes, FALSE));
+  summary_refs = g_variant_get_child_value (summary, 0);
+
+  n = g_variant_n_children (summary_refs);
+  for (i = 0; i < n; i++)
+    {
+      const char *ref;
+
+      g_variant_get_child (summary_refs, i, "(&s@(taya{sv}))", &ref, NULL);
+      if (g_str_has_prefix (ref, "app/") || g_str_has_prefix (ref, "runtime/"))
+        g_ptr_array_add (refs, (char *) ref);
+    }
+
+  flatpak_dir_save_ref_index (self, remote, refs);
+}
+
 static gboolean
 flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
                                   const char   *name,
@@ -7546,6 +9122,7 @@ flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GBytes) summary = NULL;
   g_autoptr(GBytes) summary_sig = NULL;
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("fetch-summary", name);
 
   if (!ostree_repo_remote_get_url (self->repo, name, &url, error))
     return FALSE;
@@ -7587,6 +9164,8 @@ flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
   if (!is_local)
     flatpak_dir_cache_summary (self, summary, summary_sig, name, url);
 
+  flatpak_dir_update_remote_ref_index (self, name, summary);
+
   *out_summary = g_steal_pointer (&summary);
   if (out_summary_sig)
     *out_summary_sig = g_steal_pointer (&summary_sig);
@@ -7621,6 +9200,60 @@ flatpak_dir_remote_has_ref (FlatpakDir   *self,
   return flatpak_summary_lookup_ref (summary, collection_id, ref, NULL, NULL);
 }
 
+/* Looks up the latest commit in @remote for each of @refs, with a
+   single summary fetch. Unlike flatpak_dir_list_remote_refs() this only
+   materializes the requested refs. Refs not in the remote are not in
+   the returned ref -> checksum table. */
+GHashTable *
+flatpak_dir_lookup_remote_commits (FlatpakDir         *self,
+                                   const char         *remote,
+                                   const char * const *refs,
+                                   GCancellable       *cancellable,
+                                   GError            **error)
+{
+  g_autoptr(GHashTable) commits = NULL;
+  g_autoptr(GVariant) summary = NULL;
+  g_autofree char *collection_id = NULL;
+  gboolean noenumerate;
+  int i;
+
+  if (!flatpak_dir_ensure_repo (self, cancellable, error))
+    return NULL;
+
+  summary = fetch_remote_summary_file (self, remote, NULL, cancellable, error);
+  if (summary == NULL)
+    return NULL;
+
+  if (!repo_get_remote_collection_id (self->repo, remote, &collection_id, error))
+    return NULL;
+
+  noenumerate = flatpak_dir_get_remote_noenumerate (self, remote);
+
+  commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  for (i = 0; refs[i] != NULL; i++)
+    {
+      g_autofree char *checksum = NULL;
+
+      /* For noenumerate remotes, only return data for already locally
+       * available refs */
+      if (noenumerate)
+        {
+          g_autofree char *refspec = g_strconcat (remote, ":", refs[i], NULL);
+          g_autofree char *local_rev = NULL;
+
+          if (!ostree_repo_resolve_rev (self->repo, refspec, TRUE, &local_rev, NULL) ||
+              local_rev == NULL)
+            continue;
+        }
+
+      if (flatpak_summary_lookup_ref (summary, collection_id, refs[i], &checksum, NULL))
+        g_hash_table_insert (commits, g_strdup (refs[i]), g_steal_pointer (&checksum));
+    }
+
+  return g_steal_pointer (&commits);
+}
+
 /* This duplicates ostree_repo_list_refs so it can use flatpak_dir_remote_fetch_summary
    and get caching */
 /* FIXME: For command line completion support for collection–refs over P2P,
@@ -8089,6 +9722,120 @@ flatpak_dir_find_installed_refs (FlatpakDir *self,
 
 }
 
+static GHashTable *
+flatpak_dir_load_ref_index (FlatpakDir *self,
+                            const char *name)
+{
+  g_autoptr(GFile) index_dir = flatpak_dir_get_ref_index_dir (self);
+  g_autoptr(GFile) index_file = g_file_get_child (index_dir, name);
+  g_autoptr(GHashTable) refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GVariant) index = NULL;
+  g_autofree const char **index_refs = NULL;
+  char *contents;
+  gsize len, i;
+
+  if (!g_file_load_contents (index_file, NULL, &contents, &len, NULL, NULL))
+    return NULL;
+
+  index = g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE_STRING_ARRAY,
+                                                       contents, len, FALSE, g_free, contents));
+  index_refs = g_variant_get_strv (index, &len);
+  for (i = 0; i < len; i++)
+    g_hash_table_add (refs, g_strdup (index_refs[i]));
+
+  return g_steal_pointer (&refs);
+}
+
+static guint64
+get_file_mtime_usec (GFile *file)
+{
+  g_autoptr(GFileInfo) info = NULL;
+
+  info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+                            G_FILE_QUERY_INFO_NONE, NULL, NULL);
+  if (info == NULL)
+    return 0;
+
+  return g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+    g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+}
+
+static gboolean
+ref_index_is_current (GFile *index_file,
+                      GFile *changed_file)
+{
+  guint64 index_mtime = get_file_mtime_usec (index_file);
+
+  return index_mtime != 0 && index_mtime > get_file_mtime_usec (changed_file);
+}
+
+/* Like flatpak_dir_find_remote_refs() and flatpak_dir_find_installed_refs()
+ * (if @remote is %NULL), but only using the local ref index, for completion.
+ * The installed refs are re-indexed when the installation has changed, the
+ * remote refs are whatever the last summary fetch saw. */
+char **
+flatpak_dir_find_indexed_refs (FlatpakDir   *self,
+                               const char   *remote,
+                               const char   *name,
+                               const char   *opt_branch,
+                               const char   *opt_arch,
+                               FlatpakKinds  kinds,
+                               GError      **error)
+{
+  g_autoptr(GHashTable) refs = NULL;
+  GPtrArray *matched_refs;
+
+  if (remote == NULL)
+    {
+      g_autoptr(GFile) index_dir = flatpak_dir_get_ref_index_dir (self);
+      g_autoptr(GFile) index_file = g_file_get_child (index_dir, REF_INDEX_INSTALLED);
+      g_autoptr(GFile) changed_file = flatpak_dir_get_changed_path (self);
+
+      if (ref_index_is_current (index_file, changed_file))
+        refs = flatpak_dir_load_ref_index (self, REF_INDEX_INSTALLED);
+
+      if (refs == NULL)
+        {
+          g_autoptr(GPtrArray) installed = g_ptr_array_new ();
+          GHashTableIter iter;
+          gpointer key;
+
+          refs = flatpak_dir_get_all_installed_refs (self, FLATPAK_KINDS_APP | FLATPAK_KINDS_RUNTIME, error);
+          if (refs == NULL)
+            return NULL;
+
+          g_hash_table_iter_init (&iter, refs);
+          while (g_hash_table_iter_next (&iter, &key, NULL))
+            g_ptr_array_add (installed, key);
+
+          flatpak_dir_save_ref_index (self, REF_INDEX_INSTALLED, installed);
+        }
+    }
+  else
+    {
+      refs = flatpak_dir_load_ref_index (self, remote);
+      if (refs == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                       "No refs indexed for remote %s", remote);
+          return NULL;
+        }
+    }
+
+  matched_refs = find_matching_refs (refs,
+                                     name,
+                                     opt_branch,
+                                     opt_arch,
+                                     kinds,
+                                     FIND_MATCHING_REFS_FLAGS_NONE,
+                                     error);
+  if (matched_refs == NULL)
+    return NULL;
+
+  g_ptr_array_add (matched_refs, NULL);
+  return (char **)g_ptr_array_free (matched_refs, FALSE);
+}
+
 char *
 flatpak_dir_find_installed_ref (FlatpakDir   *self,
                                 const char   *opt_name,
@@ -9011,6 +10758,9 @@ flatpak_dir_remove_remote (FlatpakDir   *self,
                                                              cancellable, error))
         return FALSE;
 
+      /* The ref index is in our cache, not the one of the helper */
+      flatpak_dir_remove_ref_index (self, remote_name);
+
       return TRUE;
     }
 
@@ -9067,6 +10817,8 @@ flatpak_dir_remove_remote (FlatpakDir   *self,
                                   cancellable, error))
     return FALSE;
 
+  flatpak_dir_remove_ref_index (self, remote_name);
+
   if (!flatpak_dir_mark_changed (self, error))
     return FALSE;
 
@@ -9083,9 +10835,11 @@ flatpak_dir_modify_remote (FlatpakDir   *self,
 {
   g_autofree char *group = g_strdup_printf ("remote \"%s\"", remote_name);
   g_autofree char *url = NULL;
+  g_autofree char *old_url = NULL;
   g_autofree char *metalink = NULL;
   g_autoptr(GKeyFile) new_config = NULL;
   g_auto(GStrv) keys = NULL;
+  gboolean url_changed;
   int i;
 
   if (strchr (remote_name, '/') != NULL)
@@ -9097,6 +10851,19 @@ flatpak_dir_modify_remote (FlatpakDir   *self,
     return flatpak_fail (error, "No configuration for remote %s specified",
                          remote_name);
 
+  metalink = g_key_file_get_string (config, group, "metalink", NULL);
+  if (metalink != NULL && *metalink != 0)
+    url = g_strconcat ("metalink=", metalink, NULL);
+  else
+    url = g_key_file_get_string (config, group, "url", NULL);
+
+  /* No url => disabled */
+  if (url == NULL)
+    url = g_strdup ("");
+
+  url_changed = self->repo == NULL ||
+    !ostree_repo_remote_get_url (self->repo, remote_name, &old_url, NULL) ||
+    strcmp (old_url, url) != 0;
 
   if (flatpak_dir_use_system_helper (self, NULL))
     {
@@ -9122,19 +10889,12 @@ flatpak_dir_modify_remote (FlatpakDir   *self,
                                                              cancellable, error))
         return FALSE;
 
+      if (url_changed)
+        flatpak_dir_remove_ref_index (self, remote_name);
+
       return TRUE;
     }
 
-  metalink = g_key_file_get_string (config, group, "metalink", NULL);
-  if (metalink != NULL && *metalink != 0)
-    url = g_strconcat ("metalink=", metalink, NULL);
-  else
-    url = g_key_file_get_string (config, group, "url", NULL);
-
-  /* No url => disabled */
-  if (url == NULL)
-    url = g_strdup ("");
-
   /* Add it if its not there yet */
   if (!ostree_repo_remote_change (self->repo, NULL,
                                   OSTREE_REPO_REMOTE_CHANGE_ADD_IF_NOT_EXISTS,
@@ -9176,6 +10936,9 @@ flatpak_dir_modify_remote (FlatpakDir   *self,
                imported, (imported == 1) ? "" : "s", remote_name);
     }
 
+  if (url_changed)
+    flatpak_dir_remove_ref_index (self, remote_name);
+
   if (!flatpak_dir_mark_changed (self, error))
     return FALSE;
 
@@ -9842,6 +11605,139 @@ flatpak_dir_fetch_ref_cache (FlatpakDir   *self,
   return TRUE;
 }
 
+static void
+call_ref_cache_func (GVariant               *refdata,
+                     GVariant               *summary,
+                     const char             *collection_id,
+                     GHashTable             *local_refs,
+                     FlatpakDirRefCacheFunc  func,
+                     gpointer                user_data)
+{
+  g_autoptr(GVariant) res = NULL;
+  g_autofree char *checksum = NULL;
+  const char *ref;
+  const char *metadata;
+  guint64 installed_size;
+  guint64 download_size;
+
+  g_variant_get_child (refdata, 0, "&s", &ref);
+
+  /* For noenumerate remotes, only return data for already locally
+   * available refs */
+  if (local_refs != NULL && !g_hash_table_contains (local_refs, ref))
+    return;
+
+  if (!flatpak_summary_lookup_ref (summary, collection_id, ref, &checksum, NULL))
+    return;
+
+  res = g_variant_get_child_value (refdata, 1);
+  g_variant_get (res, "(tt&s)", &installed_size, &download_size, &metadata);
+
+  func (ref, checksum,
+        GUINT64_FROM_BE (download_size), GUINT64_FROM_BE (installed_size),
+        metadata, user_data);
+}
+
+/* Like flatpak_dir_fetch_ref_cache(), but for many refs (or all of them
+ * if @refs is %NULL) at once, fetching and parsing the summary only once.
+ * Refs that are not in the remote are silently skipped. */
+gboolean
+flatpak_dir_foreach_ref_cache (FlatpakDir             *self,
+                               const char             *remote_name,
+                               const char * const     *refs,
+                               FlatpakDirRefCacheFunc  func,
+                               gpointer                user_data,
+                               GCancellable           *cancellable,
+                               GError                **error)
+{
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GVariant) cache_v = NULL;
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GHashTable) local_refs = NULL;
+  g_autofree char *collection_id = NULL;
+  g_autoptr(GError) local_error = NULL;
+  gsize i, n;
+
+  if (!flatpak_dir_ensure_repo (self, cancellable, error))
+    return FALSE;
+
+  summary = fetch_remote_summary_file (self, remote_name, NULL, cancellable, error);
+  if (summary == NULL)
+    return FALSE;
+
+  if (!repo_get_remote_collection_id (self->repo, remote_name, &collection_id, error))
+    return FALSE;
+
+  if (collection_id == NULL)
+    {
+      g_autoptr(GVariant) metadata = g_variant_get_child_value (summary, 1);
+
+      cache_v = g_variant_lookup_value (metadata, "xa.cache", NULL);
+    }
+  else if (!flatpak_dir_lookup_repo_metadata (self, remote_name, cancellable, &local_error,
+                                              "xa.cache", "@*", &cache_v))
+    cache_v = NULL;
+
+  if (cache_v == NULL)
+    {
+      if (local_error == NULL)
+        g_set_error_literal (&local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                             _("No flatpak cache in remote summary"));
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  cache = g_variant_get_child_value (cache_v, 0);
+
+  if (flatpak_dir_get_remote_noenumerate (self, remote_name))
+    {
+      g_autoptr(GHashTable) prefixed_refs = NULL;
+      g_autofree char *refspec_prefix = g_strconcat (remote_name, ":.", NULL);
+      GHashTableIter hash_iter;
+      gpointer key;
+
+      if (!ostree_repo_list_refs (self->repo, refspec_prefix, &prefixed_refs,
+                                  cancellable, error))
+        return FALSE;
+
+      local_refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_hash_table_iter_init (&hash_iter, prefixed_refs);
+      while (g_hash_table_iter_next (&hash_iter, &key, NULL))
+        {
+          char *ref = NULL;
+          ostree_parse_refspec (key, NULL, &ref, NULL);
+
+          if (ref)
+            g_hash_table_add (local_refs, ref);
+        }
+    }
+
+  n = refs ? g_strv_length ((char **) refs) : g_variant_n_children (cache);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) refdata = NULL;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      if (refs != NULL)
+        {
+          int pos;
+
+          if (!flatpak_variant_bsearch_str (cache, refs[i], &pos))
+            continue;
+
+          refdata = g_variant_get_child_value (cache, pos);
+        }
+      else
+        refdata = g_variant_get_child_value (cache, i);
+
+      call_ref_cache_func (refdata, summary, collection_id, local_refs, func, user_data);
+    }
+
+  return TRUE;
+}
+
 void
 flatpak_related_free (FlatpakRelated *self)
 {
@@ -10332,6 +12228,41 @@ sort_strv (char **strv)
   return strv;
 }
 
+G_LOCK_DEFINE_STATIC (locale_languages);
+
+static void
+accounts_changed_cb (GDBusConnection *connection,
+                     const gchar     *sender_name,
+                     const gchar     *object_path,
+                     const gchar     *interface_name,
+                     const gchar     *signal_name,
+                     GVariant        *parameters,
+                     gpointer         user_data)
+{
+  g_autoptr(FlatpakDir) self = g_weak_ref_get (user_data);
+
+  /* The signal may already be queued when the FlatpakDir goes away */
+  if (self == NULL)
+    return;
+
+  G_LOCK (locale_languages);
+  g_clear_pointer (&self->default_locale_languages, g_strfreev);
+  G_UNLOCK (locale_languages);
+}
+
+static void
+accounts_changed_weak_ref_free (gpointer user_data)
+{
+  GWeakRef *weak_ref = user_data;
+
+  g_weak_ref_clear (weak_ref);
+  g_free (weak_ref);
+}
+
+/* Asking AccountsService is a number of synchronous D-Bus calls per user,
+ * so the result is cached for the lifetime of the FlatpakDir. The cache is
+ * dropped whenever AccountsService signals that users or their languages
+ * changed, which long-running processes pick up in their main context. */
 char **
 flatpak_dir_get_default_locale_languages (FlatpakDir *self)
 {
@@ -10340,6 +12271,14 @@ flatpak_dir_get_default_locale_languages (FlatpakDir *self)
   if (flatpak_dir_is_user (self))
     return flatpak_get_current_locale_langs ();
 
+  G_LOCK (locale_languages);
+  if (self->default_locale_languages != NULL)
+    langs = g_strdupv (self->default_locale_languages);
+  G_UNLOCK (locale_languages);
+
+  if (langs != NULL)
+    return langs;
+
   /* If proxy is not NULL, it means that AccountService exists
    * and gets the list of languages from AccountService. */
   g_autoptr(GDBusProxy) proxy = get_accounts_dbus_proxy ();
@@ -10350,6 +12289,25 @@ flatpak_dir_get_default_locale_languages (FlatpakDir *self)
   if (langs == NULL)
     langs = g_new0 (char *, 1);
 
+  G_LOCK (locale_languages);
+  if (self->accounts_changed_id == 0 && proxy != NULL)
+    {
+      GWeakRef *weak_ref = g_new0 (GWeakRef, 1);
+
+      g_weak_ref_init (weak_ref, self);
+      self->accounts_bus = g_object_ref (g_dbus_proxy_get_connection (proxy));
+      self->accounts_changed_id =
+        g_dbus_connection_signal_subscribe (self->accounts_bus,
+                                            "org.freedesktop.Accounts",
+                                            NULL, NULL, NULL, NULL,
+                                            G_DBUS_SIGNAL_FLAGS_NONE,
+                                            accounts_changed_cb, weak_ref,
+                                            accounts_changed_weak_ref_free);
+    }
+  g_strfreev (self->default_locale_languages);
+  self->default_locale_languages = g_strdupv (langs);
+  G_UNLOCK (locale_languages);
+
   return langs;
 }
 
@@ -242,6 +242,11 @@ GFile *     flatpak_dir_get_unmaintained_extension_dir_if_exists (FlatpakDir *se
 gboolean    flatpak_dir_remote_has_ref (FlatpakDir   *self,
                                         const char   *remote,
                                         const char   *ref);
+GHashTable *flatpak_dir_lookup_remote_commits (FlatpakDir         *self,
+                                               const char         *remote,
+                                               const char * const *refs,
+                                               GCancellable       *cancellable,
+                                               GError            **error);
 char **     flatpak_dir_search_for_dependency (FlatpakDir   *self,
                                                const char   *runtime_ref,
                                                GCancellable *cancellable,
@@ -287,6 +292,13 @@ char **     flatpak_dir_find_installed_refs (FlatpakDir  *self,
                                              const char  *opt_arch,
                                              FlatpakKinds kinds,
                                              GError     **error);
+char **     flatpak_dir_find_indexed_refs (FlatpakDir   *self,
+                                           const char   *remote,
+                                           const char   *name,
+                                           const char   *opt_branch,
+                                           const char   *opt_arch,
+                                           FlatpakKinds  kinds,
+                                           GError      **error);
 FlatpakDeploy *flatpak_dir_load_deployed (FlatpakDir   *self,
                                           const char   *ref,
                                           const char   *checksum,
@@ -315,6 +327,14 @@ gboolean    flatpak_dir_set_config (FlatpakDir *self,
                                     GError    **error);
 gboolean    flatpak_dir_mark_changed (FlatpakDir *self,
                                       GError    **error);
+guint64     flatpak_dir_get_generation (FlatpakDir   *self,
+                                        GCancellable *cancellable,
+                                        GError      **error);
+GVariant *  flatpak_dir_list_changes_since (FlatpakDir   *self,
+                                            guint64       generation,
+                                            guint64      *out_generation,
+                                            GCancellable *cancellable,
+                                            GError      **error);
 gboolean    flatpak_dir_remove_appstream (FlatpakDir   *self,
                                           const char   *remote,
                                           GCancellable *cancellable,
@@ -501,6 +521,11 @@ gboolean    flatpak_dir_prune (FlatpakDir   *self,
 gboolean    flatpak_dir_cleanup_removed (FlatpakDir   *self,
                                          GCancellable *cancellable,
                                          GError      **error);
+typedef void (*FlatpakDirCleanupProgress) (guint    left,
+                                           guint64  reclaimed,
+                                           gpointer user_data);
+guint64     flatpak_dir_wait_for_removed_cleanup (FlatpakDirCleanupProgress progress,
+                                                  gpointer                  progress_data);
 gboolean    flatpak_dir_cleanup_undeployed_refs (FlatpakDir   *self,
                                                  GCancellable *cancellable,
                                                  GError      **error);
@@ -628,6 +653,19 @@ gboolean flatpak_dir_fetch_ref_cache (FlatpakDir   *self,
                                       char        **metadata,
                                       GCancellable *cancellable,
                                       GError      **error);
+typedef void (*FlatpakDirRefCacheFunc) (const char *ref,
+                                        const char *commit,
+                                        guint64     download_size,
+                                        guint64     installed_size,
+                                        const char *metadata,
+                                        gpointer    user_data);
+gboolean flatpak_dir_foreach_ref_cache (FlatpakDir             *self,
+                                        const char             *remote_name,
+                                        const char * const     *refs,
+                                        FlatpakDirRefCacheFunc  func,
+                                        gpointer                user_data,
+                                        GCancellable           *cancellable,
+                                        GError                **error);
 GPtrArray * flatpak_dir_find_remote_related (FlatpakDir *dir,
                                              const char *remote_name,
                                              const char *ref,
@@ -55,6 +55,10 @@ struct FlatpakOciRegistry
   /* Remote repos */
   SoupSession *soup_session;
   SoupURI *base_uri;
+
+  /* Shared cache of downloaded blobs, or -1 */
+  int blob_cache_dfd;
+  guint64 blob_cache_max_size;
 };
 
 typedef struct
@@ -82,6 +86,9 @@ flatpak_oci_registry_finalize (GObject *object)
   if (self->dfd != -1)
     close (self->dfd);
 
+  if (self->blob_cache_dfd != -1)
+    close (self->blob_cache_dfd);
+
   g_clear_object (&self->soup_session);
   g_clear_pointer (&self->base_uri, soup_uri_free);
   g_free (self->uri);
@@ -182,6 +189,7 @@ flatpak_oci_registry_init (FlatpakOciRegistry *self)
 {
   self->dfd = -1;
   self->tmp_dfd = -1;
+  self->blob_cache_dfd = -1;
 }
 
 const char *
@@ -659,6 +667,180 @@ checksum_fd (int fd, GCancellable *cancellable, GError **error)
   return g_strdup (g_checksum_get_string (checksum));
 }
 
+/* The blob cache is a directory of verified blobs, keyed by digest, that
+ * is shared between all registries using it. The mtime of a blob is
+ * bumped whenever it is used, and the least recently used blobs are
+ * removed once the cache grows beyond its maximum size. */
+gboolean
+flatpak_oci_registry_set_blob_cache (FlatpakOciRegistry *self,
+                                     const char         *path,
+                                     guint64             max_size,
+                                     GError            **error)
+{
+  glnx_autofd int dfd = -1;
+
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, path, 0755, NULL, error))
+    return FALSE;
+
+  if (!glnx_opendirat (AT_FDCWD, path, TRUE, &dfd, error))
+    return FALSE;
+
+  if (!glnx_shutil_mkdir_p_at (dfd, "sha256", 0755, NULL, error))
+    return FALSE;
+
+  if (self->blob_cache_dfd != -1)
+    close (self->blob_cache_dfd);
+  self->blob_cache_dfd = glnx_steal_fd (&dfd);
+  self->blob_cache_max_size = max_size;
+
+  return TRUE;
+}
+
+static char *
+get_digest_cache_subpath (const char *digest)
+{
+  return g_strdup_printf ("sha256/%s", digest + strlen ("sha256:"));
+}
+
+static int
+blob_cache_open (FlatpakOciRegistry *self,
+                 const char         *digest)
+{
+  g_autofree char *subpath = NULL;
+  int fd;
+
+  if (self->blob_cache_dfd == -1)
+    return -1;
+
+  subpath = get_digest_cache_subpath (digest);
+  fd = openat (self->blob_cache_dfd, subpath, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+
+  /* Mark as recently used */
+  (void) futimens (fd, NULL);
+
+  g_debug ("Using cached OCI blob %s", digest);
+
+  return fd;
+}
+
+typedef struct {
+  char   *name;
+  guint64 size;
+  time_t  mtime;
+} BlobCacheEntry;
+
+static void
+blob_cache_entry_clear (BlobCacheEntry *entry)
+{
+  g_free (entry->name);
+}
+
+static int
+blob_cache_entry_compare (gconstpointer a,
+                          gconstpointer b)
+{
+  const BlobCacheEntry *entry_a = a;
+  const BlobCacheEntry *entry_b = b;
+
+  if (entry_a->mtime < entry_b->mtime)
+    return -1;
+  if (entry_a->mtime > entry_b->mtime)
+    return 1;
+  return strcmp (entry_a->name, entry_b->name);
+}
+
+static void
+blob_cache_evict (FlatpakOciRegistry *self)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  g_autoptr(GArray) entries = NULL;
+  struct dirent *dent;
+  guint64 total_size = 0;
+  int i;
+
+  if (!glnx_dirfd_iterator_init_at (self->blob_cache_dfd, "sha256", FALSE, &iter, NULL))
+    return;
+
+  entries = g_array_new (FALSE, TRUE, sizeof (BlobCacheEntry));
+  g_array_set_clear_func (entries, (GDestroyNotify) blob_cache_entry_clear);
+
+  while (glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, NULL, NULL) && dent != NULL)
+    {
+      BlobCacheEntry entry;
+      struct stat stbuf;
+
+      /* Skip temporary files of concurrent downloads */
+      if (dent->d_type != DT_REG || dent->d_name[0] == '.')
+        continue;
+
+      if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        continue;
+
+      entry.name = g_strdup (dent->d_name);
+      entry.size = stbuf.st_size;
+      entry.mtime = stbuf.st_mtime;
+      g_array_append_val (entries, entry);
+
+      total_size += entry.size;
+    }
+
+  if (total_size <= self->blob_cache_max_size)
+    return;
+
+  g_array_sort (entries, blob_cache_entry_compare);
+
+  for (i = 0; i < entries->len && total_size > self->blob_cache_max_size; i++)
+    {
+      BlobCacheEntry *entry = &g_array_index (entries, BlobCacheEntry, i);
+
+      g_debug ("Evicting cached OCI blob sha256:%s", entry->name);
+      if (unlinkat (iter.fd, entry->name, 0) == 0)
+        total_size -= entry->size;
+    }
+}
+
+/* Adds a copy of the verified blob in @fd to the cache, this is a cheap
+ * reflink when the filesystems allow it. Failure is not fatal. */
+static void
+blob_cache_add (FlatpakOciRegistry *self,
+                const char         *digest,
+                int                 fd)
+{
+  g_auto(GLnxTmpfile) tmpf = { 0 };
+  g_autofree char *subpath = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (self->blob_cache_dfd == -1)
+    return;
+
+  if (!glnx_open_tmpfile_linkable_at (self->blob_cache_dfd, "sha256",
+                                      O_WRONLY | O_CLOEXEC, &tmpf, &local_error))
+    goto out;
+
+  if (lseek (fd, 0, SEEK_SET) < 0 ||
+      glnx_regfile_copy_bytes (fd, tmpf.fd, (off_t)-1) < 0 ||
+      fchmod (tmpf.fd, 0644) != 0)
+    {
+      glnx_set_error_from_errno (&local_error);
+      goto out;
+    }
+
+  subpath = get_digest_cache_subpath (digest);
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE_IGNORE_EXIST,
+                             self->blob_cache_dfd, subpath, &local_error))
+    goto out;
+
+  blob_cache_evict (self);
+
+out:
+  if (local_error)
+    g_debug ("Failed to cache OCI blob %s: %s", digest, local_error->message);
+
+  lseek (fd, 0, SEEK_SET);
+}
+
 int
 flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
                                     const char            *digest,
@@ -691,6 +873,10 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
       g_autofree char *tmpfile_name = g_strdup_printf ("oci-layer-XXXXXX");
       g_autoptr(GOutputStream) out_stream = NULL;
 
+      fd = blob_cache_open (self, digest);
+      if (fd != -1)
+        return glnx_steal_fd (&fd);
+
       /* remote case, download and verify */
 
       uri = soup_uri_new_with_base (self->base_uri, subpath);
@@ -732,6 +918,7 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
           return -1;
         }
 
+      blob_cache_add (self, digest, fd);
       lseek (fd, 0, SEEK_SET);
     }
 
@@ -752,6 +939,8 @@ flatpak_oci_registry_mirror_blob (FlatpakOciRegistry    *self,
   g_autoptr(GOutputStream) out_stream = NULL;
   struct stat stbuf;
   g_autofree char *checksum = NULL;
+  glnx_autofd int cached_fd = -1;
+  gboolean downloaded = FALSE;
 
   g_assert (self->valid);
 
@@ -775,11 +964,13 @@ flatpak_oci_registry_mirror_blob (FlatpakOciRegistry    *self,
                                       &tmpf, error))
     return FALSE;
 
-  if (source_registry->dfd != -1)
+  if (source_registry->dfd != -1 ||
+      (cached_fd = blob_cache_open (source_registry, digest)) != -1)
     {
-      glnx_autofd int src_fd = -1;
+      glnx_autofd int src_fd = glnx_steal_fd (&cached_fd);
 
-      src_fd = local_open_file (source_registry->dfd, subpath, NULL, cancellable, error);
+      if (src_fd == -1)
+        src_fd = local_open_file (source_registry->dfd, subpath, NULL, cancellable, error);
       if (src_fd == -1)
         return FALSE;
 
@@ -791,6 +982,8 @@ flatpak_oci_registry_mirror_blob (FlatpakOciRegistry    *self,
       g_autoptr(SoupURI) uri = NULL;
       g_autofree char *uri_s = NULL;
 
+      downloaded = TRUE;
+
       uri = soup_uri_new_with_base (source_registry->base_uri, subpath);
       if (uri == NULL)
         {
@@ -824,6 +1017,9 @@ flatpak_oci_registry_mirror_blob (FlatpakOciRegistry    *self,
       return FALSE;
     }
 
+  if (downloaded)
+    blob_cache_add (source_registry, digest, tmpf.fd);
+
   if (!glnx_link_tmpfile_at (&tmpf,
                              GLNX_LINK_TMPFILE_NOREPLACE_IGNORE_EXIST,
                              self->dfd, subpath,
@@ -920,6 +1116,31 @@ flatpak_oci_registry_load_versioned (FlatpakOciRegistry  *self,
   return flatpak_oci_versioned_from_json (bytes, error);
 }
 
+/* Layers are compressed in independent chunks on a thread pool, each
+ * chunk becoming a separate gzip member. A series of gzip members is
+ * itself a valid gzip stream, so the result is readable by any gzip
+ * consumer, and the per-member overhead is negligible at this size. */
+#define OCI_LAYER_CHUNK_SIZE (4 * 1024 * 1024)
+
+typedef struct
+{
+  GBytes  *input;
+  GBytes  *output;
+  GError  *error;
+  int      compression_level;
+  gboolean done;
+} FlatpakOciLayerChunk;
+
+static void
+flatpak_oci_layer_chunk_free (FlatpakOciLayerChunk *chunk)
+{
+  g_bytes_unref (chunk->input);
+  if (chunk->output)
+    g_bytes_unref (chunk->output);
+  g_clear_error (&chunk->error);
+  g_free (chunk);
+}
+
 struct FlatpakOciLayerWriter
 {
   GObject parent;
@@ -929,10 +1150,17 @@ struct FlatpakOciLayerWriter
   GChecksum *uncompressed_checksum;
   GChecksum *compressed_checksum;
   struct archive *archive;
-  GZlibCompressor *compressor;
   guint64 uncompressed_size;
   guint64 compressed_size;
   GLnxTmpfile tmpf;
+
+  int compression_level;
+  guint max_pending_chunks;
+  GThreadPool *compress_pool;
+  GByteArray *pending_input;
+  GQueue chunks; /* FlatpakOciLayerChunk, in stream order */
+  GMutex chunks_lock;
+  GCond chunks_cond;
 };
 
 typedef struct
@@ -954,18 +1182,30 @@ propagate_libarchive_error (GError      **error,
 static void
 flatpak_oci_layer_writer_reset (FlatpakOciLayerWriter *self)
 {
+  FlatpakOciLayerChunk *chunk;
+
   glnx_tmpfile_clear (&self->tmpf);
 
   g_checksum_reset (self->uncompressed_checksum);
   g_checksum_reset (self->compressed_checksum);
 
+  /* This may flush the final chunks, so do it before stopping the pool */
   if (self->archive)
     {
       archive_write_free (self->archive);
       self->archive = NULL;
     }
 
-  g_clear_object (&self->compressor);
+  if (self->compress_pool)
+    {
+      g_thread_pool_free (self->compress_pool, FALSE, TRUE);
+      self->compress_pool = NULL;
+    }
+
+  while ((chunk = g_queue_pop_head (&self->chunks)) != NULL)
+    flatpak_oci_layer_chunk_free (chunk);
+
+  g_byte_array_set_size (self->pending_input, 0);
 }
 
 
@@ -979,6 +1219,9 @@ flatpak_oci_layer_writer_finalize (GObject *object)
   g_checksum_free (self->compressed_checksum);
   g_checksum_free (self->uncompressed_checksum);
   glnx_tmpfile_clear (&self->tmpf);
+  g_byte_array_unref (self->pending_input);
+  g_mutex_clear (&self->chunks_lock);
+  g_cond_clear (&self->chunks_cond);
 
   g_clear_object (&self->registry);
 
@@ -999,6 +1242,11 @@ flatpak_oci_layer_writer_init (FlatpakOciLayerWriter *self)
 {
   self->uncompressed_checksum = g_checksum_new (G_CHECKSUM_SHA256);
   self->compressed_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  self->compression_level = -1;
+  self->pending_input = g_byte_array_new ();
+  g_queue_init (&self->chunks);
+  g_mutex_init (&self->chunks_lock);
+  g_cond_init (&self->chunks_cond);
 }
 
 static int
@@ -1008,66 +1256,145 @@ flatpak_oci_layer_writer_open_cb (struct archive *archive,
   return ARCHIVE_OK;
 }
 
-static gssize
-flatpak_oci_layer_writer_compress (FlatpakOciLayerWriter *self,
-                                  const void *buffer,
-                                  size_t length,
-                                  gboolean at_end)
+/* Runs in the compression thread pool */
+static void
+flatpak_oci_layer_chunk_compress (gpointer data,
+                                  gpointer user_data)
 {
-  guchar compressed_buffer[8192];
-  GConverterResult res;
-  gsize total_bytes_read, bytes_read, bytes_written, to_write_len;
-  guchar *to_write;
+  FlatpakOciLayerChunk *chunk = data;
+  FlatpakOciLayerWriter *self = user_data;
+  g_autoptr(GZlibCompressor) compressor = NULL;
+  g_autoptr(GByteArray) output = g_byte_array_new ();
   g_autoptr(GError) local_error = NULL;
-  GConverterFlags flags = 0;
-  bytes_read = 0;
+  const guchar *input;
+  gsize input_len, input_pos, output_len;
+  GConverterResult res;
 
-  total_bytes_read = 0;
+  compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP,
+                                      chunk->compression_level);
 
-  if (at_end)
-    flags |= G_CONVERTER_INPUT_AT_END;
+  input = g_bytes_get_data (chunk->input, &input_len);
+  input_pos = 0;
+  output_len = 0;
 
   do
     {
-      res = g_converter_convert (G_CONVERTER (self->compressor),
-                                 buffer, length,
-                                 compressed_buffer, sizeof (compressed_buffer),
-                                 flags, &bytes_read, &bytes_written,
+      gsize bytes_read, bytes_written;
+
+      if (output->len - output_len < 64 * 1024)
+        g_byte_array_set_size (output, output->len + MAX (64 * 1024, output->len));
+
+      res = g_converter_convert (G_CONVERTER (compressor),
+                                 input + input_pos, input_len - input_pos,
+                                 output->data + output_len, output->len - output_len,
+                                 G_CONVERTER_INPUT_AT_END,
+                                 &bytes_read, &bytes_written,
                                  &local_error);
       if (res == G_CONVERTER_ERROR)
+        break;
+
+      input_pos += bytes_read;
+      output_len += bytes_written;
+    }
+  while (res != G_CONVERTER_FINISHED);
+
+  g_byte_array_set_size (output, output_len);
+
+  g_mutex_lock (&self->chunks_lock);
+  if (local_error)
+    chunk->error = g_steal_pointer (&local_error);
+  else
+    chunk->output = g_byte_array_free_to_bytes (g_steal_pointer (&output));
+  chunk->done = TRUE;
+  g_cond_broadcast (&self->chunks_cond);
+  g_mutex_unlock (&self->chunks_lock);
+}
+
+static gboolean
+flatpak_oci_layer_writer_write_out (FlatpakOciLayerWriter *self,
+                                    GBytes                *bytes)
+{
+  gsize to_write_len;
+  const guchar *to_write = g_bytes_get_data (bytes, &to_write_len);
+
+  g_checksum_update (self->compressed_checksum, to_write, to_write_len);
+  self->compressed_size += to_write_len;
+
+  while (to_write_len > 0)
+    {
+      ssize_t res = write (self->tmpf.fd, to_write, to_write_len);
+      if (res <= 0)
         {
-          archive_set_error (self->archive, EIO, "%s", local_error->message);
-          return -1;
+          if (errno == EINTR)
+            continue;
+          archive_set_error (self->archive, errno, "Write error");
+          return FALSE;
         }
 
-      g_checksum_update (self->uncompressed_checksum, buffer, bytes_read);
-      g_checksum_update (self->compressed_checksum, compressed_buffer, bytes_written);
-      self->uncompressed_size += bytes_read;
-      self->compressed_size += bytes_written;
+      to_write_len -= res;
+      to_write += res;
+    }
+
+  return TRUE;
+}
+
+/* Writes out finished chunks in stream order, blocking until at most
+ * max_pending chunks are left in flight. */
+static gboolean
+flatpak_oci_layer_writer_flush_chunks (FlatpakOciLayerWriter *self,
+                                       guint                  max_pending)
+{
+  while (TRUE)
+    {
+      FlatpakOciLayerChunk *chunk;
+      gboolean res;
+
+      g_mutex_lock (&self->chunks_lock);
+
+      chunk = g_queue_peek_head (&self->chunks);
+      while (chunk != NULL && !chunk->done &&
+             g_queue_get_length (&self->chunks) > max_pending)
+        g_cond_wait (&self->chunks_cond, &self->chunks_lock);
 
-      to_write_len = bytes_written;
-      to_write = compressed_buffer;
-      while (to_write_len > 0)
+      if (chunk == NULL || !chunk->done)
         {
-          ssize_t res = write (self->tmpf.fd, to_write, to_write_len);
-          if (res <= 0)
-            {
-              if (errno == EINTR)
-                continue;
-              archive_set_error (self->archive, errno, "Write error");
-              return -1;
-            }
+          g_mutex_unlock (&self->chunks_lock);
+          return TRUE;
+        }
 
-          to_write_len -= res;
-          to_write += res;
+      g_queue_pop_head (&self->chunks);
+      g_mutex_unlock (&self->chunks_lock);
+
+      if (chunk->error)
+        {
+          archive_set_error (self->archive, EIO, "%s", chunk->error->message);
+          res = FALSE;
         }
+      else
+        res = flatpak_oci_layer_writer_write_out (self, chunk->output);
 
-      total_bytes_read += bytes_read;
+      flatpak_oci_layer_chunk_free (chunk);
+      if (!res)
+        return FALSE;
     }
-  while ((length > 0 && bytes_read == 0) || /* Repeat if we consumed nothing */
-         (at_end && res != G_CONVERTER_FINISHED)); /* Or until finished if at_end */
+}
+
+static void
+flatpak_oci_layer_writer_submit_chunk (FlatpakOciLayerWriter *self)
+{
+  FlatpakOciLayerChunk *chunk = g_new0 (FlatpakOciLayerChunk, 1);
+  GByteArray *input = g_steal_pointer (&self->pending_input);
+
+  self->pending_input = g_byte_array_sized_new (OCI_LAYER_CHUNK_SIZE);
+
+  chunk->input = g_byte_array_free_to_bytes (input);
+  chunk->compression_level = self->compression_level;
 
-  return total_bytes_read;
+  g_mutex_lock (&self->chunks_lock);
+  g_queue_push_tail (&self->chunks, chunk);
+  g_mutex_unlock (&self->chunks_lock);
+
+  g_thread_pool_push (self->compress_pool, chunk, NULL);
 }
 
 static ssize_t
@@ -1078,7 +1405,17 @@ flatpak_oci_layer_writer_write_cb (struct archive *archive,
 {
   FlatpakOciLayerWriter *self = FLATPAK_OCI_LAYER_WRITER (client_data);
 
-  return flatpak_oci_layer_writer_compress (self, buffer, length, FALSE);
+  g_checksum_update (self->uncompressed_checksum, buffer, length);
+  self->uncompressed_size += length;
+
+  g_byte_array_append (self->pending_input, buffer, length);
+  if (self->pending_input->len >= OCI_LAYER_CHUNK_SIZE)
+    flatpak_oci_layer_writer_submit_chunk (self);
+
+  if (!flatpak_oci_layer_writer_flush_chunks (self, self->max_pending_chunks))
+    return -1;
+
+  return length;
 }
 
 static int
@@ -1086,11 +1423,13 @@ flatpak_oci_layer_writer_close_cb (struct archive *archive,
                                    void *client_data)
 {
   FlatpakOciLayerWriter *self = FLATPAK_OCI_LAYER_WRITER (client_data);
-  gssize res;
-  char buffer[1] = {0};
 
-  res = flatpak_oci_layer_writer_compress (self, &buffer, 0, TRUE);
-  if (res < 0)
+  /* Always emit at least one member, even for an empty stream */
+  if (self->pending_input->len > 0 ||
+      (self->compressed_size == 0 && g_queue_is_empty (&self->chunks)))
+    flatpak_oci_layer_writer_submit_chunk (self);
+
+  if (!flatpak_oci_layer_writer_flush_chunks (self, 0))
     return ARCHIVE_FATAL;
 
   return ARCHIVE_OK;
@@ -1104,6 +1443,7 @@ flatpak_oci_registry_write_layer (FlatpakOciRegistry    *self,
   g_autoptr(FlatpakOciLayerWriter) oci_layer_writer = NULL;
   g_autoptr(FlatpakAutoArchiveWrite) a = NULL;
   g_auto(GLnxTmpfile) tmpf = { 0 };
+  guint n_threads;
 
   g_assert (self->valid);
 
@@ -1152,7 +1492,12 @@ flatpak_oci_registry_write_layer (FlatpakOciRegistry    *self,
   oci_layer_writer->archive = g_steal_pointer (&a);
   /* Transfer ownership of the tmpfile */
   oci_layer_writer->tmpf = tmpf; tmpf.initialized = 0;
-  oci_layer_writer->compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+
+  n_threads = MAX (g_get_num_processors (), 1);
+  oci_layer_writer->max_pending_chunks = 2 * n_threads;
+  oci_layer_writer->compress_pool = g_thread_pool_new (flatpak_oci_layer_chunk_compress,
+                                                       oci_layer_writer, n_threads,
+                                                       FALSE, NULL);
 
   return g_steal_pointer (&oci_layer_writer);
 }
@@ -1191,6 +1536,17 @@ flatpak_oci_layer_writer_close (FlatpakOciLayerWriter  *self,
   return TRUE;
 }
 
+/* Must be called before anything is written to the archive. Level is
+ * a zlib compression level, or -1 for the default. */
+void
+flatpak_oci_layer_writer_set_compression_level (FlatpakOciLayerWriter *self,
+                                                int                    level)
+{
+  g_return_if_fail (level >= -1 && level <= 9);
+
+  self->compression_level = level;
+}
+
 struct archive *
 flatpak_oci_layer_writer_get_archive (FlatpakOciLayerWriter  *self)
 {
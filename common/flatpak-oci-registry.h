@@ -70,6 +70,10 @@ gboolean               flatpak_oci_registry_save_index           (FlatpakOciRegi
                                                                   FlatpakOciIndex      *index,
                                                                   GCancellable         *cancellable,
                                                                   GError              **error);
+gboolean               flatpak_oci_registry_set_blob_cache       (FlatpakOciRegistry   *self,
+                                                                  const char           *path,
+                                                                  guint64               max_size,
+                                                                  GError              **error);
 int                    flatpak_oci_registry_download_blob        (FlatpakOciRegistry   *self,
                                                                   const char           *digest,
                                                                   FlatpakLoadUriProgress progress_cb,
@@ -105,6 +109,8 @@ FlatpakOciLayerWriter *flatpak_oci_registry_write_layer          (FlatpakOciRegi
                                                                   GError              **error);
 
 struct archive *flatpak_oci_layer_writer_get_archive (FlatpakOciLayerWriter  *self);
+void            flatpak_oci_layer_writer_set_compression_level (FlatpakOciLayerWriter *self,
+                                                                int                    level);
 gboolean        flatpak_oci_layer_writer_close       (FlatpakOciLayerWriter  *self,
                                                       char                 **uncompressed_digest_out,
                                                       FlatpakOciDescriptor **res_out,
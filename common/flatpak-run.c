@@ -60,13 +60,6 @@ typedef enum {
   FLATPAK_CONTEXT_SHARED_IPC       = 1 << 1,
 } FlatpakContextShares;
 
-/* In numerical order of more privs */
-typedef enum {
-  FLATPAK_FILESYSTEM_MODE_READ_ONLY    = 1,
-  FLATPAK_FILESYSTEM_MODE_READ_WRITE   = 2,
-  FLATPAK_FILESYSTEM_MODE_CREATE       = 3,
-} FlatpakFilesystemMode;
-
 
 /* Same order as enum */
 const char *flatpak_context_shares[] = {
@@ -2288,6 +2281,7 @@ flatpak_run_add_extension_args (GPtrArray    *argv_array,
     g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   g_autoptr(GHashTable) created_symlink =
     g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("add-extensions", full_ref);
 
   parts = g_strsplit (full_ref, "/", 0);
   if (g_strv_length (parts) != 4)
@@ -2462,104 +2456,83 @@ make_relative (const char *base, const char *path)
 #define FAKE_MODE_TMPFS 0
 #define FAKE_MODE_SYMLINK G_MAXINT
 
-typedef struct {
-  char *path;
+/* The exports are kept in a trie with one node per path element,
+   so that the mapping of a path can be found by walking down from
+   the root, and the bwrap args generated in a single traversal. */
+typedef struct _ExportNode ExportNode;
+struct _ExportNode {
+  char *path; /* Set if this path is exported */
   gint mode;
-} ExportedPath;
+  GHashTable *children; /* path element -> ExportNode */
+};
 
 struct _FlatpakExports {
-  GHashTable *hash;
+  ExportNode *root;
 };
 
 static void
-exported_path_free (ExportedPath *exported_path)
+export_node_free (ExportNode *node)
 {
-  g_free (exported_path->path);
-  g_free (exported_path);
+  g_free (node->path);
+  if (node->children)
+    g_hash_table_destroy (node->children);
+  g_free (node);
 }
 
-static FlatpakExports *
-exports_new (void)
+static ExportNode *
+export_node_lookup (ExportNode *node,
+                    const char *name)
 {
-  FlatpakExports *exports = g_new0 (FlatpakExports, 1);
-  exports->hash = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GFreeFunc)exported_path_free);
-  return exports;
-}
+  if (node->children == NULL)
+    return NULL;
 
-void
-flatpak_exports_free (FlatpakExports *exports)
-{
-  g_hash_table_destroy (exports->hash);
-  g_free (exports);
+  return g_hash_table_lookup (node->children, name);
 }
 
-/* Returns TRUE if the location of this export
-   is not visible due to parents being exported */
-static gboolean
-path_parent_is_mapped (const char **keys,
-                       guint n_keys,
-                       GHashTable *hash_table,
-                       const char *path)
+static ExportNode *
+export_node_ensure (ExportNode *node,
+                    const char *name)
 {
-  guint i;
-  gboolean is_mapped = FALSE;
+  ExportNode *child = export_node_lookup (node, name);
 
-  /* The keys are sorted so shorter (i.e. parents) are first */
-  for (i = 0; i < n_keys; i++)
+  if (child == NULL)
     {
-      const char *mounted_path = keys[i];
-      ExportedPath *ep = g_hash_table_lookup (hash_table, mounted_path);
-
-      if (flatpak_has_path_prefix (path, mounted_path) &&
-          (strcmp (path, mounted_path) != 0))
-        {
-          /* FAKE_MODE_DIR has same mapped value as parent */
-          if (ep->mode == FAKE_MODE_DIR)
-            continue;
+      if (node->children == NULL)
+        node->children = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, (GDestroyNotify)export_node_free);
 
-          is_mapped = ep->mode != FAKE_MODE_TMPFS;
-        }
+      child = g_new0 (ExportNode, 1);
+      g_hash_table_insert (node->children, g_strdup (name), child);
     }
 
-  return is_mapped;
+  return child;
 }
 
-static gboolean
-path_is_mapped (const char **keys,
-                guint n_keys,
-                GHashTable *hash_table,
-                const char *path)
+FlatpakExports *
+flatpak_exports_new (void)
 {
-  guint i;
-  gboolean is_mapped = FALSE;
-
-  /* The keys are sorted so shorter (i.e. parents) are first */
-  for (i = 0; i < n_keys; i++)
-    {
-      const char *mounted_path = keys[i];
-      ExportedPath *ep = g_hash_table_lookup (hash_table, mounted_path);
-
-      if (flatpak_has_path_prefix (path, mounted_path))
-        {
-          /* FAKE_MODE_DIR has same mapped value as parent */
-          if (ep->mode == FAKE_MODE_DIR)
-            continue;
-
-          if (ep->mode == FAKE_MODE_SYMLINK)
-            is_mapped = strcmp (path, mounted_path) == 0;
-          else
-            is_mapped = ep->mode != FAKE_MODE_TMPFS;
-        }
-    }
+  FlatpakExports *exports = g_new0 (FlatpakExports, 1);
+  exports->root = g_new0 (ExportNode, 1);
+  return exports;
+}
 
-  return is_mapped;
+void
+flatpak_exports_free (FlatpakExports *exports)
+{
+  export_node_free (exports->root);
+  g_free (exports);
 }
 
-static gint
-compare_eps (const ExportedPath *a,
-             const ExportedPath *b)
+/* Whether a node makes the paths below it mapped, given whether
+   its parents did. FAKE_MODE_DIR has same mapped value as parent. */
+static gboolean
+export_node_maps_children (ExportNode *node,
+                           gboolean parent_mapped)
 {
-  return g_strcmp0 (a->path, b->path);
+  if (node->path == NULL || node->mode == FAKE_MODE_DIR)
+    return parent_mapped;
+
+  return node->mode != FAKE_MODE_TMPFS;
 }
 
 /* This differs from g_file_test (path, G_FILE_TEST_IS_DIR) which
@@ -2587,78 +2560,88 @@ path_is_symlink (const char *path)
 }
 
 static void
-exports_add_bwrap_args (FlatpakExports *exports,
-                        GPtrArray *argv_array)
+export_node_add_bwrap_args (ExportNode *node,
+                            gboolean parent_mapped,
+                            GPtrArray *argv_array)
 {
-  guint n_keys;
-  g_autofree const char **keys = (const char **)g_hash_table_get_keys_as_array (exports->hash, &n_keys);
-  g_autoptr(GList) eps = NULL;
-  GList *l;
-
-  eps = g_hash_table_get_values (exports->hash);
-  eps = g_list_sort (eps, (GCompareFunc)compare_eps);
-
-  g_qsort_with_data (keys, n_keys, sizeof (char *), (GCompareDataFunc) flatpak_strcmp0_ptr, NULL);
+  const char *path = node->path;
 
-  for (l = eps; l != NULL; l = l->next)
+  if (path == NULL)
     {
-      ExportedPath *ep = l->data;
-      const char *path = ep->path;
-
-      if (ep->mode == FAKE_MODE_SYMLINK)
-        {
-          if (!path_parent_is_mapped (keys, n_keys, exports->hash, path))
-            {
-              g_autofree char *resolved = flatpak_resolve_link (path, NULL);
-              if (resolved)
-                {
-                  g_autofree char *parent = g_path_get_dirname (path);
-                  g_autofree char *relative = make_relative (parent, resolved);
-                  add_args (argv_array, "--symlink", relative, path,  NULL);
-                }
-            }
-        }
-      else if (ep->mode == FAKE_MODE_TMPFS)
+      /* Only an intermediate path element, not exported itself */
+    }
+  else if (node->mode == FAKE_MODE_SYMLINK)
+    {
+      if (!parent_mapped)
         {
-          /* Mount a tmpfs to hide the subdirectory, but only if there
-             is a pre-existing dir we can mount the path on. */
-          if (path_is_dir (path))
+          g_autofree char *resolved = flatpak_resolve_link (path, NULL);
+          if (resolved)
             {
-              if (!path_parent_is_mapped (keys, n_keys, exports->hash, path))
-                /* If the parent is not mapped, it will be a tmpfs, no need to mount another one */
-                add_args (argv_array, "--dir", path, NULL);
-              else
-                add_args (argv_array, "--tmpfs", path, NULL);
+              g_autofree char *parent = g_path_get_dirname (path);
+              g_autofree char *relative = make_relative (parent, resolved);
+              add_args (argv_array, "--symlink", relative, path,  NULL);
             }
         }
-      else if (ep->mode == FAKE_MODE_DIR)
+    }
+  else if (node->mode == FAKE_MODE_TMPFS)
+    {
+      /* Mount a tmpfs to hide the subdirectory, but only if there
+         is a pre-existing dir we can mount the path on. */
+      if (path_is_dir (path))
         {
-          if (path_is_dir (path))
+          if (!parent_mapped)
+            /* If the parent is not mapped, it will be a tmpfs, no need to mount another one */
             add_args (argv_array, "--dir", path, NULL);
+          else
+            add_args (argv_array, "--tmpfs", path, NULL);
         }
-      else
-        {
-          add_args (argv_array,
-                    (ep->mode == FLATPAK_FILESYSTEM_MODE_READ_ONLY) ? "--ro-bind" : "--bind",
-                    path, path, NULL);
-        }
     }
+  else if (node->mode == FAKE_MODE_DIR)
+    {
+      if (path_is_dir (path))
+        add_args (argv_array, "--dir", path, NULL);
+    }
+  else
+    {
+      add_args (argv_array,
+                (node->mode == FLATPAK_FILESYSTEM_MODE_READ_ONLY) ? "--ro-bind" : "--bind",
+                path, path, NULL);
+    }
+
+  /* Parents are always handled before their children */
+  if (node->children)
+    {
+      guint n_keys, i;
+      g_autofree const char **keys = (const char **)g_hash_table_get_keys_as_array (node->children, &n_keys);
+      gboolean mapped = export_node_maps_children (node, parent_mapped);
+
+      g_qsort_with_data (keys, n_keys, sizeof (char *), (GCompareDataFunc) flatpak_strcmp0_ptr, NULL);
+
+      for (i = 0; i < n_keys; i++)
+        export_node_add_bwrap_args (g_hash_table_lookup (node->children, keys[i]),
+                                    mapped, argv_array);
+    }
+}
+
+void
+flatpak_exports_append_bwrap_args (FlatpakExports *exports,
+                                   GPtrArray *argv_array)
+{
+  export_node_add_bwrap_args (exports->root, FALSE, argv_array);
 }
 
 gboolean
 flatpak_exports_path_is_visible (FlatpakExports *exports,
                                  const char *path)
 {
-  guint n_keys;
-  g_autofree const char **keys = (const char **)g_hash_table_get_keys_as_array (exports->hash, &n_keys);
   g_autofree char *canonical = NULL;
   g_auto(GStrv) parts = NULL;
   int i;
   g_autoptr(GString) path_builder = g_string_new ("");
+  ExportNode *node = exports->root;
+  gboolean parent_mapped = FALSE;
   struct stat st;
 
-  g_qsort_with_data (keys, n_keys, sizeof (char *), (GCompareDataFunc) flatpak_strcmp0_ptr, NULL);
-
   path = canonical = flatpak_canonicalize_filename (path);
 
   parts = g_strsplit (path+1, "/", -1);
@@ -2671,10 +2654,26 @@ flatpak_exports_path_is_visible (FlatpakExports *exports,
    */
   for (i = 0; parts[i] != NULL; i++)
     {
+      gboolean is_mapped;
+
       g_string_append (path_builder, "/");
       g_string_append (path_builder, parts[i]);
 
-      if (path_is_mapped (keys, n_keys, exports->hash, path_builder->str))
+      /* Nothing below an exported symlink is mapped, only the
+         symlink itself is */
+      if (node != NULL)
+        {
+          parent_mapped = export_node_maps_children (node, parent_mapped) &&
+            !(node->path != NULL && node->mode == FAKE_MODE_SYMLINK);
+          node = export_node_lookup (node, parts[i]);
+        }
+
+      if (node != NULL && node->path != NULL && node->mode != FAKE_MODE_DIR)
+        is_mapped = node->mode != FAKE_MODE_TMPFS;
+      else
+        is_mapped = parent_mapped;
+
+      if (is_mapped)
         {
           if (lstat (path_builder->str, &st) != 0)
             return FALSE;
@@ -2723,18 +2722,23 @@ do_export_path (FlatpakExports *exports,
                 const char *path,
                 gint mode)
 {
-  ExportedPath *old_ep = g_hash_table_lookup (exports->hash, path);
-  ExportedPath *ep;
+  ExportNode *node = exports->root;
+  g_auto(GStrv) parts = g_strsplit (path, "/", -1);
+  int i;
 
-  ep = g_new0 (ExportedPath, 1);
-  ep->path = g_strdup (path);
+  for (i = 0; parts[i] != NULL; i++)
+    {
+      if (*parts[i] != 0)
+        node = export_node_ensure (node, parts[i]);
+    }
 
-  if (old_ep != NULL)
-    ep->mode = MAX (old_ep->mode, mode);
+  if (node->path != NULL)
+    node->mode = MAX (node->mode, mode);
   else
-    ep->mode = mode;
-
-  g_hash_table_replace (exports->hash, ep->path, ep);
+    {
+      node->path = g_strdup (path);
+      node->mode = mode;
+    }
 }
 
 
@@ -2826,24 +2830,24 @@ _exports_path_expose (FlatpakExports *exports,
   return TRUE;
 }
 
-static void
-exports_path_expose (FlatpakExports *exports,
-                     FlatpakFilesystemMode mode,
-                     const char *path)
+void
+flatpak_exports_add_path_expose (FlatpakExports *exports,
+                                 FlatpakFilesystemMode mode,
+                                 const char *path)
 {
   _exports_path_expose (exports, mode, path, 0);
 }
 
-static void
-exports_path_tmpfs (FlatpakExports *exports,
-                    const char *path)
+void
+flatpak_exports_add_path_tmpfs (FlatpakExports *exports,
+                                const char *path)
 {
   _exports_path_expose (exports, FAKE_MODE_TMPFS, path, 0);
 }
 
-static void
-exports_path_dir (FlatpakExports *exports,
-                  const char *path)
+void
+flatpak_exports_add_path_dir (FlatpakExports *exports,
+                              const char *path)
 {
   _exports_path_expose (exports, FAKE_MODE_DIR, path, 0);
 }
@@ -2882,11 +2886,11 @@ export_paths_export_context (FlatpakContext *context,
                 continue;
 
               path = g_build_filename ("/", dirent->d_name, NULL);
-              exports_path_expose (exports, fs_mode, path);
+              flatpak_exports_add_path_expose (exports, fs_mode, path);
             }
           closedir (dir);
         }
-      exports_path_expose (exports, fs_mode, "/run/media");
+      flatpak_exports_add_path_expose (exports, fs_mode, "/run/media");
     }
 
   home_mode = (FlatpakFilesystemMode) g_hash_table_lookup (context->filesystems, "home");
@@ -2895,7 +2899,7 @@ export_paths_export_context (FlatpakContext *context,
       g_debug ("Allowing homedir access");
       home_access = TRUE;
 
-      exports_path_expose (exports, MAX (home_mode, fs_mode), g_get_home_dir ());
+      flatpak_exports_add_path_expose (exports, MAX (home_mode, fs_mode), g_get_home_dir ());
     }
 
   g_hash_table_iter_init (&iter, context->filesystems);
@@ -2944,7 +2948,7 @@ export_paths_export_context (FlatpakContext *context,
                 g_string_append_printf (xdg_dirs_conf, "%s=\"%s\"\n",
                                         config_key, path);
 
-              exports_path_expose (exports, mode, subpath);
+              flatpak_exports_add_path_expose (exports, mode, subpath);
             }
         }
       else if (g_str_has_prefix (filesystem, "~/"))
@@ -2957,7 +2961,7 @@ export_paths_export_context (FlatpakContext *context,
             g_mkdir_with_parents (path, 0755);
 
           if (g_file_test (path, G_FILE_TEST_EXISTS))
-            exports_path_expose (exports, mode, path);
+            flatpak_exports_add_path_expose (exports, mode, path);
         }
       else if (g_str_has_prefix (filesystem, "/"))
         {
@@ -2965,7 +2969,7 @@ export_paths_export_context (FlatpakContext *context,
             g_mkdir_with_parents (filesystem, 0755);
 
           if (g_file_test (filesystem, G_FILE_TEST_EXISTS))
-            exports_path_expose (exports, mode, filesystem);
+            flatpak_exports_add_path_expose (exports, mode, filesystem);
         }
       else
         {
@@ -2977,9 +2981,9 @@ export_paths_export_context (FlatpakContext *context,
     {
       g_autoptr(GFile) apps_dir = g_file_get_parent (app_id_dir);
       /* Hide the .var/app dir by default (unless explicitly made visible) */
-      exports_path_tmpfs (exports, flatpak_file_get_path_cached (apps_dir));
+      flatpak_exports_add_path_tmpfs (exports, flatpak_file_get_path_cached (apps_dir));
       /* But let the app write to the per-app dir in it */
-      exports_path_expose (exports, FLATPAK_FILESYSTEM_MODE_READ_WRITE,
+      flatpak_exports_add_path_expose (exports, FLATPAK_FILESYSTEM_MODE_READ_WRITE,
                            flatpak_file_get_path_cached (app_id_dir));
     }
 
@@ -2991,7 +2995,7 @@ FlatpakExports *
 flatpak_exports_from_context (FlatpakContext *context,
                               const char *app_id)
 {
-  g_autoptr(FlatpakExports) exports = exports_new ();
+  g_autoptr(FlatpakExports) exports = flatpak_exports_new ();
   g_autoptr(GFile) app_id_dir = flatpak_get_data_dir (app_id);
 
   export_paths_export_context (context, exports, app_id_dir, FALSE, NULL, NULL);
@@ -3034,11 +3038,12 @@ flatpak_run_add_environment_args (GPtrArray      *argv_array,
   g_autoptr(GString) xdg_dirs_conf = g_string_new ("");
   g_autoptr(GError) my_error = NULL;
   g_autoptr(GFile) user_flatpak_dir = NULL;
-  g_autoptr(FlatpakExports) exports = exports_new ();
+  g_autoptr(FlatpakExports) exports = flatpak_exports_new ();
   g_autoptr(GPtrArray) session_bus_proxy_argv = NULL;
   g_autoptr(GPtrArray) system_bus_proxy_argv = NULL;
   g_autoptr(GPtrArray) a11y_bus_proxy_argv = NULL;
   int sync_fds[2] = {-1, -1};
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("add-environment", app_id);
 
   if ((flags & FLATPAK_RUN_FLAG_NO_SESSION_BUS_PROXY) == 0)
     session_bus_proxy_argv = g_ptr_array_new_with_free_func (g_free);
@@ -3138,13 +3143,13 @@ flatpak_run_add_environment_args (GPtrArray      *argv_array,
 
   /* Hide the flatpak dir by default (unless explicitly made visible) */
   user_flatpak_dir = flatpak_get_user_base_dir_location ();
-  exports_path_tmpfs (exports, flatpak_file_get_path_cached (user_flatpak_dir));
+  flatpak_exports_add_path_tmpfs (exports, flatpak_file_get_path_cached (user_flatpak_dir));
 
   /* Ensure we always have a homedir */
-  exports_path_dir (exports, g_get_home_dir ());
+  flatpak_exports_add_path_dir (exports, g_get_home_dir ());
 
   /* This actually outputs the args for the hide/expose operations above */
-  exports_add_bwrap_args (exports, argv_array);
+  flatpak_exports_append_bwrap_args (exports, argv_array);
 
   /* Special case subdirectories of the cache, config and data xdg
    * dirs.  If these are accessible explicilty, then we bind-mount
@@ -4343,6 +4348,7 @@ setup_seccomp (GPtrArray  *argv_array,
                GError    **error)
 {
   __attribute__((cleanup (cleanup_seccomp))) scmp_filter_ctx seccomp = NULL;
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("seccomp", arch);
 
   /**** BEGIN NOTE ON CODE SHARING
    *
@@ -4993,6 +4999,7 @@ regenerate_ld_cache (GPtrArray      *base_argv_array,
   int exit_status;
   glnx_autofd int ld_so_fd = -1;
   g_autoptr(GFile) ld_so_dir = NULL;
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("ld-cache", checksum);
 
   if (app_id_dir)
     ld_so_dir = g_file_get_child (app_id_dir, ".ld.so");
@@ -5146,6 +5153,7 @@ flatpak_run_app (const char     *app_ref,
   gboolean generate_ld_so_conf = TRUE;
   gboolean use_ld_so_cache = TRUE;
   struct stat s;
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("run", app_ref);
 
   app_ref_parts = flatpak_decompose_ref (app_ref, error);
   if (app_ref_parts == NULL)
@@ -5398,6 +5406,10 @@ flatpak_run_app (const char     *app_ref,
     }
   else
     {
+      /* exec doesn't return, so end the span here */
+      flatpak_trace_end (g_steal_pointer (&span));
+      flatpak_trace_mark ("exec", app_ref);
+
       /* Ensure we unset O_CLOEXEC */
       child_setup (fd_array);
       if (execvpe (flatpak_get_bwrap (), (char **) real_argv_array->pdata, envp) == -1)
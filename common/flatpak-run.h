@@ -147,9 +147,26 @@ typedef enum {
   FLATPAK_RUN_FLAG_NO_A11Y_BUS_PROXY  = (1 << 13),
 } FlatpakRunFlags;
 
+/* In numerical order of more privs */
+typedef enum {
+  FLATPAK_FILESYSTEM_MODE_READ_ONLY    = 1,
+  FLATPAK_FILESYSTEM_MODE_READ_WRITE   = 2,
+  FLATPAK_FILESYSTEM_MODE_CREATE       = 3,
+} FlatpakFilesystemMode;
+
 typedef struct _FlatpakExports FlatpakExports;
 
+FlatpakExports *flatpak_exports_new (void);
 void flatpak_exports_free (FlatpakExports *exports);
+void flatpak_exports_add_path_expose (FlatpakExports       *exports,
+                                      FlatpakFilesystemMode mode,
+                                      const char           *path);
+void flatpak_exports_add_path_tmpfs (FlatpakExports *exports,
+                                     const char     *path);
+void flatpak_exports_add_path_dir (FlatpakExports *exports,
+                                   const char     *path);
+void flatpak_exports_append_bwrap_args (FlatpakExports *exports,
+                                        GPtrArray      *argv_array);
 
 gboolean flatpak_exports_path_is_visible (FlatpakExports *exports,
                                           const char *path);
@@ -26,6 +26,8 @@
 #include "flatpak-portal-error.h"
 #include "flatpak-oci-registry.h"
 #include "flatpak-run.h"
+#include "gvdb/gvdb-reader.h"
+#include "gvdb/gvdb-builder.h"
 
 #include <glib/gi18n.h>
 
@@ -41,6 +43,7 @@
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 
 #include <glib.h>
 #include "libglnx/libglnx.h"
@@ -93,6 +96,138 @@ flatpak_debug2 (const char *format, ...)
 
 }
 
+/* When FLATPAK_TRACE is set to a filename, timed spans of the main
+ * phases are appended to it as Chrome trace events, which can be loaded
+ * in chrome://tracing or the perfetto UI. Events are written with a
+ * single O_APPEND write each, so several processes can share a file. */
+
+struct _FlatpakTraceSpan
+{
+  const char *name;
+  char       *detail;
+  gint64      start;
+};
+
+static int
+flatpak_trace_get_fd (void)
+{
+  static gsize initialized = 0;
+  static int trace_fd = -1;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const char *path = g_getenv ("FLATPAK_TRACE");
+
+      if (path != NULL && *path != 0)
+        {
+          struct stat st;
+
+          trace_fd = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+          if (trace_fd == -1)
+            g_warning ("Unable to open trace file %s: %s", path, g_strerror (errno));
+          else if (flock (trace_fd, LOCK_EX) == 0)
+            {
+              /* The trace viewers accept a JSON array without the closing
+               * bracket, so only the first writer has to start it */
+              if (fstat (trace_fd, &st) == 0 && st.st_size == 0)
+                glnx_loop_write (trace_fd, "[\n", 2);
+              flock (trace_fd, LOCK_UN);
+            }
+        }
+
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return trace_fd;
+}
+
+static void
+flatpak_trace_write_event (const char *name,
+                           const char *detail,
+                           const char *phase,
+                           gint64      start,
+                           gint64      end)
+{
+  int fd = flatpak_trace_get_fd ();
+  g_autoptr(GString) event = NULL;
+  int res;
+
+  if (fd == -1)
+    return;
+
+  event = g_string_new ("");
+  g_string_append_printf (event,
+                          "{\"name\":\"%s\",\"cat\":\"flatpak\",\"ph\":\"%s\","
+                          "\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%ld",
+                          name, phase, start, (int) getpid (), (long) syscall (SYS_gettid));
+  if (*phase == 'X')
+    g_string_append_printf (event, ",\"dur\":%" G_GINT64_FORMAT, end - start);
+  else
+    g_string_append (event, ",\"s\":\"p\"");
+
+  if (detail != NULL)
+    {
+      const char *p;
+
+      g_string_append (event, ",\"args\":{\"detail\":\"");
+      for (p = detail; *p != 0; p++)
+        {
+          if (*p == '"' || *p == '\\')
+            g_string_append_printf (event, "\\%c", *p);
+          else if ((guchar) *p < 0x20)
+            g_string_append_printf (event, "\\u%04x", (guchar) *p);
+          else
+            g_string_append_c (event, *p);
+        }
+      g_string_append (event, "\"}");
+    }
+
+  g_string_append (event, "},\n");
+
+  res = glnx_loop_write (fd, event->str, event->len);
+  if (res < 0)
+    g_debug ("Failed to write trace event: %s", g_strerror (-res));
+}
+
+/* Returns NULL when tracing is disabled. @name must be a static string */
+FlatpakTraceSpan *
+flatpak_trace_begin (const char *name,
+                     const char *detail)
+{
+  FlatpakTraceSpan *span;
+
+  if (flatpak_trace_get_fd () == -1)
+    return NULL;
+
+  span = g_new0 (FlatpakTraceSpan, 1);
+  span->name = name;
+  span->detail = g_strdup (detail);
+  span->start = g_get_monotonic_time ();
+
+  return span;
+}
+
+void
+flatpak_trace_end (FlatpakTraceSpan *span)
+{
+  if (span == NULL)
+    return;
+
+  flatpak_trace_write_event (span->name, span->detail, "X",
+                             span->start, g_get_monotonic_time ());
+  g_free (span->detail);
+  g_free (span);
+}
+
+void
+flatpak_trace_mark (const char *name,
+                    const char *detail)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  flatpak_trace_write_event (name, detail, "i", now, now);
+}
+
 GFile *
 flatpak_file_new_tmp_in (GFile *dir,
                          const char *template,
@@ -1376,6 +1511,7 @@ flatpak_find_deploy_for_ref (const char   *ref,
   g_autoptr(GPtrArray) system_dirs = NULL;
   g_autoptr(FlatpakDeploy) deploy = NULL;
   g_autoptr(GError) my_error = NULL;
+  g_autoptr(FlatpakTraceSpan) span = flatpak_trace_begin ("find-deploy", ref);
 
   user_dir = flatpak_dir_get_user ();
   flatpak_log_dir_access (user_dir);
@@ -2640,6 +2776,34 @@ flatpak_variant_bsearch_str (GVariant   *array,
   return FALSE;
 }
 
+/* Returns the position of the first element of the sorted a(s...)
+ * @array whose first child is not less than @str, i.e. the start of
+ * the elements with @str as prefix, if any. */
+gsize
+flatpak_variant_lower_bound_str (GVariant   *array,
+                                 const char *str)
+{
+  gsize imin = 0;
+  gsize imax = g_variant_n_children (array);
+
+  while (imin < imax)
+    {
+      g_autoptr(GVariant) child = NULL;
+      g_autoptr(GVariant) cur_v = NULL;
+      gsize imid = imin + (imax - imin) / 2;
+
+      child = g_variant_get_child_value (array, imid);
+      cur_v = g_variant_get_child_value (child, 0);
+
+      if (strcmp (g_variant_get_data (cur_v), str) < 0)
+        imin = imid + 1;
+      else
+        imax = imid;
+    }
+
+  return imin;
+}
+
 /* Find the list of refs which belong to the given @collection_id in @summary.
  * If @collection_id is %NULL, the main refs list from the summary will be
  * returned. If @collection_id doesn’t match any collection IDs in the summary
@@ -2682,7 +2846,6 @@ flatpak_summary_match_subrefs (GVariant   *summary,
   GPtrArray *res = g_ptr_array_new ();
   gsize n, i;
   g_auto(GStrv) parts = NULL;
-  g_autofree char *parts_prefix = NULL;
   g_autofree char *ref_prefix = NULL;
   g_autofree char *ref_suffix = NULL;
 
@@ -2693,39 +2856,31 @@ flatpak_summary_match_subrefs (GVariant   *summary,
     {
       /* Match against the refs. */
       parts = g_strsplit (ref, "/", 0);
-      parts_prefix = g_strconcat (parts[1], ".", NULL);
 
-      ref_prefix = g_strconcat (parts[0], "/", NULL);
+      /* Must match type, and only prefix of id */
+      ref_prefix = g_strconcat (parts[0], "/", parts[1], ".", NULL);
       ref_suffix = g_strconcat ("/", parts[2], "/", parts[3], NULL);
 
+      /* The refs are sorted, so all the ones with the prefix are
+         next to each other, starting at the lower bound */
       n = g_variant_n_children (refs);
-      for (i = 0; i < n; i++)
+      for (i = flatpak_variant_lower_bound_str (refs, ref_prefix); i < n; i++)
         {
           g_autoptr(GVariant) child = NULL;
           g_autoptr(GVariant) cur_v = NULL;
           const char *cur;
-          const char *id_start;
 
           child = g_variant_get_child_value (refs, i);
           cur_v = g_variant_get_child_value (child, 0);
           cur = g_variant_get_data (cur_v);
 
-          /* Must match type */
           if (!g_str_has_prefix (cur, ref_prefix))
-            continue;
+            break;
 
           /* Must match arch & branch */
           if (!g_str_has_suffix (cur, ref_suffix))
             continue;
 
-          id_start = strchr (cur, '/');
-          if (id_start == NULL)
-            continue;
-
-          /* But only prefix of id */
-          if (!g_str_has_prefix (id_start + 1, parts_prefix))
-            continue;
-
           g_ptr_array_add (res, g_strdup (cur));
         }
     }
@@ -3520,25 +3675,6 @@ flatpak_mtree_create_root (OstreeRepo        *repo,
   return TRUE;
 }
 
-static OstreeRepoCommitFilterResult
-commit_filter (OstreeRepo *repo,
-               const char *path,
-               GFileInfo  *file_info,
-               gpointer    user_data)
-{
-  guint current_mode;
-
-  /* No user info */
-  g_file_info_set_attribute_uint32 (file_info, "unix::uid", 0);
-  g_file_info_set_attribute_uint32 (file_info, "unix::gid", 0);
-
-  /* No setuid */
-  current_mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
-  g_file_info_set_attribute_uint32 (file_info, "unix::mode", current_mode & ~07000);
-
-  return OSTREE_REPO_COMMIT_FILTER_ALLOW;
-}
-
 static gboolean
 validate_component (FlatpakXml *component,
                     const char *ref,
@@ -3700,11 +3836,11 @@ flatpak_appstream_xml_migrate (FlatpakXml *source,
 }
 
 static gboolean
-copy_icon (const char *id,
-           GFile      *root,
-           GFile      *dest,
-           const char *size,
-           GError    **error)
+load_icon (const char      *id,
+           GFile           *root,
+           const char      *size,
+           GVariantBuilder *icons,
+           GError         **error)
 {
   g_autofree char *icon_name = g_strconcat (id, ".png", NULL);
 
@@ -3713,16 +3849,11 @@ copy_icon (const char *id,
                                   "files/share/app-info/icons/flatpak");
   g_autoptr(GFile) size_dir = g_file_get_child (icons_dir, size);
   g_autoptr(GFile) icon_file = g_file_get_child (size_dir, icon_name);
-  g_autoptr(GFile) dest_dir = g_file_get_child (dest, "icons");
-  g_autoptr(GFile) dest_size_dir = g_file_get_child (dest_dir, size);
-  g_autoptr(GFile) dest_file = g_file_get_child (dest_size_dir, icon_name);
-  g_autoptr(GInputStream) in = NULL;
-  g_autoptr(GOutputStream) out = NULL;
   g_autoptr(GError) my_error = NULL;
-  gssize n_bytes_written;
+  g_autofree char *data = NULL;
+  gsize len;
 
-  in = (GInputStream *) g_file_read (icon_file, NULL, &my_error);
-  if (!in)
+  if (!g_file_load_contents (icon_file, NULL, &data, &len, NULL, &my_error))
     {
       if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
         {
@@ -3734,30 +3865,23 @@ copy_icon (const char *id,
       return FALSE;
     }
 
-  if (!flatpak_mkdir_p (dest_size_dir, NULL, error))
-    return FALSE;
-
-  out = (GOutputStream *) g_file_replace (dest_file, NULL, FALSE,
-                                          G_FILE_CREATE_REPLACE_DESTINATION,
-                                          NULL, error);
-  if (!out)
-    return FALSE;
-
-  n_bytes_written = g_output_stream_splice (out, in,
-                                            G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
-                                            NULL, error);
-  if (n_bytes_written < 0)
-    return FALSE;
+  g_variant_builder_add (icons, "(ss@ay)", size, icon_name,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, data, len, 1));
 
   return TRUE;
 }
 
-static gboolean
+/* The extracted appstream data for a ref. This only depends on the
+ * commit, so it is cached in the repo, keyed by the commit checksum:
+ * (commit, components xml, [(icon size, icon name, icon data)]) */
+#define APPSTREAM_FRAGMENT_GVARIANT_FORMAT "(ssa(ssay))"
+#define APPSTREAM_FRAGMENT_CACHE_DIR "tmp/cache/flatpak-appstream"
+
+static GVariant *
 extract_appstream (OstreeRepo   *repo,
-                   FlatpakXml   *appstream_root,
                    const char   *ref,
                    const char   *id,
-                   GFile        *dest,
+                   const char   *commit,
                    GCancellable *cancellable,
                    GError      **error)
 {
@@ -3768,10 +3892,13 @@ extract_appstream (OstreeRepo   *repo,
   g_autofree char *appstream_basename = NULL;
   g_autoptr(GInputStream) in = NULL;
   g_autoptr(FlatpakXml) xml_root = NULL;
+  g_autoptr(FlatpakXml) appstream_root = NULL;
   g_autoptr(GKeyFile) keyfile = NULL;
+  g_autoptr(GString) fragment = g_string_new ("");
+  GVariantBuilder icons;
 
-  if (!ostree_repo_read_commit (repo, ref, &root, NULL, NULL, error))
-    return FALSE;
+  if (!ostree_repo_read_commit (repo, commit, &root, NULL, NULL, error))
+    return NULL;
 
   keyfile = g_key_file_new ();
   metadata = g_file_get_child (root, "metadata");
@@ -3781,10 +3908,10 @@ extract_appstream (OstreeRepo   *repo,
       gsize len;
 
       if (!g_file_load_contents (metadata, cancellable, &content, &len, NULL, error))
-        return FALSE;
+        return NULL;
 
       if (!g_key_file_load_from_data (keyfile, content, len, G_KEY_FILE_NONE, error))
-        return FALSE;
+        return NULL;
     }
 
   xmls_dir = g_file_resolve_relative_path (root, "files/share/app-info/xmls");
@@ -3793,12 +3920,15 @@ extract_appstream (OstreeRepo   *repo,
 
   in = (GInputStream *) g_file_read (appstream_file, cancellable, error);
   if (!in)
-    return FALSE;
+    return NULL;
 
   xml_root = flatpak_xml_parse (in, TRUE, cancellable, error);
   if (xml_root == NULL)
-    return FALSE;
+    return NULL;
 
+  g_variant_builder_init (&icons, G_VARIANT_TYPE ("a(ssay)"));
+
+  appstream_root = flatpak_appstream_xml_new ();
   if (flatpak_appstream_xml_migrate (xml_root, appstream_root,
                                      ref, id, keyfile))
     {
@@ -3831,12 +3961,12 @@ extract_appstream (OstreeRepo   *repo,
           g_print ("Extracting icons for component %s\n", component_id_text);
           component_id_text[strlen (component_id_text) - strlen (".desktop")] = 0;
 
-          if (!copy_icon (component_id_text, root, dest, "64x64", &my_error))
+          if (!load_icon (component_id_text, root, "64x64", &icons, &my_error))
             {
               g_print ("Error copying 64x64 icon: %s\n", my_error->message);
               g_clear_error (&my_error);
             }
-          if (!copy_icon (component_id_text, root, dest, "128x128", &my_error))
+          if (!load_icon (component_id_text, root, "128x128", &icons, &my_error))
             {
               g_print ("Error copying 128x128 icon: %s\n", my_error->message);
               g_clear_error (&my_error);
@@ -3847,6 +3977,233 @@ extract_appstream (OstreeRepo   *repo,
         }
     }
 
+  flatpak_xml_to_string (appstream_root, fragment);
+
+  return g_variant_ref_sink (g_variant_new (APPSTREAM_FRAGMENT_GVARIANT_FORMAT,
+                                            commit, fragment->str, &icons));
+}
+
+static char *
+appstream_fragment_cache_name (const char *ref)
+{
+  g_autofree char *ref_checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, ref, -1);
+
+  return g_strconcat (ref_checksum, ".gvariant", NULL);
+}
+
+static GVariant *
+load_cached_appstream_fragment (int         cache_dfd,
+                                const char *ref,
+                                const char *commit)
+{
+  g_autofree char *name = appstream_fragment_cache_name (ref);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) fragment = NULL;
+  glnx_autofd int fd = -1;
+  const char *cached_commit;
+
+  if (!glnx_openat_rdonly (cache_dfd, name, TRUE, &fd, NULL))
+    return NULL;
+
+  bytes = glnx_fd_readall_bytes (fd, NULL, NULL);
+  if (bytes == NULL)
+    return NULL;
+
+  fragment = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (APPSTREAM_FRAGMENT_GVARIANT_FORMAT),
+                                                           bytes, FALSE));
+  g_variant_get_child (fragment, 0, "&s", &cached_commit);
+  if (strcmp (cached_commit, commit) != 0)
+    return NULL;
+
+  return g_steal_pointer (&fragment);
+}
+
+static void
+save_cached_appstream_fragment (int         cache_dfd,
+                                const char *ref,
+                                GVariant   *fragment)
+{
+  g_autofree char *name = appstream_fragment_cache_name (ref);
+  g_autoptr(GError) my_error = NULL;
+
+  if (!glnx_file_replace_contents_at (cache_dfd, name,
+                                      g_variant_get_data (fragment),
+                                      g_variant_get_size (fragment),
+                                      GLNX_FILE_REPLACE_NODATASYNC,
+                                      NULL, &my_error))
+    g_debug ("Failed to cache appstream data for %s: %s", ref, my_error->message);
+}
+
+typedef struct
+{
+  OstreeRepo *repo;
+  int         cache_dfd;
+  const char *ref;
+  const char *commit;
+  char       *id;
+  GVariant   *fragment;
+  GError     *error;
+} AppstreamExtraction;
+
+static void
+appstream_extraction_clear (gpointer data)
+{
+  AppstreamExtraction *extraction = data;
+
+  g_free (extraction->id);
+  g_clear_pointer (&extraction->fragment, g_variant_unref);
+  g_clear_error (&extraction->error);
+}
+
+static void
+appstream_extraction_thread (gpointer data,
+                             gpointer user_data)
+{
+  AppstreamExtraction *extraction = data;
+
+  if (extraction->cache_dfd != -1)
+    extraction->fragment = load_cached_appstream_fragment (extraction->cache_dfd,
+                                                           extraction->ref,
+                                                           extraction->commit);
+  if (extraction->fragment != NULL)
+    return;
+
+  extraction->fragment = extract_appstream (extraction->repo,
+                                            extraction->ref, extraction->id, extraction->commit,
+                                            NULL, &extraction->error);
+
+  if (extraction->fragment != NULL && extraction->cache_dfd != -1)
+    save_cached_appstream_fragment (extraction->cache_dfd, extraction->ref,
+                                    extraction->fragment);
+}
+
+static gboolean
+mtree_add_file_from_data (OstreeRepo        *repo,
+                          OstreeMutableTree *mtree,
+                          const char        *name,
+                          gconstpointer      data,
+                          gsize              size,
+                          GCancellable      *cancellable,
+                          GError           **error)
+{
+  g_autoptr(GFileInfo) file_info = g_file_info_new ();
+  g_autoptr(GInputStream) raw_input = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  guint64 length;
+  g_autofree guchar *child_file_csum = NULL;
+  g_autofree char *tmp_checksum = NULL;
+
+  g_file_info_set_name (file_info, name);
+  g_file_info_set_file_type (file_info, G_FILE_TYPE_REGULAR);
+  g_file_info_set_size (file_info, size);
+  g_file_info_set_attribute_uint32 (file_info, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (file_info, "unix::gid", 0);
+  g_file_info_set_attribute_uint32 (file_info, "unix::mode", 0100644);
+
+  raw_input = g_memory_input_stream_new_from_data (data, size, NULL);
+
+  if (!ostree_raw_file_to_content_stream (raw_input,
+                                          file_info, NULL,
+                                          &input, &length,
+                                          cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_write_content (repo, NULL, input, length,
+                                  &child_file_csum, cancellable, error))
+    return FALSE;
+
+  tmp_checksum = ostree_checksum_from_bytes (child_file_csum);
+  if (!ostree_mutable_tree_replace_file (mtree, name, tmp_checksum, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+static OstreeMutableTree *
+mtree_ensure_dir (OstreeRepo        *repo,
+                  OstreeMutableTree *parent,
+                  const char        *name,
+                  GCancellable      *cancellable,
+                  GError           **error)
+{
+  g_autoptr(OstreeMutableTree) dir = NULL;
+
+  if (!ostree_mutable_tree_ensure_dir (parent, name, &dir, error))
+    return NULL;
+
+  if (ostree_mutable_tree_get_metadata_checksum (dir) == NULL &&
+      !flatpak_mtree_create_root (repo, dir, cancellable, error))
+    return NULL;
+
+  return g_steal_pointer (&dir);
+}
+
+/* Merges the extracted components into appstream_root and the icons into mtree */
+static gboolean
+add_appstream_fragment (OstreeRepo        *repo,
+                        FlatpakXml        *appstream_root,
+                        OstreeMutableTree *mtree,
+                        GVariant          *fragment,
+                        GCancellable      *cancellable,
+                        GError           **error)
+{
+  g_autoptr(GInputStream) in = NULL;
+  g_autoptr(FlatpakXml) fragment_root = NULL;
+  g_autoptr(GVariant) icons = NULL;
+  FlatpakXml *components;
+  FlatpakXml *component;
+  FlatpakXml *prev_component;
+  const char *xml;
+  GVariantIter iter;
+  const char *size;
+  const char *icon_name;
+  GVariant *icon_data;
+
+  g_variant_get (fragment, "(&s&s@a(ssay))", NULL, &xml, &icons);
+
+  in = g_memory_input_stream_new_from_data (xml, -1, NULL);
+  fragment_root = flatpak_xml_parse (in, FALSE, cancellable, error);
+  if (fragment_root == NULL)
+    return FALSE;
+
+  components = fragment_root->first_child;
+  component = components ? components->first_child : NULL;
+  prev_component = NULL;
+  while (component != NULL)
+    {
+      FlatpakXml *next = component->next_sibling;
+
+      if (component->element_name != NULL)
+        flatpak_xml_add (appstream_root->first_child,
+                         flatpak_xml_unlink (component, prev_component));
+      else
+        prev_component = component;
+
+      component = next;
+    }
+
+  g_variant_iter_init (&iter, icons);
+  while (g_variant_iter_next (&iter, "(&s&s@ay)", &size, &icon_name, &icon_data))
+    {
+      g_autoptr(GVariant) icon_data_v = icon_data;
+      g_autoptr(OstreeMutableTree) icons_dir = NULL;
+      g_autoptr(OstreeMutableTree) size_dir = NULL;
+
+      icons_dir = mtree_ensure_dir (repo, mtree, "icons", cancellable, error);
+      if (icons_dir == NULL)
+        return FALSE;
+
+      size_dir = mtree_ensure_dir (repo, icons_dir, size, cancellable, error);
+      if (size_dir == NULL)
+        return FALSE;
+
+      if (!mtree_add_file_from_data (repo, size_dir, icon_name,
+                                     g_variant_get_data (icon_data_v),
+                                     g_variant_get_size (icon_data_v),
+                                     cancellable, error))
+        return FALSE;
+    }
+
   return TRUE;
 }
 
@@ -3897,6 +4254,263 @@ flatpak_appstream_xml_root_to_data (FlatpakXml *appstream_root,
   return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (out));
 }
 
+/* The appstream index maps component ids to the most commonly needed
+ * data about the component, so that it can be found without parsing
+ * the whole appstream xml: (name, summary, cached icon, keywords) */
+#define APPSTREAM_INDEX_GVARIANT_FORMAT "(sssas)"
+
+typedef struct
+{
+  int        depth;
+  gboolean   in_keywords;
+  char     **target;
+  gboolean   collecting_keyword;
+  GString   *text;
+  char      *id;
+  char      *name;
+  char      *summary;
+  char      *icon;
+  GPtrArray *keywords;
+} AppstreamIndexComponent;
+
+static gboolean
+has_lang_attribute (const gchar **attribute_names)
+{
+  int i;
+
+  for (i = 0; attribute_names[i] != NULL; i++)
+    if (strcmp (attribute_names[i], "xml:lang") == 0)
+      return TRUE;
+
+  return FALSE;
+}
+
+static void
+index_start_element (GMarkupParseContext *context,
+                     const gchar         *element_name,
+                     const gchar        **attribute_names,
+                     const gchar        **attribute_values,
+                     gpointer             user_data,
+                     GError             **error)
+{
+  AppstreamIndexComponent *c = user_data;
+
+  c->depth++;
+  g_string_truncate (c->text, 0);
+
+  if (c->depth == 2)
+    {
+      if (strcmp (element_name, "keywords") == 0)
+        c->in_keywords = TRUE;
+      else if (has_lang_attribute (attribute_names))
+        return;
+      else if (strcmp (element_name, "id") == 0)
+        c->target = &c->id;
+      else if (strcmp (element_name, "name") == 0)
+        c->target = &c->name;
+      else if (strcmp (element_name, "summary") == 0)
+        c->target = &c->summary;
+      else if (strcmp (element_name, "icon") == 0)
+        {
+          const char *type = NULL;
+          int i;
+
+          for (i = 0; attribute_names[i] != NULL; i++)
+            if (strcmp (attribute_names[i], "type") == 0)
+              type = attribute_values[i];
+
+          if (g_strcmp0 (type, "cached") == 0)
+            c->target = &c->icon;
+        }
+    }
+  else if (c->depth == 3 && c->in_keywords &&
+           strcmp (element_name, "keyword") == 0 &&
+           !has_lang_attribute (attribute_names))
+    c->collecting_keyword = TRUE;
+}
+
+static void
+index_end_element (GMarkupParseContext *context,
+                   const gchar         *element_name,
+                   gpointer             user_data,
+                   GError             **error)
+{
+  AppstreamIndexComponent *c = user_data;
+
+  if (c->target != NULL)
+    {
+      /* Only use the first one, e.g. the smallest icon */
+      if (*c->target == NULL)
+        *c->target = g_strstrip (g_strdup (c->text->str));
+      c->target = NULL;
+    }
+  else if (c->collecting_keyword)
+    {
+      g_ptr_array_add (c->keywords, g_strstrip (g_strdup (c->text->str)));
+      c->collecting_keyword = FALSE;
+    }
+
+  if (c->depth == 2)
+    c->in_keywords = FALSE;
+
+  c->depth--;
+}
+
+static void
+index_text (GMarkupParseContext *context,
+            const gchar         *text,
+            gsize                text_len,
+            gpointer             user_data,
+            GError             **error)
+{
+  AppstreamIndexComponent *c = user_data;
+
+  if (c->target != NULL || c->collecting_keyword)
+    g_string_append_len (c->text, text, text_len);
+}
+
+static const GMarkupParser index_parser = {
+  index_start_element,
+  index_end_element,
+  index_text,
+  NULL,
+  NULL
+};
+
+static void
+index_component (GHashTable *table,
+                 const char *component,
+                 gsize       len)
+{
+  g_autoptr(GMarkupParseContext) ctx = NULL;
+  g_autoptr(GError) my_error = NULL;
+  g_autoptr(GString) text = g_string_new ("");
+  g_autoptr(GPtrArray) keywords = g_ptr_array_new_with_free_func (g_free);
+  AppstreamIndexComponent c = { 0, };
+  GvdbItem *item;
+
+  c.text = text;
+  c.keywords = keywords;
+
+  ctx = g_markup_parse_context_new (&index_parser, 0, &c, NULL);
+  if (!g_markup_parse_context_parse (ctx, component, len, &my_error) ||
+      !g_markup_parse_context_end_parse (ctx, &my_error))
+    g_debug ("Failed to index appstream component: %s", my_error->message);
+  else if (c.id != NULL)
+    {
+      g_ptr_array_add (keywords, NULL);
+      item = gvdb_hash_table_insert (table, c.id);
+      gvdb_item_set_value (item,
+                           g_variant_new ("(sss^as)",
+                                          c.name ? c.name : "",
+                                          c.summary ? c.summary : "",
+                                          c.icon ? c.icon : "",
+                                          (const char * const *) keywords->pdata));
+    }
+
+  g_free (c.id);
+  g_free (c.name);
+  g_free (c.summary);
+  g_free (c.icon);
+}
+
+/* Builds an index of the components in the (compressed) appstream
+ * xml file at @appstream_path, and writes it as a gvdb file at
+ * @index_path */
+gboolean
+flatpak_appstream_index_write (const char   *appstream_path,
+                               const char   *index_path,
+                               GCancellable *cancellable,
+                               GError      **error)
+{
+  g_autoptr(GFile) appstream_file = g_file_new_for_path (appstream_path);
+  g_autoptr(GInputStream) in = NULL;
+  g_autoptr(GInputStream) decompressed = NULL;
+  g_autoptr(GZlibDecompressor) decompressor = NULL;
+  g_autoptr(GOutputStream) out = NULL;
+  g_autoptr(GBytes) xml_bytes = NULL;
+  g_autoptr(GHashTable) table = NULL;
+  const char *xml, *p, *end;
+  gsize xml_len;
+
+  in = (GInputStream *) g_file_read (appstream_file, cancellable, error);
+  if (in == NULL)
+    return FALSE;
+
+  decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+  decompressed = g_converter_input_stream_new (in, G_CONVERTER (decompressor));
+  out = g_memory_output_stream_new_resizable ();
+  if (g_output_stream_splice (out, decompressed,
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                              cancellable, error) < 0)
+    return FALSE;
+
+  xml_bytes = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (out));
+  xml = g_bytes_get_data (xml_bytes, &xml_len);
+
+  table = gvdb_hash_table_new (NULL, NULL);
+
+  /* Components don't nest, and the text in them is escaped, so we can
+     find them without parsing the whole document */
+  p = xml;
+  end = xml + xml_len;
+  while (p < end)
+    {
+      const char *start, *stop;
+
+      start = g_strstr_len (p, end - p, "<component");
+      if (start == NULL)
+        break;
+
+      p = start + strlen ("<component");
+      if (p >= end || !(*p == ' ' || *p == '>' || *p == '\t' || *p == '\n'))
+        continue;
+
+      stop = g_strstr_len (p, end - p, "</component>");
+      if (stop == NULL)
+        break;
+      stop += strlen ("</component>");
+
+      index_component (table, start, stop - start);
+      p = stop;
+    }
+
+  return gvdb_table_write_contents (table, index_path, FALSE, error);
+}
+
+/* Looks up a component in an index written by flatpak_appstream_index_write() */
+gboolean
+flatpak_appstream_index_lookup (const char *index_path,
+                                const char *component_id,
+                                char      **out_name,
+                                char      **out_summary,
+                                char      **out_icon,
+                                char     ***out_keywords,
+                                GError    **error)
+{
+  GvdbTable *table;
+  g_autoptr(GVariant) value = NULL;
+
+  table = gvdb_table_new (index_path, TRUE, error);
+  if (table == NULL)
+    return FALSE;
+
+  value = gvdb_table_get_value (table, component_id);
+  gvdb_table_free (table);
+
+  if (value == NULL || !g_variant_is_of_type (value, G_VARIANT_TYPE (APPSTREAM_INDEX_GVARIANT_FORMAT)))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   _("No appstream component %s"), component_id);
+      return FALSE;
+    }
+
+  g_variant_get (value, "(sss^as)",
+                 out_name, out_summary, out_icon, out_keywords);
+
+  return TRUE;
+}
+
 gboolean
 flatpak_repo_generate_appstream (OstreeRepo   *repo,
                                  const char  **gpg_key_ids,
@@ -3907,9 +4521,13 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
 {
   g_autoptr(GHashTable) all_refs = NULL;
   g_autoptr(GHashTable) arches = NULL;  /* (element-type utf8 utf8) */
+  g_autofree const char **sorted_refs = NULL;
+  glnx_autofd int cache_dfd = -1;
+  g_autoptr(GError) cache_error = NULL;
   GHashTableIter iter;
   gpointer key;
   const char *collection_id;
+  guint i;
 
   arches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
@@ -3942,38 +4560,46 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
         g_hash_table_add (arches, g_strdup (arch));
     }
 
+  /* Generate the components in a stable order */
+  sorted_refs = (const char **) g_hash_table_get_keys_as_array (all_refs, NULL);
+  qsort (sorted_refs, g_hash_table_size (all_refs), sizeof (char *), flatpak_strcmp0_ptr);
+
+  if (!glnx_shutil_mkdir_p_at (ostree_repo_get_dfd (repo), APPSTREAM_FRAGMENT_CACHE_DIR, 0755,
+                               cancellable, &cache_error) ||
+      !glnx_opendirat (ostree_repo_get_dfd (repo), APPSTREAM_FRAGMENT_CACHE_DIR, TRUE,
+                       &cache_dfd, &cache_error))
+    {
+      g_debug ("Not caching appstream data: %s", cache_error->message);
+      cache_dfd = -1;
+    }
+
   g_hash_table_iter_init (&iter, arches);
   while (g_hash_table_iter_next (&iter, &key, NULL))
     {
-      GHashTableIter iter2;
       const char *arch = key;
-      g_autofree char *tmpdir = g_strdup ("/tmp/flatpak-appstream-XXXXXX");
-      g_autoptr(FlatpakTempDir) tmpdir_file = NULL;
-      g_autoptr(GFile) appstream_file = NULL;
+      g_autoptr(GArray) extractions = NULL;
+      GThreadPool *pool;
       g_autoptr(GFile) root = NULL;
       g_autoptr(OstreeMutableTree) mtree = NULL;
       g_autofree char *commit_checksum = NULL;
       OstreeRepoTransactionStats stats;
-      g_autoptr(OstreeRepoCommitModifier) modifier = NULL;
       g_autofree char *parent = NULL;
       g_autofree char *branch = NULL;
       g_autoptr(FlatpakXml) appstream_root = NULL;
       g_autoptr(GBytes) xml_data = NULL;
       gboolean skip_commit = FALSE;
 
-      if (g_mkdtemp_full (tmpdir, 0755) == NULL)
-        return flatpak_fail (error, "Can't create temporary directory");
-
-      tmpdir_file = g_file_new_for_path (tmpdir);
-
       appstream_root = flatpak_appstream_xml_new ();
 
-      g_hash_table_iter_init (&iter2, all_refs);
-      while (g_hash_table_iter_next (&iter2, &key, NULL))
+      /* Extracting the appstream data means reading and parsing every
+         commit, so do it in parallel */
+      extractions = g_array_new (FALSE, TRUE, sizeof (AppstreamExtraction));
+      g_array_set_clear_func (extractions, appstream_extraction_clear);
+      for (i = 0; sorted_refs[i] != NULL; i++)
         {
-          const char *ref = key;
+          const char *ref = sorted_refs[i];
+          AppstreamExtraction extraction = { repo, cache_dfd, ref, };
           g_auto(GStrv) split = NULL;
-          g_autoptr(GError) my_error = NULL;
 
           split = flatpak_decompose_ref (ref, NULL);
           if (!split)
@@ -3982,32 +4608,21 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
           if (strcmp (split[2], arch) != 0)
             continue;
 
-          if (!extract_appstream (repo, appstream_root,
-                                  ref, split[1], tmpdir_file,
-                                  cancellable, &my_error))
-            {
-              if (g_str_has_prefix (ref, "app/"))
-                g_print ("No appstream data for %s: %s\n", ref, my_error->message);
-              continue;
-            }
+          extraction.commit = g_hash_table_lookup (all_refs, ref);
+          extraction.id = g_strdup (split[1]);
+          g_array_append_val (extractions, extraction);
         }
 
-      xml_data = flatpak_appstream_xml_root_to_data (appstream_root, error);
-      if (xml_data == NULL)
+      pool = g_thread_pool_new (appstream_extraction_thread, NULL,
+                                g_get_num_processors (), FALSE, error);
+      if (pool == NULL)
         return FALSE;
 
-      appstream_file = g_file_get_child (tmpdir_file, "appstream.xml.gz");
+      for (i = 0; i < extractions->len; i++)
+        g_thread_pool_push (pool, &g_array_index (extractions, AppstreamExtraction, i), NULL);
 
-      if (!g_file_replace_contents (appstream_file,
-                                    g_bytes_get_data (xml_data, NULL),
-                                    g_bytes_get_size (xml_data),
-                                    NULL,
-                                    FALSE,
-                                    G_FILE_CREATE_NONE,
-                                    NULL,
-                                    cancellable,
-                                    error))
-        return FALSE;
+      /* Wait for all the extractions to finish */
+      g_thread_pool_free (pool, FALSE, TRUE);
 
       if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
         return FALSE;
@@ -4018,12 +4633,33 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
         goto out;
 
       mtree = ostree_mutable_tree_new ();
+      if (!flatpak_mtree_create_root (repo, mtree, cancellable, error))
+        goto out;
 
-      modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS |
-                                                  OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CANONICAL_PERMISSIONS,
-                                                  (OstreeRepoCommitFilter) commit_filter, NULL, NULL);
+      for (i = 0; i < extractions->len; i++)
+        {
+          AppstreamExtraction *extraction = &g_array_index (extractions, AppstreamExtraction, i);
 
-      if (!ostree_repo_write_directory_to_mtree (repo, G_FILE (tmpdir_file), mtree, modifier, cancellable, error))
+          if (extraction->fragment == NULL)
+            {
+              if (g_str_has_prefix (extraction->ref, "app/"))
+                g_print ("No appstream data for %s: %s\n", extraction->ref, extraction->error->message);
+              continue;
+            }
+
+          if (!add_appstream_fragment (repo, appstream_root, mtree, extraction->fragment,
+                                       cancellable, error))
+            goto out;
+        }
+
+      xml_data = flatpak_appstream_xml_root_to_data (appstream_root, error);
+      if (xml_data == NULL)
+        goto out;
+
+      if (!mtree_add_file_from_data (repo, mtree, "appstream.xml.gz",
+                                     g_bytes_get_data (xml_data, NULL),
+                                     g_bytes_get_size (xml_data),
+                                     cancellable, error))
         goto out;
 
       if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
@@ -4078,8 +4714,6 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
 
           if (gpg_key_ids)
             {
-              int i;
-
               for (i = 0; gpg_key_ids[i] != NULL; i++)
                 {
                   const char *keyid = gpg_key_ids[i];
@@ -4691,6 +5325,7 @@ flatpak_bundle_get_installed_size (GVariant *bundle, gboolean byte_swap)
 GVariant *
 flatpak_bundle_load (GFile   *file,
                      char   **commit,
+                     char   **from_commit,
                      char   **ref,
                      char   **origin,
                      char   **runtime_repo,
@@ -4747,6 +5382,19 @@ flatpak_bundle_load (GFile   *file,
   if (commit)
     *commit = ostree_checksum_from_bytes_v (to_csum_v);
 
+  if (from_commit)
+    {
+      g_autoptr(GVariant) from_csum_v = g_variant_get_child_value (delta, 2);
+
+      /* Full bundles have no from commit */
+      if (g_variant_n_children (from_csum_v) == 0)
+        *from_commit = NULL;
+      else if (!ostree_validate_structureof_csum_v (from_csum_v, error))
+        return NULL;
+      else
+        *from_commit = ostree_checksum_from_bytes_v (from_csum_v);
+    }
+
   if (installed_size)
     *installed_size = flatpak_bundle_get_installed_size (delta, byte_swap);
 
@@ -4822,6 +5470,7 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
 {
   g_autofree char *metadata_contents = NULL;
   g_autofree char *to_checksum = NULL;
+  g_autofree char *from_checksum = NULL;
 
   g_autoptr(GFile) root = NULL;
   g_autoptr(GFile) metadata_file = NULL;
@@ -4833,7 +5482,7 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
   g_autofree char *remote_collection_id = NULL;
   g_autofree char *collection_id = NULL;
 
-  metadata = flatpak_bundle_load (file, &to_checksum, NULL, NULL, NULL, &metadata_contents, NULL, NULL, &collection_id, error);
+  metadata = flatpak_bundle_load (file, &to_checksum, &from_checksum, NULL, NULL, NULL, &metadata_contents, NULL, NULL, &collection_id, error);
   if (metadata == NULL)
     return FALSE;
 
@@ -4848,6 +5497,20 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
     return flatpak_fail (error, "Collection ‘%s’ of bundle doesn’t match collection ‘%s’ of remote",
                          collection_id, remote_collection_id);
 
+  /* Delta bundles only contain the changes since their from commit */
+  if (from_checksum != NULL)
+    {
+      gboolean has_from_commit;
+
+      if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, from_checksum,
+                                   &has_from_commit, cancellable, error))
+        return FALSE;
+
+      if (!has_from_commit)
+        return flatpak_fail (error, _("Bundle is an update from commit %s, which is not installed"),
+                             from_checksum);
+    }
+
   if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
     return FALSE;
 
@@ -5042,6 +5705,153 @@ flatpak_mirror_image_from_oci (FlatpakOciRegistry *dst_registry,
   return TRUE;
 }
 
+#define OCI_WHITEOUT_PREFIX ".wh."
+#define OCI_WHITEOUT_OPAQUE ".wh..wh..opq"
+
+/* Adds the tree that was written for a single layer to the combined tree
+ * of the image. Later layers replace files from earlier ones, also when
+ * a file becomes a directory or the reverse, while directories keep the
+ * metadata of the layer that created them. Whiteouts remove entries of
+ * the earlier layers, and are not added themselves.
+ *
+ * The combined tree is only built in memory, and nothing has been
+ * checksummed yet, so entries can be dropped from its tables directly. */
+static gboolean
+merge_oci_layer_tree (OstreeRepo        *repo,
+                      OstreeMutableTree *mtree,
+                      const char        *contents_checksum,
+                      const char        *metadata_checksum,
+                      GCancellable      *cancellable,
+                      GError           **error)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) files_v = NULL;
+  g_autoptr(GVariant) dirs_v = NULL;
+  GHashTable *merged_files = ostree_mutable_tree_get_files (mtree);
+  GHashTable *merged_subdirs = ostree_mutable_tree_get_subdirs (mtree);
+  gsize i, n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, contents_checksum,
+                                 &dirtree, error))
+    return FALSE;
+
+  files_v = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files_v);
+
+  /* Whiteouts only apply to the earlier layers, so handle them first */
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+
+      g_variant_get_child (files_v, i, "(&s@ay)", &name, NULL);
+
+      if (strcmp (name, OCI_WHITEOUT_OPAQUE) == 0)
+        {
+          g_hash_table_remove_all (merged_files);
+          g_hash_table_remove_all (merged_subdirs);
+          ostree_mutable_tree_set_metadata_checksum (mtree, metadata_checksum);
+        }
+      else if (g_str_has_prefix (name, OCI_WHITEOUT_PREFIX))
+        {
+          g_hash_table_remove (merged_files, name + strlen (OCI_WHITEOUT_PREFIX));
+          g_hash_table_remove (merged_subdirs, name + strlen (OCI_WHITEOUT_PREFIX));
+        }
+    }
+
+  if (ostree_mutable_tree_get_metadata_checksum (mtree) == NULL)
+    ostree_mutable_tree_set_metadata_checksum (mtree, metadata_checksum);
+
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *checksum = NULL;
+
+      g_variant_get_child (files_v, i, "(&s@ay)", &name, &csum_v);
+      if (g_str_has_prefix (name, OCI_WHITEOUT_PREFIX))
+        continue;
+
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+
+      g_hash_table_remove (merged_subdirs, name);
+      if (!ostree_mutable_tree_replace_file (mtree, name, checksum, error))
+        return FALSE;
+    }
+
+  dirs_v = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs_v);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) contents_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_autofree char *subdir_contents = NULL;
+      g_autofree char *subdir_meta = NULL;
+      g_autoptr(OstreeMutableTree) subdir = NULL;
+
+      g_variant_get_child (dirs_v, i, "(&s@ay@ay)", &name, &contents_csum_v, &meta_csum_v);
+      subdir_contents = ostree_checksum_from_bytes_v (contents_csum_v);
+      subdir_meta = ostree_checksum_from_bytes_v (meta_csum_v);
+
+      g_hash_table_remove (merged_files, name);
+      if (!ostree_mutable_tree_ensure_dir (mtree, name, &subdir, error))
+        return FALSE;
+
+      if (!merge_oci_layer_tree (repo, subdir, subdir_contents, subdir_meta,
+                                 cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* The previous commit of the ref records the tree each of its layers
+ * was imported to, so layers that didn't change need not be fetched again. */
+static GVariant *
+load_previous_oci_layer_trees (OstreeRepo *repo,
+                               const char *full_ref)
+{
+  g_autofree char *old_checksum = NULL;
+  g_autoptr(GVariant) old_commit = NULL;
+  g_autoptr(GVariant) old_metadata = NULL;
+
+  if (!ostree_repo_resolve_rev (repo, full_ref, TRUE, &old_checksum, NULL) ||
+      old_checksum == NULL)
+    return NULL;
+
+  if (!ostree_repo_load_commit (repo, old_checksum, &old_commit, NULL, NULL))
+    return NULL;
+
+  old_metadata = g_variant_get_child_value (old_commit, 0);
+  return g_variant_lookup_value (old_metadata, "xa.oci-layers", G_VARIANT_TYPE ("a{s(ss)}"));
+}
+
+static gboolean
+lookup_previous_oci_layer_tree (OstreeRepo  *repo,
+                                GVariant    *layer_trees,
+                                const char  *digest,
+                                const char **out_contents_checksum,
+                                const char **out_metadata_checksum)
+{
+  gboolean has_contents, has_metadata;
+
+  if (layer_trees == NULL ||
+      !g_variant_lookup (layer_trees, digest, "(&s&s)",
+                         out_contents_checksum, out_metadata_checksum))
+    return FALSE;
+
+  /* The trees are not referenced by any commit, so a prune may have removed them */
+  if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_DIR_TREE, *out_contents_checksum,
+                               &has_contents, NULL, NULL) ||
+      !ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_DIR_META, *out_metadata_checksum,
+                               &has_metadata, NULL, NULL))
+    return FALSE;
+
+  return has_contents && has_metadata;
+}
 
 char *
 flatpak_pull_from_oci (OstreeRepo   *repo,
@@ -5068,6 +5878,8 @@ flatpak_pull_from_oci (OstreeRepo   *repo,
   FlatpakOciPullProgressData progress_data = { progress_cb, progress_user_data };
   g_autoptr(GVariantBuilder) metadata_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
   g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GVariant) previous_layer_trees = NULL;
+  g_auto(GVariantBuilder) layer_trees_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
   GHashTable *annotations;
   gboolean gpg_verify = FALSE;
   int i;
@@ -5142,6 +5954,14 @@ flatpak_pull_from_oci (OstreeRepo   *repo,
   g_variant_builder_add (metadata_builder, "{s@v}", "xa.alt-id",
                          g_variant_new_variant (g_variant_new_string (digest + strlen("sha256:"))));
 
+  if (remote)
+    full_ref = g_strdup_printf ("%s:%s", remote, ref);
+  else
+    full_ref = g_strdup (ref);
+
+  previous_layer_trees = load_previous_oci_layer_trees (repo, full_ref);
+  g_variant_builder_init (&layer_trees_builder, G_VARIANT_TYPE ("a{s(ss)}"));
+
   if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
     return NULL;
 
@@ -5168,7 +5988,18 @@ flatpak_pull_from_oci (OstreeRepo   *repo,
       g_autoptr(FlatpakAutoArchiveRead) a = NULL;
       glnx_autofd int layer_fd = -1;
       g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+      g_autoptr(OstreeMutableTree) layer_mtree = NULL;
+      g_autoptr(GFile) layer_root = NULL;
       const char *layer_checksum;
+      const char *layer_contents_checksum;
+      const char *layer_metadata_checksum;
+
+      if (lookup_previous_oci_layer_tree (repo, previous_layer_trees, layer->digest,
+                                          &layer_contents_checksum, &layer_metadata_checksum))
+        {
+          g_debug ("Reusing unchanged OCI layer %s", layer->digest);
+          goto merge;
+        }
 
       opts.autocreate_parents = TRUE;
       opts.ignore_unsupported_content = TRUE;
@@ -5190,7 +6021,8 @@ flatpak_pull_from_oci (OstreeRepo   *repo,
       if (!flatpak_archive_read_open_fd_with_checksum (a, layer_fd, checksum, error))
         goto error;
 
-      if (!ostree_repo_import_archive_to_mtree (repo, &opts, a, archive_mtree, NULL, cancellable, error))
+      layer_mtree = ostree_mutable_tree_new ();
+      if (!ostree_repo_import_archive_to_mtree (repo, &opts, a, layer_mtree, NULL, cancellable, error))
         goto error;
 
       if (archive_read_close (a) != ARCHIVE_OK)
@@ -5207,6 +6039,21 @@ flatpak_pull_from_oci (OstreeRepo   *repo,
           goto error;
         }
 
+      if (!ostree_repo_write_mtree (repo, layer_mtree, &layer_root, cancellable, error))
+        goto error;
+
+      layer_contents_checksum = ostree_mutable_tree_get_contents_checksum (layer_mtree);
+      layer_metadata_checksum = ostree_mutable_tree_get_metadata_checksum (layer_mtree);
+
+    merge:
+      if (!merge_oci_layer_tree (repo, archive_mtree,
+                                 layer_contents_checksum, layer_metadata_checksum,
+                                 cancellable, error))
+        goto error;
+
+      g_variant_builder_add (&layer_trees_builder, "{s(ss)}", layer->digest,
+                             layer_contents_checksum, layer_metadata_checksum);
+
       progress_data.pulled_layers++;
       progress_data.previous_layers_size += layer->size;
     }
@@ -5217,6 +6064,9 @@ flatpak_pull_from_oci (OstreeRepo   *repo,
   if (!ostree_repo_file_ensure_resolved ((OstreeRepoFile *) archive_root, error))
     goto error;
 
+  g_variant_builder_add (metadata_builder, "{s@v}", "xa.oci-layers",
+                         g_variant_new_variant (g_variant_builder_end (&layer_trees_builder)));
+
   metadata = g_variant_ref_sink (g_variant_builder_end (metadata_builder));
   if (!ostree_repo_write_commit_with_time (repo,
                                            parent,
@@ -5229,11 +6079,6 @@ flatpak_pull_from_oci (OstreeRepo   *repo,
                                            cancellable, error))
     goto error;
 
-  if (remote)
-    full_ref = g_strdup_printf ("%s:%s", remote, ref);
-  else
-    full_ref = g_strdup (ref);
-
   /* Don’t need to set the collection ID here, since the ref is bound to a
    * collection via its remote. */
   ostree_repo_transaction_set_ref (repo, NULL, full_ref, commit_checksum);
@@ -5909,22 +6754,12 @@ flatpak_complete_partial_ref (FlatpakCompletion *completion,
   cur_parts[2] = arch ? arch : "";
   cur_parts[3] = branch ? branch : "";
 
-  if (remote)
-    {
-      refs = flatpak_dir_find_remote_refs (dir, completion->argv[1],
-                                           (element > 1) ? id : NULL,
-                                           (element > 3) ? branch : NULL,
-                                           (element > 2 )? arch : only_arch,
-                                           matched_kinds, NULL, &error);
-    }
-  else
-    {
-      refs = flatpak_dir_find_installed_refs (dir,
-                                              (element > 1) ? id : NULL,
-                                              (element > 3) ? branch : NULL,
-                                              (element > 2 )? arch : only_arch,
-                                              matched_kinds, &error);
-    }
+  /* This never touches the network, see flatpak_dir_find_indexed_refs() */
+  refs = flatpak_dir_find_indexed_refs (dir, remote,
+                                        (element > 1) ? id : NULL,
+                                        (element > 3) ? branch : NULL,
+                                        (element > 2 )? arch : only_arch,
+                                        matched_kinds, &error);
   if (refs == NULL)
     flatpak_completion_debug ("find refs error: %s", error->message);
   for (i = 0; refs != NULL && refs[i] != NULL; i++)
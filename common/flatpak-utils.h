@@ -63,6 +63,16 @@ typedef void (*FlatpakLoadUriProgress) (guint64 downloaded_bytes,
 
 void flatpak_debug2 (const char *format, ...) G_GNUC_PRINTF(1, 2);
 
+typedef struct _FlatpakTraceSpan FlatpakTraceSpan;
+
+FlatpakTraceSpan *flatpak_trace_begin (const char *name,
+                                       const char *detail);
+void              flatpak_trace_end (FlatpakTraceSpan *span);
+void              flatpak_trace_mark (const char *name,
+                                      const char *detail);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakTraceSpan, flatpak_trace_end)
+
 gint flatpak_strcmp0_ptr (gconstpointer a,
                           gconstpointer b);
 
@@ -132,6 +142,8 @@ void    flatpak_variant_builder_init_from_variant (GVariantBuilder *builder,
 gboolean flatpak_variant_bsearch_str (GVariant   *array,
                                       const char *str,
                                       int        *out_pos);
+gsize    flatpak_variant_lower_bound_str (GVariant   *array,
+                                          const char *str);
 GVariant *flatpak_repo_load_summary (OstreeRepo *repo,
                                      GError **error);
 char **  flatpak_summary_match_subrefs (GVariant   *summary,
@@ -352,6 +364,7 @@ gboolean flatpak_mtree_create_root (OstreeRepo        *repo,
 
 GVariant * flatpak_bundle_load (GFile   *file,
                                 char   **commit,
+                                char   **from_commit,
                                 char   **ref,
                                 char   **origin,
                                 char   **runtime_repo,
@@ -621,6 +634,17 @@ gboolean   flatpak_appstream_xml_migrate (FlatpakXml *source,
                                           GKeyFile   *metadata);
 GBytes *flatpak_appstream_xml_root_to_data (FlatpakXml *appstream_root,
                                             GError    **error);
+gboolean   flatpak_appstream_index_write (const char   *appstream_path,
+                                          const char   *index_path,
+                                          GCancellable *cancellable,
+                                          GError      **error);
+gboolean   flatpak_appstream_index_lookup (const char *index_path,
+                                           const char *component_id,
+                                           char      **out_name,
+                                           char      **out_summary,
+                                           char      **out_icon,
+                                           char     ***out_keywords,
+                                           GError    **error);
 gboolean   flatpak_repo_generate_appstream (OstreeRepo   *repo,
                                             const char  **gpg_key_ids,
                                             const char   *gpg_homedir,
@@ -1,6 +1,6 @@
 #include "config.h"
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 31
 
 #include <glib-unix.h>
 
@@ -15,6 +15,8 @@
 #include <gio/gio.h>
 #include <pthread.h>
 #include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "flatpak-portal-error.h"
 #include "xdp-fuse.h"
@@ -28,6 +30,14 @@
 #define ATTR_CACHE_TIME 60.0
 #define ENTRY_CACHE_TIME 60.0
 
+/* The largest write we ask the kernel to send us in one request, libfuse
+   clamps this to its own buffer size during init */
+#define XDP_FUSE_MAX_WRITE (1024 * 1024)
+
+#define XDP_SET_ATTR_TIMES (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | \
+                            FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW | \
+                            FUSE_SET_ATTR_CTIME)
+
 /* We pretend that the file is hardlinked. This causes most apps to do
    a truncating overwrite, which suits us better, as we do the atomic
    rename ourselves anyway. */
@@ -102,9 +112,13 @@ G_LOCK_DEFINE (inodes);
 
 static GThread *fuse_thread = NULL;
 static struct fuse_session *session = NULL;
-static struct fuse_chan *main_ch = NULL;
+static gboolean session_mounted = FALSE;
 static char *mount_path = NULL;
 static pthread_t fuse_pthread = 0;
+static gboolean use_writeback_cache = FALSE;
+
+/* Bumped whenever the set of documents, apps or permissions changes */
+static gint dir_listing_generation = 0;
 
 static int
 reopen_fd (int fd, int flags)
@@ -114,6 +128,12 @@ reopen_fd (int fd, int flags)
   return open (path, flags | O_CLOEXEC);
 }
 
+static void
+xdp_dir_listings_invalidate (void)
+{
+  g_atomic_int_inc (&dir_listing_generation);
+}
+
 /* Call with inodes lock held */
 static fuse_ino_t
 allocate_inode_unlocked (void)
@@ -152,6 +172,11 @@ get_dir_inode_nr_unlocked (const char *app_id, const char *doc_id)
 
   allocated = allocate_inode_unlocked ();
   g_hash_table_insert (dir_to_inode_nr, g_strdup (dir), (gpointer) allocated);
+
+  /* A new app dir shows up in the by-app listing */
+  if (doc_id == NULL)
+    xdp_dir_listings_invalidate ();
+
   return allocated;
 }
 
@@ -938,29 +963,41 @@ xdp_inode_stat (XdpInode    *inode,
   return 0;
 }
 
+/* Drops refs given to the kernel */
 static void
-xdp_fuse_lookup (fuse_req_t  req,
-                 fuse_ino_t  parent,
-                 const char *name)
+xdp_fuse_forget_one (fuse_ino_t ino, unsigned long nlookup)
 {
-  g_autoptr(XdpInode) parent_inode = NULL;
-  struct fuse_entry_param e = {0};
-  g_autoptr(XdpInode) child_inode = NULL;
-  g_autoptr(FlatpakDbEntry) entry = NULL;
-
-  g_debug ("xdp_fuse_lookup %lx/%s -> ", parent, name);
+  g_autoptr(XdpInode) inode = NULL;
 
-  parent_inode = xdp_inode_lookup (parent);
-  if (parent_inode == NULL)
+  inode = xdp_inode_lookup (ino);
+  if (inode == NULL)
     {
-      g_debug ("xdp_fuse_lookup <- error parent ENOENT");
-      fuse_reply_err (req, ENOENT);
-      return;
+      g_warning ("xdp_fuse_forget, unknown inode");
+    }
+  else
+    {
+      while (nlookup > 0)
+        {
+          xdp_inode_unref (inode);
+          nlookup--;
+        }
     }
+}
+
+/* Resolves name in parent_inode and fills in e. On success the
+   returned entry holds a ref that is given to the kernel and returned
+   in xdp_fuse_forget(), otherwise an errno value is returned */
+static int
+xdp_inode_lookup_entry (XdpInode                *parent_inode,
+                        const char              *name,
+                        struct fuse_entry_param *e)
+{
+  g_autoptr(XdpInode) child_inode = NULL;
+  g_autoptr(FlatpakDbEntry) entry = NULL;
 
   /* Default */
-  e.attr_timeout = ATTR_CACHE_TIME;
-  e.entry_timeout = ENTRY_CACHE_TIME;
+  e->attr_timeout = ATTR_CACHE_TIME;
+  e->entry_timeout = ENTRY_CACHE_TIME;
 
   switch (parent_inode->type)
     {
@@ -998,8 +1035,7 @@ xdp_fuse_lookup (fuse_req_t  req,
         if (entry == NULL)
           {
             g_debug ("xdp_fuse_lookup <- error no parent entry ENOENT");
-            fuse_reply_err (req, ENOENT);
-            return;
+            return ENOENT;
           }
 
         /* Ensure it is alive at least during lookup_child () */
@@ -1010,14 +1046,13 @@ xdp_fuse_lookup (fuse_req_t  req,
         /* We verify in the stat below if the backing file exists */
 
         /* Files can be changed from outside the fuse fs, so don't cache any data */
-        e.attr_timeout = 0;
-        e.entry_timeout = 0;
+        e->attr_timeout = 0;
+        e->entry_timeout = 0;
       }
       break;
 
     case XDP_INODE_DOC_FILE:
-      fuse_reply_err (req, ENOTDIR);
-      return;
+      return ENOTDIR;
 
     default:
       break;
@@ -1026,78 +1061,150 @@ xdp_fuse_lookup (fuse_req_t  req,
   if (child_inode == NULL)
     {
       g_debug ("xdp_fuse_lookup <- error child ENOENT");
+      return ENOENT;
+    }
+
+  if (xdp_inode_stat (child_inode, &e->attr) != 0)
+    return errno;
+
+  e->ino = child_inode->ino;
+
+  xdp_inode_ref (child_inode); /* Ref given to the kernel, returned in xdp_fuse_forget() */
+  return 0;
+}
+
+static void
+xdp_fuse_lookup (fuse_req_t  req,
+                 fuse_ino_t  parent,
+                 const char *name)
+{
+  g_autoptr(XdpInode) parent_inode = NULL;
+  struct fuse_entry_param e = {0};
+  int res;
+
+  g_debug ("xdp_fuse_lookup %lx/%s -> ", parent, name);
+
+  parent_inode = xdp_inode_lookup (parent);
+  if (parent_inode == NULL)
+    {
+      g_debug ("xdp_fuse_lookup <- error parent ENOENT");
       fuse_reply_err (req, ENOENT);
       return;
     }
 
-  if (xdp_inode_stat (child_inode, &e.attr) != 0)
+  res = xdp_inode_lookup_entry (parent_inode, name, &e);
+  if (res != 0)
     {
-      fuse_reply_err (req, errno);
+      fuse_reply_err (req, res);
       return;
     }
 
-  e.ino = child_inode->ino;
-
   g_debug ("xdp_fuse_lookup <- inode %lx", (long) e.ino);
-  xdp_inode_ref (child_inode); /* Ref given to the kernel, returned in xdp_fuse_forget() */
-  fuse_reply_entry (req, &e);
+  if (fuse_reply_entry (req, &e) != 0)
+    xdp_fuse_forget_one (e.ino, 1);
 }
 
 static void
 xdp_fuse_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
 {
-  g_autoptr(XdpInode) inode = NULL;
   g_debug ("xdp_fuse_forget %lx %ld -> ", ino, nlookup);
 
-  inode = xdp_inode_lookup (ino);
-  if (inode == NULL)
-    {
-      g_warning ("xdp_fuse_forget, unknown inode");
-    }
-  else
-    {
-      while (nlookup > 0)
-        {
-          xdp_inode_unref (inode);
-          nlookup--;
-        }
-    }
+  xdp_fuse_forget_one (ino, nlookup);
 
   fuse_reply_none (req);
 }
 
-struct dirbuf
+static void
+xdp_fuse_forget_multi (fuse_req_t                req,
+                       size_t                    count,
+                       struct fuse_forget_data  *forgets)
 {
-  char  *p;
-  size_t size;
-};
+  size_t i;
+
+  g_debug ("xdp_fuse_forget_multi %ld -> ", (long) count);
+
+  for (i = 0; i < count; i++)
+    xdp_fuse_forget_one (forgets[i].ino, forgets[i].nlookup);
+
+  fuse_reply_none (req);
+}
+
+typedef struct
+{
+  char      *name;
+  fuse_ino_t ino;
+  mode_t     mode;
+} XdpDirEntry;
+
+/* The listing of a directory, entry i has readdir offset i + 1. The
+   listings for the root, by-app and app dirs are shared between all
+   opens and rebuilt only when the db changes, see dir_listing_generation */
+typedef struct
+{
+  gint       ref_count; /* atomic */
+  gint       generation;
+  GPtrArray *entries;
+} XdpDirListing;
+
+/* Cached listings, protected by dir_listings lock */
+static XdpDirListing *root_listing;
+static XdpDirListing *by_app_listing;
+static GHashTable *app_listings; /* app id -> XdpDirListing */
+
+G_LOCK_DEFINE (dir_listings);
+
+static void
+xdp_dir_entry_free (XdpDirEntry *entry)
+{
+  g_free (entry->name);
+  g_free (entry);
+}
+
+static XdpDirListing *
+xdp_dir_listing_new (gint generation)
+{
+  XdpDirListing *d = g_new0 (XdpDirListing, 1);
+
+  d->ref_count = 1;
+  d->generation = generation;
+  d->entries = g_ptr_array_new_with_free_func ((GDestroyNotify) xdp_dir_entry_free);
+  return d;
+}
+
+static XdpDirListing *
+xdp_dir_listing_ref (XdpDirListing *d)
+{
+  g_atomic_int_inc (&d->ref_count);
+  return d;
+}
 
 static void
-dirbuf_add (fuse_req_t     req,
-            struct dirbuf *b,
-            const char    *name,
-            fuse_ino_t     ino,
-            mode_t         mode)
+xdp_dir_listing_unref (XdpDirListing *d)
 {
-  struct stat stbuf;
+  if (!g_atomic_int_dec_and_test (&d->ref_count))
+    return;
+
+  g_ptr_array_unref (d->entries);
+  g_free (d);
+}
 
-  size_t oldsize = b->size;
+static void
+xdp_dir_listing_add (XdpDirListing *d,
+                     const char    *name,
+                     fuse_ino_t     ino,
+                     mode_t         mode)
+{
+  XdpDirEntry *entry = g_new0 (XdpDirEntry, 1);
 
-  b->size += fuse_add_direntry (req, NULL, 0, name, NULL, 0);
-  b->p = (char *) g_realloc (b->p, b->size);
-  memset (&stbuf, 0, sizeof (stbuf));
-  stbuf.st_ino = ino;
-  stbuf.st_mode = mode;
-  fuse_add_direntry (req, b->p + oldsize,
-                     b->size - oldsize,
-                     name, &stbuf,
-                     b->size);
+  entry->name = g_strdup (name);
+  entry->ino = ino;
+  entry->mode = mode;
+  g_ptr_array_add (d->entries, entry);
 }
 
 static void
-dirbuf_add_docs (fuse_req_t     req,
-                 struct dirbuf *b,
-                 const char    *app_id)
+xdp_dir_listing_add_docs (XdpDirListing *d,
+                          const char    *app_id)
 {
   g_auto(GStrv) docs = NULL;
   fuse_ino_t ino;
@@ -1114,31 +1221,203 @@ dirbuf_add_docs (fuse_req_t     req,
             continue;
         }
       ino = get_dir_inode_nr (app_id, docs[i]);
-      dirbuf_add (req, b, docs[i], ino, S_IFDIR);
+      xdp_dir_listing_add (d, docs[i], ino, S_IFDIR);
     }
 }
 
-static int
-reply_buf_limited (fuse_req_t  req,
-                   const char *buf,
-                   size_t      bufsize,
-                   off_t       off,
-                   size_t      maxsize)
-{
-  if (off < bufsize)
-    return fuse_reply_buf (req, buf + off,
-                           MIN (bufsize - off, maxsize));
+static XdpDirListing *
+xdp_dir_listing_build (XdpInode *inode, gint generation)
+{
+  XdpDirListing *d = xdp_dir_listing_new (generation);
+
+  switch (inode->type)
+    {
+    case XDP_INODE_ROOT:
+      xdp_dir_listing_add (d, ".", ROOT_INODE, S_IFDIR);
+      xdp_dir_listing_add (d, "..", ROOT_INODE, S_IFDIR);
+      xdp_dir_listing_add (d, BY_APP_NAME, BY_APP_INODE, S_IFDIR);
+      xdp_dir_listing_add_docs (d, NULL);
+      break;
+
+    case XDP_INODE_BY_APP:
+      {
+        g_auto(GStrv) db_app_ids = NULL;
+        g_auto(GStrv) app_ids = NULL;
+        int i;
+
+        xdp_dir_listing_add (d, ".", BY_APP_INODE, S_IFDIR);
+        xdp_dir_listing_add (d, "..", ROOT_INODE, S_IFDIR);
+
+        /* Ensure that all apps from db are allocated */
+        db_app_ids = xdp_list_apps ();
+        allocate_app_dir_inode_nr (db_app_ids);
+
+        /* But return all allocated dirs. We might have app dirs
+           that have no permissions, and are thus not in the db */
+        app_ids = get_allocated_app_dirs ();
+        for (i = 0; app_ids[i] != NULL; i++)
+          xdp_dir_listing_add (d, app_ids[i],
+                               get_dir_inode_nr (app_ids[i], NULL), S_IFDIR);
+      }
+      break;
+
+    case XDP_INODE_APP_DIR:
+      xdp_dir_listing_add (d, ".", inode->ino, S_IFDIR);
+      xdp_dir_listing_add (d, "..", BY_APP_INODE, S_IFDIR);
+      xdp_dir_listing_add_docs (d, inode->app_id);
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return d;
+}
+
+/* Returns the shared listing for a root, by-app or app dir, rebuilding
+   it if the db changed since it was last built */
+static XdpDirListing *
+xdp_dir_listing_get_cached (XdpInode *inode)
+{
+  XdpDirListing **cachep = NULL;
+  XdpDirListing *d;
+  gint generation;
+
+  AUTOLOCK (dir_listings);
+
+  generation = g_atomic_int_get (&dir_listing_generation);
+
+  switch (inode->type)
+    {
+    case XDP_INODE_ROOT:
+      cachep = &root_listing;
+      break;
+
+    case XDP_INODE_BY_APP:
+      cachep = &by_app_listing;
+      break;
+
+    case XDP_INODE_APP_DIR:
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  if (cachep != NULL)
+    d = *cachep;
+  else
+    d = g_hash_table_lookup (app_listings, inode->app_id);
+
+  if (d != NULL && d->generation == generation)
+    return xdp_dir_listing_ref (d);
+
+  /* Any change while we build this bumps the generation, so
+     we never keep a stale listing around as current */
+  d = xdp_dir_listing_build (inode, generation);
+
+  if (cachep != NULL)
+    {
+      if (*cachep != NULL)
+        xdp_dir_listing_unref (*cachep);
+      *cachep = xdp_dir_listing_ref (d);
+    }
   else
-    return fuse_reply_buf (req, NULL, 0);
+    {
+      g_hash_table_replace (app_listings, g_strdup (inode->app_id),
+                            xdp_dir_listing_ref (d));
+    }
+
+  return d;
+}
+
+static gboolean
+is_dot_or_dotdot (const char *name)
+{
+  return strcmp (name, ".") == 0 || strcmp (name, "..") == 0;
 }
 
 static void
 xdp_fuse_readdir (fuse_req_t req, fuse_ino_t ino, size_t size,
                   off_t off, struct fuse_file_info *fi)
 {
-  struct dirbuf *b = (struct dirbuf *) (gsize) (fi->fh);
+  XdpDirListing *d = (XdpDirListing *) (gsize) (fi->fh);
+  g_autofree char *buf = g_malloc (size);
+  size_t pos = 0;
+  guint i;
+
+  for (i = off; i < d->entries->len; i++)
+    {
+      XdpDirEntry *entry = g_ptr_array_index (d->entries, i);
+      struct stat stbuf = { 0 };
+      size_t entsize;
+
+      stbuf.st_ino = entry->ino;
+      stbuf.st_mode = entry->mode;
+      entsize = fuse_add_direntry (req, buf + pos, size - pos,
+                                   entry->name, &stbuf, i + 1);
+      if (entsize > size - pos)
+        break;
+      pos += entsize;
+    }
+
+  fuse_reply_buf (req, buf, pos);
+}
+
+/* Like readdir, but also returns the attributes of each entry, which
+   saves the kernel a lookup per entry when listing a directory. Every
+   entry except . and .. counts as a lookup, so we hand out a ref for it */
+static void
+xdp_fuse_readdirplus (fuse_req_t req, fuse_ino_t ino, size_t size,
+                      off_t off, struct fuse_file_info *fi)
+{
+  XdpDirListing *d = (XdpDirListing *) (gsize) (fi->fh);
+  g_autoptr(XdpInode) inode = NULL;
+  g_autofree char *buf = NULL;
+  size_t pos = 0;
+  guint i;
+
+  g_debug ("xdp_fuse_readdirplus %lx %ld", ino, (long) off);
+
+  inode = xdp_inode_lookup (ino);
+  if (inode == NULL)
+    {
+      g_debug ("xdp_fuse_readdirplus <- error ENOENT");
+      fuse_reply_err (req, ENOENT);
+      return;
+    }
+
+  buf = g_malloc (size);
+
+  for (i = off; i < d->entries->len; i++)
+    {
+      XdpDirEntry *entry = g_ptr_array_index (d->entries, i);
+      struct fuse_entry_param e = { 0 };
+      size_t entsize;
+
+      if (is_dot_or_dotdot (entry->name))
+        {
+          e.attr.st_ino = entry->ino;
+          e.attr.st_mode = entry->mode;
+        }
+      else if (xdp_inode_lookup_entry (inode, entry->name, &e) != 0)
+        {
+          /* Removed since opendir */
+          continue;
+        }
 
-  reply_buf_limited (req, b->p, b->size, off, size);
+      entsize = fuse_add_direntry_plus (req, buf + pos, size - pos,
+                                        entry->name, &e, i + 1);
+      if (entsize > size - pos)
+        {
+          if (e.ino != 0)
+            xdp_fuse_forget_one (e.ino, 1);
+          break;
+        }
+      pos += entsize;
+    }
+
+  fuse_reply_buf (req, buf, pos);
 }
 
 static void
@@ -1147,7 +1426,7 @@ xdp_fuse_opendir (fuse_req_t             req,
                   struct fuse_file_info *fi)
 {
   g_autoptr(XdpInode) inode = NULL;
-  struct dirbuf b = {0};
+  XdpDirListing *d;
 
   g_debug ("xdp_fuse_opendir %lx", ino);
 
@@ -1162,43 +1441,14 @@ xdp_fuse_opendir (fuse_req_t             req,
   switch (inode->type)
     {
     case XDP_INODE_ROOT:
-      dirbuf_add (req, &b, ".", ROOT_INODE, S_IFDIR);
-      dirbuf_add (req, &b, "..", ROOT_INODE, S_IFDIR);
-      dirbuf_add (req, &b, BY_APP_NAME, BY_APP_INODE, S_IFDIR);
-      dirbuf_add_docs (req, &b, NULL);
-      break;
-
     case XDP_INODE_BY_APP:
-      {
-        g_auto(GStrv) db_app_ids = NULL;
-        g_auto(GStrv) app_ids = NULL;
-        int i;
-
-        dirbuf_add (req, &b, ".", BY_APP_INODE, S_IFDIR);
-        dirbuf_add (req, &b, "..", ROOT_INODE, S_IFDIR);
-
-        /* Ensure that all apps from db are allocated */
-        db_app_ids = xdp_list_apps ();
-        allocate_app_dir_inode_nr (db_app_ids);
-
-        /* But return all allocated dirs. We might have app dirs
-           that have no permissions, and are thus not in the db */
-        app_ids = get_allocated_app_dirs ();
-        for (i = 0; app_ids[i] != NULL; i++)
-          dirbuf_add (req, &b, app_ids[i],
-                      get_dir_inode_nr (app_ids[i], NULL), S_IFDIR);
-      }
-      break;
-
     case XDP_INODE_APP_DIR:
-      dirbuf_add (req, &b, ".", inode->ino, S_IFDIR);
-      dirbuf_add (req, &b, "..", BY_APP_INODE, S_IFDIR);
-      dirbuf_add_docs (req, &b, inode->app_id);
+      d = xdp_dir_listing_get_cached (inode);
       break;
 
     case XDP_INODE_DOC_FILE:
       fuse_reply_err (req, ENOTDIR);
-      break;
+      return;
 
     case XDP_INODE_APP_DOC_DIR:
     case XDP_INODE_DOC_DIR:
@@ -1211,11 +1461,15 @@ xdp_fuse_opendir (fuse_req_t             req,
         if (entry == NULL)
           {
             fuse_reply_err (req, ENOENT);
-            break;
+            return;
           }
 
-        dirbuf_add (req, &b, ".", inode->ino, S_IFDIR);
-        dirbuf_add (req, &b, "..", inode->parent->ino, S_IFDIR);
+        /* The document dirs are small and their contents can change
+           without the db changing, so these are never cached */
+        d = xdp_dir_listing_new (0);
+
+        xdp_dir_listing_add (d, ".", inode->ino, S_IFDIR);
+        xdp_dir_listing_add (d, "..", inode->parent->ino, S_IFDIR);
 
         /* Ensure it is alive at least during list_children () */
         doc_inode = xdp_inode_ensure_document_file (inode);
@@ -1228,7 +1482,7 @@ xdp_fuse_opendir (fuse_req_t             req,
             XdpInode *child = l->data;
             g_autofree char *filename = xdp_inode_get_filename (child);
             if (filename != NULL && xdp_inode_stat (child, &stbuf) == 0)
-              dirbuf_add (req, &b, filename, child->ino, stbuf.st_mode);
+              xdp_dir_listing_add (d, filename, child->ino, stbuf.st_mode);
             xdp_inode_unref (child);
           }
         g_list_free (children);
@@ -1239,15 +1493,9 @@ xdp_fuse_opendir (fuse_req_t             req,
       g_assert_not_reached ();
     }
 
-  if (b.p != NULL)
-    {
-      fi->fh = (gsize) g_memdup (&b, sizeof (b));
-      if (fuse_reply_open (req, fi) == -ENOENT)
-        {
-          g_free (b.p);
-          g_free ((gpointer) (gsize) (fi->fh));
-        }
-    }
+  fi->fh = (gsize) d;
+  if (fuse_reply_open (req, fi) != 0)
+    xdp_dir_listing_unref (d);
 }
 
 static void
@@ -1255,10 +1503,9 @@ xdp_fuse_releasedir (fuse_req_t             req,
                      fuse_ino_t             ino,
                      struct fuse_file_info *fi)
 {
-  struct dirbuf *b = (struct dirbuf *) (gsize) (fi->fh);
+  XdpDirListing *d = (XdpDirListing *) (gsize) (fi->fh);
 
-  g_free (b->p);
-  g_free (b);
+  xdp_dir_listing_unref (d);
   fuse_reply_err (req, 0);
 }
 
@@ -1801,7 +2048,17 @@ xdp_fuse_setattr (fuse_req_t             req,
 
   can_write = app_can_write_doc (entry, inode->app_id);
 
-  if (to_set == FUSE_SET_ATTR_SIZE)
+  /* With the writeback cache enabled the kernel sends time updates
+     along with (or instead of) size changes, so handle each attribute
+     separately */
+  if ((to_set & ~(FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_MODE | XDP_SET_ATTR_TIMES)) != 0)
+    {
+      g_debug ("xdp_fuse_setattr <- unsupported attributes ENOSYS");
+      fuse_reply_err (req, ENOSYS);
+      return;
+    }
+
+  if (to_set & FUSE_SET_ATTR_SIZE)
     {
       g_mutex_lock (&inode->mutex);
 
@@ -1858,8 +2115,11 @@ xdp_fuse_setattr (fuse_req_t             req,
         }
       g_mutex_unlock (&inode->mutex);
     }
-  else if (to_set == FUSE_SET_ATTR_MODE)
+
+  if (res == 0 && (to_set & FUSE_SET_ATTR_MODE))
     {
+      g_mutex_lock (&inode->mutex);
+
       if (!can_write)
         {
           res = EACCES;
@@ -1871,10 +2131,44 @@ xdp_fuse_setattr (fuse_req_t             req,
               fchmod (fd, get_user_perms (attr)) != 0)
             res = errno;
         }
+
+      g_mutex_unlock (&inode->mutex);
     }
-  else
+
+  if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
     {
-      res = ENOSYS;
+      struct timespec times[2];
+
+      times[0].tv_sec = 0;
+      times[0].tv_nsec = UTIME_OMIT;
+      times[1].tv_sec = 0;
+      times[1].tv_nsec = UTIME_OMIT;
+
+      if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+        times[0].tv_nsec = UTIME_NOW;
+      else if (to_set & FUSE_SET_ATTR_ATIME)
+        times[0] = attr->st_atim;
+
+      if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+        times[1].tv_nsec = UTIME_NOW;
+      else if (to_set & FUSE_SET_ATTR_MTIME)
+        times[1] = attr->st_mtim;
+
+      g_mutex_lock (&inode->mutex);
+
+      if (!can_write)
+        {
+          res = EACCES;
+        }
+      else
+        {
+          int fd = xdp_inode_locked_get_write_fd (inode);
+          if (fd == -1 ||
+              futimens (fd, times) != 0)
+            res = errno;
+        }
+
+      g_mutex_unlock (&inode->mutex);
     }
 
   if (res != 0)
@@ -1963,6 +2257,91 @@ xdp_fuse_write_buf (fuse_req_t             req,
   g_mutex_unlock (&inode->mutex);
 }
 
+#if FUSE_VERSION >= FUSE_MAKE_VERSION (3, 4)
+static ssize_t
+do_copy_file_range (int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+                    size_t len, unsigned int flags)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+  return copy_file_range (fd_in, off_in, fd_out, off_out, len, flags);
+#elif defined(__NR_copy_file_range)
+  return syscall (__NR_copy_file_range, fd_in, off_in, fd_out, off_out, len, flags);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* Lets the kernel copy between two documents (or within one) on the
+   backing filesystem, rather than passing every byte through us. Falls
+   back to read/write in the kernel if we return an error */
+static void
+xdp_fuse_copy_file_range (fuse_req_t             req,
+                          fuse_ino_t             ino_in,
+                          off_t                  off_in,
+                          struct fuse_file_info *fi_in,
+                          fuse_ino_t             ino_out,
+                          off_t                  off_out,
+                          struct fuse_file_info *fi_out,
+                          size_t                 len,
+                          int                    flags)
+{
+  XdpFile *file_in = (gpointer) (gsize) fi_in->fh;
+  XdpFile *file_out = (gpointer) (gsize) fi_out->fh;
+  XdpInode *inode_in = file_in->inode;
+  XdpInode *inode_out = file_out->inode;
+  XdpInode *first, *second;
+  loff_t loff_in = off_in;
+  loff_t loff_out = off_out;
+  int fd_in, fd_out;
+  ssize_t res = 0;
+  int errsv = 0;
+
+  g_debug ("xdp_fuse_copy_file_range %lx %ld -> %lx %ld %ld", ino_in, (long) off_in,
+           ino_out, (long) off_out, (long) len);
+
+  /* Lock in a stable order to avoid deadlocking against a copy in the
+     other direction */
+  first = MIN (inode_in, inode_out);
+  second = MAX (inode_in, inode_out);
+
+  g_mutex_lock (&first->mutex);
+  if (second != first)
+    g_mutex_lock (&second->mutex);
+
+  fd_in = xdp_inode_locked_get_fd (inode_in);
+  fd_out = xdp_inode_locked_get_write_fd (inode_out);
+  if (fd_in == -1)
+    {
+      errsv = EBADF;
+    }
+  else if (fd_out == -1)
+    {
+      errsv = errno;
+    }
+  else
+    {
+      res = do_copy_file_range (fd_in, &loff_in, fd_out, &loff_out, len, flags);
+      if (res < 0)
+        errsv = errno;
+    }
+
+  if (second != first)
+    g_mutex_unlock (&second->mutex);
+  g_mutex_unlock (&first->mutex);
+
+  if (errsv != 0)
+    {
+      g_debug ("xdp_fuse_copy_file_range <- error %s", strerror (errsv));
+      fuse_reply_err (req, errsv);
+    }
+  else
+    {
+      fuse_reply_write (req, res);
+    }
+}
+#endif
+
 static void
 xdp_fuse_fsync (fuse_req_t             req,
                 fuse_ino_t             ino,
@@ -2043,13 +2422,21 @@ xdp_fuse_rename (fuse_req_t  req,
                  fuse_ino_t  parent,
                  const char *name,
                  fuse_ino_t  newparent,
-                 const char *newname)
+                 const char *newname,
+                 unsigned int flags)
 {
   g_autoptr(XdpInode) parent_inode = NULL;
   g_autoptr(FlatpakDbEntry) entry = NULL;
   gboolean can_see, can_write;
 
-  g_debug ("xdp_fuse_rename %lx/%s -> %lx/%s", parent, name, newparent, newname);
+  g_debug ("xdp_fuse_rename %lx/%s -> %lx/%s (%x)", parent, name, newparent, newname, flags);
+
+  /* RENAME_NOREPLACE and RENAME_EXCHANGE are not supported */
+  if (flags != 0)
+    {
+      fuse_reply_err (req, EINVAL);
+      return;
+    }
 
   parent_inode = xdp_inode_lookup (parent);
   if (parent_inode == NULL)
@@ -2196,12 +2583,38 @@ xdp_fuse_access (fuse_req_t req, fuse_ino_t ino, int mask)
   fuse_reply_err (req, 0);
 }
 
+static void
+xdp_fuse_init_conn (void                  *userdata,
+                    struct fuse_conn_info *conn)
+{
+  unsigned int wanted = FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE |
+                        FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO |
+                        FUSE_CAP_PARALLEL_DIROPS;
+
+  /* The backing files can be changed by the host at any time, and with
+     the writeback cache the kernel trusts its own idea of size and mtime,
+     so this is only done when explicitly requested */
+  if (use_writeback_cache)
+    wanted |= FUSE_CAP_WRITEBACK_CACHE;
+
+  conn->want |= conn->capable & wanted;
+
+  /* libfuse lowers this to what its buffers can take */
+  conn->max_write = XDP_FUSE_MAX_WRITE;
+
+  g_debug ("fuse init: max_write %u max_readahead %u%s", conn->max_write, conn->max_readahead,
+           (conn->want & FUSE_CAP_WRITEBACK_CACHE) ? " writeback" : "");
+}
+
 static struct fuse_lowlevel_ops xdp_fuse_oper = {
+  .init         = xdp_fuse_init_conn,
   .lookup       = xdp_fuse_lookup,
   .forget       = xdp_fuse_forget,
+  .forget_multi = xdp_fuse_forget_multi,
   .getattr      = xdp_fuse_getattr,
   .opendir      = xdp_fuse_opendir,
   .readdir      = xdp_fuse_readdir,
+  .readdirplus  = xdp_fuse_readdirplus,
   .releasedir   = xdp_fuse_releasedir,
   .fsyncdir     = xdp_fuse_fsyncdir,
   .open         = xdp_fuse_open,
@@ -2215,6 +2628,9 @@ static struct fuse_lowlevel_ops xdp_fuse_oper = {
   .unlink       = xdp_fuse_unlink,
   .rename       = xdp_fuse_rename,
   .access       = xdp_fuse_access,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION (3, 4)
+  .copy_file_range = xdp_fuse_copy_file_range,
+#endif
 };
 
 /* Called when a apps permissions to see a document is changed,
@@ -2229,27 +2645,29 @@ xdp_fuse_invalidate_doc_app (const char *doc_id,
 
   /* This can happen if fuse is not initialized yet for the very
      first dbus message that activated the service */
-  if (main_ch == NULL)
+  if (!session_mounted)
     return;
 
   g_debug ("invalidate %s/%s", doc_id, opt_app_id ? opt_app_id : "*");
 
+  xdp_dir_listings_invalidate ();
+
   AUTOLOCK (inodes);
   ino = get_dir_inode_nr_unlocked (opt_app_id, doc_id);
   inode = xdp_inode_lookup_unlocked (ino);
   if (inode != NULL)
     {
-      fuse_lowlevel_notify_inval_inode (main_ch, inode->ino, 0, 0);
-      fuse_lowlevel_notify_inval_entry (main_ch, inode->parent->ino,
+      fuse_lowlevel_notify_inval_inode (session, inode->ino, 0, 0);
+      fuse_lowlevel_notify_inval_entry (session, inode->parent->ino,
                                         inode->filename, strlen (inode->filename));
 
       for (l = inode->children; l != NULL; l = l->next)
         {
           XdpInode *child = l->data;
 
-          fuse_lowlevel_notify_inval_inode (main_ch, child->ino, 0, 0);
+          fuse_lowlevel_notify_inval_inode (session, child->ino, 0, 0);
           if (child->filename != NULL)
-            fuse_lowlevel_notify_inval_entry (main_ch, inode->ino,
+            fuse_lowlevel_notify_inval_entry (session, inode->ino,
                                               child->filename, strlen (child->filename));
         }
     }
@@ -2271,6 +2689,12 @@ xdp_fuse_lookup_id_for_inode (ino_t ino)
   return g_strdup (inode->doc_id);
 }
 
+void
+xdp_fuse_set_writeback_cache (gboolean enable)
+{
+  use_writeback_cache = enable;
+}
+
 const char *
 xdp_fuse_get_mountpoint (void)
 {
@@ -2297,18 +2721,18 @@ xdp_fuse_mainloop (gpointer data)
 {
   fuse_pthread = pthread_self ();
 
-  fuse_session_loop_mt (session);
+  fuse_session_loop_mt (session, 0);
 
-  fuse_session_remove_chan (main_ch);
+  session_mounted = FALSE;
+  fuse_session_unmount (session);
   fuse_session_destroy (session);
-  fuse_unmount (mount_path, main_ch);
   return NULL;
 }
 
 gboolean
 xdp_fuse_init (GError **error)
 {
-  char *argv[] = { "xdp-fuse", "-osplice_write,splice_move" };
+  char *argv[] = { "xdp-fuse" };
   struct fuse_args args = FUSE_ARGS_INIT (G_N_ELEMENTS (argv), argv);
   struct stat st;
   struct statfs stfs;
@@ -2321,6 +2745,8 @@ xdp_fuse_init (GError **error)
   by_app_inode = xdp_inode_new (BY_APP_INODE, XDP_INODE_BY_APP, root_inode, BY_APP_NAME, NULL, NULL);
   dir_to_inode_nr =
     g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  app_listings =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) xdp_dir_listing_unref);
 
   path = xdp_fuse_get_mountpoint ();
   if ((stat (path, &st) == -1 && errno == ENOTCONN) ||
@@ -2328,7 +2754,7 @@ xdp_fuse_init (GError **error)
        (statfs_res == 0 && stfs.f_type == 0x65735546 /* fuse */)))
     {
       int count;
-      char *umount_argv[] = { "fusermount", "-u", "-z", (char *) path, NULL };
+      char *umount_argv[] = { "fusermount3", "-u", "-z", (char *) path, NULL };
 
       g_spawn_sync (NULL, umount_argv, NULL, G_SPAWN_SEARCH_PATH,
                     NULL, NULL, NULL, NULL, NULL, NULL);
@@ -2346,22 +2772,23 @@ xdp_fuse_init (GError **error)
       return FALSE;
     }
 
-  main_ch = fuse_mount (path, &args);
-  if (main_ch == NULL)
+  session = fuse_session_new (&args, &xdp_fuse_oper,
+                              sizeof (xdp_fuse_oper), NULL);
+  if (session == NULL)
     {
-      g_set_error (error, FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_FAILED, "Can't mount fuse fs");
+      g_set_error (error, FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_FAILED,
+                   "Can't create fuse session");
       return FALSE;
     }
 
-  session = fuse_lowlevel_new (&args, &xdp_fuse_oper,
-                               sizeof (xdp_fuse_oper), NULL);
-  if (session == NULL)
+  if (fuse_session_mount (session, path) != 0)
     {
-      g_set_error (error, FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_FAILED,
-                   "Can't create fuse session");
+      g_set_error (error, FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_FAILED, "Can't mount fuse fs");
+      fuse_session_destroy (session);
+      session = NULL;
       return FALSE;
     }
-  fuse_session_add_chan (session, main_ch);
+  session_mounted = TRUE;
 
   fuse_thread = g_thread_new ("fuse mainloop", xdp_fuse_mainloop, session);
 
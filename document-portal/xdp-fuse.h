@@ -12,6 +12,7 @@ FlatpakDbEntry *xdp_lookup_doc (const char *doc_id);
 
 gboolean    xdp_fuse_init (GError **error);
 void        xdp_fuse_exit (void);
+void        xdp_fuse_set_writeback_cache (gboolean enable);
 const char *xdp_fuse_get_mountpoint (void);
 void        xdp_fuse_invalidate_doc_app (const char *doc_id,
                                          const char *opt_app_id);
@@ -1118,6 +1118,7 @@ on_name_acquired (GDBusConnection *connection,
 
   g_debug ("%s acquired", name);
 
+  xdp_fuse_set_writeback_cache (opt_writeback_cache);
   if (!xdp_fuse_init (&exit_error))
     {
       final_exit_status = 6;
@@ -1215,12 +1216,14 @@ static gboolean opt_verbose;
 static gboolean opt_daemon;
 static gboolean opt_replace;
 static gboolean opt_version;
+static gboolean opt_writeback_cache;
 
 static GOptionEntry entries[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information", NULL },
   { "daemon", 'd', 0, G_OPTION_ARG_NONE, &opt_daemon, "Run in background", NULL },
   { "replace", 'r', 0, G_OPTION_ARG_NONE, &opt_replace, "Replace", NULL },
   { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version and exit", NULL },
+  { "writeback-cache", 0, 0, G_OPTION_ARG_NONE, &opt_writeback_cache, "Enable the fuse writeback cache (unsafe if documents change on the host)", NULL },
   { NULL }
 };
 
@@ -288,7 +288,7 @@ flatpak_bundle_ref_new (GFile   *file,
   guint64 installed_size;
   g_autofree char *collection_id = NULL;
 
-  metadata = flatpak_bundle_load (file, &commit, &full_ref, &origin, &runtime_repo, &metadata_contents, &installed_size,
+  metadata = flatpak_bundle_load (file, &commit, NULL, &full_ref, &origin, &runtime_repo, &metadata_contents, &installed_size,
                                   NULL, &collection_id, error);
   if (metadata == NULL)
     return NULL;
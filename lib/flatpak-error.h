@@ -32,13 +32,16 @@ G_BEGIN_DECLS
  * @FLATPAK_ERROR_NOT_INSTALLED: App/runtime is not installed
  * @FLATPAK_ERROR_ONLY_PULLED: App/runtime was only pulled into the local
  *                             repository but not installed.
+ * @FLATPAK_ERROR_CHANGES_EXPIRED: The requested changes are no longer in the
+ *                                 change log of the installation (Since: 0.10.0)
  *
  * Error codes for library functions.
  */
 typedef enum {
   FLATPAK_ERROR_ALREADY_INSTALLED,
   FLATPAK_ERROR_NOT_INSTALLED,
-  FLATPAK_ERROR_ONLY_PULLED
+  FLATPAK_ERROR_ONLY_PULLED,
+  FLATPAK_ERROR_CHANGES_EXPIRED,
 } FlatpakError;
 
 #define FLATPAK_ERROR flatpak_error_quark ()
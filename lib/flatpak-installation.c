@@ -31,6 +31,7 @@
 #include "flatpak-installation.h"
 #include "flatpak-installed-ref-private.h"
 #include "flatpak-related-ref-private.h"
+#include "flatpak-ref-change-private.h"
 #include "flatpak-remote-private.h"
 #include "flatpak-remote-ref-private.h"
 #include "flatpak-enum-types.h"
@@ -66,8 +67,17 @@ struct _FlatpakInstallationPrivate
      flatpak_installation_drop_caches(), so every user needs to keep its own reference alive until
      done. */
   FlatpakDir *dir_unlocked;
+
+  /* The _async operations are queued on this pool, and all share the
+     async_dir copy of the dir, which is also protected by the dir lock */
+  GThreadPool *async_pool;
+  FlatpakDir *async_dir;
 };
 
+/* Pulls on the shared async_dir are not threadsafe, so the async
+   operations run one at a time */
+#define ASYNC_OP_MAX_THREADS 1
+
 G_DEFINE_TYPE_WITH_PRIVATE (FlatpakInstallation, flatpak_installation, G_TYPE_OBJECT)
 
 enum {
@@ -79,6 +89,30 @@ no_progress_cb (OstreeAsyncProgress *progress, gpointer user_data)
 {
 }
 
+/* If @out_ostree_progress is given it is set to the (unowned) progress
+ * object, so the async operations can also report the raw transfer
+ * counters. It stays valid until the operation finishes it. */
+static OstreeAsyncProgress *
+installation_progress_new (FlatpakProgressCallback progress,
+                           gpointer                progress_data,
+                           OstreeAsyncProgress   **out_ostree_progress)
+{
+  OstreeAsyncProgress *ostree_progress;
+
+  if (progress == NULL)
+    ostree_progress = ostree_async_progress_new_and_connect (no_progress_cb, NULL);
+  else
+    ostree_progress = flatpak_progress_new (progress, progress_data);
+
+  if (out_ostree_progress)
+    *out_ostree_progress = ostree_progress;
+
+  return ostree_progress;
+}
+
+G_DEFINE_BOXED_TYPE (FlatpakProgressEvent, flatpak_progress_event,
+                     flatpak_progress_event_copy, flatpak_progress_event_free)
+
 static void
 flatpak_installation_finalize (GObject *object)
 {
@@ -86,6 +120,10 @@ flatpak_installation_finalize (GObject *object)
   FlatpakInstallationPrivate *priv = flatpak_installation_get_instance_private (self);
 
   g_object_unref (priv->dir_unlocked);
+  g_clear_object (&priv->async_dir);
+  /* Every queued operation holds a reference on us, so the pool is
+     idle, but we may be running in its last worker thread */
+  g_thread_pool_free (priv->async_pool, FALSE, FALSE);
 
   G_OBJECT_CLASS (flatpak_installation_parent_class)->finalize (object);
 }
@@ -131,9 +169,16 @@ flatpak_installation_class_init (FlatpakInstallationClass *klass)
 
 }
 
+static void async_op_pool_func (gpointer data,
+                                gpointer user_data);
+
 static void
 flatpak_installation_init (FlatpakInstallation *self)
 {
+  FlatpakInstallationPrivate *priv = flatpak_installation_get_instance_private (self);
+
+  priv->async_pool = g_thread_pool_new (async_op_pool_func, NULL,
+                                        ASYNC_OP_MAX_THREADS, FALSE, NULL);
 }
 
 static FlatpakInstallation *
@@ -346,6 +391,53 @@ flatpak_installation_get_dir (FlatpakInstallation *self)
   return dir;
 }
 
+/* Returns the dir the async operations share, made on first use */
+static FlatpakDir *
+flatpak_installation_get_async_dir (FlatpakInstallation *self,
+                                    GCancellable        *cancellable,
+                                    GError             **error)
+{
+  FlatpakInstallationPrivate *priv = flatpak_installation_get_instance_private (self);
+  FlatpakDir *dir = NULL;
+
+  G_LOCK (dir);
+
+  if (priv->async_dir == NULL)
+    {
+      g_autoptr(FlatpakDir) clone = flatpak_dir_clone (priv->dir_unlocked);
+
+      if (flatpak_dir_ensure_repo (clone, cancellable, error))
+        priv->async_dir = g_steal_pointer (&clone);
+    }
+
+  if (priv->async_dir != NULL)
+    dir = g_object_ref (priv->async_dir);
+
+  G_UNLOCK (dir);
+
+  return dir;
+}
+
+/* Pull, prune, etc are not threadsafe, so the operations work on a
+   copy of @dir, unless the caller already serializes them on @work_dir */
+static FlatpakDir *
+installation_get_work_dir (FlatpakDir   *dir,
+                           FlatpakDir   *work_dir,
+                           GCancellable *cancellable,
+                           GError      **error)
+{
+  g_autoptr(FlatpakDir) dir_clone = NULL;
+
+  if (work_dir != NULL)
+    return g_object_ref (work_dir);
+
+  dir_clone = flatpak_dir_clone (dir);
+  if (!flatpak_dir_ensure_repo (dir_clone, cancellable, error))
+    return NULL;
+
+  return g_steal_pointer (&dir_clone);
+}
+
 /**
  * flatpak_installation_drop_caches:
  * @self: a #FlatpakInstallation
@@ -375,6 +467,8 @@ flatpak_installation_drop_caches (FlatpakInstallation *self,
     {
       priv->dir_unlocked = clone;
       g_object_unref (old);
+      /* Queued async operations pick up the new dir */
+      g_clear_object (&priv->async_dir);
       res = TRUE;
     }
 
@@ -798,6 +892,81 @@ flatpak_installation_list_installed_refs_by_kind (FlatpakInstallation *self,
   return g_steal_pointer (&refs);
 }
 
+/* Groups @installed by origin, skipping refs from disabled remotes.
+   Returns origin -> GPtrArray of #FlatpakInstalledRef */
+static GHashTable *
+group_installed_refs_by_origin (FlatpakDir *dir,
+                                GPtrArray  *installed)
+{
+  g_autoptr(GHashTable) by_origin = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                           g_free, (GDestroyNotify) g_ptr_array_unref);
+  int i;
+
+  for (i = 0; i < installed->len; i++)
+    {
+      FlatpakInstalledRef *installed_ref = g_ptr_array_index (installed, i);
+      const char *origin = flatpak_installed_ref_get_origin (installed_ref);
+      GPtrArray *refs;
+
+      if (origin == NULL || flatpak_dir_get_remote_disabled (dir, origin))
+        continue;
+
+      refs = g_hash_table_lookup (by_origin, origin);
+      if (refs == NULL)
+        {
+          refs = g_ptr_array_new_with_free_func (g_object_unref);
+          g_hash_table_insert (by_origin, g_strdup (origin), refs);
+        }
+
+      g_ptr_array_add (refs, g_object_ref (installed_ref));
+    }
+
+  return g_steal_pointer (&by_origin);
+}
+
+/* Returns the refs in @installed (all from @remote_name) that have a
+   different commit in the remote. Only the summary entries for the
+   installed refs are looked at. */
+static GPtrArray *
+find_updates_in_remote (FlatpakDir   *dir,
+                        const char   *remote_name,
+                        GPtrArray    *installed,
+                        GCancellable *cancellable,
+                        GError      **error)
+{
+  g_autoptr(GPtrArray) full_refs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) updates = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GHashTable) remote_commits = NULL;
+  int i;
+
+  for (i = 0; i < installed->len; i++)
+    {
+      FlatpakInstalledRef *installed_ref = g_ptr_array_index (installed, i);
+      g_ptr_array_add (full_refs, flatpak_ref_format_ref (FLATPAK_REF (installed_ref)));
+    }
+  g_ptr_array_add (full_refs, NULL);
+
+  remote_commits = flatpak_dir_lookup_remote_commits (dir, remote_name,
+                                                      (const char * const *) full_refs->pdata,
+                                                      cancellable, error);
+  if (remote_commits == NULL)
+    return NULL;
+
+  for (i = 0; i < installed->len; i++)
+    {
+      FlatpakInstalledRef *installed_ref = g_ptr_array_index (installed, i);
+      const char *remote_commit = g_hash_table_lookup (remote_commits,
+                                                       g_ptr_array_index (full_refs, i));
+
+      if (remote_commit != NULL &&
+          g_strcmp0 (remote_commit,
+                     flatpak_installed_ref_get_latest_commit (installed_ref)) != 0)
+        g_ptr_array_add (updates, g_object_ref (installed_ref));
+    }
+
+  return g_steal_pointer (&updates);
+}
+
 /**
  * flatpak_installation_list_installed_refs_for_update:
  * @self: a #FlatpakInstallation
@@ -809,6 +978,9 @@ flatpak_installation_list_installed_refs_by_kind (FlatpakInstallation *self,
  * it can have local updates available that has not been deployed. Look
  * at commit vs latest_commit on installed apps for this.
  *
+ * See flatpak_installation_list_installed_refs_for_update_async() for
+ * a version that checks all remotes concurrently.
+ *
  * Returns: (transfer container) (element-type FlatpakInstalledRef): an GPtrArray of
  *   #FlatpakInstalledRef instances
  */
@@ -817,74 +989,287 @@ flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
                                                      GCancellable        *cancellable,
                                                      GError             **error)
 {
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
   g_autoptr(GPtrArray) updates = NULL;
   g_autoptr(GPtrArray) installed = NULL;
-  g_autoptr(GPtrArray) remotes = NULL;
-  g_autoptr(GHashTable) ht = NULL;
-  int i, j;
+  g_autoptr(GHashTable) by_origin = NULL;
+  g_autoptr(GHashTable) updated = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  int i;
 
-  ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-  remotes = flatpak_installation_list_remotes (self, cancellable, error);
-  if (remotes == NULL)
+  installed = flatpak_installation_list_installed_refs (self, cancellable, error);
+  if (installed == NULL)
     return NULL;
 
-  for (i = 0; i < remotes->len; i++)
+  by_origin = group_installed_refs_by_origin (dir, installed);
+  updated = g_hash_table_new (NULL, NULL);
+
+  g_hash_table_iter_init (&iter, by_origin);
+  while (g_hash_table_iter_next (&iter, &key, &value))
     {
-      FlatpakRemote *remote = g_ptr_array_index (remotes, i);
-      g_autoptr(GPtrArray) refs = NULL;
+      const char *remote_name = key;
+      g_autoptr(GPtrArray) remote_updates = NULL;
       g_autoptr(GError) local_error = NULL;
 
-      if (flatpak_remote_get_disabled (remote))
-        continue;
-
       /* We ignore errors here. we don't want one remote to fail us */
-      refs = flatpak_installation_list_remote_refs_sync (self,
-                                                         flatpak_remote_get_name (remote),
-                                                         cancellable, &local_error);
-      if (refs != NULL)
-        {
-          for (j = 0; j < refs->len; j++)
-            {
-              FlatpakRemoteRef *remote_ref = g_ptr_array_index (refs, j);
-              g_autofree char *full_ref = flatpak_ref_format_ref (FLATPAK_REF (remote_ref));
-              g_autofree char *key = g_strdup_printf ("%s:%s", flatpak_remote_get_name (remote),
-                                                      full_ref);
-
-              g_hash_table_insert (ht, g_steal_pointer (&key),
-                                   g_strdup (flatpak_ref_get_commit (FLATPAK_REF (remote_ref))));
-            }
-        }
-      else
+      remote_updates = find_updates_in_remote (dir, remote_name, value,
+                                               cancellable, &local_error);
+      if (remote_updates == NULL)
         {
           g_debug ("Update: Failed to read remote %s: %s",
-                   flatpak_remote_get_name (remote),
-                   local_error->message);
+                   remote_name, local_error->message);
+          continue;
         }
-    }
 
-  installed = flatpak_installation_list_installed_refs (self, cancellable, error);
-  if (installed == NULL)
-    return NULL;
+      for (i = 0; i < remote_updates->len; i++)
+        g_hash_table_add (updated, g_ptr_array_index (remote_updates, i));
+    }
 
+  /* Keep the order of the installed refs */
   updates = g_ptr_array_new_with_free_func (g_object_unref);
-
   for (i = 0; i < installed->len; i++)
     {
       FlatpakInstalledRef *installed_ref = g_ptr_array_index (installed, i);
-      g_autofree char *full_ref = flatpak_ref_format_ref (FLATPAK_REF (installed_ref));
-      g_autofree char *key = g_strdup_printf ("%s:%s", flatpak_installed_ref_get_origin (installed_ref),
-                                              full_ref);
-      const char *remote_ref = g_hash_table_lookup (ht, key);
 
-      if (remote_ref != NULL &&
-          g_strcmp0 (remote_ref,
-                     flatpak_installed_ref_get_latest_commit (installed_ref)) != 0)
+      if (g_hash_table_contains (updated, installed_ref))
         g_ptr_array_add (updates, g_object_ref (installed_ref));
     }
 
   return g_steal_pointer (&updates);
 }
 
+typedef struct
+{
+  FlatpakDir                             *dir;
+  GPtrArray                              *updates;
+  guint                                   outstanding;
+  FlatpakInstallationUpdatesFoundCallback found_cb;
+  gpointer                                found_data;
+} ListUpdatesData;
+
+static void
+list_updates_data_free (ListUpdatesData *data)
+{
+  g_object_unref (data->dir);
+  g_ptr_array_unref (data->updates);
+  g_free (data);
+}
+
+typedef struct
+{
+  FlatpakDir *dir;
+  char       *remote_name;
+  GPtrArray  *installed;
+} RemoteUpdatesData;
+
+static void
+remote_updates_data_free (RemoteUpdatesData *data)
+{
+  g_object_unref (data->dir);
+  g_free (data->remote_name);
+  g_ptr_array_unref (data->installed);
+  g_free (data);
+}
+
+static void
+list_updates_return (GTask *task)
+{
+  ListUpdatesData *data = g_task_get_task_data (task);
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  g_task_return_pointer (task, g_ptr_array_ref (data->updates),
+                         (GDestroyNotify) g_ptr_array_unref);
+}
+
+static void
+remote_updates_thread (GTask        *task,
+                       gpointer      source_object,
+                       gpointer      task_data,
+                       GCancellable *cancellable)
+{
+  RemoteUpdatesData *remote_data = task_data;
+  GError *error = NULL;
+  GPtrArray *remote_updates;
+
+  remote_updates = find_updates_in_remote (remote_data->dir, remote_data->remote_name,
+                                           remote_data->installed,
+                                           cancellable, &error);
+  if (remote_updates == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, remote_updates, (GDestroyNotify) g_ptr_array_unref);
+}
+
+static void
+remote_updates_done (GObject      *source_object,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  ListUpdatesData *data = g_task_get_task_data (task);
+  RemoteUpdatesData *remote_data = g_task_get_task_data (G_TASK (result));
+  g_autoptr(GPtrArray) remote_updates = NULL;
+  g_autoptr(GError) local_error = NULL;
+  int i;
+
+  /* We ignore errors here. we don't want one remote to fail us */
+  remote_updates = g_task_propagate_pointer (G_TASK (result), &local_error);
+  if (remote_updates == NULL)
+    {
+      g_debug ("Update: Failed to read remote %s: %s",
+               remote_data->remote_name, local_error->message);
+    }
+  else if (remote_updates->len > 0)
+    {
+      for (i = 0; i < remote_updates->len; i++)
+        g_ptr_array_add (data->updates, g_object_ref (g_ptr_array_index (remote_updates, i)));
+
+      if (data->found_cb)
+        data->found_cb (FLATPAK_INSTALLATION (source_object),
+                        remote_data->remote_name,
+                        remote_updates,
+                        data->found_data);
+    }
+
+  if (--data->outstanding == 0)
+    list_updates_return (task);
+}
+
+static void
+list_installed_thread (GTask        *task,
+                       gpointer      source_object,
+                       gpointer      task_data,
+                       GCancellable *cancellable)
+{
+  GError *error = NULL;
+  GPtrArray *installed;
+
+  installed = flatpak_installation_list_installed_refs (FLATPAK_INSTALLATION (source_object),
+                                                        cancellable, &error);
+  if (installed == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, installed, (GDestroyNotify) g_ptr_array_unref);
+}
+
+static void
+list_installed_done (GObject      *source_object,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  ListUpdatesData *data = g_task_get_task_data (task);
+  g_autoptr(GPtrArray) installed = NULL;
+  g_autoptr(GHashTable) by_origin = NULL;
+  GError *error = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  installed = g_task_propagate_pointer (G_TASK (result), &error);
+  if (installed == NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  /* Start one lookup per remote that we have anything installed from,
+     they all run concurrently */
+  by_origin = group_installed_refs_by_origin (data->dir, installed);
+
+  g_hash_table_iter_init (&iter, by_origin);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      g_autoptr(GTask) remote_task = NULL;
+      RemoteUpdatesData *remote_data = g_new0 (RemoteUpdatesData, 1);
+
+      remote_data->dir = g_object_ref (data->dir);
+      remote_data->remote_name = g_strdup (key);
+      remote_data->installed = g_ptr_array_ref (value);
+
+      remote_task = g_task_new (source_object, g_task_get_cancellable (task),
+                                remote_updates_done, g_object_ref (task));
+      g_task_set_task_data (remote_task, remote_data, (GDestroyNotify) remote_updates_data_free);
+      g_task_run_in_thread (remote_task, remote_updates_thread);
+      data->outstanding++;
+    }
+
+  if (data->outstanding == 0)
+    list_updates_return (task);
+}
+
+/**
+ * flatpak_installation_list_installed_refs_for_update_async:
+ * @self: a #FlatpakInstallation
+ * @found_cb: (nullable): called each time a remote finishes with updates
+ * @found_data: (closure found_cb): user data for @found_cb
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when all remotes are done
+ * @user_data: user data for @callback
+ *
+ * Asynchronous version of flatpak_installation_list_installed_refs_for_update().
+ *
+ * The summaries of all remotes that have installed refs are fetched
+ * concurrently, and only the entries for the installed refs are looked at.
+ * Each time a remote has been checked and some updates were found,
+ * @found_cb is called with the updates from that remote, so callers can
+ * show results before the slowest remote has answered. @found_cb and
+ * @callback are called in the thread-default main context of the caller.
+ *
+ * Since: 0.10.0
+ */
+void
+flatpak_installation_list_installed_refs_for_update_async (FlatpakInstallation                    *self,
+                                                           FlatpakInstallationUpdatesFoundCallback found_cb,
+                                                           gpointer                                found_data,
+                                                           GCancellable                           *cancellable,
+                                                           GAsyncReadyCallback                     callback,
+                                                           gpointer                                user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GTask) installed_task = NULL;
+  ListUpdatesData *data;
+
+  data = g_new0 (ListUpdatesData, 1);
+  data->dir = flatpak_installation_get_dir (self);
+  data->updates = g_ptr_array_new_with_free_func (g_object_unref);
+  data->found_cb = found_cb;
+  data->found_data = found_data;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, flatpak_installation_list_installed_refs_for_update_async);
+  g_task_set_task_data (task, data, (GDestroyNotify) list_updates_data_free);
+
+  installed_task = g_task_new (self, cancellable, list_installed_done, g_object_ref (task));
+  g_task_run_in_thread (installed_task, list_installed_thread);
+}
+
+/**
+ * flatpak_installation_list_installed_refs_for_update_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with
+ * flatpak_installation_list_installed_refs_for_update_async().
+ *
+ * Returns: (transfer container) (element-type FlatpakInstalledRef): an GPtrArray of
+ *   #FlatpakInstalledRef instances, or %NULL on error
+ *
+ * Since: 0.10.0
+ */
+GPtrArray *
+flatpak_installation_list_installed_refs_for_update_finish (FlatpakInstallation *self,
+                                                            GAsyncResult        *result,
+                                                            GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
 #ifdef FLATPAK_ENABLE_P2P
 static void
 async_result_cb (GObject      *obj,
@@ -1293,46 +1678,21 @@ flatpak_installation_install_ref_file (FlatpakInstallation *self,
   return flatpak_remote_ref_new (ref, NULL, remote);
 }
 
-/**
- * flatpak_installation_install_full:
- * @self: a #FlatpakInstallation
- * @flags: set of #FlatpakInstallFlags flag
- * @remote_name: name of the remote to use
- * @kind: what this ref contains (an #FlatpakRefKind)
- * @name: name of the app/runtime to fetch
- * @arch: (nullable): which architecture to fetch (default: current architecture)
- * @branch: (nullable): which branch to fetch (default: 'master')
- * @subpaths: (nullable): A list of subpaths to fetch, or %NULL for everything
- * @progress: (scope call) (nullable): progress callback
- * @progress_data: (closure progress) (nullable): user data passed to @progress
- * @cancellable: (nullable): a #GCancellable
- * @error: return location for a #GError
- *
- * Install a new application or runtime.
- *
- * Note that this function was originally written to always return a
- * #FlatpakInstalledRef. Since 0.9.13, passing
- * FLATPAK_INSTALL_FLAGS_NO_DEPLOY will only pull refs into the local flatpak
- * repository without deploying them, however this function will
- * be unable to provide information on the installed ref, so
- * FLATPAK_ERROR_ONLY_PULLED will be set and the caller must respond
- * accordingly.
- *
- * Returns: (transfer full): The ref for the newly installed app or %NULL on failure
- */
-FlatpakInstalledRef *
-flatpak_installation_install_full (FlatpakInstallation    *self,
-                                   FlatpakInstallFlags     flags,
-                                   const char             *remote_name,
-                                   FlatpakRefKind          kind,
-                                   const char             *name,
-                                   const char             *arch,
-                                   const char             *branch,
-                                   const char * const     *subpaths,
-                                   FlatpakProgressCallback progress,
-                                   gpointer                progress_data,
-                                   GCancellable           *cancellable,
-                                   GError                **error)
+static FlatpakInstalledRef *
+installation_install_full (FlatpakInstallation    *self,
+                           FlatpakInstallFlags     flags,
+                           const char             *remote_name,
+                           FlatpakRefKind          kind,
+                           const char             *name,
+                           const char             *arch,
+                           const char             *branch,
+                           const char * const     *subpaths,
+                           FlatpakProgressCallback progress,
+                           gpointer                progress_data,
+                           OstreeAsyncProgress   **out_ostree_progress,
+                           FlatpakDir             *work_dir,
+                           GCancellable           *cancellable,
+                           GError                **error)
 {
   g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
   g_autofree char *ref = NULL;
@@ -1355,19 +1715,15 @@ flatpak_installation_install_full (FlatpakInstallation    *self,
       return NULL;
     }
 
-  /* Pull, prune, etc are not threadsafe, so we work on a copy */
-  dir_clone = flatpak_dir_clone (dir);
-  if (!flatpak_dir_ensure_repo (dir_clone, cancellable, error))
+  dir_clone = installation_get_work_dir (dir, work_dir, cancellable, error);
+  if (dir_clone == NULL)
     return NULL;
 
   /* Work around ostree-pull spinning the default main context for the sync calls */
   main_context = g_main_context_new ();
   g_main_context_push_thread_default (main_context);
 
-  if (progress)
-    ostree_progress = flatpak_progress_new (progress, progress_data);
-  else
-    ostree_progress = ostree_async_progress_new_and_connect (no_progress_cb, NULL);
+  ostree_progress = installation_progress_new (progress, progress_data, out_ostree_progress);
 
   if (!flatpak_dir_install (dir_clone,
                             (flags & FLATPAK_INSTALL_FLAGS_NO_PULL) != 0,
@@ -1404,13 +1760,15 @@ out:
 }
 
 /**
- * flatpak_installation_install:
+ * flatpak_installation_install_full:
  * @self: a #FlatpakInstallation
+ * @flags: set of #FlatpakInstallFlags flag
  * @remote_name: name of the remote to use
  * @kind: what this ref contains (an #FlatpakRefKind)
  * @name: name of the app/runtime to fetch
  * @arch: (nullable): which architecture to fetch (default: current architecture)
  * @branch: (nullable): which branch to fetch (default: 'master')
+ * @subpaths: (nullable): A list of subpaths to fetch, or %NULL for everything
  * @progress: (scope call) (nullable): progress callback
  * @progress_data: (closure progress) (nullable): user data passed to @progress
  * @cancellable: (nullable): a #GCancellable
@@ -1429,53 +1787,81 @@ out:
  * Returns: (transfer full): The ref for the newly installed app or %NULL on failure
  */
 FlatpakInstalledRef *
-flatpak_installation_install (FlatpakInstallation    *self,
-                              const char             *remote_name,
-                              FlatpakRefKind          kind,
-                              const char             *name,
-                              const char             *arch,
-                              const char             *branch,
-                              FlatpakProgressCallback progress,
-                              gpointer                progress_data,
-                              GCancellable           *cancellable,
-                              GError                **error)
-{
-  return flatpak_installation_install_full (self, FLATPAK_INSTALL_FLAGS_NONE,
-                                            remote_name, kind, name, arch, branch,
-                                            NULL, progress, progress_data,
-                                            cancellable, error);
-}
-
-/**
- * flatpak_installation_update_full:
+flatpak_installation_install_full (FlatpakInstallation    *self,
+                                   FlatpakInstallFlags     flags,
+                                   const char             *remote_name,
+                                   FlatpakRefKind          kind,
+                                   const char             *name,
+                                   const char             *arch,
+                                   const char             *branch,
+                                   const char * const     *subpaths,
+                                   FlatpakProgressCallback progress,
+                                   gpointer                progress_data,
+                                   GCancellable           *cancellable,
+                                   GError                **error)
+{
+  return installation_install_full (self, flags, remote_name, kind, name, arch, branch,
+                                    subpaths, progress, progress_data, NULL, NULL,
+                                    cancellable, error);
+}
+
+/**
+ * flatpak_installation_install:
  * @self: a #FlatpakInstallation
- * @flags: set of #FlatpakUpdateFlags flag
- * @kind: whether this is an app or runtime
- * @name: name of the app or runtime to update
- * @arch: (nullable): architecture of the app or runtime to update (default: current architecture)
- * @branch: (nullable): name of the branch of the app or runtime to update (default: master)
- * @subpaths: (nullable): A list of subpaths to fetch, or %NULL for everything
- * @progress: (scope call) (nullable): the callback
+ * @remote_name: name of the remote to use
+ * @kind: what this ref contains (an #FlatpakRefKind)
+ * @name: name of the app/runtime to fetch
+ * @arch: (nullable): which architecture to fetch (default: current architecture)
+ * @branch: (nullable): which branch to fetch (default: 'master')
+ * @progress: (scope call) (nullable): progress callback
  * @progress_data: (closure progress) (nullable): user data passed to @progress
  * @cancellable: (nullable): a #GCancellable
  * @error: return location for a #GError
  *
- * Update an application or runtime.
+ * Install a new application or runtime.
  *
- * Returns: (transfer full): The ref for the newly updated app (or the same if no update) or %NULL on failure
+ * Note that this function was originally written to always return a
+ * #FlatpakInstalledRef. Since 0.9.13, passing
+ * FLATPAK_INSTALL_FLAGS_NO_DEPLOY will only pull refs into the local flatpak
+ * repository without deploying them, however this function will
+ * be unable to provide information on the installed ref, so
+ * FLATPAK_ERROR_ONLY_PULLED will be set and the caller must respond
+ * accordingly.
+ *
+ * Returns: (transfer full): The ref for the newly installed app or %NULL on failure
  */
 FlatpakInstalledRef *
-flatpak_installation_update_full (FlatpakInstallation    *self,
-                                  FlatpakUpdateFlags      flags,
-                                  FlatpakRefKind          kind,
-                                  const char             *name,
-                                  const char             *arch,
-                                  const char             *branch,
-                                  const char * const     *subpaths,
-                                  FlatpakProgressCallback progress,
-                                  gpointer                progress_data,
-                                  GCancellable           *cancellable,
-                                  GError                **error)
+flatpak_installation_install (FlatpakInstallation    *self,
+                              const char             *remote_name,
+                              FlatpakRefKind          kind,
+                              const char             *name,
+                              const char             *arch,
+                              const char             *branch,
+                              FlatpakProgressCallback progress,
+                              gpointer                progress_data,
+                              GCancellable           *cancellable,
+                              GError                **error)
+{
+  return flatpak_installation_install_full (self, FLATPAK_INSTALL_FLAGS_NONE,
+                                            remote_name, kind, name, arch, branch,
+                                            NULL, progress, progress_data,
+                                            cancellable, error);
+}
+
+static FlatpakInstalledRef *
+installation_update_full (FlatpakInstallation    *self,
+                          FlatpakUpdateFlags      flags,
+                          FlatpakRefKind          kind,
+                          const char             *name,
+                          const char             *arch,
+                          const char             *branch,
+                          const char * const     *subpaths,
+                          FlatpakProgressCallback progress,
+                          gpointer                progress_data,
+                          OstreeAsyncProgress   **out_ostree_progress,
+                          FlatpakDir             *work_dir,
+                          GCancellable           *cancellable,
+                          GError                **error)
 {
   g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
   g_autofree char *ref = NULL;
@@ -1513,19 +1899,15 @@ flatpak_installation_update_full (FlatpakInstallation    *self,
   if (target_commit == NULL)
     return NULL;
 
-  /* Pull, prune, etc are not threadsafe, so we work on a copy */
-  dir_clone = flatpak_dir_clone (dir);
-  if (!flatpak_dir_ensure_repo (dir_clone, cancellable, error))
+  dir_clone = installation_get_work_dir (dir, work_dir, cancellable, error);
+  if (dir_clone == NULL)
     return NULL;
 
   /* Work around ostree-pull spinning the default main context for the sync calls */
   main_context = g_main_context_new ();
   g_main_context_push_thread_default (main_context);
 
-  if (progress)
-    ostree_progress = flatpak_progress_new (progress, progress_data);
-  else
-    ostree_progress = ostree_async_progress_new_and_connect (no_progress_cb, NULL);
+  ostree_progress = installation_progress_new (progress, progress_data, out_ostree_progress);
 
   if (!flatpak_dir_update (dir_clone,
                            (flags & FLATPAK_UPDATE_FLAGS_NO_PULL) != 0,
@@ -1552,6 +1934,42 @@ out:
   return result;
 }
 
+/**
+ * flatpak_installation_update_full:
+ * @self: a #FlatpakInstallation
+ * @flags: set of #FlatpakUpdateFlags flag
+ * @kind: whether this is an app or runtime
+ * @name: name of the app or runtime to update
+ * @arch: (nullable): architecture of the app or runtime to update (default: current architecture)
+ * @branch: (nullable): name of the branch of the app or runtime to update (default: master)
+ * @subpaths: (nullable): A list of subpaths to fetch, or %NULL for everything
+ * @progress: (scope call) (nullable): the callback
+ * @progress_data: (closure progress) (nullable): user data passed to @progress
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Update an application or runtime.
+ *
+ * Returns: (transfer full): The ref for the newly updated app (or the same if no update) or %NULL on failure
+ */
+FlatpakInstalledRef *
+flatpak_installation_update_full (FlatpakInstallation    *self,
+                                  FlatpakUpdateFlags      flags,
+                                  FlatpakRefKind          kind,
+                                  const char             *name,
+                                  const char             *arch,
+                                  const char             *branch,
+                                  const char * const     *subpaths,
+                                  FlatpakProgressCallback progress,
+                                  gpointer                progress_data,
+                                  GCancellable           *cancellable,
+                                  GError                **error)
+{
+  return installation_update_full (self, flags, kind, name, arch, branch,
+                                   subpaths, progress, progress_data, NULL, NULL,
+                                   cancellable, error);
+}
+
 /**
  * flatpak_installation_update:
  * @self: a #FlatpakInstallation
@@ -1586,6 +2004,35 @@ flatpak_installation_update (FlatpakInstallation    *self,
                                            cancellable, error);
 }
 
+static gboolean
+installation_uninstall (FlatpakInstallation    *self,
+                        FlatpakRefKind          kind,
+                        const char             *name,
+                        const char             *arch,
+                        const char             *branch,
+                        FlatpakDir             *work_dir,
+                        GCancellable           *cancellable,
+                        GError                **error)
+{
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
+  g_autofree char *ref = NULL;
+  g_autoptr(FlatpakDir) dir_clone = NULL;
+
+  ref = flatpak_compose_ref (kind == FLATPAK_REF_KIND_APP, name, branch, arch, error);
+  if (ref == NULL)
+    return FALSE;
+
+  dir_clone = installation_get_work_dir (dir, work_dir, cancellable, error);
+  if (dir_clone == NULL)
+    return FALSE;
+
+  if (!flatpak_dir_uninstall (dir_clone, ref, FLATPAK_HELPER_UNINSTALL_FLAGS_NONE,
+                              cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
 /**
  * flatpak_installation_uninstall:
  * @self: a #FlatpakInstallation
@@ -1613,24 +2060,8 @@ flatpak_installation_uninstall (FlatpakInstallation    *self,
                                 GCancellable           *cancellable,
                                 GError                **error)
 {
-  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
-  g_autofree char *ref = NULL;
-  g_autoptr(FlatpakDir) dir_clone = NULL;
-
-  ref = flatpak_compose_ref (kind == FLATPAK_REF_KIND_APP, name, branch, arch, error);
-  if (ref == NULL)
-    return FALSE;
-
-  /* prune, etc are not threadsafe, so we work on a copy */
-  dir_clone = flatpak_dir_clone (dir);
-  if (!flatpak_dir_ensure_repo (dir_clone, cancellable, error))
-    return FALSE;
-
-  if (!flatpak_dir_uninstall (dir_clone, ref, FLATPAK_HELPER_UNINSTALL_FLAGS_NONE,
-                              cancellable, error))
-    return FALSE;
-
-  return TRUE;
+  return installation_uninstall (self, kind, name, arch, branch, NULL,
+                                 cancellable, error);
 }
 
 /**
@@ -1705,6 +2136,122 @@ flatpak_installation_fetch_remote_metadata_sync (FlatpakInstallation *self,
   return g_bytes_new_take (res, strlen (res));
 }
 
+typedef struct
+{
+  const char                 *remote_name;
+  FlatpakRemoteRefInfoCallback callback;
+  gpointer                    user_data;
+} RefInfoData;
+
+static void
+ref_info_cb (const char *full_ref,
+             const char *commit,
+             guint64     download_size,
+             guint64     installed_size,
+             const char *metadata,
+             gpointer    user_data)
+{
+  RefInfoData *data = user_data;
+  g_autoptr(FlatpakRemoteRef) ref = NULL;
+  g_autoptr(GBytes) metadata_bytes = NULL;
+
+  ref = flatpak_remote_ref_new (full_ref, commit, data->remote_name);
+  if (ref == NULL)
+    return;
+
+  metadata_bytes = g_bytes_new (metadata, strlen (metadata));
+  g_object_set (ref,
+                "download-size", download_size,
+                "installed-size", installed_size,
+                "metadata", metadata_bytes,
+                NULL);
+
+  data->callback (ref, data->user_data);
+}
+
+/**
+ * flatpak_installation_foreach_remote_ref_info_sync:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @refs: (nullable) (array zero-terminated=1): the full refs to look up,
+ *   or %NULL for all refs in the remote
+ * @callback: (scope call): called for each ref that was found
+ * @user_data: user data for @callback
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Looks up the commit, download size, installed size and metadata of
+ * many refs at once. This is equivalent to calling
+ * flatpak_installation_fetch_remote_size_sync() and
+ * flatpak_installation_fetch_remote_metadata_sync() for each ref, but
+ * the remote summary is only fetched and parsed once. Refs are passed
+ * to @callback as they are found, so the full set never needs to be
+ * kept in memory. Refs in @refs that are not in the remote are skipped.
+ *
+ * Returns: %TRUE, unless an error occurred
+ *
+ * Since: 0.10.0
+ */
+gboolean
+flatpak_installation_foreach_remote_ref_info_sync (FlatpakInstallation         *self,
+                                                   const char                  *remote_name,
+                                                   const char * const          *refs,
+                                                   FlatpakRemoteRefInfoCallback callback,
+                                                   gpointer                     user_data,
+                                                   GCancellable                *cancellable,
+                                                   GError                     **error)
+{
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
+  RefInfoData data = { remote_name, callback, user_data };
+
+  return flatpak_dir_foreach_ref_cache (dir, remote_name, refs,
+                                        ref_info_cb, &data,
+                                        cancellable, error);
+}
+
+static void
+collect_ref_info_cb (FlatpakRemoteRef *ref,
+                     gpointer          user_data)
+{
+  GPtrArray *refs = user_data;
+
+  g_ptr_array_add (refs, g_object_ref (ref));
+}
+
+/**
+ * flatpak_installation_fetch_remote_refs_info_sync:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @refs: (nullable) (array zero-terminated=1): the full refs to look up,
+ *   or %NULL for all refs in the remote
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Like flatpak_installation_foreach_remote_ref_info_sync(), but returns
+ * all the refs at once.
+ *
+ * Returns: (transfer container) (element-type FlatpakRemoteRef): a GPtrArray of
+ *   #FlatpakRemoteRef instances with sizes and metadata set
+ *
+ * Since: 0.10.0
+ */
+GPtrArray *
+flatpak_installation_fetch_remote_refs_info_sync (FlatpakInstallation *self,
+                                                  const char          *remote_name,
+                                                  const char * const  *refs,
+                                                  GCancellable        *cancellable,
+                                                  GError             **error)
+{
+  g_autoptr(GPtrArray) result = g_ptr_array_new_with_free_func (g_object_unref);
+
+  if (!flatpak_installation_foreach_remote_ref_info_sync (self, remote_name, refs,
+                                                          collect_ref_info_cb, result,
+                                                          cancellable, error))
+    return NULL;
+
+  return g_steal_pointer (&result);
+}
+
 /**
  * flatpak_installation_list_remote_refs_sync:
  * @self: a #FlatpakInstallation
@@ -1841,29 +2388,65 @@ flatpak_installation_update_appstream_sync (FlatpakInstallation *self,
 }
 
 /**
- * flatpak_installation_update_appstream_full_sync:
+ * flatpak_installation_lookup_appstream_component:
  * @self: a #FlatpakInstallation
  * @remote_name: the name of the remote
- * @arch: Architecture to update, or %NULL for the local machine arch
- * @progress: (scope call) (nullable): progress callback
- * @progress_data: (closure progress) (nullable): user data passed to @progress
- * @out_changed: (nullable): Set to %TRUE if the contents of the appstream changed, %FALSE if nothing changed
- * @cancellable: (nullable): a #GCancellable
+ * @arch: (nullable): Architecture of the appstream data, or %NULL for the local machine arch
+ * @component_id: the appstream component id, such as "org.gnome.gedit.desktop"
+ * @out_name: (out) (optional): return location for the name of the component
+ * @out_summary: (out) (optional): return location for the summary of the component
+ * @out_icon: (out) (optional): return location for the file name of the cached icon,
+ *   relative to the icons directory of the appstream data, or "" if there is none
+ * @out_keywords: (out) (optional) (array zero-terminated=1): return location for the keywords
  * @error: return location for a #GError
  *
- * Updates the local copy of appstream for @remote_name for the specified @arch.
+ * Looks up the untranslated name, summary, icon and keywords of a
+ * component in the local copy of the appstream data for @remote_name.
+ * This uses an index that is built when the appstream data is updated,
+ * so it is much faster than parsing the appstream xml.
  *
- * Returns: %TRUE on success, or %FALSE on error
+ * Returns: %TRUE if the component was found, %FALSE otherwise
+ *
+ * Since: 0.10.0
  */
 gboolean
-flatpak_installation_update_appstream_full_sync (FlatpakInstallation *self,
+flatpak_installation_lookup_appstream_component (FlatpakInstallation *self,
                                                  const char          *remote_name,
                                                  const char          *arch,
-                                                 FlatpakProgressCallback progress,
-                                                 gpointer                progress_data,
-                                                 gboolean            *out_changed,
-                                                 GCancellable        *cancellable,
+                                                 const char          *component_id,
+                                                 char               **out_name,
+                                                 char               **out_summary,
+                                                 char               **out_icon,
+                                                 char              ***out_keywords,
                                                  GError             **error)
+{
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
+  g_autoptr(GFile) index_file = NULL;
+
+  if (arch == NULL)
+    arch = flatpak_get_arch ();
+
+  index_file = flatpak_build_file (flatpak_dir_get_path (dir),
+                                   "appstream", remote_name, arch,
+                                   "active", "appstream.gvdb", NULL);
+
+  return flatpak_appstream_index_lookup (flatpak_file_get_path_cached (index_file),
+                                         component_id,
+                                         out_name, out_summary, out_icon, out_keywords,
+                                         error);
+}
+
+static gboolean
+installation_update_appstream (FlatpakInstallation    *self,
+                               const char             *remote_name,
+                               const char             *arch,
+                               FlatpakProgressCallback progress,
+                               gpointer                progress_data,
+                               OstreeAsyncProgress   **out_ostree_progress,
+                               FlatpakDir             *work_dir,
+                               gboolean               *out_changed,
+                               GCancellable           *cancellable,
+                               GError                **error)
 {
   g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
   g_autoptr(FlatpakDir) dir_clone = NULL;
@@ -1871,19 +2454,15 @@ flatpak_installation_update_appstream_full_sync (FlatpakInstallation *self,
   g_autoptr(GMainContext) main_context = NULL;
   gboolean res;
 
-  /* Pull, prune, etc are not threadsafe, so we work on a copy */
-  dir_clone = flatpak_dir_clone (dir);
-  if (!flatpak_dir_ensure_repo (dir_clone, cancellable, error))
+  dir_clone = installation_get_work_dir (dir, work_dir, cancellable, error);
+  if (dir_clone == NULL)
     return FALSE;
 
   /* Work around ostree-pull spinning the default main context for the sync calls */
   main_context = g_main_context_new ();
   g_main_context_push_thread_default (main_context);
 
-  if (progress)
-    ostree_progress = flatpak_progress_new (progress, progress_data);
-  else
-    ostree_progress = ostree_async_progress_new_and_connect (no_progress_cb, NULL);
+  ostree_progress = installation_progress_new (progress, progress_data, out_ostree_progress);
 
   res = flatpak_dir_update_appstream (dir_clone,
                                       remote_name,
@@ -1901,6 +2480,36 @@ flatpak_installation_update_appstream_full_sync (FlatpakInstallation *self,
   return res;
 }
 
+/**
+ * flatpak_installation_update_appstream_full_sync:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @arch: Architecture to update, or %NULL for the local machine arch
+ * @progress: (scope call) (nullable): progress callback
+ * @progress_data: (closure progress) (nullable): user data passed to @progress
+ * @out_changed: (nullable): Set to %TRUE if the contents of the appstream changed, %FALSE if nothing changed
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Updates the local copy of appstream for @remote_name for the specified @arch.
+ *
+ * Returns: %TRUE on success, or %FALSE on error
+ */
+gboolean
+flatpak_installation_update_appstream_full_sync (FlatpakInstallation *self,
+                                                 const char          *remote_name,
+                                                 const char          *arch,
+                                                 FlatpakProgressCallback progress,
+                                                 gpointer                progress_data,
+                                                 gboolean            *out_changed,
+                                                 GCancellable        *cancellable,
+                                                 GError             **error)
+{
+  return installation_update_appstream (self, remote_name, arch,
+                                        progress, progress_data, NULL, NULL,
+                                        out_changed, cancellable, error);
+}
+
 
 /**
  * flatpak_installation_create_monitor:
@@ -1912,6 +2521,10 @@ flatpak_installation_update_appstream_full_sync (FlatpakInstallation *self,
  * emit the #GFileMonitor::changed signal whenever an application or runtime
  * was installed, uninstalled or updated.
  *
+ * To find out what changed without reloading everything, remember the
+ * value of flatpak_installation_get_generation() and call
+ * flatpak_installation_list_changes_since() when the monitor fires.
+ *
  * Returns: (transfer full): a new #GFileMonitor instance, or %NULL on error
  */
 GFileMonitor *
@@ -1928,6 +2541,85 @@ flatpak_installation_create_monitor (FlatpakInstallation *self,
                               cancellable, error);
 }
 
+/**
+ * flatpak_installation_get_generation:
+ * @self: a #FlatpakInstallation
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Gets the current generation of the installation. The generation
+ * is increased by one for every install, update or uninstall of a ref,
+ * and can be passed to flatpak_installation_list_changes_since() later
+ * to find out what changed.
+ *
+ * Returns: the current generation, or 0 if nothing was changed yet
+ *   or on error
+ *
+ * Since: 0.10.0
+ */
+guint64
+flatpak_installation_get_generation (FlatpakInstallation *self,
+                                     GCancellable        *cancellable,
+                                     GError             **error)
+{
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
+
+  return flatpak_dir_get_generation (dir, cancellable, error);
+}
+
+/**
+ * flatpak_installation_list_changes_since:
+ * @self: a #FlatpakInstallation
+ * @generation: a generation previously returned by
+ *   flatpak_installation_get_generation() or this function
+ * @out_generation: (out) (optional): return location for the current generation
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Lists the refs that were installed, updated or uninstalled since
+ * @generation, oldest first.
+ *
+ * Only a limited number of changes are kept. If some of the changes
+ * since @generation are no longer available this fails with
+ * %FLATPAK_ERROR_CHANGES_EXPIRED, and the caller should reload the
+ * installed refs with flatpak_installation_list_installed_refs() and
+ * continue from flatpak_installation_get_generation().
+ *
+ * Returns: (transfer container) (element-type FlatpakRefChange): a GPtrArray of
+ *   #FlatpakRefChange instances
+ *
+ * Since: 0.10.0
+ */
+GPtrArray *
+flatpak_installation_list_changes_since (FlatpakInstallation *self,
+                                         guint64              generation,
+                                         guint64             *out_generation,
+                                         GCancellable        *cancellable,
+                                         GError             **error)
+{
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
+  g_autoptr(GVariant) changes = NULL;
+  g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_object_unref);
+  gsize n, i;
+
+  changes = flatpak_dir_list_changes_since (dir, generation, out_generation,
+                                            cancellable, error);
+  if (changes == NULL)
+    return NULL;
+
+  n = g_variant_n_children (changes);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) entry = g_variant_get_child_value (changes, i);
+      FlatpakRefChange *change = flatpak_ref_change_new_from_variant (entry);
+
+      if (change != NULL)
+        g_ptr_array_add (refs, change);
+    }
+
+  return g_steal_pointer (&refs);
+}
+
 
 /**
  * flatpak_installation_list_remote_related_refs_sync:
@@ -2123,3 +2815,828 @@ flatpak_installation_prune_local_repo (FlatpakInstallation *self,
 
   return flatpak_dir_prune (dir, cancellable, error);
 }
+
+/**
+ * flatpak_progress_event_copy:
+ * @event: a #FlatpakProgressEvent
+ *
+ * Returns: (transfer full): a copy of @event
+ *
+ * Since: 0.10.0
+ */
+FlatpakProgressEvent *
+flatpak_progress_event_copy (const FlatpakProgressEvent *event)
+{
+  FlatpakProgressEvent *copy = g_new0 (FlatpakProgressEvent, 1);
+
+  *copy = *event;
+  copy->ref = g_strdup (event->ref);
+  copy->status = g_strdup (event->status);
+
+  return copy;
+}
+
+/**
+ * flatpak_progress_event_free:
+ * @event: a #FlatpakProgressEvent
+ *
+ * Frees @event.
+ *
+ * Since: 0.10.0
+ */
+void
+flatpak_progress_event_free (FlatpakProgressEvent *event)
+{
+  g_free (event->ref);
+  g_free (event->status);
+  g_free (event);
+}
+
+/* State for the _async variants of the operations, used as task data */
+typedef struct
+{
+  GMainContext                       *context;
+  FlatpakInstallationProgressCallback progress_cb;
+  gpointer                            progress_data;
+  /* Only valid while a pull is running in the worker thread */
+  OstreeAsyncProgress                *ostree_progress;
+  GTaskThreadFunc                     thread_func;
+  /* The shared dir of the installation, set in the worker thread */
+  FlatpakDir                         *dir;
+
+  /* Arguments */
+  guint                               flags;
+  char                               *remote_name;
+  FlatpakRefKind                      kind;
+  char                               *name;
+  char                               *arch;
+  char                               *branch;
+  char                              **subpaths;
+  FlatpakRef                         *ref;
+  char                               *full_ref;
+
+  /* Extra results */
+  gboolean                            changed;
+  guint64                             download_size;
+  guint64                             installed_size;
+} AsyncOp;
+
+static void
+async_op_free (AsyncOp *op)
+{
+  g_main_context_unref (op->context);
+  g_clear_object (&op->dir);
+  g_free (op->remote_name);
+  g_free (op->name);
+  g_free (op->arch);
+  g_free (op->branch);
+  g_strfreev (op->subpaths);
+  g_clear_object (&op->ref);
+  g_free (op->full_ref);
+  g_free (op);
+}
+
+static GTask *
+async_op_task_new (FlatpakInstallation                *self,
+                   gpointer                            source_tag,
+                   FlatpakInstallationProgressCallback progress_cb,
+                   gpointer                            progress_data,
+                   GCancellable                       *cancellable,
+                   GAsyncReadyCallback                 callback,
+                   gpointer                            user_data,
+                   AsyncOp                           **op_out)
+{
+  GTask *task;
+  AsyncOp *op = g_new0 (AsyncOp, 1);
+
+  op->context = g_main_context_ref_thread_default ();
+  op->progress_cb = progress_cb;
+  op->progress_data = progress_data;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, source_tag);
+  g_task_set_task_data (task, op, (GDestroyNotify) async_op_free);
+
+  *op_out = op;
+  return task;
+}
+
+typedef struct
+{
+  GTask                *task;
+  FlatpakProgressEvent *event;
+} ProgressDelivery;
+
+static void
+progress_delivery_free (ProgressDelivery *delivery)
+{
+  g_object_unref (delivery->task);
+  flatpak_progress_event_free (delivery->event);
+  g_free (delivery);
+}
+
+static gboolean
+deliver_progress (gpointer user_data)
+{
+  ProgressDelivery *delivery = user_data;
+  AsyncOp *op = g_task_get_task_data (delivery->task);
+
+  op->progress_cb (g_task_get_source_object (delivery->task),
+                   delivery->event, op->progress_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Called in the worker thread, forwards the progress to the main
+   context of the caller of the _async function */
+static void
+async_op_progress_cb (const char *status,
+                      guint       progress,
+                      gboolean    estimating,
+                      gpointer    user_data)
+{
+  GTask *task = user_data;
+  AsyncOp *op = g_task_get_task_data (task);
+  ProgressDelivery *delivery;
+  FlatpakProgressEvent *event;
+
+  event = g_new0 (FlatpakProgressEvent, 1);
+  event->ref = g_strdup (op->full_ref);
+  event->status = g_strdup (status);
+  event->progress = progress;
+  event->estimating = estimating;
+
+  if (op->ostree_progress)
+    {
+      event->bytes_transferred =
+        ostree_async_progress_get_uint64 (op->ostree_progress, "bytes-transferred") +
+        ostree_async_progress_get_uint64 (op->ostree_progress, "transferred-extra-data-bytes");
+      event->start_time = ostree_async_progress_get_uint64 (op->ostree_progress, "start-time");
+    }
+
+  delivery = g_new0 (ProgressDelivery, 1);
+  delivery->task = g_object_ref (task);
+  delivery->event = event;
+
+  g_main_context_invoke_full (op->context, G_PRIORITY_DEFAULT,
+                              deliver_progress, delivery,
+                              (GDestroyNotify) progress_delivery_free);
+}
+
+/* Returns the progress callback for the sync calls, and sets
+   @out_progress_data to its data */
+static FlatpakProgressCallback
+async_op_get_progress (GTask    *task,
+                       gpointer *out_progress_data)
+{
+  AsyncOp *op = g_task_get_task_data (task);
+
+  *out_progress_data = task;
+  return op->progress_cb ? async_op_progress_cb : NULL;
+}
+
+static void
+async_op_pool_func (gpointer data,
+                    gpointer user_data)
+{
+  g_autoptr(GTask) task = data;
+  FlatpakInstallation *self = g_task_get_source_object (task);
+  GCancellable *cancellable = g_task_get_cancellable (task);
+  AsyncOp *op = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  op->dir = flatpak_installation_get_async_dir (self, cancellable, &error);
+  if (op->dir == NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  op->thread_func (task, self, op, cancellable);
+}
+
+/* Queues @task to run @thread_func in the worker thread */
+static void
+async_op_run (GTask          *task,
+              GTaskThreadFunc thread_func)
+{
+  FlatpakInstallation *self = g_task_get_source_object (task);
+  FlatpakInstallationPrivate *priv = flatpak_installation_get_instance_private (self);
+  AsyncOp *op = g_task_get_task_data (task);
+
+  op->thread_func = thread_func;
+  g_thread_pool_push (priv->async_pool, g_object_ref (task), NULL);
+}
+
+static void
+install_thread (GTask        *task,
+                gpointer      source_object,
+                gpointer      task_data,
+                GCancellable *cancellable)
+{
+  AsyncOp *op = task_data;
+  GError *error = NULL;
+  FlatpakProgressCallback progress;
+  gpointer progress_data;
+  FlatpakInstalledRef *ref;
+
+  progress = async_op_get_progress (task, &progress_data);
+  ref = installation_install_full (source_object, op->flags, op->remote_name,
+                                   op->kind, op->name, op->arch, op->branch,
+                                   (const char * const *) op->subpaths,
+                                   progress, progress_data,
+                                   &op->ostree_progress, op->dir,
+                                   cancellable, &error);
+  op->ostree_progress = NULL;
+
+  if (ref == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, ref, g_object_unref);
+}
+
+/**
+ * flatpak_installation_install_full_async:
+ * @self: a #FlatpakInstallation
+ * @flags: set of #FlatpakInstallFlags flag
+ * @remote_name: name of the remote to use
+ * @kind: what this ref contains (an #FlatpakRefKind)
+ * @name: name of the app/runtime to fetch
+ * @arch: (nullable): which architecture to fetch (default: current architecture)
+ * @branch: (nullable): which branch to fetch (default: 'master')
+ * @subpaths: (nullable) (array zero-terminated=1): A list of subpaths to fetch, or %NULL for everything
+ * @progress: (nullable): progress callback
+ * @progress_data: (closure progress) (nullable): user data passed to @progress
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the install is done
+ * @user_data: user data for @callback
+ *
+ * Asynchronous version of flatpak_installation_install_full(). The
+ * operation runs in a worker thread. The asynchronous operations on one
+ * #FlatpakInstallation are queued and run one at a time, in the order
+ * they were started. @progress and @callback are called in the
+ * thread-default main context of the caller.
+ *
+ * Since: 0.10.0
+ */
+void
+flatpak_installation_install_full_async (FlatpakInstallation                *self,
+                                         FlatpakInstallFlags                 flags,
+                                         const char                         *remote_name,
+                                         FlatpakRefKind                      kind,
+                                         const char                         *name,
+                                         const char                         *arch,
+                                         const char                         *branch,
+                                         const char * const                 *subpaths,
+                                         FlatpakInstallationProgressCallback progress,
+                                         gpointer                            progress_data,
+                                         GCancellable                       *cancellable,
+                                         GAsyncReadyCallback                 callback,
+                                         gpointer                            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOp *op;
+
+  task = async_op_task_new (self, flatpak_installation_install_full_async,
+                            progress, progress_data, cancellable, callback, user_data, &op);
+  op->flags = flags;
+  op->remote_name = g_strdup (remote_name);
+  op->kind = kind;
+  op->name = g_strdup (name);
+  op->arch = g_strdup (arch);
+  op->branch = g_strdup (branch);
+  op->subpaths = g_strdupv ((char **) subpaths);
+  op->full_ref = flatpak_compose_ref (kind == FLATPAK_REF_KIND_APP, name, branch, arch, NULL);
+
+  async_op_run (task, install_thread);
+}
+
+/**
+ * flatpak_installation_install_full_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with flatpak_installation_install_full_async().
+ *
+ * Returns: (transfer full): The ref for the newly installed app or %NULL on failure
+ *
+ * Since: 0.10.0
+ */
+FlatpakInstalledRef *
+flatpak_installation_install_full_finish (FlatpakInstallation *self,
+                                          GAsyncResult        *result,
+                                          GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+update_thread (GTask        *task,
+               gpointer      source_object,
+               gpointer      task_data,
+               GCancellable *cancellable)
+{
+  AsyncOp *op = task_data;
+  GError *error = NULL;
+  FlatpakProgressCallback progress;
+  gpointer progress_data;
+  FlatpakInstalledRef *ref;
+
+  progress = async_op_get_progress (task, &progress_data);
+  ref = installation_update_full (source_object, op->flags,
+                                  op->kind, op->name, op->arch, op->branch,
+                                  (const char * const *) op->subpaths,
+                                  progress, progress_data,
+                                  &op->ostree_progress, op->dir,
+                                  cancellable, &error);
+  op->ostree_progress = NULL;
+
+  if (ref == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, ref, g_object_unref);
+}
+
+/**
+ * flatpak_installation_update_full_async:
+ * @self: a #FlatpakInstallation
+ * @flags: set of #FlatpakUpdateFlags flag
+ * @kind: whether this is an app or runtime
+ * @name: name of the app or runtime to update
+ * @arch: (nullable): architecture of the app or runtime to update (default: current architecture)
+ * @branch: (nullable): name of the branch of the app or runtime to update (default: master)
+ * @subpaths: (nullable) (array zero-terminated=1): A list of subpaths to fetch, or %NULL for everything
+ * @progress: (nullable): progress callback
+ * @progress_data: (closure progress) (nullable): user data passed to @progress
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the update is done
+ * @user_data: user data for @callback
+ *
+ * Asynchronous version of flatpak_installation_update_full(). See
+ * flatpak_installation_install_full_async() for details.
+ *
+ * Since: 0.10.0
+ */
+void
+flatpak_installation_update_full_async (FlatpakInstallation                *self,
+                                        FlatpakUpdateFlags                  flags,
+                                        FlatpakRefKind                      kind,
+                                        const char                         *name,
+                                        const char                         *arch,
+                                        const char                         *branch,
+                                        const char * const                 *subpaths,
+                                        FlatpakInstallationProgressCallback progress,
+                                        gpointer                            progress_data,
+                                        GCancellable                       *cancellable,
+                                        GAsyncReadyCallback                 callback,
+                                        gpointer                            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOp *op;
+
+  task = async_op_task_new (self, flatpak_installation_update_full_async,
+                            progress, progress_data, cancellable, callback, user_data, &op);
+  op->flags = flags;
+  op->kind = kind;
+  op->name = g_strdup (name);
+  op->arch = g_strdup (arch);
+  op->branch = g_strdup (branch);
+  op->subpaths = g_strdupv ((char **) subpaths);
+  op->full_ref = flatpak_compose_ref (kind == FLATPAK_REF_KIND_APP, name, branch, arch, NULL);
+
+  async_op_run (task, update_thread);
+}
+
+/**
+ * flatpak_installation_update_full_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with flatpak_installation_update_full_async().
+ *
+ * Returns: (transfer full): The ref for the newly updated app or %NULL on failure
+ *
+ * Since: 0.10.0
+ */
+FlatpakInstalledRef *
+flatpak_installation_update_full_finish (FlatpakInstallation *self,
+                                         GAsyncResult        *result,
+                                         GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+uninstall_thread (GTask        *task,
+                  gpointer      source_object,
+                  gpointer      task_data,
+                  GCancellable *cancellable)
+{
+  AsyncOp *op = task_data;
+  GError *error = NULL;
+
+  if (!installation_uninstall (source_object,
+                               op->kind, op->name, op->arch, op->branch,
+                               op->dir, cancellable, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * flatpak_installation_uninstall_async:
+ * @self: a #FlatpakInstallation
+ * @kind: what this ref contains (an #FlatpakRefKind)
+ * @name: name of the app or runtime to uninstall
+ * @arch: (nullable): architecture of the app or runtime to uninstall (default: current architecture)
+ * @branch: (nullable): name of the branch of the app or runtime to uninstall (default: master)
+ * @progress: (nullable): progress callback
+ * @progress_data: (closure progress) (nullable): user data passed to @progress
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the uninstall is done
+ * @user_data: user data for @callback
+ *
+ * Asynchronous version of flatpak_installation_uninstall().
+ *
+ * Since: 0.10.0
+ */
+void
+flatpak_installation_uninstall_async (FlatpakInstallation                *self,
+                                      FlatpakRefKind                      kind,
+                                      const char                         *name,
+                                      const char                         *arch,
+                                      const char                         *branch,
+                                      FlatpakInstallationProgressCallback progress,
+                                      gpointer                            progress_data,
+                                      GCancellable                       *cancellable,
+                                      GAsyncReadyCallback                 callback,
+                                      gpointer                            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOp *op;
+
+  task = async_op_task_new (self, flatpak_installation_uninstall_async,
+                            progress, progress_data, cancellable, callback, user_data, &op);
+  op->kind = kind;
+  op->name = g_strdup (name);
+  op->arch = g_strdup (arch);
+  op->branch = g_strdup (branch);
+  op->full_ref = flatpak_compose_ref (kind == FLATPAK_REF_KIND_APP, name, branch, arch, NULL);
+
+  async_op_run (task, uninstall_thread);
+}
+
+/**
+ * flatpak_installation_uninstall_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with flatpak_installation_uninstall_async().
+ *
+ * Returns: %TRUE on success
+ *
+ * Since: 0.10.0
+ */
+gboolean
+flatpak_installation_uninstall_finish (FlatpakInstallation *self,
+                                       GAsyncResult        *result,
+                                       GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+update_appstream_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  AsyncOp *op = task_data;
+  GError *error = NULL;
+  FlatpakProgressCallback progress;
+  gpointer progress_data;
+  gboolean res;
+
+  progress = async_op_get_progress (task, &progress_data);
+  res = installation_update_appstream (source_object,
+                                       op->remote_name, op->arch,
+                                       progress, progress_data,
+                                       &op->ostree_progress, op->dir,
+                                       &op->changed,
+                                       cancellable, &error);
+  op->ostree_progress = NULL;
+
+  if (!res)
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * flatpak_installation_update_appstream_full_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @arch: Architecture to update, or %NULL for the local machine arch
+ * @progress: (nullable): progress callback
+ * @progress_data: (closure progress) (nullable): user data passed to @progress
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the update is done
+ * @user_data: user data for @callback
+ *
+ * Asynchronous version of flatpak_installation_update_appstream_full_sync().
+ *
+ * Since: 0.10.0
+ */
+void
+flatpak_installation_update_appstream_full_async (FlatpakInstallation                *self,
+                                                  const char                         *remote_name,
+                                                  const char                         *arch,
+                                                  FlatpakInstallationProgressCallback progress,
+                                                  gpointer                            progress_data,
+                                                  GCancellable                       *cancellable,
+                                                  GAsyncReadyCallback                 callback,
+                                                  gpointer                            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOp *op;
+
+  task = async_op_task_new (self, flatpak_installation_update_appstream_full_async,
+                            progress, progress_data, cancellable, callback, user_data, &op);
+  op->remote_name = g_strdup (remote_name);
+  op->arch = g_strdup (arch);
+  op->full_ref = g_strdup_printf ("appstream/%s", arch ? arch : flatpak_get_arch ());
+
+  async_op_run (task, update_appstream_thread);
+}
+
+/**
+ * flatpak_installation_update_appstream_full_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @out_changed: (nullable): Set to %TRUE if the contents of the appstream changed, %FALSE if nothing changed
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with
+ * flatpak_installation_update_appstream_full_async().
+ *
+ * Returns: %TRUE on success, or %FALSE on error
+ *
+ * Since: 0.10.0
+ */
+gboolean
+flatpak_installation_update_appstream_full_finish (FlatpakInstallation *self,
+                                                   GAsyncResult        *result,
+                                                   gboolean            *out_changed,
+                                                   GError             **error)
+{
+  AsyncOp *op;
+
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  if (!g_task_propagate_boolean (G_TASK (result), error))
+    return FALSE;
+
+  op = g_task_get_task_data (G_TASK (result));
+  if (out_changed)
+    *out_changed = op->changed;
+
+  return TRUE;
+}
+
+static void
+fetch_remote_size_thread (GTask        *task,
+                          gpointer      source_object,
+                          gpointer      task_data,
+                          GCancellable *cancellable)
+{
+  AsyncOp *op = task_data;
+  GError *error = NULL;
+
+  if (!flatpak_installation_fetch_remote_size_sync (source_object, op->remote_name, op->ref,
+                                                    &op->download_size, &op->installed_size,
+                                                    cancellable, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * flatpak_installation_fetch_remote_size_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @ref: the ref
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the sizes are available
+ * @user_data: user data for @callback
+ *
+ * Asynchronous version of flatpak_installation_fetch_remote_size_sync().
+ *
+ * Since: 0.10.0
+ */
+void
+flatpak_installation_fetch_remote_size_async (FlatpakInstallation *self,
+                                              const char          *remote_name,
+                                              FlatpakRef          *ref,
+                                              GCancellable        *cancellable,
+                                              GAsyncReadyCallback  callback,
+                                              gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOp *op;
+
+  task = async_op_task_new (self, flatpak_installation_fetch_remote_size_async,
+                            NULL, NULL, cancellable, callback, user_data, &op);
+  op->remote_name = g_strdup (remote_name);
+  op->ref = g_object_ref (ref);
+
+  async_op_run (task, fetch_remote_size_thread);
+}
+
+/**
+ * flatpak_installation_fetch_remote_size_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @download_size: (out) (optional): return location for the (maximum) download size
+ * @installed_size: (out) (optional): return location for the installed size
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with flatpak_installation_fetch_remote_size_async().
+ *
+ * Returns: %TRUE, unless an error occurred
+ *
+ * Since: 0.10.0
+ */
+gboolean
+flatpak_installation_fetch_remote_size_finish (FlatpakInstallation *self,
+                                               GAsyncResult        *result,
+                                               guint64             *download_size,
+                                               guint64             *installed_size,
+                                               GError             **error)
+{
+  AsyncOp *op;
+
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  if (!g_task_propagate_boolean (G_TASK (result), error))
+    return FALSE;
+
+  op = g_task_get_task_data (G_TASK (result));
+  if (download_size)
+    *download_size = op->download_size;
+  if (installed_size)
+    *installed_size = op->installed_size;
+
+  return TRUE;
+}
+
+static void
+fetch_remote_metadata_thread (GTask        *task,
+                              gpointer      source_object,
+                              gpointer      task_data,
+                              GCancellable *cancellable)
+{
+  AsyncOp *op = task_data;
+  GError *error = NULL;
+  GBytes *metadata;
+
+  metadata = flatpak_installation_fetch_remote_metadata_sync (source_object, op->remote_name, op->ref,
+                                                              cancellable, &error);
+  if (metadata == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, metadata, (GDestroyNotify) g_bytes_unref);
+}
+
+/**
+ * flatpak_installation_fetch_remote_metadata_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @ref: the ref
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the metadata is available
+ * @user_data: user data for @callback
+ *
+ * Asynchronous version of flatpak_installation_fetch_remote_metadata_sync().
+ *
+ * Since: 0.10.0
+ */
+void
+flatpak_installation_fetch_remote_metadata_async (FlatpakInstallation *self,
+                                                  const char          *remote_name,
+                                                  FlatpakRef          *ref,
+                                                  GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOp *op;
+
+  task = async_op_task_new (self, flatpak_installation_fetch_remote_metadata_async,
+                            NULL, NULL, cancellable, callback, user_data, &op);
+  op->remote_name = g_strdup (remote_name);
+  op->ref = g_object_ref (ref);
+
+  async_op_run (task, fetch_remote_metadata_thread);
+}
+
+/**
+ * flatpak_installation_fetch_remote_metadata_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with flatpak_installation_fetch_remote_metadata_async().
+ *
+ * Returns: (transfer full): a #GBytes containing the flatpak metadata file,
+ *   or %NULL if an error occurred
+ *
+ * Since: 0.10.0
+ */
+GBytes *
+flatpak_installation_fetch_remote_metadata_finish (FlatpakInstallation *self,
+                                                   GAsyncResult        *result,
+                                                   GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+list_remote_refs_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  AsyncOp *op = task_data;
+  GError *error = NULL;
+  GPtrArray *refs;
+
+  refs = flatpak_installation_list_remote_refs_sync (source_object, op->remote_name,
+                                                     cancellable, &error);
+  if (refs == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, refs, (GDestroyNotify) g_ptr_array_unref);
+}
+
+/**
+ * flatpak_installation_list_remote_refs_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the refs are available
+ * @user_data: user data for @callback
+ *
+ * Asynchronous version of flatpak_installation_list_remote_refs_sync().
+ *
+ * Since: 0.10.0
+ */
+void
+flatpak_installation_list_remote_refs_async (FlatpakInstallation *self,
+                                             const char          *remote_name,
+                                             GCancellable        *cancellable,
+                                             GAsyncReadyCallback  callback,
+                                             gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOp *op;
+
+  task = async_op_task_new (self, flatpak_installation_list_remote_refs_async,
+                            NULL, NULL, cancellable, callback, user_data, &op);
+  op->remote_name = g_strdup (remote_name);
+
+  async_op_run (task, list_remote_refs_thread);
+}
+
+/**
+ * flatpak_installation_list_remote_refs_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with flatpak_installation_list_remote_refs_async().
+ *
+ * Returns: (transfer container) (element-type FlatpakRemoteRef): an GPtrArray of
+ *   #FlatpakRemoteRef instances
+ *
+ * Since: 0.10.0
+ */
+GPtrArray *
+flatpak_installation_list_remote_refs_finish (FlatpakInstallation *self,
+                                              GAsyncResult        *result,
+                                              GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
@@ -134,6 +134,86 @@ typedef void (*FlatpakProgressCallback)(const char *status,
                                         gboolean    estimating,
                                         gpointer    user_data);
 
+/**
+ * FlatpakInstallationUpdatesFoundCallback:
+ * @self: the #FlatpakInstallation
+ * @remote_name: the remote that was checked
+ * @updates: (element-type FlatpakInstalledRef): the installed refs from
+ *   @remote_name that have an update
+ * @user_data: User data passed to the caller
+ *
+ * Called by flatpak_installation_list_installed_refs_for_update_async()
+ * each time a remote has been checked and updates were found in it.
+ *
+ * Since: 0.10.0
+ */
+typedef void (*FlatpakInstallationUpdatesFoundCallback)(FlatpakInstallation *self,
+                                                        const char          *remote_name,
+                                                        GPtrArray           *updates,
+                                                        gpointer             user_data);
+
+/**
+ * FlatpakProgressEvent:
+ * @ref: the ref the operation is working on
+ * @status: A status string, suitable for display
+ * @progress: percentage of completion
+ * @estimating: whether @progress is just an estimate
+ * @bytes_transferred: number of bytes downloaded so far
+ * @start_time: monotonic time (in microseconds) when the download started,
+ *   or 0 if unknown
+ *
+ * Progress information reported by the _async variants of the
+ * #FlatpakInstallation operations.
+ *
+ * Since: 0.10.0
+ */
+typedef struct
+{
+  char    *ref;
+  char    *status;
+  guint    progress;
+  gboolean estimating;
+  guint64  bytes_transferred;
+  guint64  start_time;
+} FlatpakProgressEvent;
+
+#define FLATPAK_TYPE_PROGRESS_EVENT flatpak_progress_event_get_type ()
+
+FLATPAK_EXTERN GType                 flatpak_progress_event_get_type (void);
+FLATPAK_EXTERN FlatpakProgressEvent *flatpak_progress_event_copy (const FlatpakProgressEvent *event);
+FLATPAK_EXTERN void                  flatpak_progress_event_free (FlatpakProgressEvent *event);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakProgressEvent, flatpak_progress_event_free)
+
+/**
+ * FlatpakInstallationProgressCallback:
+ * @self: the #FlatpakInstallation
+ * @event: the progress information
+ * @user_data: User data passed to the caller
+ *
+ * The progress callback of the _async variants of the operations. It
+ * occurs in the thread-default context of the caller of the _async
+ * function, even though the operation itself runs in a worker thread.
+ *
+ * Since: 0.10.0
+ */
+typedef void (*FlatpakInstallationProgressCallback)(FlatpakInstallation        *self,
+                                                    const FlatpakProgressEvent *event,
+                                                    gpointer                    user_data);
+
+/**
+ * FlatpakRemoteRefInfoCallback:
+ * @ref: a #FlatpakRemoteRef with sizes and metadata set
+ * @user_data: User data passed to the caller
+ *
+ * Called by flatpak_installation_foreach_remote_ref_info_sync() for each
+ * ref that was found.
+ *
+ * Since: 0.10.0
+ */
+typedef void (*FlatpakRemoteRefInfoCallback)(FlatpakRemoteRef *ref,
+                                             gpointer          user_data);
+
 FLATPAK_EXTERN gboolean             flatpak_installation_drop_caches (FlatpakInstallation *self,
                                                                       GCancellable        *cancellable,
                                                                       GError             **error);
@@ -153,6 +233,14 @@ FLATPAK_EXTERN gboolean             flatpak_installation_launch (FlatpakInstalla
 FLATPAK_EXTERN GFileMonitor        *flatpak_installation_create_monitor (FlatpakInstallation *self,
                                                                          GCancellable        *cancellable,
                                                                          GError             **error);
+FLATPAK_EXTERN guint64              flatpak_installation_get_generation (FlatpakInstallation *self,
+                                                                         GCancellable        *cancellable,
+                                                                         GError             **error);
+FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_changes_since (FlatpakInstallation *self,
+                                                                             guint64              generation,
+                                                                             guint64             *out_generation,
+                                                                             GCancellable        *cancellable,
+                                                                             GError             **error);
 FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_installed_refs (FlatpakInstallation *self,
                                                                               GCancellable        *cancellable,
                                                                               GError             **error);
@@ -163,6 +251,15 @@ FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_installed_refs_by_
 FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
                                                                                          GCancellable        *cancellable,
                                                                                          GError             **error);
+FLATPAK_EXTERN void                 flatpak_installation_list_installed_refs_for_update_async (FlatpakInstallation                    *self,
+                                                                                               FlatpakInstallationUpdatesFoundCallback found_cb,
+                                                                                               gpointer                                found_data,
+                                                                                               GCancellable                           *cancellable,
+                                                                                               GAsyncReadyCallback                     callback,
+                                                                                               gpointer                                user_data);
+FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_installed_refs_for_update_finish (FlatpakInstallation *self,
+                                                                                                GAsyncResult        *result,
+                                                                                                GError             **error);
 FLATPAK_EXTERN FlatpakInstalledRef * flatpak_installation_get_installed_ref (FlatpakInstallation *self,
                                                                              FlatpakRefKind       kind,
                                                                              const char          *name,
@@ -260,6 +357,51 @@ FLATPAK_EXTERN gboolean             flatpak_installation_uninstall (FlatpakInsta
                                                                     GCancellable           *cancellable,
                                                                     GError                **error);
 
+FLATPAK_EXTERN void                  flatpak_installation_install_full_async (FlatpakInstallation                *self,
+                                                                              FlatpakInstallFlags                 flags,
+                                                                              const char                         *remote_name,
+                                                                              FlatpakRefKind                      kind,
+                                                                              const char                         *name,
+                                                                              const char                         *arch,
+                                                                              const char                         *branch,
+                                                                              const char * const                 *subpaths,
+                                                                              FlatpakInstallationProgressCallback progress,
+                                                                              gpointer                            progress_data,
+                                                                              GCancellable                       *cancellable,
+                                                                              GAsyncReadyCallback                 callback,
+                                                                              gpointer                            user_data);
+FLATPAK_EXTERN FlatpakInstalledRef * flatpak_installation_install_full_finish (FlatpakInstallation *self,
+                                                                               GAsyncResult        *result,
+                                                                               GError             **error);
+FLATPAK_EXTERN void                  flatpak_installation_update_full_async (FlatpakInstallation                *self,
+                                                                             FlatpakUpdateFlags                  flags,
+                                                                             FlatpakRefKind                      kind,
+                                                                             const char                         *name,
+                                                                             const char                         *arch,
+                                                                             const char                         *branch,
+                                                                             const char * const                 *subpaths,
+                                                                             FlatpakInstallationProgressCallback progress,
+                                                                             gpointer                            progress_data,
+                                                                             GCancellable                       *cancellable,
+                                                                             GAsyncReadyCallback                 callback,
+                                                                             gpointer                            user_data);
+FLATPAK_EXTERN FlatpakInstalledRef * flatpak_installation_update_full_finish (FlatpakInstallation *self,
+                                                                              GAsyncResult        *result,
+                                                                              GError             **error);
+FLATPAK_EXTERN void                  flatpak_installation_uninstall_async (FlatpakInstallation                *self,
+                                                                           FlatpakRefKind                      kind,
+                                                                           const char                         *name,
+                                                                           const char                         *arch,
+                                                                           const char                         *branch,
+                                                                           FlatpakInstallationProgressCallback progress,
+                                                                           gpointer                            progress_data,
+                                                                           GCancellable                       *cancellable,
+                                                                           GAsyncReadyCallback                 callback,
+                                                                           gpointer                            user_data);
+FLATPAK_EXTERN gboolean              flatpak_installation_uninstall_finish (FlatpakInstallation *self,
+                                                                            GAsyncResult        *result,
+                                                                            GError             **error);
+
 FLATPAK_EXTERN gboolean          flatpak_installation_fetch_remote_size_sync (FlatpakInstallation *self,
                                                                               const char          *remote_name,
                                                                               FlatpakRef          *ref,
@@ -272,6 +414,18 @@ FLATPAK_EXTERN GBytes        *   flatpak_installation_fetch_remote_metadata_sync
                                                                                   FlatpakRef          *ref,
                                                                                   GCancellable        *cancellable,
                                                                                   GError             **error);
+FLATPAK_EXTERN gboolean          flatpak_installation_foreach_remote_ref_info_sync (FlatpakInstallation         *self,
+                                                                                    const char                  *remote_name,
+                                                                                    const char * const          *refs,
+                                                                                    FlatpakRemoteRefInfoCallback callback,
+                                                                                    gpointer                     user_data,
+                                                                                    GCancellable                *cancellable,
+                                                                                    GError                     **error);
+FLATPAK_EXTERN GPtrArray    *    flatpak_installation_fetch_remote_refs_info_sync (FlatpakInstallation *self,
+                                                                                   const char          *remote_name,
+                                                                                   const char * const  *refs,
+                                                                                   GCancellable        *cancellable,
+                                                                                   GError             **error);
 FLATPAK_EXTERN GPtrArray    *    flatpak_installation_list_remote_refs_sync (FlatpakInstallation *self,
                                                                              const char          *remote_name,
                                                                              GCancellable        *cancellable,
@@ -298,6 +452,55 @@ FLATPAK_EXTERN gboolean          flatpak_installation_update_appstream_full_sync
                                                                                   gboolean            *out_changed,
                                                                                   GCancellable        *cancellable,
                                                                                   GError             **error);
+FLATPAK_EXTERN void              flatpak_installation_fetch_remote_size_async (FlatpakInstallation *self,
+                                                                               const char          *remote_name,
+                                                                               FlatpakRef          *ref,
+                                                                               GCancellable        *cancellable,
+                                                                               GAsyncReadyCallback  callback,
+                                                                               gpointer             user_data);
+FLATPAK_EXTERN gboolean          flatpak_installation_fetch_remote_size_finish (FlatpakInstallation *self,
+                                                                                GAsyncResult        *result,
+                                                                                guint64             *download_size,
+                                                                                guint64             *installed_size,
+                                                                                GError             **error);
+FLATPAK_EXTERN void              flatpak_installation_fetch_remote_metadata_async (FlatpakInstallation *self,
+                                                                                   const char          *remote_name,
+                                                                                   FlatpakRef          *ref,
+                                                                                   GCancellable        *cancellable,
+                                                                                   GAsyncReadyCallback  callback,
+                                                                                   gpointer             user_data);
+FLATPAK_EXTERN GBytes        *   flatpak_installation_fetch_remote_metadata_finish (FlatpakInstallation *self,
+                                                                                    GAsyncResult        *result,
+                                                                                    GError             **error);
+FLATPAK_EXTERN void              flatpak_installation_list_remote_refs_async (FlatpakInstallation *self,
+                                                                              const char          *remote_name,
+                                                                              GCancellable        *cancellable,
+                                                                              GAsyncReadyCallback  callback,
+                                                                              gpointer             user_data);
+FLATPAK_EXTERN GPtrArray    *    flatpak_installation_list_remote_refs_finish (FlatpakInstallation *self,
+                                                                               GAsyncResult        *result,
+                                                                               GError             **error);
+FLATPAK_EXTERN void              flatpak_installation_update_appstream_full_async (FlatpakInstallation                *self,
+                                                                                   const char                         *remote_name,
+                                                                                   const char                         *arch,
+                                                                                   FlatpakInstallationProgressCallback progress,
+                                                                                   gpointer                            progress_data,
+                                                                                   GCancellable                       *cancellable,
+                                                                                   GAsyncReadyCallback                 callback,
+                                                                                   gpointer                            user_data);
+FLATPAK_EXTERN gboolean          flatpak_installation_update_appstream_full_finish (FlatpakInstallation *self,
+                                                                                    GAsyncResult        *result,
+                                                                                    gboolean            *out_changed,
+                                                                                    GError             **error);
+FLATPAK_EXTERN gboolean          flatpak_installation_lookup_appstream_component (FlatpakInstallation *self,
+                                                                                  const char          *remote_name,
+                                                                                  const char          *arch,
+                                                                                  const char          *component_id,
+                                                                                  char               **out_name,
+                                                                                  char               **out_summary,
+                                                                                  char               **out_icon,
+                                                                                  char              ***out_keywords,
+                                                                                  GError             **error);
 FLATPAK_EXTERN GPtrArray    *    flatpak_installation_list_remote_related_refs_sync (FlatpakInstallation *self,
                                                                                      const char          *remote_name,
                                                                                      const char          *ref,
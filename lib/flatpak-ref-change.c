@@ -0,0 +1,257 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "flatpak-utils.h"
+#include "flatpak-ref-change.h"
+#include "flatpak-ref-change-private.h"
+#include "flatpak-enum-types.h"
+
+/**
+ * SECTION:flatpak-ref-change
+ * @Title: FlatpakRefChange
+ * @Short_description: Recorded change to an installation
+ *
+ * A FlatpakRefChange describes one install, update or uninstall
+ * operation in an installation, as returned by
+ * flatpak_installation_list_changes_since(). The commit of the
+ * #FlatpakRef is the commit deployed after the change, which is
+ * %NULL for uninstalls.
+ *
+ * Since: 0.10.0
+ */
+
+typedef struct _FlatpakRefChangePrivate FlatpakRefChangePrivate;
+
+struct _FlatpakRefChangePrivate
+{
+  FlatpakRefChangeType change_type;
+  guint64              generation;
+  char                *old_commit;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (FlatpakRefChange, flatpak_ref_change, FLATPAK_TYPE_REF)
+
+enum {
+  PROP_0,
+
+  PROP_CHANGE_TYPE,
+  PROP_GENERATION,
+  PROP_OLD_COMMIT,
+};
+
+static void
+flatpak_ref_change_finalize (GObject *object)
+{
+  FlatpakRefChange *self = FLATPAK_REF_CHANGE (object);
+  FlatpakRefChangePrivate *priv = flatpak_ref_change_get_instance_private (self);
+
+  g_free (priv->old_commit);
+
+  G_OBJECT_CLASS (flatpak_ref_change_parent_class)->finalize (object);
+}
+
+static void
+flatpak_ref_change_set_property (GObject      *object,
+                                 guint         prop_id,
+                                 const GValue *value,
+                                 GParamSpec   *pspec)
+{
+  FlatpakRefChange *self = FLATPAK_REF_CHANGE (object);
+  FlatpakRefChangePrivate *priv = flatpak_ref_change_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_CHANGE_TYPE:
+      priv->change_type = g_value_get_enum (value);
+      break;
+
+    case PROP_GENERATION:
+      priv->generation = g_value_get_uint64 (value);
+      break;
+
+    case PROP_OLD_COMMIT:
+      g_clear_pointer (&priv->old_commit, g_free);
+      priv->old_commit = g_value_dup_string (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+flatpak_ref_change_get_property (GObject    *object,
+                                 guint       prop_id,
+                                 GValue     *value,
+                                 GParamSpec *pspec)
+{
+  FlatpakRefChange *self = FLATPAK_REF_CHANGE (object);
+  FlatpakRefChangePrivate *priv = flatpak_ref_change_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_CHANGE_TYPE:
+      g_value_set_enum (value, priv->change_type);
+      break;
+
+    case PROP_GENERATION:
+      g_value_set_uint64 (value, priv->generation);
+      break;
+
+    case PROP_OLD_COMMIT:
+      g_value_set_string (value, priv->old_commit);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+flatpak_ref_change_class_init (FlatpakRefChangeClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->get_property = flatpak_ref_change_get_property;
+  object_class->set_property = flatpak_ref_change_set_property;
+  object_class->finalize = flatpak_ref_change_finalize;
+
+  g_object_class_install_property (object_class,
+                                   PROP_CHANGE_TYPE,
+                                   g_param_spec_enum ("change-type",
+                                                      "Change type",
+                                                      "The kind of change",
+                                                      FLATPAK_TYPE_REF_CHANGE_TYPE,
+                                                      FLATPAK_REF_CHANGE_TYPE_INSTALL,
+                                                      G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_GENERATION,
+                                   g_param_spec_uint64 ("generation",
+                                                        "Generation",
+                                                        "The generation of the installation after the change",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_OLD_COMMIT,
+                                   g_param_spec_string ("old-commit",
+                                                        "Old commit",
+                                                        "The commit deployed before the change",
+                                                        NULL,
+                                                        G_PARAM_READWRITE));
+}
+
+static void
+flatpak_ref_change_init (FlatpakRefChange *self)
+{
+}
+
+/**
+ * flatpak_ref_change_get_change_type:
+ * @self: a #FlatpakRefChange
+ *
+ * Returns whether the ref was installed, updated or uninstalled.
+ *
+ * Returns: a #FlatpakRefChangeType
+ *
+ * Since: 0.10.0
+ */
+FlatpakRefChangeType
+flatpak_ref_change_get_change_type (FlatpakRefChange *self)
+{
+  FlatpakRefChangePrivate *priv = flatpak_ref_change_get_instance_private (self);
+
+  return priv->change_type;
+}
+
+/**
+ * flatpak_ref_change_get_generation:
+ * @self: a #FlatpakRefChange
+ *
+ * Returns the generation of the installation right after this change.
+ *
+ * Returns: the generation
+ *
+ * Since: 0.10.0
+ */
+guint64
+flatpak_ref_change_get_generation (FlatpakRefChange *self)
+{
+  FlatpakRefChangePrivate *priv = flatpak_ref_change_get_instance_private (self);
+
+  return priv->generation;
+}
+
+/**
+ * flatpak_ref_change_get_old_commit:
+ * @self: a #FlatpakRefChange
+ *
+ * Returns the commit that was deployed before the change. This is
+ * %NULL for installs.
+ *
+ * Returns: (transfer none) (nullable): the old commit
+ *
+ * Since: 0.10.0
+ */
+const char *
+flatpak_ref_change_get_old_commit (FlatpakRefChange *self)
+{
+  FlatpakRefChangePrivate *priv = flatpak_ref_change_get_instance_private (self);
+
+  return priv->old_commit;
+}
+
+
+FlatpakRefChange *
+flatpak_ref_change_new_from_variant (GVariant *entry)
+{
+  FlatpakRefKind kind = FLATPAK_REF_KIND_APP;
+  FlatpakRefChangeType change_type;
+  guint64 generation;
+  const char *op, *full_ref, *old_commit, *new_commit;
+  g_auto(GStrv) parts = NULL;
+
+  g_variant_get (entry, "(t&s&s&s&s)", &generation, &op, &full_ref, &old_commit, &new_commit);
+
+  parts = flatpak_decompose_ref (full_ref, NULL);
+  if (parts == NULL)
+    return NULL;
+
+  if (strcmp (parts[0], "app") != 0)
+    kind = FLATPAK_REF_KIND_RUNTIME;
+
+  if (strcmp (op, "install") == 0)
+    change_type = FLATPAK_REF_CHANGE_TYPE_INSTALL;
+  else if (strcmp (op, "uninstall") == 0)
+    change_type = FLATPAK_REF_CHANGE_TYPE_UNINSTALL;
+  else
+    change_type = FLATPAK_REF_CHANGE_TYPE_UPDATE;
+
+  return g_object_new (FLATPAK_TYPE_REF_CHANGE,
+                       "kind", kind,
+                       "name", parts[1],
+                       "arch", parts[2],
+                       "branch", parts[3],
+                       "commit", *new_commit ? new_commit : NULL,
+                       "old-commit", *old_commit ? old_commit : NULL,
+                       "change-type", change_type,
+                       "generation", generation,
+                       NULL);
+}
@@ -0,0 +1,68 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(__FLATPAK_H_INSIDE__) && !defined(FLATPAK_COMPILATION)
+#error "Only <flatpak.h> can be included directly."
+#endif
+
+#ifndef __FLATPAK_REF_CHANGE_H__
+#define __FLATPAK_REF_CHANGE_H__
+
+typedef struct _FlatpakRefChange FlatpakRefChange;
+
+#include <gio/gio.h>
+#include <flatpak-ref.h>
+
+#define FLATPAK_TYPE_REF_CHANGE flatpak_ref_change_get_type ()
+#define FLATPAK_REF_CHANGE(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), FLATPAK_TYPE_REF_CHANGE, FlatpakRefChange))
+#define FLATPAK_IS_REF_CHANGE(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), FLATPAK_TYPE_REF_CHANGE))
+
+FLATPAK_EXTERN GType flatpak_ref_change_get_type (void);
+
+struct _FlatpakRefChange
+{
+  FlatpakRef parent;
+};
+
+typedef struct
+{
+  FlatpakRefClass parent_class;
+} FlatpakRefChangeClass;
+
+#ifdef G_DEFINE_AUTOPTR_CLEANUP_FUNC
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakRefChange, g_object_unref)
+#endif
+
+/**
+ * FlatpakRefChangeType:
+ * @FLATPAK_REF_CHANGE_TYPE_INSTALL: The ref was installed
+ * @FLATPAK_REF_CHANGE_TYPE_UPDATE: The ref was updated to a new commit
+ * @FLATPAK_REF_CHANGE_TYPE_UNINSTALL: The ref was uninstalled
+ *
+ * The kind of change recorded in a #FlatpakRefChange.
+ *
+ * Since: 0.10.0
+ */
+typedef enum {
+  FLATPAK_REF_CHANGE_TYPE_INSTALL,
+  FLATPAK_REF_CHANGE_TYPE_UPDATE,
+  FLATPAK_REF_CHANGE_TYPE_UNINSTALL,
+} FlatpakRefChangeType;
+
+FLATPAK_EXTERN FlatpakRefChangeType flatpak_ref_change_get_change_type (FlatpakRefChange *self);
+FLATPAK_EXTERN guint64              flatpak_ref_change_get_generation (FlatpakRefChange *self);
+FLATPAK_EXTERN const char *         flatpak_ref_change_get_old_commit (FlatpakRefChange *self);
+
+#endif /* __FLATPAK_REF_CHANGE_H__ */
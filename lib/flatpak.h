@@ -32,6 +32,7 @@
 #include <flatpak-installed-ref.h>
 #include <flatpak-remote-ref.h>
 #include <flatpak-related-ref.h>
+#include <flatpak-ref-change.h>
 #include <flatpak-bundle-ref.h>
 #include <flatpak-remote.h>
 #include <flatpak-installation.h>
@@ -1123,6 +1123,7 @@ main (int    argc,
   GBusNameOwnerFlags flags;
   GOptionContext *context;
   g_autoptr(GError) error = NULL;
+  guint64 reclaimed;
   const GOptionEntry options[] = {
     { "replace", 'r', 0, G_OPTION_ARG_NONE, &replace,  "Replace old daemon.", NULL },
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,  "Enable debug output.", NULL },
@@ -1218,5 +1219,14 @@ main (int    argc,
   main_loop = g_main_loop_new (NULL, FALSE);
   g_main_loop_run (main_loop);
 
+  /* The removals outlive the calls that queued them, so they can't be
+     reported to the callers */
+  reclaimed = flatpak_dir_wait_for_removed_cleanup (NULL, NULL);
+  if (reclaimed > 0)
+    {
+      g_autofree char *formatted = g_format_size (reclaimed);
+      g_message ("Reclaimed %s from old deployments", formatted);
+    }
+
   return 0;
 }
@@ -0,0 +1,57 @@
+#!/bin/bash
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+# Times shell completion of refs, which should never hit the network
+# and should take well under 10ms per TAB press.
+#
+# Usage: bench-completion.sh REMOTE [PREFIX] [ITERATIONS]
+#
+# This is not run as part of the testsuite. Fetch the summary of
+# REMOTE once first (for instance with remote-ls) so that its refs
+# are indexed.
+
+set -euo pipefail
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 REMOTE [PREFIX] [ITERATIONS]" >&2
+    exit 1
+fi
+
+FLATPAK=${FLATPAK:-flatpak}
+REMOTE=$1
+PREFIX=${2:-org.}
+ITERATIONS=${3:-100}
+
+now () {
+    date +%s%N
+}
+
+printf "%-12s %10s %12s\n" "command" "matches" "ms/complete"
+
+for command in "install $REMOTE" "uninstall" "update"; do
+    line="flatpak $command $PREFIX"
+    matches=$(${FLATPAK} complete "$line" ${#line} "$PREFIX" | wc -l)
+
+    start=$(now)
+    for i in $(seq $ITERATIONS); do
+        ${FLATPAK} complete "$line" ${#line} "$PREFIX" > /dev/null
+    done
+    end=$(now)
+
+    printf "%-12s %10s %12.2f\n" "${command%% *}" $matches \
+           $(echo "($end - $start) / $ITERATIONS / 1000000" | bc -l)
+done
@@ -0,0 +1,74 @@
+#!/bin/bash
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+# Times build-bundle at the various compression levels, for both
+# regular bundles and OCI images.
+#
+# Usage: bench-compression.sh REPO NAME [BRANCH] [BUILD-BUNDLE-OPTIONS...]
+#
+# This is not run as part of the testsuite. Point it at a repo with
+# a reasonably large ref (such as a runtime) to get useful numbers.
+
+set -euo pipefail
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 REPO NAME [BRANCH] [BUILD-BUNDLE-OPTIONS...]" >&2
+    exit 1
+fi
+
+FLATPAK=${FLATPAK:-flatpak}
+REPO=$1
+NAME=$2
+shift 2
+ARGS=("$@")
+
+export FLATPAK_ENABLE_EXPERIMENTAL_OCI=1
+
+WORKDIR=$(mktemp -d /tmp/flatpak-bench-XXXXXX)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+now () {
+    date +%s.%N
+}
+
+printf "%-8s %-6s %10s %14s\n" "format" "level" "seconds" "bytes"
+
+for format in bundle oci; do
+    for level in 0 1 3 6 9; do
+        # Regular bundles are either uncompressed or xz
+        if [ $format = bundle ] && [ $level -gt 1 ]; then
+            continue
+        fi
+
+        out=$WORKDIR/$format-$level
+        if [ $format = oci ]; then
+            FORMAT_ARGS=(--oci)
+        else
+            FORMAT_ARGS=()
+        fi
+
+        start=$(now)
+        ${FLATPAK} build-bundle ${FORMAT_ARGS[@]+"${FORMAT_ARGS[@]}"} --compression-level=$level \
+                   "$REPO" "$out" "$NAME" ${ARGS[@]+"${ARGS[@]}"} > /dev/null
+        end=$(now)
+
+        size=$(du -sb "$out" | cut -f1)
+        printf "%-8s %-6s %10.2f %14s\n" $format $level $(echo "$end - $start" | bc) $size
+
+        rm -rf "$out"
+    done
+done
@@ -0,0 +1,288 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmarks for hot paths in the common code. This is run by
+ * `make bench` through tests/bench.sh, and prints one JSON object per
+ * line in the same format as the macrobenchmarks there. */
+
+#include "config.h"
+
+#include <signal.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <ostree.h>
+
+#include "flatpak-utils.h"
+#include "flatpak-db.h"
+
+#define FAKE_CHECKSUM "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+
+static int opt_n = 10000;
+static int opt_iterations = 100000;
+
+static GOptionEntry options[] = {
+  { "n", 'n', 0, G_OPTION_ARG_INT, &opt_n, "Size of the generated data", "N" },
+  { "iterations", 'i', 0, G_OPTION_ARG_INT, &opt_iterations, "Number of operations to time", "ITERATIONS" },
+  { NULL }
+};
+
+static void
+report (const char *name,
+        guint       n,
+        guint       iterations,
+        gint64      usec)
+{
+  g_print ("{\"benchmark\":\"%s\",\"n\":%u,\"iterations\":%u,\"seconds\":%.6f,\"usec_per_op\":%.3f}\n",
+           name, n, iterations, usec / (double) G_USEC_PER_SEC,
+           iterations > 0 ? usec / (double) iterations : 0.0);
+}
+
+static char *
+bench_app_ref (guint i)
+{
+  return g_strdup_printf ("app/org.bench.App%06u/x86_64/master", i);
+}
+
+static GVariant *
+make_summary (guint n)
+{
+  g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GVariant) csum = NULL;
+  GVariantBuilder refs_builder;
+  GVariantBuilder extensions_builder;
+  guint i;
+
+  for (i = 0; i < n; i++)
+    {
+      g_ptr_array_add (refs, bench_app_ref (i));
+      g_ptr_array_add (refs, g_strdup_printf ("runtime/org.bench.App%06u.Locale/x86_64/master", i));
+    }
+  g_ptr_array_sort (refs, flatpak_strcmp0_ptr);
+
+  csum = g_variant_ref_sink (ostree_checksum_to_bytes_v (FAKE_CHECKSUM));
+
+  g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(s(taya{sv}))"));
+  for (i = 0; i < refs->len; i++)
+    g_variant_builder_add (&refs_builder, "(s(t@aya{sv}))",
+                           g_ptr_array_index (refs, i), (guint64) 0, csum, NULL);
+
+  g_variant_builder_init (&extensions_builder, G_VARIANT_TYPE_VARDICT);
+
+  return g_variant_ref_sink (g_variant_new ("(@a(s(taya{sv}))@a{sv})",
+                                            g_variant_builder_end (&refs_builder),
+                                            g_variant_builder_end (&extensions_builder)));
+}
+
+static void
+bench_summary (void)
+{
+  g_autoptr(GVariant) summary = make_summary (opt_n);
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  gint64 start;
+  int i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      g_autofree char *ref = bench_app_ref (g_rand_int_range (rand, 0, opt_n));
+      g_autofree char *checksum = NULL;
+
+      if (!flatpak_summary_lookup_ref (summary, NULL, ref, &checksum, NULL))
+        g_error ("Ref %s not found in summary", ref);
+    }
+  report ("summary-lookup", opt_n, opt_iterations, g_get_monotonic_time () - start);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      g_autofree char *ref = bench_app_ref (g_rand_int_range (rand, 0, opt_n));
+      g_auto(GStrv) subrefs = flatpak_summary_match_subrefs (summary, NULL, ref);
+
+      if (subrefs == NULL || subrefs[0] == NULL)
+        g_error ("No subrefs of %s found in summary", ref);
+    }
+  report ("summary-match-subrefs", opt_n, opt_iterations, g_get_monotonic_time () - start);
+}
+
+static void
+bench_db (void)
+{
+  g_autoptr(FlatpakDb) db = NULL;
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  g_autoptr(GError) error = NULL;
+  const char *permissions[] = { "read", "write", NULL };
+  gint64 start;
+  int i;
+
+  db = flatpak_db_new (NULL, FALSE, &error);
+  g_assert_no_error (error);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_n; i++)
+    {
+      g_autofree char *id = g_strdup_printf ("id%06d", i);
+      g_autofree char *app = g_strdup_printf ("org.bench.App%d", i % 100);
+      g_autoptr(FlatpakDbEntry) entry = flatpak_db_entry_new (g_variant_new_string (id));
+      g_autoptr(FlatpakDbEntry) new_entry = flatpak_db_entry_set_app_permissions (entry, app, permissions);
+
+      flatpak_db_set_entry (db, id, new_entry);
+    }
+  report ("db-set", opt_n, opt_n, g_get_monotonic_time () - start);
+
+  start = g_get_monotonic_time ();
+  flatpak_db_update (db);
+  report ("db-update", opt_n, 1, g_get_monotonic_time () - start);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      g_autofree char *id = g_strdup_printf ("id%06d", g_rand_int_range (rand, 0, opt_n));
+      g_autoptr(FlatpakDbEntry) entry = flatpak_db_lookup (db, id);
+
+      if (entry == NULL)
+        g_error ("Entry %s not found in db", id);
+    }
+  report ("db-lookup", opt_n, opt_iterations, g_get_monotonic_time () - start);
+}
+
+static void
+get_id_cb (GObject      *source,
+           GAsyncResult *res,
+           gpointer      user_data)
+{
+  guint *pending = user_data;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) error = NULL;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), res, &error);
+  g_assert_no_error (error);
+
+  (*pending)--;
+}
+
+static void
+time_bus_calls (const char *name,
+                const char *address)
+{
+  g_autoptr(GDBusConnection) conn = NULL;
+  g_autoptr(GError) error = NULL;
+  guint pending = 0;
+  gint64 start;
+  int i;
+
+  conn = g_dbus_connection_new_for_address_sync (address,
+                                                 G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                 G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                 NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      pending++;
+      g_dbus_connection_call (conn, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                              "org.freedesktop.DBus", "GetId", NULL, G_VARIANT_TYPE ("(s)"),
+                              G_DBUS_CALL_FLAGS_NONE, -1, NULL, get_id_cb, &pending);
+
+      /* Keep a bounded number of calls in flight */
+      while (pending >= 64)
+        g_main_context_iteration (NULL, TRUE);
+    }
+  while (pending > 0)
+    g_main_context_iteration (NULL, TRUE);
+  report (name, 0, opt_iterations, g_get_monotonic_time () - start);
+}
+
+static void
+bench_dbus_proxy (void)
+{
+  const char *proxy = g_getenv ("FLATPAK_DBUSPROXY");
+  const char *bus_address = g_getenv ("DBUS_SESSION_BUS_ADDRESS");
+  g_autofree char *tmpdir = NULL;
+  g_autofree char *socket_path = NULL;
+  g_autofree char *proxy_address = NULL;
+  g_autoptr(GError) error = NULL;
+  const char *argv[] = { proxy, bus_address, NULL, "--filter", NULL };
+  GPid pid;
+  int i;
+
+  if (proxy == NULL || bus_address == NULL)
+    {
+      g_printerr ("Skipping dbus-proxy benchmark, FLATPAK_DBUSPROXY or DBUS_SESSION_BUS_ADDRESS not set\n");
+      return;
+    }
+
+  time_bus_calls ("dbus-direct", bus_address);
+
+  tmpdir = g_dir_make_tmp ("flatpak-bench-XXXXXX", &error);
+  g_assert_no_error (error);
+  socket_path = g_build_filename (tmpdir, "bus", NULL);
+  argv[2] = socket_path;
+
+  if (!g_spawn_async (NULL, (char **) argv, NULL, G_SPAWN_DEFAULT, NULL, NULL, &pid, &error))
+    g_error ("Failed to start %s: %s", proxy, error->message);
+
+  for (i = 0; i < 500 && !g_file_test (socket_path, G_FILE_TEST_EXISTS); i++)
+    g_usleep (10000);
+
+  proxy_address = g_strdup_printf ("unix:path=%s", socket_path);
+  time_bus_calls ("dbus-proxy", proxy_address);
+
+  kill (pid, SIGTERM);
+  g_spawn_close_pid (pid);
+  (void) unlink (socket_path);
+  (void) rmdir (tmpdir);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  int i;
+
+  context = g_option_context_new ("[BENCHMARK...] - run flatpak microbenchmarks");
+  g_option_context_set_summary (context, "Benchmarks: summary, db, dbus-proxy. All are run by default.");
+  g_option_context_add_main_entries (context, options, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  if (opt_n <= 0 || opt_iterations <= 0)
+    {
+      g_printerr ("N and ITERATIONS must be positive\n");
+      return 1;
+    }
+
+  for (i = argc > 1 ? 1 : 0; i < argc; i++)
+    {
+      const char *name = i > 0 ? argv[i] : NULL;
+
+      if (name == NULL || strcmp (name, "summary") == 0)
+        bench_summary ();
+      if (name == NULL || strcmp (name, "db") == 0)
+        bench_db ();
+      if (name == NULL || strcmp (name, "dbus-proxy") == 0)
+        bench_dbus_proxy ();
+    }
+
+  return 0;
+}
@@ -0,0 +1,135 @@
+#!/bin/bash
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+# Runs the benchmark suite against a local test repo, printing one
+# JSON object per line on stdout:
+#
+#   {"benchmark":NAME,"n":N,"iterations":I,"seconds":S,"usec_per_op":U}
+#
+# This is what `make bench` runs, in an empty directory with the same
+# environment as `make check`. The sizes can be changed with BENCH_N
+# (number of refs, files or db entries) and BENCH_REPEAT (number of
+# times each macrobenchmark is repeated). Benchmarks that don't depend
+# on the size report an n of 0.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+BENCH_N=${BENCH_N:-1000}
+BENCH_REPEAT=${BENCH_REPEAT:-5}
+
+now () {
+    date +%s%N
+}
+
+# report NAME N ITERATIONS START-NS END-NS
+report () {
+    awk -v name="$1" -v n=$2 -v it=$3 -v ns=$(($5 - $4)) 'BEGIN {
+        printf "{\"benchmark\":\"%s\",\"n\":%d,\"iterations\":%d,\"seconds\":%.6f,\"usec_per_op\":%.3f}\n",
+               name, n, it, ns / 1e9, ns / 1e3 / it }'
+}
+
+if "${FLATPAK_BWRAP:-bwrap}" --unshare-ipc --unshare-net --unshare-pid \
+        --ro-bind / / /bin/true > bwrap-result 2>&1; then
+    HAVE_BWRAP=yes
+else
+    echo "Skipping install and run benchmarks, cannot run bwrap" >&2
+    HAVE_BWRAP=no
+fi
+
+# flatpak_repo_update with N refs
+
+mkdir -p bench-tree/files
+echo "[Application]" > bench-tree/metadata
+ostree init --repo=repos/bench --mode=archive-z2
+COMMIT=$(ostree --repo=repos/bench commit --branch=bench-base --tree=dir=bench-tree --no-xattrs)
+for i in $(seq $BENCH_N); do
+    mkdir -p repos/bench/refs/heads/app/org.bench.App$i/$ARCH
+    echo $COMMIT > repos/bench/refs/heads/app/org.bench.App$i/$ARCH/master
+done
+
+start=$(now)
+for i in $(seq $BENCH_REPEAT); do
+    ${FLATPAK} build-update-repo repos/bench > /dev/null
+done
+report repo-update $BENCH_N $BENCH_REPEAT $start $(now)
+
+if [ $HAVE_BWRAP = yes ]; then
+    setup_repo >&2
+    install_repo >&2
+
+    # Deploy of an N-file commit
+
+    DIR=$(mktemp -d)
+    cat > ${DIR}/metadata <<EOF
+[Application]
+name=org.bench.Files
+runtime=org.test.Platform/$ARCH/master
+sdk=org.test.Platform/$ARCH/master
+EOF
+    mkdir -p ${DIR}/files/bin
+    echo 'echo "Hello from bench"' > ${DIR}/files/bin/hello.sh
+    chmod a+x ${DIR}/files/bin/hello.sh
+    for i in $(seq $BENCH_N); do
+        mkdir -p ${DIR}/files/share/bench/$((i / 100))
+        echo "file $i" > ${DIR}/files/share/bench/$((i / 100))/file-$i
+    done
+    ${FLATPAK} build-finish --command=hello.sh ${DIR} >&2
+    ${FLATPAK} build-export ${FL_GPGARGS} repos/test ${DIR} >&2
+    rm -rf ${DIR}
+    update_repo >&2
+
+    ${FLATPAK} ${U} install --no-deploy test-repo org.bench.Files >&2
+
+    elapsed=0
+    for i in $(seq $BENCH_REPEAT); do
+        start=$(now)
+        ${FLATPAK} ${U} install --no-pull test-repo org.bench.Files > /dev/null
+        end=$(now)
+        elapsed=$((elapsed + end - start))
+        ${FLATPAK} ${U} uninstall --keep-ref org.bench.Files > /dev/null
+    done
+    report deploy $BENCH_N $BENCH_REPEAT 0 $elapsed
+
+    # flatpak run launch latency, which doesn't depend on BENCH_N
+
+    run org.test.Hello > /dev/null
+    start=$(now)
+    for i in $(seq $BENCH_REPEAT); do
+        run org.test.Hello > /dev/null
+    done
+    report run 0 $BENCH_REPEAT $start $(now)
+fi
+
+# Document portal (xdp-fuse) read throughput, reported per MiB read
+
+head -c $((64 * 1024 * 1024)) /dev/zero > bench-doc
+if DOC_PATH=$(${FLATPAK} document-export bench-doc 2> /dev/null) && [ -f "$DOC_PATH" ]; then
+    cat "$DOC_PATH" > /dev/null
+    start=$(now)
+    for i in $(seq $BENCH_REPEAT); do
+        cat "$DOC_PATH" > /dev/null
+    done
+    report xdp-fuse-read 64 $((64 * BENCH_REPEAT)) $start $(now)
+else
+    echo "Skipping document portal benchmark, cannot export documents" >&2
+fi
+
+# Microbenchmarks: summary lookup, FlatpakDb and D-Bus proxy throughput
+
+bench-flatpak --n=$((BENCH_N * 10)) --iterations=$((BENCH_N * 100))
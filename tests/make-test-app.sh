@@ -48,7 +48,7 @@ cp $(dirname $0)/org.test.Hello.png ${DIR}/files/share/icons/HighContrast/64x64/
 
 mkdir -p ${DIR}/files/share/app-info/xmls
 mkdir -p ${DIR}/files/share/app-info/icons/flatpak/64x64
-gzip -c > ${DIR}/files/share/app-info/xmls/org.test.Hello.xml.gz <<EOF
+gzip -n -c > ${DIR}/files/share/app-info/xmls/org.test.Hello.xml.gz <<EOF
 <?xml version="1.0" encoding="UTF-8"?>
 <components version="0.8">
   <component type="desktop">
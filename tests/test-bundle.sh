@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_bwrap
 [ x${USE_SYSTEMDIR-} != xyes ] || skip_without_user_xattrs
 
-echo "1..7"
+echo "1..9"
 
 mkdir bundles
 
@@ -163,3 +163,39 @@ run org.test.Hello > hello_out
 assert_file_has_content hello_out '^Hello world, from a sandboxUPDATED2$'
 
 echo "ok update as bundle"
+
+make_updated_app test org.test.Collection.test UPDATED3
+
+${FLATPAK} build-bundle repos/test --from=${NEW2_COMMIT} bundles/hello3.flatpak org.test.Hello
+assert_has_file bundles/hello3.flatpak
+
+${FLATPAK} install ${U} -y --bundle bundles/hello3.flatpak
+
+NEW3_COMMIT=`${FLATPAK} ${U} info --show-commit org.test.Hello`
+
+assert_not_streq "$NEW2_COMMIT" "$NEW3_COMMIT"
+
+run org.test.Hello > hello_out
+assert_file_has_content hello_out '^Hello world, from a sandboxUPDATED3$'
+
+echo "ok update as delta bundle"
+
+make_updated_app test org.test.Collection.test UPDATED4
+NEW4_COMMIT=`ostree --repo=repos/test rev-parse app/org.test.Hello/$ARCH/master`
+make_updated_app test org.test.Collection.test UPDATED5
+
+# The base of this delta was never installed
+${FLATPAK} build-bundle repos/test --from=${NEW4_COMMIT} bundles/hello5.flatpak org.test.Hello
+assert_has_file bundles/hello5.flatpak
+
+if ${FLATPAK} install ${U} -y --bundle bundles/hello5.flatpak &> install-error-log; then
+    assert_not_reached "Should not be able to install a delta bundle without its base commit"
+fi
+assert_file_has_content install-error-log "update from commit ${NEW4_COMMIT}, which is not installed"
+
+assert_streq "$NEW3_COMMIT" `${FLATPAK} ${U} info --show-commit org.test.Hello`
+
+run org.test.Hello > hello_out
+assert_file_has_content hello_out '^Hello world, from a sandboxUPDATED3$'
+
+echo "ok delta bundle needs its base commit"
@@ -416,7 +416,7 @@ global_setup (void)
   GError *error = NULL;
   g_autofree gchar *services = NULL;
 
-  fusermount = g_find_program_in_path ("fusermount");
+  fusermount = g_find_program_in_path ("fusermount3");
   /* cache result so subsequent tests can be marked as skipped */
   have_fuse = (access ("/dev/fuse", W_OK) == 0 &&
                fusermount != NULL &&
@@ -26,7 +26,20 @@ export FLATPAK_ENABLE_EXPERIMENTAL_OCI=1
 skip_without_bwrap
 [ x${USE_SYSTEMDIR-} != xyes ] || skip_without_user_xattrs
 
-echo "1..6"
+echo "1..9"
+
+# Prints the layer digests of the image for APP in oci/registry
+oci_layers () {
+    python -c '
+import json, sys
+index = json.load(open("oci/registry/index.json"))
+for m in index["manifests"]:
+    if m.get("annotations", {}).get("org.opencontainers.image.ref.name", "").startswith("app/" + sys.argv[1] + "/"):
+        manifest = json.load(open("oci/registry/blobs/sha256/" + m["digest"][len("sha256:"):]))
+        for layer in manifest["layers"]:
+            print(layer["digest"])
+' $1
+}
 
 setup_repo
 
@@ -91,6 +104,10 @@ ${FLATPAK} install -v ${U} oci-remote-http org.test.Hello
 run org.test.Hello > hello_out
 assert_file_has_content hello_out '^Hello world, from a sandboxHTTP$'
 
+# Downloaded layers end up in the shared blob cache
+ls ${XDG_CACHE_HOME}/flatpak/system-cache/oci-blobs/sha256 > cached_blobs
+assert_file_has_content cached_blobs '^[0-9a-f]\{64\}$'
+
 echo "ok install oci http"
 
 make_updated_app test org.test.Collection.test UPDATEDHTTP
@@ -101,3 +118,152 @@ run org.test.Hello > hello_out
 assert_file_has_content hello_out '^Hello world, from a sandboxUPDATEDHTTP$'
 
 echo "ok update oci http"
+
+make_updated_app test org.test.Collection.test SPLIT
+${FLATPAK} build-bundle --oci --split-layers $FL_GPGARGS repos/test oci/registry org.test.Hello
+
+${FLATPAK} update ${U} org.test.Hello
+run org.test.Hello > hello_out
+assert_file_has_content hello_out '^Hello world, from a sandboxSPLIT$'
+
+oci_layers org.test.Hello > split_layers
+
+# Only the layer with files/bin changes, the others are reused
+make_updated_app test org.test.Collection.test SPLIT2
+${FLATPAK} build-bundle --oci --split-layers $FL_GPGARGS repos/test oci/registry org.test.Hello
+
+oci_layers org.test.Hello > split2_layers
+sort split_layers > split_layers.sorted
+sort split2_layers > split2_layers.sorted
+comm -13 split_layers.sorted split2_layers.sorted > changed_layers
+comm -12 split_layers.sorted split2_layers.sorted > reused_layers
+assert_streq "$(wc -l < changed_layers)" 1
+assert_streq "$(wc -l < reused_layers)" $(($(wc -l < split2_layers) - 1))
+
+truncate -s 0 httpd-log
+${FLATPAK} update ${U} -v org.test.Hello > update_out 2>&1
+run org.test.Hello > hello_out
+assert_file_has_content hello_out '^Hello world, from a sandboxSPLIT2$'
+
+for digest in $(cat reused_layers); do
+    assert_file_has_content update_out "Reusing unchanged OCI layer ${digest}"
+    assert_not_file_has_content httpd-log "GET /registry/blobs/sha256/${digest#sha256:}"
+done
+assert_file_has_content httpd-log "GET /registry/blobs/sha256/$(sed s/sha256:// changed_layers)"
+
+echo "ok update oci split layers"
+
+# Indexes written by other tools only have the ref name annotation, so
+# the rest is loaded from the manifests, and cached by digest
+python -c '
+import json
+index = json.load(open("oci/registry/index.json"))
+for m in index["manifests"]:
+    name = m["annotations"]["org.opencontainers.image.ref.name"]
+    m["annotations"] = { "org.opencontainers.image.ref.name": name }
+json.dump(index, open("oci/registry/index.json", "w"))
+'
+
+${FLATPAK} ${U} remote-ls -v oci-remote > remote_ls 2>&1
+assert_file_has_content remote_ls "Loading 1 OCI manifests"
+assert_file_has_content remote_ls "org.test.Hello"
+
+sleep 1 # Make sure the index.json mtime is changed
+touch oci/registry/index.json
+${FLATPAK} ${U} remote-ls -v oci-remote > remote_ls 2>&1
+assert_not_file_has_content remote_ls "Loading .* OCI manifests"
+assert_file_has_content remote_ls "org.test.Hello"
+
+# A manifest that fails to load is an error, not cached as a non-flatpak
+cat > not-flatpak.json <<EOF
+{"schemaVersion":2,"mediaType":"application/vnd.oci.image.manifest.v1+json","config":{"mediaType":"application/vnd.oci.image.config.v1+json","digest":"sha256:0000000000000000000000000000000000000000000000000000000000000000","size":0},"layers":[]}
+EOF
+NOT_FLATPAK_DIGEST=$(sha256sum not-flatpak.json | cut -d " " -f 1)
+python -c '
+import json, os, sys
+index = json.load(open("oci/registry/index.json"))
+index["manifests"].append({
+    "mediaType": "application/vnd.oci.image.manifest.v1+json",
+    "digest": "sha256:" + sys.argv[1],
+    "size": os.path.getsize("not-flatpak.json"),
+    "annotations": { "org.opencontainers.image.ref.name": "app/org.test.NotFlatpak/x86_64/master" } })
+json.dump(index, open("oci/registry/index.json", "w"))
+' $NOT_FLATPAK_DIGEST
+
+sleep 1
+if ${FLATPAK} ${U} remote-ls -v oci-remote > remote_ls 2>&1; then
+    assert_not_reached "Listing a remote with a missing manifest should fail"
+fi
+assert_file_has_content remote_ls "Can't load OCI manifest sha256:$NOT_FLATPAK_DIGEST"
+
+cp not-flatpak.json oci/registry/blobs/sha256/$NOT_FLATPAK_DIGEST
+touch oci/registry/index.json
+${FLATPAK} ${U} remote-ls -v oci-remote > remote_ls 2>&1
+assert_file_has_content remote_ls "Loading 1 OCI manifests"
+assert_not_file_has_content remote_ls "org.test.NotFlatpak"
+
+sleep 1
+touch oci/registry/index.json
+${FLATPAK} ${U} remote-ls -v oci-remote > remote_ls 2>&1
+assert_not_file_has_content remote_ls "Loading .* OCI manifests"
+assert_file_has_content remote_ls "org.test.Hello"
+
+echo "ok oci summary cache"
+
+# A later layer can remove files, replace a file with a directory and
+# the reverse, and replace a whole directory
+python -c '
+import hashlib, io, json, os, shutil, tarfile
+
+shutil.copytree("oci/registry", "oci/whiteout")
+index = json.load(open("oci/whiteout/index.json"))
+index["manifests"] = [m for m in index["manifests"]
+                      if m["annotations"]["org.opencontainers.image.ref.name"].startswith("app/org.test.Hello/")]
+manifest_path = "oci/whiteout/blobs/sha256/" + index["manifests"][0]["digest"][len("sha256:"):]
+manifest = json.load(open(manifest_path))
+
+def add (tar, name, content=None):
+    info = tarfile.TarInfo(name)
+    if content is None:
+        info.type = tarfile.DIRTYPE
+        info.mode = 0o755
+        tar.addfile(info)
+    else:
+        info.size = len(content)
+        info.mode = 0o644
+        tar.addfile(info, io.BytesIO(content))
+
+out = io.BytesIO()
+with tarfile.open(fileobj=out, mode="w:gz") as tar:
+    add(tar, "files/bin/.wh.hello.sh", b"")
+    add(tar, "files/share/icons/HighContrast/.wh..wh..opq", b"")
+    add(tar, "files/share/icons/HighContrast/new-file", b"new\n")
+    add(tar, "files/share/applications/org.test.Hello.desktop")
+    add(tar, "files/share/applications/org.test.Hello.desktop/inside", b"inside\n")
+    add(tar, "files/share/icons/hicolor", b"was a directory\n")
+layer = out.getvalue()
+digest = hashlib.sha256(layer).hexdigest()
+open("oci/whiteout/blobs/sha256/" + digest, "wb").write(layer)
+manifest["layers"].append({ "mediaType": "application/vnd.oci.image.layer.v1.tar+gzip",
+                            "digest": "sha256:" + digest, "size": len(layer) })
+
+data = json.dumps(manifest).encode("utf-8")
+digest = hashlib.sha256(data).hexdigest()
+open("oci/whiteout/blobs/sha256/" + digest, "wb").write(data)
+index["manifests"][0]["digest"] = "sha256:" + digest
+index["manifests"][0]["size"] = len(data)
+json.dump(index, open("oci/whiteout/index.json", "w"))
+'
+
+ostree --repo=repo3 init --mode=archive-z2
+$FLATPAK build-import-bundle --oci repo3 oci/whiteout
+ostree checkout -U --repo=repo3 app/org.test.Hello/$ARCH/master whiteout-checkout
+
+assert_has_file whiteout-checkout/metadata
+assert_not_has_file whiteout-checkout/files/bin/hello.sh
+assert_not_has_file whiteout-checkout/files/bin/.wh.hello.sh
+assert_streq "$(ls -A whiteout-checkout/files/share/icons/HighContrast)" "new-file"
+assert_file_has_content whiteout-checkout/files/share/applications/org.test.Hello.desktop/inside "^inside$"
+assert_file_has_content whiteout-checkout/files/share/icons/hicolor "^was a directory$"
+
+echo "ok oci layer whiteouts"
@@ -28,7 +28,7 @@ if [ x${USE_COLLECTIONS_IN_CLIENT-} == xyes ] || [ x${USE_COLLECTIONS_IN_SERVER-
     skip_without_p2p
 fi
 
-echo "1..6"
+echo "1..8"
 
 #Regular repo
 setup_repo
@@ -132,3 +132,34 @@ ${FLATPAK} ${U} install test-repo org.test.Hello
 assert_file_has_content $FL_DIR/app/org.test.Hello/$ARCH/master/active/files/bin/hello.sh UPDATED
 
 echo "ok redirect url and gpg key"
+
+# Completion only uses the refs seen in the last summary fetch
+LINE="flatpak ${U} install test-repo org.test.Hel"
+${FLATPAK} complete "$LINE" ${#LINE} "org.test.Hel" > complete-out
+assert_file_has_content complete-out "^org.test.Hello"
+
+LINE="flatpak ${U} uninstall org.test.Hel"
+${FLATPAK} complete "$LINE" ${#LINE} "org.test.Hel" > complete-out
+assert_file_has_content complete-out "^org.test.Hello"
+
+echo "ok complete from ref index"
+
+# Removing a remote drops its index
+port=$(cat httpd-port-main)
+${FLATPAK} ${U} remote-add --no-gpg-verify test-gone-repo "http://127.0.0.1:${port}/test-gpg3"
+${FLATPAK} ${U} remote-ls test-gone-repo > /dev/null
+find ${XDG_CACHE_HOME}/flatpak/ref-index -name test-gone-repo > index-files
+assert_file_has_content index-files test-gone-repo
+
+${FLATPAK} ${U} remote-delete test-gone-repo
+find ${XDG_CACHE_HOME}/flatpak/ref-index -name test-gone-repo > index-files
+assert_not_file_has_content index-files test-gone-repo
+
+# A new remote with the same name doesn't get the old refs
+${FLATPAK} ${U} remote-add --no-gpg-verify test-gone-repo "http://127.0.0.1:${port}/nonexistent"
+LINE="flatpak ${U} install test-gone-repo org.test.Hel"
+${FLATPAK} complete "$LINE" ${#LINE} "org.test.Hel" > complete-out
+assert_not_file_has_content complete-out "org.test.Hello"
+${FLATPAK} ${U} remote-delete test-gone-repo
+
+echo "ok ref index of removed remote"
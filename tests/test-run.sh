@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_bwrap
 [ x${USE_SYSTEMDIR-} != xyes ] || skip_without_user_xattrs
 
-echo "1..12"
+echo "1..17"
 
 setup_repo
 install_repo
@@ -70,6 +70,14 @@ assert_file_has_content hello_out '^Hello world, from a sandbox$'
 
 echo "ok hello"
 
+FLATPAK_TRACE=`pwd`/trace.json run org.test.Hello > /dev/null
+assert_file_has_content trace.json '^\[$'
+assert_file_has_content trace.json '"name":"find-deploy"'
+assert_file_has_content trace.json '"name":"run".*"ph":"X"'
+assert_file_has_content trace.json '"name":"exec"'
+
+echo "ok trace"
+
 run_sh cat /run/user/`id -u`/flatpak-info > fpi
 assert_file_has_content fpi '^name=org.test.Hello$'
 
@@ -195,12 +203,24 @@ echo "ok null update"
 
 make_updated_app
 
-${FLATPAK} ${U} update org.test.Hello
+# Make this an incremental prune
+touch $FL_DIR/.prune-full
+
+${FLATPAK} ${U} update org.test.Hello > update-log
 
 NEW_COMMIT=`${FLATPAK} ${U} info --show-commit org.test.Hello`
 
 assert_not_streq "$OLD_COMMIT" "$NEW_COMMIT"
 
+assert_not_has_file $FL_DIR/repo/objects/$(echo $OLD_COMMIT | cut -b 1-2)/$(echo $OLD_COMMIT | cut -b 3-).commit
+assert_streq "$(cat $FL_DIR/.prune-pending)" ""
+
+# The old deployment is removed in the background, but before we exit
+if [ x${USE_SYSTEMDIR-} != xyes ] ; then
+    assert_streq "$(ls -A $FL_DIR/.removed)" ""
+    assert_file_has_content update-log "^Reclaimed .* from old deployments$"
+fi
+
 run org.test.Hello > hello_out
 assert_file_has_content hello_out '^Hello world, from a sandboxUPDATED$'
 
@@ -368,3 +388,109 @@ fi
 assert_file_has_content err2.txt [Ii]nvalid
 
 echo "ok no setuid"
+
+rm -rf app
+flatpak build-init app org.test.Modes org.test.Platform org.test.Platform
+mkdir -p app/files/
+for mode in 700 600 775 640; do
+    echo $mode > app/files/mode-$mode
+    chmod $mode app/files/mode-$mode
+done
+flatpak build-finish --command=hello.sh app
+ostree --repo=repos/test commit  ${FL_GPGARGS} --branch=app/org.test.Modes/$ARCH/master app
+update_repo
+
+${FLATPAK} ${U} install test-repo org.test.Modes
+
+for mode in 700 600 775 640; do
+    assert_file_has_mode $FL_DIR/app/org.test.Modes/$ARCH/master/active/files/mode-$mode $mode
+done
+ostree fsck --repo=$FL_DIR/repo > fsck.txt
+
+rm -rf app
+flatpak build-init app org.test.Sticky org.test.Platform org.test.Platform
+mkdir -p app/files/
+touch app/files/sticky
+chmod 1755 app/files/sticky
+flatpak build-finish --command=hello.sh app
+ostree --repo=repos/test commit  ${FL_GPGARGS} --branch=app/org.test.Sticky/$ARCH/master app
+update_repo
+
+if ${FLATPAK} ${U} install test-repo org.test.Sticky &> err2.txt; then
+    assert_not_reached "Should not be able to install with sticky file"
+fi
+assert_file_has_content err2.txt [Ii]nvalid
+
+echo "ok file modes are kept"
+
+rm -rf app
+flatpak build-init app org.test.Jobs org.test.Platform org.test.Platform
+mkdir -p app/files/bin app/files/share/data
+for i in $(seq 100); do
+    echo "file $i" > app/files/share/data/file-$i
+done
+ln -s ../share/data/file-1 app/files/bin/link
+flatpak build-finish --command=hello.sh app
+
+ostree init --repo=repos/jobs1 --mode=archive-z2
+ostree init --repo=repos/jobs4 --mode=archive-z2
+${FLATPAK} build-export --no-update-summary --timestamp=2017-01-01T00:00:00Z --jobs=1 repos/jobs1 app
+${FLATPAK} build-export --no-update-summary --timestamp=2017-01-01T00:00:00Z --jobs=4 repos/jobs4 app
+
+COMMIT1=`ostree --repo=repos/jobs1 rev-parse app/org.test.Jobs/$ARCH/master`
+COMMIT4=`ostree --repo=repos/jobs4 rev-parse app/org.test.Jobs/$ARCH/master`
+assert_streq "$COMMIT1" "$COMMIT4"
+
+echo "ok parallel export is deterministic"
+
+assert_has_file app/.flatpak-export-cache
+echo "file 2 changed" > app/files/share/data/file-2
+${FLATPAK} build-export --no-update-summary --timestamp=2017-01-01T00:00:00Z repos/jobs1 app
+COMMIT_CACHED=`ostree --repo=repos/jobs1 rev-parse app/org.test.Jobs/$ARCH/master`
+assert_not_streq "$COMMIT1" "$COMMIT_CACHED"
+
+rm app/.flatpak-export-cache
+ostree init --repo=repos/nocache --mode=archive-z2
+${FLATPAK} build-export --no-update-summary --timestamp=2017-01-01T00:00:00Z repos/nocache app
+COMMIT_UNCACHED=`ostree --repo=repos/nocache rev-parse app/org.test.Jobs/$ARCH/master`
+assert_streq "$COMMIT_CACHED" "$COMMIT_UNCACHED"
+
+# Same size and mtime, but new content
+cp -p app/files/share/data/file-3 file-3.orig
+echo "file Z" > app/files/share/data/file-3
+touch -r file-3.orig app/files/share/data/file-3
+${FLATPAK} build-export --no-update-summary --timestamp=2017-01-01T00:00:00Z repos/nocache app
+ostree --repo=repos/nocache cat app/org.test.Jobs/$ARCH/master /files/share/data/file-3 > file-3.exported
+assert_file_has_content file-3.exported "^file Z$"
+
+echo "ok export cache skips unchanged files"
+
+# The system helper doesn't see FLATPAK_PRUNE_BUDGET
+if [ x${USE_SYSTEMDIR-} != xyes ] ; then
+    BUDGET_OLD_COMMIT=`${FLATPAK} ${U} info --show-commit org.test.Hello`
+    BUDGET_OLD_OBJECT=`ostree --repo=$FL_DIR/repo ls -C $BUDGET_OLD_COMMIT /files/bin/hello.sh | awk '{ print $5 }'`
+
+    make_updated_app test org.test.Collection.test BUDGET
+    touch $FL_DIR/.prune-full
+    FLATPAK_PRUNE_BUDGET=0.000001 ${FLATPAK} ${U} update org.test.Hello
+
+    # Nothing was removed, and the old commit is left for the next prune
+    assert_has_file $FL_DIR/repo/objects/$(echo $BUDGET_OLD_COMMIT | cut -b 1-2)/$(echo $BUDGET_OLD_COMMIT | cut -b 3-).commit
+    assert_file_has_content $FL_DIR/.prune-pending "^$BUDGET_OLD_COMMIT$"
+
+    # A prune that ran out of budget half-way removed content first,
+    # so the commit can still be traversed the next time
+    rm $FL_DIR/repo/objects/$(echo $BUDGET_OLD_OBJECT | cut -b 1-2)/$(echo $BUDGET_OLD_OBJECT | cut -b 3-).file
+
+    make_updated_app test org.test.Collection.test BUDGET2
+    touch $FL_DIR/.prune-full
+    ${FLATPAK} ${U} update org.test.Hello
+
+    assert_not_has_file $FL_DIR/repo/objects/$(echo $BUDGET_OLD_COMMIT | cut -b 1-2)/$(echo $BUDGET_OLD_COMMIT | cut -b 3-).commit
+    assert_streq "$(cat $FL_DIR/.prune-pending)" ""
+
+    run org.test.Hello > hello_out
+    assert_file_has_content hello_out '^Hello world, from a sandboxBUDGET2$'
+fi
+
+echo "ok prune budget"
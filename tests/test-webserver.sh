@@ -6,7 +6,7 @@ dir=$1
 test_tmpdir=$(pwd)
 
 cd ${dir}
-env PYTHONUNBUFFERED=1 setsid python -m SimpleHTTPServer 0 >${test_tmpdir}/httpd-output &
+env PYTHONUNBUFFERED=1 setsid python -m SimpleHTTPServer 0 >${test_tmpdir}/httpd-output 2>${test_tmpdir}/httpd-log &
 child_pid=$!
 
 for x in $(seq 50); do
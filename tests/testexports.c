@@ -0,0 +1,307 @@
+#include "config.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include "libglnx/libglnx.h"
+
+#include "flatpak-run.h"
+
+/* All tests share a scratch tree with this layout:
+ *
+ *   base/rw/ro/file
+ *   base/rw/hide/file
+ *   base/rw/sibling/file
+ *   base/other/file
+ *   base/link -> rw/ro
+ */
+static char *base;
+
+static char *
+test_path (const char *relative)
+{
+  return g_build_filename (base, relative, NULL);
+}
+
+static void
+make_test_file (const char *relative)
+{
+  g_autofree char *path = test_path (relative);
+  g_autofree char *dir = g_path_get_dirname (path);
+  GError *error = NULL;
+
+  g_assert_cmpint (g_mkdir_with_parents (dir, 0755), ==, 0);
+  g_file_set_contents (path, "", 0, &error);
+  g_assert_no_error (error);
+}
+
+static void
+setup_test_tree (void)
+{
+  g_autofree char *tmp = NULL;
+  g_autofree char *link = NULL;
+  GError *error = NULL;
+
+  tmp = g_dir_make_tmp ("flatpak-test-exports-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  /* The exports resolve symlinks in all parents, so make sure there
+     are none in the base path */
+  base = realpath (tmp, NULL);
+  g_assert (base != NULL);
+
+  make_test_file ("rw/ro/file");
+  make_test_file ("rw/hide/file");
+  make_test_file ("rw/sibling/file");
+  make_test_file ("other/file");
+
+  link = test_path ("link");
+  g_assert_cmpint (symlink ("rw/ro", link), ==, 0);
+}
+
+static void
+teardown_test_tree (void)
+{
+  GError *error = NULL;
+
+  glnx_shutil_rm_rf_at (AT_FDCWD, base, NULL, &error);
+  g_assert_no_error (error);
+  g_clear_pointer (&base, free);
+}
+
+/* The expected args are a NULL terminated list of options, each
+   followed by the path relative to the base it applies to. The path
+   is duplicated for the bind options, and --symlink takes the link
+   target before the path. */
+static void
+assert_bwrap_args (FlatpakExports *exports,
+                   ...)
+{
+  g_autoptr(GPtrArray) args = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) expected = g_ptr_array_new_with_free_func (g_free);
+  const char *option;
+  va_list ap;
+  guint i;
+
+  flatpak_exports_append_bwrap_args (exports, args);
+
+  va_start (ap, exports);
+  while ((option = va_arg (ap, const char *)) != NULL)
+    {
+      g_ptr_array_add (expected, g_strdup (option));
+      if (strcmp (option, "--symlink") == 0)
+        g_ptr_array_add (expected, g_strdup (va_arg (ap, const char *)));
+      else if (strcmp (option, "--bind") == 0 ||
+               strcmp (option, "--ro-bind") == 0)
+        {
+          const char *relative = va_arg (ap, const char *);
+          g_ptr_array_add (expected, test_path (relative));
+          g_ptr_array_add (expected, test_path (relative));
+          continue;
+        }
+      g_ptr_array_add (expected, test_path (va_arg (ap, const char *)));
+    }
+  va_end (ap);
+
+  for (i = 0; i < args->len && i < expected->len; i++)
+    g_assert_cmpstr (g_ptr_array_index (args, i), ==, g_ptr_array_index (expected, i));
+  g_assert_cmpuint (args->len, ==, expected->len);
+}
+
+static void
+assert_visible (FlatpakExports *exports,
+                const char *relative,
+                gboolean visible)
+{
+  g_autofree char *path = test_path (relative);
+
+  if (visible)
+    g_assert_true (flatpak_exports_path_is_visible (exports, path));
+  else
+    g_assert_false (flatpak_exports_path_is_visible (exports, path));
+}
+
+static void
+test_nested (void)
+{
+  g_autoptr(FlatpakExports) exports = flatpak_exports_new ();
+  g_autofree char *rw = test_path ("rw");
+  g_autofree char *ro = test_path ("rw/ro");
+
+  /* Add the child first, the parent must still be mounted before it */
+  flatpak_exports_add_path_expose (exports, FLATPAK_FILESYSTEM_MODE_READ_ONLY, ro);
+  flatpak_exports_add_path_expose (exports, FLATPAK_FILESYSTEM_MODE_READ_WRITE, rw);
+
+  assert_bwrap_args (exports,
+                     "--bind", "rw",
+                     "--ro-bind", "rw/ro",
+                     NULL);
+
+  assert_visible (exports, "rw", TRUE);
+  assert_visible (exports, "rw/ro", TRUE);
+  assert_visible (exports, "rw/ro/file", TRUE);
+  assert_visible (exports, "rw/sibling", TRUE);
+  assert_visible (exports, "rw/sibling/file", TRUE);
+  assert_visible (exports, "rw/missing", FALSE);
+  assert_visible (exports, "other", FALSE);
+  assert_visible (exports, "", FALSE);
+}
+
+static void
+test_child_only (void)
+{
+  g_autoptr(FlatpakExports) exports = flatpak_exports_new ();
+  g_autofree char *ro = test_path ("rw/ro");
+
+  flatpak_exports_add_path_expose (exports, FLATPAK_FILESYSTEM_MODE_READ_ONLY, ro);
+
+  assert_bwrap_args (exports,
+                     "--ro-bind", "rw/ro",
+                     NULL);
+
+  assert_visible (exports, "rw/ro", TRUE);
+  assert_visible (exports, "rw/ro/file", TRUE);
+  assert_visible (exports, "rw", FALSE);
+  assert_visible (exports, "rw/sibling", FALSE);
+  assert_visible (exports, "rw/sibling/file", FALSE);
+}
+
+static void
+test_tmpfs (void)
+{
+  g_autoptr(FlatpakExports) exports = flatpak_exports_new ();
+  g_autofree char *rw = test_path ("rw");
+  g_autofree char *hide = test_path ("rw/hide");
+  g_autofree char *other = test_path ("other");
+
+  flatpak_exports_add_path_tmpfs (exports, hide);
+  flatpak_exports_add_path_expose (exports, FLATPAK_FILESYSTEM_MODE_READ_WRITE, rw);
+  /* Nothing is mapped above this, so it is already on a tmpfs */
+  flatpak_exports_add_path_tmpfs (exports, other);
+
+  assert_bwrap_args (exports,
+                     "--dir", "other",
+                     "--bind", "rw",
+                     "--tmpfs", "rw/hide",
+                     NULL);
+
+  assert_visible (exports, "rw", TRUE);
+  assert_visible (exports, "rw/ro/file", TRUE);
+  assert_visible (exports, "rw/sibling", TRUE);
+  assert_visible (exports, "rw/hide", FALSE);
+  assert_visible (exports, "rw/hide/file", FALSE);
+  assert_visible (exports, "other", FALSE);
+  assert_visible (exports, "other/file", FALSE);
+}
+
+static void
+test_dir (void)
+{
+  g_autoptr(FlatpakExports) exports = flatpak_exports_new ();
+  g_autofree char *rw = test_path ("rw");
+  g_autofree char *ro = test_path ("rw/ro");
+  g_autofree char *other = test_path ("other");
+
+  /* A dir keeps the mapping of its parent */
+  flatpak_exports_add_path_expose (exports, FLATPAK_FILESYSTEM_MODE_READ_WRITE, rw);
+  flatpak_exports_add_path_dir (exports, ro);
+  flatpak_exports_add_path_dir (exports, other);
+
+  assert_bwrap_args (exports,
+                     "--dir", "other",
+                     "--bind", "rw",
+                     "--dir", "rw/ro",
+                     NULL);
+
+  assert_visible (exports, "rw/ro", TRUE);
+  assert_visible (exports, "rw/ro/file", TRUE);
+  assert_visible (exports, "other", FALSE);
+  assert_visible (exports, "other/file", FALSE);
+}
+
+static void
+test_symlink (void)
+{
+  g_autoptr(FlatpakExports) exports = flatpak_exports_new ();
+  g_autofree char *link = test_path ("link");
+  g_autofree char *link_file = test_path ("link/file");
+  g_autofree char *target = NULL;
+  g_autoptr(GString) up = g_string_new ("");
+  const char *p;
+
+  /* Exporting a symlink exports its target, and the link is
+     recreated relative to its parent, via the root */
+  for (p = base; *p != 0; p++)
+    if (*p == '/')
+      g_string_append (up, "../");
+  target = g_strconcat (up->str, base + 1, "/rw/ro", NULL);
+
+  flatpak_exports_add_path_expose (exports, FLATPAK_FILESYSTEM_MODE_READ_ONLY, link);
+
+  assert_bwrap_args (exports,
+                     "--symlink", target, "link",
+                     "--ro-bind", "rw/ro",
+                     NULL);
+
+  assert_visible (exports, "link", TRUE);
+  assert_visible (exports, "link/file", TRUE);
+  assert_visible (exports, "rw/ro", TRUE);
+  assert_visible (exports, "rw/ro/file", TRUE);
+  assert_visible (exports, "rw", FALSE);
+  assert_visible (exports, "rw/sibling/file", FALSE);
+
+  /* Paths below the symlink are exported at the target */
+  flatpak_exports_add_path_expose (exports, FLATPAK_FILESYSTEM_MODE_READ_WRITE, link_file);
+
+  assert_bwrap_args (exports,
+                     "--symlink", target, "link",
+                     "--ro-bind", "rw/ro",
+                     "--bind", "rw/ro/file",
+                     NULL);
+}
+
+static void
+test_symlink_mapped_parent (void)
+{
+  g_autoptr(FlatpakExports) exports = flatpak_exports_new ();
+  g_autofree char *link = test_path ("link");
+
+  /* The symlink is already there when its parent is mapped */
+  flatpak_exports_add_path_expose (exports, FLATPAK_FILESYSTEM_MODE_READ_ONLY, link);
+  flatpak_exports_add_path_expose (exports, FLATPAK_FILESYSTEM_MODE_READ_WRITE, base);
+
+  assert_bwrap_args (exports,
+                     "--bind", "",
+                     "--ro-bind", "rw/ro",
+                     NULL);
+
+  assert_visible (exports, "", TRUE);
+  assert_visible (exports, "link", TRUE);
+  assert_visible (exports, "link/file", TRUE);
+  assert_visible (exports, "rw/sibling/file", TRUE);
+  assert_visible (exports, "other/file", TRUE);
+}
+
+int
+main (int argc, char **argv)
+{
+  int res;
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/exports/nested", test_nested);
+  g_test_add_func ("/exports/child-only", test_child_only);
+  g_test_add_func ("/exports/tmpfs", test_tmpfs);
+  g_test_add_func ("/exports/dir", test_dir);
+  g_test_add_func ("/exports/symlink", test_symlink);
+  g_test_add_func ("/exports/symlink-mapped-parent", test_symlink_mapped_parent);
+
+  setup_test_tree ();
+  res = g_test_run ();
+  teardown_test_tree ();
+
+  return res;
+}
@@ -34,6 +34,9 @@ typedef struct
   FlatpakStorageType storage_type;
 } InstallationExtraData;
 
+static void make_updated_test_app (void);
+static void update_repo (void);
+
 static void
 test_library_version (void)
 {
@@ -348,6 +351,15 @@ changed_cb (GFileMonitor *monitor,
   *count += 1;
 }
 
+static void
+async_result_cb (GObject      *obj,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  GAsyncResult **result_out = user_data;
+  *result_out = g_object_ref (result);
+}
+
 static gboolean
 timeout_cb (gpointer data)
 {
@@ -356,6 +368,28 @@ timeout_cb (gpointer data)
   return G_SOURCE_CONTINUE;
 }
 
+static gboolean
+check_bwrap_support (void)
+{
+  const char *bwrap = g_getenv ("FLATPAK_BWRAP");
+  g_autoptr(GError) error = NULL;
+
+  if (bwrap != NULL)
+    {
+      gint exit_code = 0;
+      char *argv[] = { (char *)bwrap, "--unshare-ipc", "--unshare-net",
+          "--unshare-pid", "--ro-bind", "/", "/", "/bin/true", NULL };
+      g_autofree char *argv_str = g_strjoinv (" ", argv);
+      g_test_message ("Spawning %s", argv_str);
+      g_spawn_sync (NULL, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, NULL, &exit_code, &error);
+      g_assert_no_error (error);
+      if (exit_code != 0)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static void
 test_install_launch_uninstall (void)
 {
@@ -372,22 +406,12 @@ test_install_launch_uninstall (void)
   gboolean timeout_reached;
   guint timeout_id;
   gboolean res;
-  const char *bwrap = g_getenv ("FLATPAK_BWRAP");
+  guint64 generation, new_generation;
 
-  if (bwrap != NULL)
+  if (!check_bwrap_support ())
     {
-      gint exit_code = 0;
-      char *argv[] = { (char *)bwrap, "--unshare-ipc", "--unshare-net",
-          "--unshare-pid", "--ro-bind", "/", "/", "/bin/true", NULL };
-      g_autofree char *argv_str = g_strjoinv (" ", argv);
-      g_test_message ("Spawning %s", argv_str);
-      g_spawn_sync (NULL, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, NULL, &exit_code, &error);
-      g_assert_no_error (error);
-      if (exit_code != 0)
-        {
-          g_test_skip ("bwrap not supported");
-          return;
-        }
+      g_test_skip ("bwrap not supported");
+      return;
     }
 
   inst = flatpak_installation_new_user (NULL, &error);
@@ -405,6 +429,9 @@ test_install_launch_uninstall (void)
   g_assert_cmpint (refs->len, ==, 0);
   g_ptr_array_unref (refs);
 
+  generation = flatpak_installation_get_generation (inst, NULL, &error);
+  g_assert_no_error (error);
+
   changed_count = 0;
   progress_count = 0;
   timeout_reached = FALSE;
@@ -496,6 +523,116 @@ test_install_launch_uninstall (void)
 
   g_ptr_array_unref (refs);
 
+  {
+    g_autoptr(GPtrArray) changes = NULL;
+    FlatpakRefChange *change;
+
+    changes = flatpak_installation_list_changes_since (inst, generation, &new_generation, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_cmpint (changes->len, ==, 2);
+    g_assert_cmpuint (new_generation, ==, generation + 2);
+
+    change = g_ptr_array_index (changes, 0);
+    g_assert_cmpint (flatpak_ref_change_get_change_type (change), ==, FLATPAK_REF_CHANGE_TYPE_INSTALL);
+    g_assert_cmpuint (flatpak_ref_change_get_generation (change), ==, generation + 1);
+    g_assert_cmpstr (flatpak_ref_get_name (FLATPAK_REF (change)), ==, "org.test.Platform");
+    g_assert_cmpstr (flatpak_ref_get_commit (FLATPAK_REF (change)), ==, flatpak_ref_get_commit (FLATPAK_REF (runtime_ref)));
+    g_assert_null (flatpak_ref_change_get_old_commit (change));
+
+    change = g_ptr_array_index (changes, 1);
+    g_assert_cmpstr (flatpak_ref_get_name (FLATPAK_REF (change)), ==, "org.test.Hello");
+    g_assert_cmpint (flatpak_ref_get_kind (FLATPAK_REF (change)), ==, FLATPAK_REF_KIND_APP);
+
+    g_clear_pointer (&changes, g_ptr_array_unref);
+    changes = flatpak_installation_list_changes_since (inst, new_generation, NULL, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_cmpint (changes->len, ==, 0);
+
+    g_clear_pointer (&changes, g_ptr_array_unref);
+    changes = flatpak_installation_list_changes_since (inst, new_generation + 1, NULL, NULL, &error);
+    g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_CHANGES_EXPIRED);
+    g_assert_null (changes);
+    g_clear_error (&error);
+  }
+
+  refs = flatpak_installation_list_installed_refs_for_update (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (refs->len, ==, 0);
+
+  g_ptr_array_unref (refs);
+
+  {
+    g_autoptr(GAsyncResult) result = NULL;
+
+    flatpak_installation_list_installed_refs_for_update_async (inst, NULL, NULL, NULL,
+                                                               async_result_cb, &result);
+    while (result == NULL)
+      g_main_context_iteration (NULL, TRUE);
+
+    refs = flatpak_installation_list_installed_refs_for_update_finish (inst, result, &error);
+    g_assert_no_error (error);
+    g_assert_cmpint (refs->len, ==, 0);
+
+    g_ptr_array_unref (refs);
+  }
+
+  {
+    g_autoptr(GAsyncResult) result = NULL;
+    guint64 download_size = 0, installed_size = 0;
+
+    flatpak_installation_fetch_remote_size_async (inst, repo_name, FLATPAK_REF (ref), NULL,
+                                                  async_result_cb, &result);
+    while (result == NULL)
+      g_main_context_iteration (NULL, TRUE);
+
+    res = flatpak_installation_fetch_remote_size_finish (inst, result,
+                                                         &download_size, &installed_size,
+                                                         &error);
+    g_assert_no_error (error);
+    g_assert_true (res);
+    g_assert_cmpuint (installed_size, >, 0);
+  }
+
+  {
+    g_autoptr(GPtrArray) infos = NULL;
+    g_autofree char *app_ref = flatpak_ref_format_ref (FLATPAK_REF (ref));
+    const char *wanted[] = { app_ref, "app/org.test.Missing/x86_64/master", NULL };
+    FlatpakRemoteRef *info;
+
+    infos = flatpak_installation_fetch_remote_refs_info_sync (inst, repo_name, wanted, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_cmpint (infos->len, ==, 1);
+
+    info = g_ptr_array_index (infos, 0);
+    g_assert_cmpstr (flatpak_ref_get_name (FLATPAK_REF (info)), ==, "org.test.Hello");
+    g_assert_cmpstr (flatpak_ref_get_commit (FLATPAK_REF (info)), ==, flatpak_ref_get_commit (FLATPAK_REF (ref)));
+    g_assert_cmpuint (flatpak_remote_ref_get_installed_size (info), >, 0);
+    g_assert_nonnull (flatpak_remote_ref_get_metadata (info));
+
+    g_clear_pointer (&infos, g_ptr_array_unref);
+    infos = flatpak_installation_fetch_remote_refs_info_sync (inst, repo_name, NULL, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_cmpint (infos->len, ==, 2);
+  }
+
+  {
+    g_autofree char *name = NULL;
+    g_autofree char *icon = NULL;
+
+    res = flatpak_installation_update_appstream_sync (inst, repo_name, NULL, NULL, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_true (res);
+
+    res = flatpak_installation_lookup_appstream_component (inst, repo_name, NULL,
+                                                           "org.test.Hello.desktop",
+                                                           &name, NULL, &icon, NULL,
+                                                           &error);
+    g_assert_no_error (error);
+    g_assert_true (res);
+    g_assert_cmpstr (name, ==, "Hello world test app");
+    g_assert_cmpstr (icon, ==, "64x64/org.gnome.gedit.png");
+  }
+
   res = flatpak_installation_launch (inst, "org.test.Hello", NULL, NULL, NULL, NULL, &error);
   g_assert_no_error (error);
   g_assert_true (res);
@@ -561,6 +698,236 @@ test_install_launch_uninstall (void)
   g_assert_cmpint (refs->len, ==, 0);
 
   g_ptr_array_unref (refs);
+
+  {
+    g_autoptr(GPtrArray) changes = NULL;
+    FlatpakRefChange *change;
+
+    changes = flatpak_installation_list_changes_since (inst, new_generation, NULL, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_cmpint (changes->len, ==, 2);
+
+    change = g_ptr_array_index (changes, 0);
+    g_assert_cmpint (flatpak_ref_change_get_change_type (change), ==, FLATPAK_REF_CHANGE_TYPE_UNINSTALL);
+    g_assert_cmpstr (flatpak_ref_get_name (FLATPAK_REF (change)), ==, "org.test.Hello");
+    g_assert_cmpstr (flatpak_ref_change_get_old_commit (change), ==, flatpak_ref_get_commit (FLATPAK_REF (ref)));
+    g_assert_null (flatpak_ref_get_commit (FLATPAK_REF (change)));
+  }
+}
+
+typedef struct
+{
+  GThread  *thread;
+  char     *ref;
+  int       count;
+  guint64   bytes_transferred;
+  gboolean  wrong_thread;
+  gboolean  wrong_ref;
+} ProgressEvents;
+
+static void
+progress_event_cb (FlatpakInstallation        *self,
+                   const FlatpakProgressEvent *event,
+                   gpointer                    user_data)
+{
+  ProgressEvents *events = user_data;
+
+  events->count++;
+  events->bytes_transferred = MAX (events->bytes_transferred, event->bytes_transferred);
+  if (g_thread_self () != events->thread)
+    events->wrong_thread = TRUE;
+  if (g_strcmp0 (event->ref, events->ref) != 0)
+    events->wrong_ref = TRUE;
+}
+
+static void
+progress_events_reset (ProgressEvents *events,
+                       gboolean        is_app,
+                       const char     *name)
+{
+  g_free (events->ref);
+  memset (events, 0, sizeof (ProgressEvents));
+  events->thread = g_thread_self ();
+  events->ref = g_strdup_printf ("%s/%s/%s/master", is_app ? "app" : "runtime",
+                                 name, flatpak_get_default_arch ());
+}
+
+static void
+updates_found_cb (FlatpakInstallation *self,
+                  const char          *remote_name,
+                  GPtrArray           *updates,
+                  gpointer             user_data)
+{
+  guint *n_found = user_data;
+
+  g_assert_cmpstr (remote_name, ==, repo_name);
+  *n_found += updates->len;
+}
+
+static void
+test_install_update_uninstall_async (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FlatpakInstalledRef) runtime_ref = NULL;
+  g_autoptr(FlatpakInstalledRef) ref = NULL;
+  g_autoptr(FlatpakInstalledRef) updated_ref = NULL;
+  ProgressEvents events = { NULL };
+  gboolean res;
+
+  if (!check_bwrap_support ())
+    {
+      g_test_skip ("bwrap not supported");
+      return;
+    }
+
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+
+  {
+    g_autoptr(GAsyncResult) runtime_result = NULL;
+    g_autoptr(GAsyncResult) result = NULL;
+    ProgressEvents runtime_events = { NULL };
+
+    /* Both installs are queued on the installation at once */
+    progress_events_reset (&runtime_events, FALSE, "org.test.Platform");
+    flatpak_installation_install_full_async (inst, FLATPAK_INSTALL_FLAGS_NONE, repo_name,
+                                             FLATPAK_REF_KIND_RUNTIME, "org.test.Platform",
+                                             NULL, NULL, NULL,
+                                             progress_event_cb, &runtime_events,
+                                             NULL, async_result_cb, &runtime_result);
+
+    progress_events_reset (&events, TRUE, "org.test.Hello");
+    flatpak_installation_install_full_async (inst, FLATPAK_INSTALL_FLAGS_NONE, repo_name,
+                                             FLATPAK_REF_KIND_APP, "org.test.Hello",
+                                             NULL, NULL, NULL,
+                                             progress_event_cb, &events,
+                                             NULL, async_result_cb, &result);
+
+    while (runtime_result == NULL || result == NULL)
+      g_main_context_iteration (NULL, TRUE);
+
+    runtime_ref = flatpak_installation_install_full_finish (inst, runtime_result, &error);
+    g_assert_no_error (error);
+    g_assert (FLATPAK_IS_INSTALLED_REF (runtime_ref));
+    g_assert_cmpstr (flatpak_ref_get_name (FLATPAK_REF (runtime_ref)), ==, "org.test.Platform");
+
+    /* Progress is delivered in our main context, with the transfer counters */
+    g_assert_cmpint (runtime_events.count, >, 0);
+    g_assert_cmpuint (runtime_events.bytes_transferred, >, 0);
+    g_assert_false (runtime_events.wrong_thread);
+    g_assert_false (runtime_events.wrong_ref);
+    g_free (runtime_events.ref);
+
+    ref = flatpak_installation_install_full_finish (inst, result, &error);
+    g_assert_no_error (error);
+    g_assert (FLATPAK_IS_INSTALLED_REF (ref));
+    g_assert_cmpint (events.count, >, 0);
+    g_assert_false (events.wrong_thread);
+    g_assert_false (events.wrong_ref);
+  }
+
+  {
+    g_autoptr(GAsyncResult) result = NULL;
+
+    progress_events_reset (&events, TRUE, "org.test.Hello");
+    flatpak_installation_install_full_async (inst, FLATPAK_INSTALL_FLAGS_NONE, repo_name,
+                                             FLATPAK_REF_KIND_APP, "org.test.Hello",
+                                             NULL, NULL, NULL,
+                                             progress_event_cb, &events,
+                                             NULL, async_result_cb, &result);
+    while (result == NULL)
+      g_main_context_iteration (NULL, TRUE);
+
+    g_assert_null (flatpak_installation_install_full_finish (inst, result, &error));
+    g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED);
+    g_clear_error (&error);
+  }
+
+  make_updated_test_app ();
+  update_repo ();
+
+  {
+    g_autoptr(GAsyncResult) result = NULL;
+    g_autoptr(GPtrArray) refs = NULL;
+    FlatpakInstalledRef *update;
+    guint n_found = 0;
+
+    flatpak_installation_list_installed_refs_for_update_async (inst, updates_found_cb, &n_found,
+                                                               NULL, async_result_cb, &result);
+    while (result == NULL)
+      g_main_context_iteration (NULL, TRUE);
+
+    refs = flatpak_installation_list_installed_refs_for_update_finish (inst, result, &error);
+    g_assert_no_error (error);
+    g_assert_cmpint (refs->len, ==, 1);
+    g_assert_cmpuint (n_found, ==, 1);
+
+    update = g_ptr_array_index (refs, 0);
+    g_assert_cmpstr (flatpak_ref_get_name (FLATPAK_REF (update)), ==, "org.test.Hello");
+    g_assert_cmpint (flatpak_ref_get_kind (FLATPAK_REF (update)), ==, FLATPAK_REF_KIND_APP);
+  }
+
+  {
+    g_autoptr(GAsyncResult) result = NULL;
+
+    progress_events_reset (&events, TRUE, "org.test.Hello");
+    flatpak_installation_update_full_async (inst, FLATPAK_UPDATE_FLAGS_NONE,
+                                            FLATPAK_REF_KIND_APP, "org.test.Hello",
+                                            NULL, NULL, NULL,
+                                            progress_event_cb, &events,
+                                            NULL, async_result_cb, &result);
+    while (result == NULL)
+      g_main_context_iteration (NULL, TRUE);
+
+    updated_ref = flatpak_installation_update_full_finish (inst, result, &error);
+    g_assert_no_error (error);
+    g_assert (FLATPAK_IS_INSTALLED_REF (updated_ref));
+    g_assert_cmpstr (flatpak_ref_get_commit (FLATPAK_REF (updated_ref)), !=,
+                     flatpak_ref_get_commit (FLATPAK_REF (ref)));
+    g_assert_cmpint (events.count, >, 0);
+    g_assert_cmpuint (events.bytes_transferred, >, 0);
+    g_assert_false (events.wrong_thread);
+    g_assert_false (events.wrong_ref);
+  }
+
+  {
+    g_autoptr(GAsyncResult) result = NULL;
+
+    flatpak_installation_uninstall_async (inst, FLATPAK_REF_KIND_APP, "org.test.Hello",
+                                          NULL, NULL, NULL, NULL,
+                                          NULL, async_result_cb, &result);
+    while (result == NULL)
+      g_main_context_iteration (NULL, TRUE);
+
+    res = flatpak_installation_uninstall_finish (inst, result, &error);
+    g_assert_no_error (error);
+    g_assert_true (res);
+  }
+
+  {
+    g_autoptr(GAsyncResult) result = NULL;
+
+    flatpak_installation_uninstall_async (inst, FLATPAK_REF_KIND_RUNTIME, "org.test.Platform",
+                                          NULL, NULL, NULL, NULL,
+                                          NULL, async_result_cb, &result);
+    while (result == NULL)
+      g_main_context_iteration (NULL, TRUE);
+
+    res = flatpak_installation_uninstall_finish (inst, result, &error);
+    g_assert_no_error (error);
+    g_assert_true (res);
+  }
+
+  {
+    g_autoptr(GPtrArray) refs = NULL;
+
+    refs = flatpak_installation_list_installed_refs (inst, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_cmpint (refs->len, ==, 0);
+  }
+
+  g_free (events.ref);
 }
 
 typedef enum
@@ -643,6 +1010,17 @@ make_test_app (void)
   run_test_subprocess (argv, RUN_TEST_SUBPROCESS_DEFAULT);
 }
 
+static void
+make_updated_test_app (void)
+{
+  g_autofree char *arg0 = NULL;
+  char *argv[] = { NULL, "test", "", "UPDATED", NULL };
+
+  arg0 = g_test_build_filename (G_TEST_DIST, "make-test-app.sh", NULL);
+  argv[0] = arg0;
+  run_test_subprocess (argv, RUN_TEST_SUBPROCESS_DEFAULT);
+}
+
 static void
 update_repo (void)
 {
@@ -893,6 +1271,7 @@ main (int argc, char *argv[])
   g_test_add_func ("/library/remote", test_remote);
   g_test_add_func ("/library/list-refs", test_list_refs);
   g_test_add_func ("/library/install-launch-uninstall", test_install_launch_uninstall);
+  g_test_add_func ("/library/install-update-uninstall-async", test_install_update_uninstall_async);
 
   global_setup ();
 